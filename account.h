@@ -9,15 +9,20 @@
 // C++ Standard Library
 #include <exception>
 #include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 // ATM Controller
+#include "backend.h"
 #include "machine.h"
+#include "metrics.h"
 
 /**
  * @brief A struct to be used as message for actions to be performed on an account
  */
 struct ManagementAction {
-  enum ManagementActionType { WITHDRAW = 0, DEPOSIT = 1, BALANCE = 2, DONE = 4 };
+  enum ManagementActionType { WITHDRAW = 0, DEPOSIT = 1, BALANCE = 2, MINI_STATEMENT = 3, DONE = 4 };
 
   ManagementAction(ManagementActionType action, int amount = 0) : 
     action(action), amount(amount) {}
@@ -26,10 +31,47 @@ struct ManagementAction {
   int amount;
 };
 
+/**
+ * @brief The outcome of a single action within a batch of management actions
+ */
+struct ManagementActionResult {
+  ManagementActionResult(ManagementAction::ManagementActionType action, int balance, const std::string& error = "") :
+    action(action), balance(balance), error(error) {}
+
+  /// Whether or not the action passed validation
+  bool ok() const {
+    return error.empty();
+  }
+
+  ManagementAction::ManagementActionType action;
+
+  /// The balance of the selected account once this action (and the ones before it) is applied
+  int balance;
+
+  /// Why the action was refused, empty if it was valid
+  std::string error;
+};
+
+/**
+ * @brief The outcome of a batch of management actions, which is applied all at once or not at all
+ */
+struct ManagementBatchResult {
+  /// Whether or not the batch was committed to the account
+  bool applied{false};
+
+  /// Per-action results, in the same order as the requested actions
+  std::vector<ManagementActionResult> results;
+};
+
 /**
  * @brief Class representing an individual account in the bank accessed by the ATM
+ *
+ * @tparam Backend  The machine / server interface, see IsMachineBackend.  Calls to it are resolved at compile time
  */
-class Account {
+template <typename Backend>
+class BasicAccount {
+  static_assert(IsMachineBackend<Backend>::value, "Backend does not provide the machine backend interface");
+
  public:
   /**
    * @brief Constructor for the account
@@ -37,7 +79,16 @@ class Account {
    * @param machine A pointer to the machine/server interface
    * @param accountNumber The account number to open and register with
    */
-  Account(std::shared_ptr<Machine> machine, uint64_t accountNumber);
+  BasicAccount(std::shared_ptr<Backend> machine, uint64_t accountNumber);
+
+  /**
+   * @brief Constructor for the account, from a profile already fetched from the server
+   *
+   * @param machine A pointer to the machine/server interface
+   * @param accountNumber The account number to open and register with
+   * @param profile The account's balances, see backendGetAccountProfile()
+   */
+  BasicAccount(std::shared_ptr<Backend> machine, uint64_t accountNumber, const AccountProfile& profile);
 
   /// Unlocks the account when given the right pin
   void unlock(uint16_t pin);
@@ -48,15 +99,80 @@ class Account {
   /// Returns the balance of the account
   int getBalance();
 
+  /// Returns the part of the balance that can be withdrawn, the balance less deposits that haven't cleared
+  int getAvailableBalance();
+
+  /**
+   * @brief Copies the most recent transactions of the selected account type, newest first, without allocating
+   *
+   * @param out  Filled in from the front
+   * @return  How many entries of out were filled in, 0 if the backend keeps no mini statements
+   */
+  size_t getMiniStatement(MiniStatement& out);
+
   /// Deposits money into the account
   void deposit(int deposit_amount);
 
   /// Withdraws money from the account
   void withdraw(uint withdraw_amount);
 
+  /**
+   * @brief Validates a sequence of actions together and applies them atomically
+   * @details  Withdrawals are checked against the running balance, and their sum against the withdraw limit and the
+   *           cash in the machine.  If every action is valid, the net change is sent to the server in a single
+   *           update and the cash is disbursed once; otherwise nothing is applied.  DONE may only be the last action.
+   *
+   * @param actions  The actions to perform, in order
+   * @return  Whether the batch was applied, and the result of each action
+   */
+  ManagementBatchResult applyBatch(const std::vector<ManagementAction>& actions);
+
  private:
+  /**
+   * @brief Throws if a withdrawal can't be made
+   *
+   * @param withdraw_amount  The amount being withdrawn
+   * @param total_withdrawn  The amount withdrawn so far in this transaction, including withdraw_amount
+   * @param balance  The balance the withdrawal would be taken from
+   */
+  void validateWithdraw(uint withdraw_amount, uint total_withdrawn, int balance);
+
+  /**
+   * @brief Dispenses cash for a change already sent to the server, reversing the change if the dispense fails
+   * @details  Doesn't wait for the cash to come out if the backend dispenses asynchronously, the backend credits back
+   *           whatever a jam or short dispense doesn't hand out when the dispenser reports.  A backend that waits
+   *           throws DispenseFault instead, and this credits back what didn't come out.
+   *
+   * @param amount  The cash to dispense
+   * @param reversal  What to add to the balance to undo the withdrawal, and only the withdrawal
+   */
+  void disburseOrRefund(uint amount, int reversal);
+
+  /**
+   * @brief Sends a change worked out from balances_ to the server, as long as balances_ is still current
+   * @details  If another session changed the account first, balances_ is read again and validate decides whether
+   *           the change still stands before it is retried.  Reads never block, so the only cost of a conflict is
+   *           the retry.
+   *
+   * @param change  What to add to the balance of the selected account type
+   * @param transactionId  The id of the change, kept across retries
+   * @param validate  Called with the fresh balance after a conflict, returns false or throws to drop the change
+   * @return  Whether or not the change was applied
+   */
+  template <typename Validate>
+  bool writeBack(int change, TransactionId transactionId, Validate&& validate);
+
+  /// Records a security event for this account in the backend's audit log, if it keeps one
+  void audit(AuditEvent event, int amount = 0, uint32_t code = 0);
+
+  /// Deposits to the selected account type that haven't cleared, 0 if the backend makes deposits available at once
+  int heldAmount();
+
+  /// Write-backs tried before giving up on an account that keeps changing underneath us
+  static constexpr int kMaxWriteBackAttempts = 16;
+
   /// Pointer to the machine to access control functions
-  std::shared_ptr<Machine> machine_;
+  std::shared_ptr<Backend> machine_;
 
   /// Whether or not the account is locked
   bool locked_;
@@ -67,9 +183,6 @@ class Account {
   /// Account number for the account
   uint64_t account_number_;
 
-  /// The pin of the account
-  uint16_t pin_;
-
   /// The type of account we're accessing
   AccountType account_type_;
 
@@ -77,4 +190,378 @@ class Account {
   Balances balances_;
 };
 
+/// An account served by the default machine backend
+using Account = BasicAccount<Machine>;
+
+// Instantiated once in account.cpp
+extern template class BasicAccount<Machine>;
+
+template <typename Backend>
+BasicAccount<Backend>::BasicAccount(std::shared_ptr<Backend> machine, uint64_t accountNumber) :
+    BasicAccount(machine, accountNumber, backendGetAccountProfile(*machine, accountNumber)) {
+}
+
+template <typename Backend>
+BasicAccount<Backend>::BasicAccount(std::shared_ptr<Backend> machine,
+                                    uint64_t accountNumber,
+                                    const AccountProfile& profile) :
+    machine_(std::move(machine)),
+    account_number_(accountNumber),
+    locked_(true),
+    has_type_(false),
+    balances_(profile.balances) {
+}
+
+template <typename Backend>
+void BasicAccount<Backend>::unlock(uint16_t pin) {
+  PinAttemptTracker* const pin_attempts = backendPinAttemptTracker(*machine_);
+  if (pin_attempts != nullptr and pin_attempts->isLockedOut(account_number_)) {
+    atmMetrics().error_e12347.increment();
+    audit(AUDIT_CARD_LOCKED, 0, 12347);
+    throw std::runtime_error("E12347: Card locked, contact your bank");
+  }
+
+  // Checked against the salted hash the server keeps, the pin itself isn't stored anywhere
+  if (machine_->verifyPin(account_number_, pin)) {
+    // Request from server account details
+    if (pin_attempts != nullptr) {
+      pin_attempts->recordSuccess(account_number_);
+    }
+    locked_ = false;
+  } else {
+    atmMetrics().wrong_pins.increment();
+    audit(AUDIT_WRONG_PIN);
+    if (pin_attempts != nullptr and pin_attempts->recordFailure(account_number_)) {
+      atmMetrics().card_lockouts.increment();
+      atmMetrics().error_e12347.increment();
+      audit(AUDIT_CARD_LOCKED, 0, 12347);
+      throw std::runtime_error("E12347: Card locked, contact your bank");
+    }
+    throw std::runtime_error("Wrong pin");
+  }
+}
+
+template <typename Backend>
+void BasicAccount<Backend>::selectType(const AccountType accountType) {
+  if (locked_ or has_type_) {
+    throw std::runtime_error("Account is locked / type already selected");
+  }
+
+  account_type_ = accountType;
+  has_type_ = true;
+}
+
+template <typename Backend>
+int BasicAccount<Backend>::getBalance() {
+  if (locked_ or !has_type_) {
+    throw std::runtime_error("Account is locked / type not selected");
+  }
+
+  return balances_.get(account_type_);
+}
+
+template <typename Backend>
+int BasicAccount<Backend>::getAvailableBalance() {
+  if (locked_ or !has_type_) {
+    throw std::runtime_error("Account is locked / type not selected");
+  }
+
+  return balances_.get(account_type_) - heldAmount();
+}
+
+template <typename Backend>
+size_t BasicAccount<Backend>::getMiniStatement(MiniStatement& out) {
+  if (locked_ or !has_type_) {
+    throw std::runtime_error("Account is locked / type not selected");
+  }
+
+  MiniStatementStore* const mini_statements = backendMiniStatements(*machine_);
+  if (mini_statements == nullptr) {
+    return 0;
+  }
+  return mini_statements->read(account_number_, static_cast<uint32_t>(account_type_), out);
+}
+
+template <typename Backend>
+void BasicAccount<Backend>::deposit(int deposit_amount) {
+  if (locked_ or !has_type_) {
+    throw std::runtime_error("Account is locked / type not selected");
+  }
+
+  if (deposit_amount <= 0) {
+    atmMetrics().error_e12348.increment();
+    throw std::runtime_error("E12348: Invalid deposit amount");
+  }
+
+  // Credit account, a deposit stands whatever else happened to the account
+  const TransactionId transaction_id = machine_->newTransactionId();
+  writeBack(deposit_amount, transaction_id, [](int) { return true; });
+
+  // Hold it until it clears, which happens in the background
+  DepositPipeline* const pipeline = backendDepositPipeline(*machine_);
+  if (pipeline != nullptr) {
+    pipeline->capture(transaction_id, account_number_, static_cast<uint32_t>(account_type_), deposit_amount);
+  }
+  atmMetrics().deposits.increment();
+  atmMetrics().cash_deposited.increment(static_cast<uint64_t>(deposit_amount));
+}
+
+template <typename Backend>
+void BasicAccount<Backend>::withdraw(uint withdraw_amount) {
+  if (locked_ or !has_type_) {
+    throw std::runtime_error("Account is locked / type not selected");
+  }
+
+  validateWithdraw(withdraw_amount, withdraw_amount, balances_.get(account_type_) - heldAmount());
+  VelocityTracker* const velocity = backendVelocityTracker(*machine_);
+  if (velocity != nullptr and !velocity->tryRecordWithdrawal(account_number_, withdraw_amount)) {
+    atmMetrics().error_e12346.increment();
+    audit(AUDIT_WITHDRAW_REFUSED, static_cast<int>(withdraw_amount), 12346);
+    throw std::runtime_error("E12346: Too many withdrawals, try again later");
+  }
+
+  // Debit account, checking again if someone else got to the balance first.  The velocity check above still counts
+  // a withdrawal that then loses the race, an attempt is an attempt
+  writeBack(-static_cast<int>(withdraw_amount), machine_->newTransactionId(), [this, withdraw_amount](int balance) {
+    validateWithdraw(withdraw_amount, withdraw_amount, balance - heldAmount());
+    return true;
+  });
+
+  // Disburse cash
+  disburseOrRefund(withdraw_amount, static_cast<int>(withdraw_amount));
+  atmMetrics().withdrawals.increment();
+}
+
+template <typename Backend>
+ManagementBatchResult BasicAccount<Backend>::applyBatch(const std::vector<ManagementAction>& actions) {
+  if (locked_ or !has_type_) {
+    throw std::runtime_error("Account is locked / type not selected");
+  }
+
+  ManagementBatchResult batch;
+  batch.results.reserve(actions.size());
+
+  // Dry run against a running balance so later actions see the effect of earlier ones.  Withdrawals come out of the
+  // available balance, which deposits in the batch don't add to until they clear
+  const int held = heldAmount();
+  int balance = 0;
+  int available = 0;
+  uint total_withdrawn = 0;
+  uint withdrawals = 0;
+  uint64_t total_deposited = 0;
+  uint deposits = 0;
+  const auto dry_run = [&](int starting_balance) {
+    balance = starting_balance;
+    available = starting_balance - held;
+    total_withdrawn = 0;
+    withdrawals = 0;
+    total_deposited = 0;
+    deposits = 0;
+    batch.results.clear();
+
+    bool valid = true;
+    for (size_t i = 0; i < actions.size(); ++i) {
+      const ManagementAction& action = actions[i];
+      try {
+        switch (action.action) {
+          case ManagementAction::ManagementActionType::WITHDRAW: {
+            const uint withdraw_amount = static_cast<uint>(action.amount);
+            validateWithdraw(withdraw_amount, total_withdrawn + withdraw_amount, available);
+            total_withdrawn += withdraw_amount;
+            ++withdrawals;
+            balance -= static_cast<int>(withdraw_amount);
+            available -= static_cast<int>(withdraw_amount);
+            break;
+          }
+          case ManagementAction::ManagementActionType::DEPOSIT:
+            if (action.amount <= 0) {
+              atmMetrics().error_e12348.increment();
+              throw std::runtime_error("E12348: Invalid deposit amount");
+            }
+            balance += action.amount;
+            total_deposited += action.amount;
+            ++deposits;
+            break;
+          case ManagementAction::ManagementActionType::BALANCE:
+          case ManagementAction::ManagementActionType::MINI_STATEMENT:
+            break;
+          case ManagementAction::ManagementActionType::DONE:
+            if (i + 1 != actions.size()) {
+              throw std::runtime_error("DONE must be the last action");
+            }
+            break;
+        }
+        batch.results.emplace_back(action.action, balance);
+      } catch (const std::exception& e) {
+        valid = false;
+        batch.results.emplace_back(action.action, balance, e.what());
+      }
+    }
+    return valid;
+  };
+  bool valid = dry_run(balances_.get(account_type_));
+
+  VelocityTracker* const velocity = backendVelocityTracker(*machine_);
+  if (valid and withdrawals > 0 and velocity != nullptr and
+      !velocity->tryRecordWithdrawal(account_number_, total_withdrawn, withdrawals)) {
+    // Blame the last withdrawal, it's the one that tipped the batch over
+    atmMetrics().error_e12346.increment();
+    audit(AUDIT_WITHDRAW_REFUSED, static_cast<int>(total_withdrawn), 12346);
+    for (auto result = batch.results.rbegin(); result != batch.results.rend(); ++result) {
+      if (result->action == ManagementAction::ManagementActionType::WITHDRAW) {
+        result->error = "E12346: Too many withdrawals, try again later";
+        break;
+      }
+    }
+    valid = false;
+  }
+
+  if (!valid) {
+    return batch;
+  }
+
+  // Commit everything at once: one update to the server and one trip to the cash dispenser.  If the account moved
+  // on since it was read, the batch is run again against the fresh balance; the net change is the same unless that
+  // run refuses something
+  const int net_change = balance - balances_.get(account_type_);
+  const TransactionId transaction_id = machine_->newTransactionId();
+  if (net_change != 0 and !writeBack(net_change, transaction_id, dry_run)) {
+    return batch;
+  }
+
+  DepositPipeline* const pipeline = backendDepositPipeline(*machine_);
+  if (pipeline != nullptr) {
+    // Each deposit clears on its own, though they went to the ledger together
+    for (const ManagementAction& action : actions) {
+      if (action.action == ManagementAction::ManagementActionType::DEPOSIT) {
+        pipeline->capture(
+            transaction_id, account_number_, static_cast<uint32_t>(account_type_), static_cast<uint>(action.amount));
+      }
+    }
+  }
+  if (total_withdrawn > 0) {
+    disburseOrRefund(total_withdrawn, static_cast<int>(total_withdrawn));
+  }
+
+  atmMetrics().batches.increment();
+  atmMetrics().withdrawals.increment(withdrawals);
+  atmMetrics().deposits.increment(deposits);
+  atmMetrics().cash_deposited.increment(total_deposited);
+  batch.applied = true;
+  return batch;
+}
+
+template <typename Backend>
+void BasicAccount<Backend>::disburseOrRefund(uint amount, int reversal) {
+  // The dispenser may report after the session is over, so the completion holds nothing of this account
+  AuditLog* const log = backendAuditLog(*machine_);
+  const uint64_t account_number = account_number_;
+  try {
+    backendDispenseCash(*machine_,
+                        DispenseRequest{account_number_, account_type_, amount},
+                        [log, account_number](const DispenseEvent& event) {
+                          if (log == nullptr) {
+                            return;
+                          }
+                          if (event.dispensed > 0) {
+                            log->append(auditRecord(
+                                AUDIT_CASH_DISBURSED, account_number, static_cast<int>(event.dispensed)));
+                          }
+                          if (event.dispensed < event.requested) {
+                            log->append(auditRecord(AUDIT_DISPENSE_FAULT,
+                                                    account_number,
+                                                    static_cast<int>(event.requested - event.dispensed),
+                                                    static_cast<uint32_t>(event.status)));
+                          }
+                        });
+  } catch (const DispenseFault& fault) {
+    // Some notes may have come out before the dispenser stopped, only the debit for the rest is handed back.  The
+    // completion above already audited both parts
+    const int undispensed = reversal - static_cast<int>(fault.event().dispensed);
+    if (undispensed != 0) {
+      balances_.get(account_type_) += undispensed;
+      machine_->updateAccountBalance(account_number_, account_type_, undispensed, machine_->newTransactionId());
+    }
+    atmMetrics().dispense_faults.increment();
+    atmMetrics().error_e12345.increment();
+    throw std::runtime_error("E12345: Something went wrong!");
+  } catch (const std::exception& e) {
+    // The cash ran out between the check and the dispense (another ATM on the same machine got there first), so
+    // hand the debit back rather than charge for money that never came out
+    if (reversal != 0) {
+      balances_.get(account_type_) += reversal;
+      machine_->updateAccountBalance(account_number_, account_type_, reversal, machine_->newTransactionId());
+    }
+    atmMetrics().error_e12345.increment();
+    audit(AUDIT_WITHDRAW_REFUSED, static_cast<int>(amount), 12345);
+    throw std::runtime_error("E12345: Something went wrong!");
+  }
+}
+
+template <typename Backend>
+template <typename Validate>
+bool BasicAccount<Backend>::writeBack(int change, TransactionId transactionId, Validate&& validate) {
+  for (int attempt = 1;; ++attempt) {
+    const LedgerUpdateResult result = backendUpdateAccountBalanceIfVersion(
+        *machine_, account_number_, account_type_, change, balances_.version, transactionId);
+    if (result != UPDATE_CONFLICT) {
+      // Exactly one update landed since balances_ was read, ours
+      balances_.get(account_type_) += change;
+      ++balances_.version;
+      return true;
+    }
+
+    atmMetrics().ledger_conflicts.increment();
+    if (attempt == kMaxWriteBackAttempts) {
+      atmMetrics().error_e12345.increment();
+      throw std::runtime_error("E12345: Something went wrong!");
+    }
+    balances_ = machine_->getAccountBalances(account_number_);
+    if (!validate(balances_.get(account_type_))) {
+      return false;
+    }
+  }
+}
+
+template <typename Backend>
+void BasicAccount<Backend>::audit(AuditEvent event, int amount, uint32_t code) {
+  AuditLog* const log = backendAuditLog(*machine_);
+  if (log != nullptr) {
+    log->append(auditRecord(event, account_number_, amount, code));
+  }
+}
+
+template <typename Backend>
+int BasicAccount<Backend>::heldAmount() {
+  DepositPipeline* const pipeline = backendDepositPipeline(*machine_);
+  return pipeline == nullptr ? 0
+                             : static_cast<int>(pipeline->heldAmount(account_number_, static_cast<uint32_t>(account_type_)));
+}
+
+template <typename Backend>
+void BasicAccount<Backend>::validateWithdraw(uint withdraw_amount, uint total_withdrawn, int balance) {
+  VelocityTracker* const velocity = backendVelocityTracker(*machine_);
+  if (total_withdrawn > machine_->getAvailableCash()) {
+    // Should probably give a vague error and tell the user to try another ATM
+    atmMetrics().error_e12345.increment();
+    audit(AUDIT_WITHDRAW_REFUSED, static_cast<int>(withdraw_amount), 12345);
+    throw std::runtime_error("E12345: Something went wrong!");
+  } else if (withdraw_amount > balances_.limit(account_type_) or
+             total_withdrawn > balances_.limit(account_type_)) {
+    if (velocity != nullptr) {
+      velocity->reportRefusal(account_number_, withdraw_amount, VelocityAlert::Reason::OVER_LIMIT);
+    }
+    atmMetrics().error_e12344.increment();
+    audit(AUDIT_WITHDRAW_REFUSED, static_cast<int>(withdraw_amount), 12344);
+    throw std::runtime_error("E12344: Withdraw amount too great, change your settings online");
+  } else if (balance < 0 or withdraw_amount > static_cast<uint>(balance)) {
+    if (velocity != nullptr) {
+      velocity->reportRefusal(account_number_, withdraw_amount, VelocityAlert::Reason::INSUFFICIENT_BALANCE);
+    }
+    atmMetrics().error_e12343.increment();
+    audit(AUDIT_WITHDRAW_REFUSED, static_cast<int>(withdraw_amount), 12343);
+    throw std::runtime_error("E12343: Insufficient balance!");
+  }
+}
+
 #endif  // ATM_ACCOUNT_H
@@ -7,29 +7,64 @@
 #define ATM_ATM_H
 
 // C++ Standard Library
-#include <deque>
+#include <array>
+#include <ctime>
 #include <exception>
+#include <iostream>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <thread>
-#include <unordered_map>
+#include <vector>
 
 // ATM Controller
 #include "account.h"
+#include "backend.h"
+#include "instrumentation.h"
 #include "machine.h"
+#include "metrics.h"
+#include "profile_prefetch.h"
+#include "screen_state.h"
+#include "trace.h"
 
-enum ATMScreenState { IDLE = 0, ENTER_PIN = 1, SELECT_ACCOUNT = 2, ACCOUNT_MANAGEMENT = 3 };
-
-static std::unordered_map<ATMScreenState, std::string> kATMScreenStateToString{
-  {ATMScreenState::IDLE, "IDLE"},
-  {ATMScreenState::ENTER_PIN, "ENTER_PIN"},
-  {ATMScreenState::SELECT_ACCOUNT, "SELECT_ACCOUNT"},
-  {ATMScreenState::ACCOUNT_MANAGEMENT, "ACCOUNT_MANAGEMENT"}
-};
+/**
+ * @brief Which screen transitions the controller allows, indexed [from][to]
+ * @details  IDLE -> ENTER_PIN
+ *           ENTER_PIN -> SELECT_ACCOUNT, IDLE
+ *           SELECT_ACCOUNT -> ACCOUNT_MANAGEMENT, IDLE
+ *           ACCOUNT_MANAGEMENT -> IDLE
+ *           On top of this, only IDLE is allowed without a card in the reader.
+ */
+static constexpr std::array<std::array<bool, 4>, 4> kATMTransitionTable{{
+  {{false, true, false, false}},
+  {{true, false, true, false}},
+  {{true, false, false, true}},
+  {{true, false, false, false}}
+}};
 
-class ATM {
+/**
+ * @brief The ATM controller state machine
+ * @details  The callbacks, service() and getState() may be called from any thread.  With tracing on, each of them is
+ *           recorded as a span of the session of the card in the reader.  A card swipe starts fetching the account's
+ *           balances in the background and goes straight to ENTER_PIN, so the request to the server overlaps with
+ *           the customer typing their pin.  enterPinCB() only waits for it if it hasn't come back yet, then has the
+ *           server verify the pin.  Waiting on a fetch never holds the lock service() and getState() take, so those
+ *           don't block on the host.
+ *
+ * @tparam Backend  The machine / server interface, see IsMachineBackend.  Calls to it are resolved at compile time
+ */
+template <typename Backend>
+class BasicATM {
  public:
-  /// Constructor for the ATM
-  ATM();
+  /// Constructor for the ATM, with a backend of its own
+  BasicATM();
+
+  /**
+   * @brief Constructor for the ATM
+   *
+   * @param machine  The machine / server interface, possibly shared with other ATMs
+   */
+  explicit BasicATM(std::shared_ptr<Backend> machine);
 
   /// Main callback service request function
   void service();
@@ -46,13 +81,35 @@ class ATM {
   /// Callback function for the interface to give an account management action to the controller
   void accountManagementCB(const ManagementAction& action);
 
+  /**
+   * @brief Callback function for the interface to give a sequence of account management actions to the controller
+   * @details  The actions are validated together and applied atomically with a single server update.  A refused
+   *           batch sends the ATM back to IDLE, the same as a refused single action.
+   *
+   * @param actions  The actions to perform, in order
+   * @return  Whether the batch was applied, and the result of each action
+   */
+  ManagementBatchResult accountManagementBatchCB(const std::vector<ManagementAction>& actions);
+
   /// Returns the current state of the ATM screen to render to the user
   ATMScreenState getState();
 
+  /**
+   * @brief Has a function called once the card's account has been fetched, for callers that can't wait on the server
+   * @details  cardReaderCB() and enterPinCB() wait for the fetch while it is running.  An event loop can hold those
+   *           back until done is called, on a prefetch worker, see ProfileFetch::notifyWhenFinished().
+   *
+   * @return  Whether the fetch is still running, if not the callbacks won't wait and done isn't called
+   */
+  bool notifyWhenFetched(ProfileFetch::DoneFunction done, void* context);
+
  private:
   /// Internal "callback" to request a state transition
   void transitionCB(const ATMScreenState& desiredState);
 
+  /// Puts the current account's recent transactions on the display
+  void displayMiniStatement();
+
   /**
    * @brief Performs the state transition and makes required changes along the way
    * 
@@ -60,28 +117,332 @@ class ATM {
    */
   void doStateTransition(const ATMScreenState& desiredState);
   /**
-   * @brief Dictates what is a valid state transition for the ATM Controller
-   * @details  IDLE -> ENTER_PIN
-   *           ENTER_PIN -> SELECT_ACCOUNT, IDLE
-   *           SELECT_ACCOUNT -> ACCOUNT_MANAGEMENT, IDLE
-   *           ACCOUNT_MANAGEMENT -> IDLE
+   * @brief Dictates what is a valid state transition for the ATM Controller, see kATMTransitionTable
    * 
    * @param desiredState  The state we are trying to transition to
    * @return  Whether or not the state transition is valid
    */
   bool validTransition(const ATMScreenState& desiredState);
 
-  /// The current account being managed.  nullptr if disconnected
-  std::shared_ptr<Account> current_account_;
+  /**
+   * @brief Takes mutex_ once the profile fetch has finished
+   * @details  The fetch is waited for without the lock, so a slow host doesn't hold up service() and getState().  A
+   *           swipe in the meantime may start another fetch, so it is checked again under the lock.
+   *
+   * @return  The held lock
+   */
+  std::unique_lock<std::mutex> lockFetched();
+
+  /// Fetches a profile from the backend, on a prefetch worker
+  static AccountProfile fetchProfile(void* backend, uint64_t accountNumber);
+
+  /// The current account being managed, kept in place so a session doesn't allocate.  Empty until the pin is entered
+  std::optional<BasicAccount<Backend>> current_account_;
+
+  /// Whether a card is in the reader, its account may still be being fetched
+  bool has_card_;
+
+  /// The account number on the card in the reader
+  uint64_t card_number_;
 
   /// Interface to the machine / server control
-  std::shared_ptr<Machine> machine_;
+  std::shared_ptr<Backend> machine_;
 
   /// The current state of the ATM Screen
   ATMScreenState state_;
 
-  /// The callback queue of requested state transitions
-  std::deque<ATMScreenState> state_transition_cb_queue_;
+  /// The callback queue of requested state transitions, oldest first.  Cleared by service(), keeping its capacity
+  std::vector<ATMScreenState> state_transition_cb_queue_;
+
+  /// Serializes the callbacks and service(), which are called from different threads
+  std::mutex mutex_;
+
+  /// Trace session of the current card, see trace.h
+  uint64_t session_id_;
+
+  /// Profile of the card's account, fetched in the background from the swipe on.  Declared after machine_ so
+  /// it waits for a fetch still running before the backend can go away
+  ProfileFetch profile_fetch_;
+
+  /// Transitions queued between calls to service() without the queue growing
+  static constexpr size_t kTransitionQueueCapacity = 16;
 };
 
+/// An ATM served by the default machine backend
+using ATM = BasicATM<Machine>;
+
+// Instantiated once in atm.cpp
+extern template class BasicATM<Machine>;
+
+template <typename Backend>
+BasicATM<Backend>::BasicATM() :
+  BasicATM(std::make_shared<Backend>())
+{}
+
+template <typename Backend>
+BasicATM<Backend>::BasicATM(std::shared_ptr<Backend> machine) :
+  has_card_(false),
+  card_number_(0),
+  machine_(std::move(machine)), 
+  state_(ATMScreenState::IDLE),
+  session_id_(0)
+{
+  state_transition_cb_queue_.reserve(kTransitionQueueCapacity);
+}
+
+template <typename Backend>
+void BasicATM<Backend>::service() {
+  ATM_PROBE(InstrumentedScope::SCOPE_SERVICE);
+  std::lock_guard<std::mutex> lock(mutex_);
+  const TraceSession trace_session(session_id_);
+  const TraceSpan span("service");
+
+  // Check for requested state transitions
+  for (const ATMScreenState desired_state : state_transition_cb_queue_) {
+    if (validTransition(desired_state)) {
+      doStateTransition(desired_state);
+    } 
+    // else {
+    //   throw std::runtime_error("Invalid transiton!");
+    //   doStateTransition(ATMScreenState::IDLE);
+    // }
+  }
+  state_transition_cb_queue_.clear();
+}
+
+template <typename Backend>
+void BasicATM<Backend>::accountManagementCB(const ManagementAction& action) {
+  ATM_PROBE(InstrumentedScope::SCOPE_ACCOUNT_MANAGEMENT_CB);
+  std::lock_guard<std::mutex> lock(mutex_);
+  const TraceSession trace_session(session_id_);
+  const TraceSpan span("accountManagementCB");
+
+  if (state_ != ATMScreenState::ACCOUNT_MANAGEMENT) {
+    transitionCB(ATMScreenState::IDLE);
+    return;
+  }
+
+  try {
+    switch (action.action) {
+      case ManagementAction::ManagementActionType::WITHDRAW:
+        current_account_->withdraw(action.amount);
+        break;
+      case ManagementAction::ManagementActionType::DEPOSIT:
+        current_account_->deposit(action.amount);
+        break;
+      case ManagementAction::ManagementActionType::BALANCE:
+        // Here would be some kind of hook to put it on the display
+        std::cout << "BALANCE: [$" << current_account_->getBalance() << "] AVAILABLE: [$"
+                  << current_account_->getAvailableBalance() << "]" << std::endl;
+        break;
+      case ManagementAction::ManagementActionType::MINI_STATEMENT:
+        displayMiniStatement();
+        break;
+      case ManagementAction::ManagementActionType::DONE:
+        transitionCB(ATMScreenState::IDLE);
+        break;
+    }
+  } catch (const std::exception& e) {
+    // go back to idle
+    std::cout << e.what() << std::endl;
+    transitionCB(ATMScreenState::IDLE);
+  }
+}
+
+template <typename Backend>
+ManagementBatchResult BasicATM<Backend>::accountManagementBatchCB(const std::vector<ManagementAction>& actions) {
+  ATM_PROBE(InstrumentedScope::SCOPE_ACCOUNT_MANAGEMENT_BATCH_CB);
+  std::lock_guard<std::mutex> lock(mutex_);
+  const TraceSession trace_session(session_id_);
+  const TraceSpan span("accountManagementBatchCB");
+
+  if (state_ != ATMScreenState::ACCOUNT_MANAGEMENT) {
+    transitionCB(ATMScreenState::IDLE);
+    return ManagementBatchResult{};
+  }
+
+  try {
+    ManagementBatchResult batch = current_account_->applyBatch(actions);
+    for (const ManagementActionResult& result : batch.results) {
+      if (!result.ok()) {
+        std::cout << result.error << std::endl;
+      } else if (batch.applied and result.action == ManagementAction::ManagementActionType::BALANCE) {
+        // Here would be some kind of hook to put it on the display
+        std::cout << "BALANCE: [$" << result.balance << "]" << std::endl;
+      } else if (batch.applied and result.action == ManagementAction::ManagementActionType::MINI_STATEMENT) {
+        // Read after the batch is applied, so it shows up on the statement as a single net change
+        displayMiniStatement();
+      }
+    }
+
+    if (!batch.applied or
+        (!actions.empty() and actions.back().action == ManagementAction::ManagementActionType::DONE)) {
+      transitionCB(ATMScreenState::IDLE);
+    }
+    return batch;
+  } catch (const std::exception& e) {
+    // go back to idle
+    std::cout << e.what() << std::endl;
+    transitionCB(ATMScreenState::IDLE);
+    return ManagementBatchResult{};
+  }
+}
+
+template <typename Backend>
+void BasicATM<Backend>::accountSelectCB(const AccountType accountType) {
+  ATM_PROBE(InstrumentedScope::SCOPE_ACCOUNT_SELECT_CB);
+  std::lock_guard<std::mutex> lock(mutex_);
+  const TraceSession trace_session(session_id_);
+  const TraceSpan span("accountSelectCB");
+
+  if (state_ != ATMScreenState::SELECT_ACCOUNT) {
+    transitionCB(ATMScreenState::IDLE);
+    return;
+  }
+
+  try {
+    if (current_account_){
+      current_account_->selectType(accountType);
+    }
+    transitionCB(ATMScreenState::ACCOUNT_MANAGEMENT);
+  } catch (const std::exception& e) {
+    // go back to idle
+    std::cout << e.what() << std::endl;
+    transitionCB(ATMScreenState::IDLE);
+  }
+}
+
+template <typename Backend>
+void BasicATM<Backend>::enterPinCB(const uint16_t pin) {
+  ATM_PROBE(InstrumentedScope::SCOPE_ENTER_PIN_CB);
+  const std::unique_lock<std::mutex> lock = lockFetched();
+  const TraceSession trace_session(session_id_);
+  const TraceSpan span("enterPinCB");
+
+  if (state_ != ATMScreenState::ENTER_PIN) {
+    transitionCB(ATMScreenState::IDLE);
+    return;
+  }
+
+  try {
+    if (!current_account_) {
+      // Already back, lockFetched() waited for it
+      const TraceSpan account_span("Account");
+      current_account_.emplace(machine_, card_number_, profile_fetch_.wait());
+    }
+    current_account_->unlock(pin);
+    transitionCB(ATMScreenState::SELECT_ACCOUNT);
+  } catch (const std::exception& e) {
+    // go back to idle
+    std::cout << e.what() << std::endl;
+    transitionCB(ATMScreenState::IDLE);
+  }
+}
+
+template <typename Backend>
+void BasicATM<Backend>::cardReaderCB(const uint64_t accountNumber) {
+  ATM_PROBE(InstrumentedScope::SCOPE_CARD_READER_CB);
+  // A card pulled before its fetch came back leaves the fetch running, the new one can only start after it
+  const std::unique_lock<std::mutex> lock = lockFetched();
+  if (state_ == ATMScreenState::IDLE) {
+    // A swipe starts a new session
+    session_id_ = newTraceSessionId();
+  }
+  const TraceSession trace_session(session_id_);
+  const TraceSpan span("cardReaderCB");
+
+  if (state_ != ATMScreenState::IDLE) {
+    transitionCB(ATMScreenState::IDLE);
+    return;
+  }
+
+  has_card_ = true;
+  card_number_ = accountNumber;
+  profile_fetch_.start(&BasicATM::fetchProfile, machine_.get(), accountNumber, session_id_);
+  atmMetrics().sessions.increment();
+  transitionCB(ATMScreenState::ENTER_PIN);
+}
+
+template <typename Backend>
+bool BasicATM<Backend>::notifyWhenFetched(ProfileFetch::DoneFunction done, void* context) {
+  return profile_fetch_.notifyWhenFinished(done, context);
+}
+
+template <typename Backend>
+std::unique_lock<std::mutex> BasicATM<Backend>::lockFetched() {
+  std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+  while (true) {
+    profile_fetch_.waitFinished();
+    lock.lock();
+    if (profile_fetch_.ready()) {
+      return lock;
+    }
+    lock.unlock();
+  }
+}
+
+template <typename Backend>
+void BasicATM<Backend>::transitionCB(const ATMScreenState& desiredState) {
+  traceInstant("transitionCB", kATMScreenStateToString[desiredState]);
+  state_transition_cb_queue_.push_back(desiredState);
+}
+
+template <typename Backend>
+void BasicATM<Backend>::displayMiniStatement() {
+  MiniStatement statement;
+  const size_t entries = current_account_->getMiniStatement(statement);
+
+  // Here would be some kind of hook to put it on the display
+  std::cout << "MINI STATEMENT:" << std::endl;
+  for (size_t i = 0; i < entries; ++i) {
+    const std::time_t time = statement[i].time;
+    std::tm local{};
+    ::localtime_r(&time, &local);
+    char date[32];
+    std::strftime(date, sizeof(date), "%Y-%m-%d %H:%M", &local);
+    std::cout << date << " " << (statement[i].amount >= 0 ? "+" : "") << statement[i].amount << " [$"
+              << statement[i].balance << "]" << std::endl;
+  }
+}
+
+template <typename Backend>
+ATMScreenState BasicATM<Backend>::getState() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return state_;
+}
+
+template <typename Backend>
+void BasicATM<Backend>::doStateTransition(const ATMScreenState& desiredState) {
+  const TraceSpan span("doStateTransition", kATMScreenStateToString[desiredState]);
+  if (desiredState == ATMScreenState::IDLE) {
+    // Disconnect current account
+    current_account_.reset();
+    has_card_ = false;
+  } else if (state_ == ATMScreenState::IDLE and desiredState == ATMScreenState::ENTER_PIN) {
+    // check if account number has been selected
+  } else if (state_ == ATMScreenState::ENTER_PIN and desiredState == ATMScreenState::SELECT_ACCOUNT) {
+    // Make sure the current account is unlocked
+  } else if (state_ == ATMScreenState::SELECT_ACCOUNT and desiredState == ATMScreenState::ACCOUNT_MANAGEMENT) {
+    // Make sure the current account has an account selected
+  }
+  atmMetrics().transitions[state_][desiredState]->increment();
+  state_ = desiredState;
+}
+
+template <typename Backend>
+bool BasicATM<Backend>::validTransition(const ATMScreenState& desiredState) {
+  std::cout << kATMScreenStateToString.at(state_) << " -> " << kATMScreenStateToString.at(desiredState) << std::endl;
+
+  if (desiredState != ATMScreenState::IDLE and !has_card_) {
+    // A queued IDLE already disconnected the card this transition was requested for
+    return false;
+  }
+  return kATMTransitionTable[state_][desiredState];
+}
+
+template <typename Backend>
+AccountProfile BasicATM<Backend>::fetchProfile(void* backend, uint64_t accountNumber) {
+  return backendGetAccountProfile(*static_cast<Backend*>(backend), accountNumber);
+}
+
 #endif  // ATM_ATM_H
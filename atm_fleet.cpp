@@ -0,0 +1,152 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+// C++ Standard Library
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+// ATM Controller
+#include "atm_fleet.h"
+
+constexpr size_t ATMFleet::kPendingDepth;
+constexpr uint32_t ATMFleet::kNoSession;
+
+/**
+ * @brief BasicATM::validTransition(), without branches
+ * @details  The lookup in kATMTransitionTable is unrolled over its entries, which are known at compile time, so it
+ *           becomes a handful of compares that vectorize on any SIMD width, unlike an indexed load or variable shift.
+ *
+ * @return  1 if the transition from one state to the other is allowed with or without a card in, else 0
+ */
+static inline uint32_t allowedTransition(uint32_t from, uint32_t to, uint32_t hasCard) {
+  uint32_t allowed = 0;
+  for (uint32_t table_from = 0; table_from < kATMTransitionTable.size(); ++table_from) {
+    for (uint32_t table_to = 0; table_to < kATMTransitionTable[table_from].size(); ++table_to) {
+      allowed |= static_cast<uint32_t>(kATMTransitionTable[table_from][table_to]) &
+                 static_cast<uint32_t>(from == table_from) & static_cast<uint32_t>(to == table_to);
+    }
+  }
+  return allowed & (static_cast<uint32_t>(to == ATMScreenState::IDLE) | hasCard);
+}
+
+ATMFleet::ATMFleet(size_t terminals) :
+  state_(terminals, ATMScreenState::IDLE),
+  has_card_(terminals, 0),
+  pending_count_(terminals, 0),
+  pending_(kPendingDepth * terminals, ATMScreenState::IDLE),
+  session_(terminals, kNoSession),
+  max_pending_(0) {
+  if (terminals > UINT32_MAX) {
+    throw std::runtime_error("Too many terminals in one fleet");
+  }
+}
+
+uint64_t ATMFleet::cardNumber(size_t terminal) const {
+  return session_[terminal] == kNoSession ? 0 : slot_cards_[session_[terminal]];
+}
+
+void ATMFleet::insertCard(size_t terminal, uint64_t accountNumber) {
+  if (state_[terminal] != ATMScreenState::IDLE) {
+    requestTransition(terminal, ATMScreenState::IDLE);
+    return;
+  }
+
+  if (session_[terminal] == kNoSession) {
+    if (free_slots_.empty()) {
+      session_[terminal] = static_cast<uint32_t>(slot_cards_.size());
+      slot_cards_.push_back(0);
+    } else {
+      session_[terminal] = free_slots_.back();
+      free_slots_.pop_back();
+    }
+  }
+  slot_cards_[session_[terminal]] = accountNumber;
+  has_card_[terminal] = 1;
+  requestTransition(terminal, ATMScreenState::ENTER_PIN);
+}
+
+void ATMFleet::requestTransition(size_t terminal, ATMScreenState desiredState) {
+  const size_t count = pending_count_[terminal];
+  if (count < kPendingDepth) {
+    pending_[count * size() + terminal] = static_cast<uint8_t>(desiredState);
+    pending_count_[terminal] = static_cast<uint8_t>(count + 1);
+    max_pending_ = std::max(max_pending_, count + 1);
+  } else {
+    spilled_.emplace_back(static_cast<uint32_t>(terminal), static_cast<uint8_t>(desiredState));
+  }
+}
+
+uint64_t ATMFleet::step() {
+  uint64_t applied = 0;
+  uint64_t idled = 0;
+  for (size_t position = 0; position < max_pending_; ++position) {
+    applied += stepPosition(position, idled);
+  }
+
+  // Rare, and in request order, which is after each terminal's positions
+  for (const auto& spilled : spilled_) {
+    const uint32_t terminal = spilled.first;
+    const uint32_t to = spilled.second;
+    if (allowedTransition(state_[terminal], to, has_card_[terminal])) {
+      state_[terminal] = static_cast<uint8_t>(to);
+      has_card_[terminal] &= static_cast<uint8_t>(to != ATMScreenState::IDLE);
+      ++applied;
+      idled += to == ATMScreenState::IDLE;
+    }
+  }
+
+  if (idled > 0) {
+    releaseSessions();
+  }
+  if (max_pending_ > 0) {
+    std::memset(pending_count_.data(), 0, pending_count_.size());
+  }
+  max_pending_ = 0;
+  spilled_.clear();
+  return applied;
+}
+
+uint64_t ATMFleet::stepPosition(size_t position, uint64_t& idled) {
+  const size_t terminals = size();
+  const uint8_t* const pending = pending_.data() + position * terminals;
+  const uint8_t* const count = pending_count_.data();
+  uint8_t* const state = state_.data();
+  uint8_t* const has_card = has_card_.data();
+
+  // Every terminal, branch-free, so that it vectorizes; terminals without a transition at this position keep theirs
+  const uint32_t queued_past = static_cast<uint32_t>(position);
+  uint32_t applied = 0;
+  uint32_t to_idle = 0;
+  for (size_t i = 0; i < terminals; ++i) {
+    const uint32_t from = state[i];
+    const uint32_t to = pending[i];
+    const uint32_t apply = static_cast<uint32_t>(count[i] > queued_past) & allowedTransition(from, to, has_card[i]);
+    const uint32_t idle = apply & static_cast<uint32_t>(to == ATMScreenState::IDLE);
+    state[i] = static_cast<uint8_t>(apply ? to : from);
+    has_card[i] = static_cast<uint8_t>(has_card[i] & (idle ^ 1u));
+    applied += apply;
+    to_idle += idle;
+  }
+  idled += to_idle;
+  return applied;
+}
+
+void ATMFleet::releaseSessions() {
+  for (size_t i = 0; i < size(); ++i) {
+    if (!has_card_[i] and session_[i] != kNoSession) {
+      free_slots_.push_back(session_[i]);
+      session_[i] = kNoSession;
+    }
+  }
+}
+
+std::array<uint64_t, 4> ATMFleet::stateCounts() const {
+  std::array<uint64_t, 4> counts{};
+  for (const uint8_t state : state_) {
+    ++counts[state];
+  }
+  return counts;
+}
@@ -0,0 +1,105 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+#ifndef ATM_ATM_FLEET_H
+#define ATM_ATM_FLEET_H
+
+// C++ Standard Library
+#include <array>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// ATM Controller
+#include "atm.h"
+
+/**
+ * @brief The screen state machines of many simulated terminals, in dense parallel arrays
+ * @details  Each terminal takes a byte of screen state, a byte of card presence, a pending transition count, a few
+ *           bytes of pending transitions and a session slot index, instead of a whole BasicATM, so a million
+ *           terminals fit in a few megabytes.  Card numbers live in a pool of session slots, taken only by terminals
+ *           with a card in.  step() is service() for every terminal at once: transitions are checked against
+ *           kATMTransitionTable with the same rules as BasicATM::validTransition(), one queue position at a time
+ *           across all terminals, in loops the compiler vectorizes.  Not thread-safe, one thread steps the fleet.
+ */
+class ATMFleet {
+ public:
+  /// Pending transitions per terminal kept in the dense arrays, more spill over to a slower list
+  static constexpr size_t kPendingDepth = 4;
+
+  /// Terminal count, all IDLE without a card
+  explicit ATMFleet(size_t terminals);
+
+  size_t size() const {
+    return state_.size();
+  }
+
+  ATMScreenState state(size_t terminal) const {
+    return static_cast<ATMScreenState>(state_[terminal]);
+  }
+
+  bool hasCard(size_t terminal) const {
+    return has_card_[terminal] != 0;
+  }
+
+  /// The account number of the card in the terminal, 0 if there is none
+  uint64_t cardNumber(size_t terminal) const;
+
+  /**
+   * @brief A card swipe at a terminal, with the state-level effect of BasicATM::cardReaderCB()
+   * @details  Outside of IDLE the swipe is refused with a transition to IDLE.  Otherwise the card takes a session
+   *           slot and ENTER_PIN is requested.
+   */
+  void insertCard(size_t terminal, uint64_t accountNumber);
+
+  /// Queues a transition to be checked and applied by the next step(), like BasicATM's transitionCB
+  void requestTransition(size_t terminal, ATMScreenState desiredState);
+
+  /**
+   * @brief Applies every terminal's pending transitions in order, like service() on each ATM
+   *
+   * @return  The number of transitions applied
+   */
+  uint64_t step();
+
+  /// Terminals in each screen state, indexed by ATMScreenState
+  std::array<uint64_t, 4> stateCounts() const;
+
+  /// Session slots in use
+  size_t sessions() const {
+    return slot_cards_.size() - free_slots_.size();
+  }
+
+ private:
+  static constexpr uint32_t kNoSession = UINT32_MAX;
+
+  /// Applies the transitions queued at one position of every terminal's queue, counting those to IDLE in idled
+  uint64_t stepPosition(size_t position, uint64_t& idled);
+
+  /// Gives back the session slots of the terminals that went back to IDLE
+  void releaseSessions();
+
+  /// Screen state of each terminal, an ATMScreenState
+  std::vector<uint8_t> state_;
+  /// Whether a card is in each terminal, 0 or 1
+  std::vector<uint8_t> has_card_;
+  /// Transitions queued at each terminal, those past kPendingDepth are in spilled_
+  std::vector<uint8_t> pending_count_;
+  /// kPendingDepth rows of one pending transition per terminal
+  std::vector<uint8_t> pending_;
+  /// Index into slot_cards_ of each terminal's session, kNoSession without a card
+  std::vector<uint32_t> session_;
+
+  /// Card number of each session slot, and the slots not in use
+  std::vector<uint64_t> slot_cards_;
+  std::vector<uint32_t> free_slots_;
+
+  /// Transitions past a terminal's kPendingDepth, in the order they were requested
+  std::vector<std::pair<uint32_t, uint8_t>> spilled_;
+  /// Deepest queue since the last step, positions past it are skipped
+  size_t max_pending_;
+};
+
+#endif  // ATM_ATM_FLEET_H
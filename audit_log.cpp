@@ -0,0 +1,498 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+// C++ Standard Library
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+// POSIX
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// ATM Controller
+#include "audit_log.h"
+#include "transaction_log.h"
+
+constexpr size_t AuditLog::kRingCapacity;
+constexpr uint32_t AuditLog::kRecordsPerBlock;
+constexpr size_t AuditLog::kPipelineBlocks;
+constexpr std::chrono::milliseconds AuditLog::kFlushInterval;
+
+/// Audit logs start with this, followed by the record size
+static constexpr char kAuditLogMagic[8] = {'A', 'T', 'M', 'A', 'U', 'D', 'T', '1'};
+
+struct AuditLogHeader {
+  char magic[8];
+  uint64_t record_size;
+};
+
+/// Starts each block, followed by its records and then the HMAC-SHA256 of the header and records
+struct AuditBlockHeader {
+  /// Blocks are numbered from 0
+  uint64_t sequence;
+  uint32_t record_count;
+  uint32_t reserved;
+  /// MAC of the block before, all zeros for the first
+  uint8_t previous_hash[32];
+};
+
+static_assert(sizeof(AuditBlockHeader) == 48, "Audit block headers are a fixed 48 bytes on disk");
+
+/// Bytes on disk of a block holding count records
+static constexpr size_t blockSize(uint32_t count) {
+  return sizeof(AuditBlockHeader) + count * sizeof(AuditRecord) + sizeof(Sha256Digest);
+}
+
+/// Bytes of the file read at once by verifyAuditLog()
+static constexpr size_t kVerifyChunkSize = 32 << 20;
+
+/// Writes all of data, retrying short writes
+static bool writeAll(int fd, const void* data, size_t size) {
+  const char* bytes = static_cast<const char*>(data);
+  while (size > 0) {
+    const ssize_t written = ::write(fd, bytes, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    bytes += written;
+    size -= written;
+  }
+  return true;
+}
+
+/// Reads up to size bytes at offset, retrying short reads, returns how many were read or -1
+static ssize_t readAll(int fd, void* data, size_t size, uint64_t offset) {
+  char* bytes = static_cast<char*>(data);
+  size_t total = 0;
+  while (total < size) {
+    const ssize_t read = ::pread(fd, bytes + total, size - total, offset + total);
+    if (read < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (read == 0) {
+      break;
+    }
+    total += read;
+  }
+  return total;
+}
+
+AuditRecord auditRecord(AuditEvent event, uint64_t accountNumber, int32_t amount, uint32_t code) {
+  return AuditRecord{toTransactionTime(std::chrono::system_clock::now()),
+                     accountNumber,
+                     amount,
+                     code,
+                     static_cast<uint32_t>(event),
+                     0};
+}
+
+/// A block being filled, waiting to be written or free, with room for kRecordsPerBlock records
+struct AuditLog::Block {
+  Block() : bytes(blockSize(kRecordsPerBlock)), records(0) {}
+
+  std::vector<uint8_t> bytes;
+  uint32_t records;
+};
+
+AuditLog::AuditLog(const std::string& path, const AuditKey& key) :
+  path_(path),
+  key_(hmacSha256Key(key.data(), key.size())),
+  fd_(-1),
+  ring_(kRingCapacity),
+  appended_(0),
+  taken_(0),
+  written_(0),
+  flush_target_(0),
+  written_head_{0, {}},
+  stopping_(false),
+  hasher_done_(false),
+  next_sequence_(0),
+  previous_hash_{} {
+  fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd_ < 0) {
+    throw std::runtime_error("Could not open audit log " + path);
+  }
+  try {
+    resumeChain();
+  } catch (...) {
+    ::close(fd_);
+    throw;
+  }
+
+  for (size_t i = 0; i < kPipelineBlocks; ++i) {
+    blocks_.emplace_back(new Block());
+    free_.push_back(blocks_.back().get());
+  }
+  hasher_ = std::thread(&AuditLog::hashLoop, this);
+  writer_ = std::thread(&AuditLog::writeLoop, this);
+}
+
+AuditLog::~AuditLog() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  records_ready_.notify_one();
+  hasher_.join();
+  writer_.join();
+  ::close(fd_);
+}
+
+void AuditLog::resumeChain() {
+  struct stat status {};
+  if (::fstat(fd_, &status) != 0) {
+    throw std::runtime_error("Could not open audit log " + path_);
+  }
+  const uint64_t file_size = status.st_size;
+  if (file_size == 0) {
+    AuditLogHeader header{};
+    std::memcpy(header.magic, kAuditLogMagic, sizeof(header.magic));
+    header.record_size = sizeof(AuditRecord);
+    if (!writeAll(fd_, &header, sizeof(header))) {
+      throw std::runtime_error("Could not write audit log " + path_);
+    }
+    return;
+  }
+
+  AuditLogHeader header{};
+  if (readAll(fd_, &header, sizeof(header), 0) != sizeof(header) or
+      std::memcmp(header.magic, kAuditLogMagic, sizeof(header.magic)) != 0 or
+      header.record_size != sizeof(AuditRecord)) {
+    throw std::runtime_error("Not an audit log " + path_);
+  }
+
+  // Walk the block headers to the end of the chain.  The MACs are taken as written, checking them is the
+  // verifier's job, this only needs to know what to chain the next block to.
+  uint64_t offset = sizeof(AuditLogHeader);
+  uint64_t sequence = 0;
+  AuditBlockHeader block{};
+  while (offset < file_size) {
+    const bool whole_header = readAll(fd_, &block, sizeof(block), offset) == sizeof(block);
+    const bool valid = whole_header and block.sequence == sequence and block.record_count > 0 and
+                       block.record_count <= kRecordsPerBlock;
+    if (valid and offset + blockSize(block.record_count) <= file_size) {
+      const uint64_t hash_offset = offset + blockSize(block.record_count) - sizeof(Sha256Digest);
+      if (readAll(fd_, previous_hash_.data(), previous_hash_.size(), hash_offset) != sizeof(Sha256Digest)) {
+        throw std::runtime_error("Could not read audit log " + path_);
+      }
+      offset += blockSize(block.record_count);
+      ++sequence;
+      continue;
+    }
+
+    // Only the last write can be torn, and it leaves the start of a good block.  Anything else is damage that
+    // cutting off would hide, so the file is left for the verifier
+    if (whole_header and !valid) {
+      throw std::runtime_error("Audit log " + path_ + " is corrupt at block " + std::to_string(sequence));
+    }
+    if (::ftruncate(fd_, offset) != 0) {
+      throw std::runtime_error("Could not truncate torn block of audit log " + path_);
+    }
+    break;
+  }
+  next_sequence_ = sequence;
+  written_head_ = AuditHead{sequence, previous_hash_};
+}
+
+void AuditLog::append(const AuditRecord& record) {
+  const uint64_t appended = appended_.fetch_add(1) + 1;
+  while (!ring_.tryPush(record)) {
+    // The hasher is a whole ring behind, make sure it's awake and give it the core
+    records_ready_.notify_one();
+    std::this_thread::yield();
+  }
+  if (appended % kRecordsPerBlock == 0) {
+    // A block's worth is waiting.  Taking the lock orders this with the hasher checking for records
+    { std::lock_guard<std::mutex> lock(mutex_); }
+    records_ready_.notify_one();
+  }
+}
+
+void AuditLog::flush(bool sync) {
+  const uint64_t target = appended_.load();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    flush_target_ = std::max(flush_target_, target);
+  }
+  records_ready_.notify_one();
+
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    written_cv_.wait(lock, [this, target] { return written_ >= target; });
+    if (!error_.empty()) {
+      throw std::runtime_error(error_);
+    }
+  }
+  if (sync and ::fsync(fd_) != 0) {
+    throw std::runtime_error("Could not sync audit log " + path_);
+  }
+}
+
+uint64_t AuditLog::blocks() {
+  return head().blocks;
+}
+
+AuditHead AuditLog::head() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return written_head_;
+}
+
+void AuditLog::hashLoop() {
+  for (;;) {
+    bool stopping;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      records_ready_.wait_for(lock, kFlushInterval, [this] {
+        return stopping_ or flush_target_ > taken_ or ring_.size() >= kRecordsPerBlock;
+      });
+      stopping = stopping_;
+    }
+
+    // Everything in the ring, in full blocks and then the rest in a partial one
+    for (;;) {
+      Block* block;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        block_free_.wait(lock, [this] { return !free_.empty(); });
+        block = free_.back();
+        free_.pop_back();
+      }
+
+      AuditRecord* const records = reinterpret_cast<AuditRecord*>(block->bytes.data() + sizeof(AuditBlockHeader));
+      uint32_t count = 0;
+      while (count < kRecordsPerBlock and ring_.tryPop(records[count])) {
+        ++count;
+      }
+      if (count == 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_.push_back(block);
+        break;
+      }
+
+      AuditBlockHeader header{};
+      header.sequence = next_sequence_;
+      header.record_count = count;
+      std::memcpy(header.previous_hash, previous_hash_.data(), previous_hash_.size());
+      std::memcpy(block->bytes.data(), &header, sizeof(header));
+      const size_t hashed = blockSize(count) - sizeof(Sha256Digest);
+      previous_hash_ = hmacSha256(key_, block->bytes.data(), hashed);
+      std::memcpy(block->bytes.data() + hashed, previous_hash_.data(), previous_hash_.size());
+      block->records = count;
+      ++next_sequence_;
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        finished_.push_back(block);
+        taken_ += count;
+      }
+      block_ready_.notify_one();
+      if (count < kRecordsPerBlock) {
+        break;
+      }
+    }
+
+    // Appends are over once stopping, so the ring just drained stays empty
+    if (stopping) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        hasher_done_ = true;
+      }
+      block_ready_.notify_one();
+      return;
+    }
+  }
+}
+
+void AuditLog::writeLoop() {
+  bool failed = false;
+  for (;;) {
+    Block* block;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      block_ready_.wait(lock, [this] { return !finished_.empty() or hasher_done_; });
+      if (finished_.empty()) {
+        return;
+      }
+      block = finished_.front();
+      finished_.pop_front();
+    }
+
+    // After a failed write the chain on disk is broken, so later blocks are dropped rather than written after a gap
+    failed = failed or !writeAll(fd_, block->bytes.data(), blockSize(block->records));
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (failed and error_.empty()) {
+        error_ = "Could not write audit log " + path_;
+      }
+      if (!failed) {
+        const size_t hashed = blockSize(block->records) - sizeof(Sha256Digest);
+        std::memcpy(&written_head_.blocks, block->bytes.data(), sizeof(written_head_.blocks));
+        ++written_head_.blocks;
+        std::memcpy(written_head_.mac.data(), block->bytes.data() + hashed, written_head_.mac.size());
+      }
+      written_ += block->records;
+      free_.push_back(block);
+    }
+    block_free_.notify_one();
+    written_cv_.notify_all();
+  }
+}
+
+/// A block found in a chunk of the file being verified
+struct VerifyBlock {
+  const uint8_t* bytes;
+  uint32_t records;
+};
+
+AuditVerifyResult verifyAuditLog(const std::string& path,
+                                 const AuditKey& key,
+                                 const AuditHead* head,
+                                 unsigned threads) {
+  AuditVerifyResult result;
+  const HmacSha256Key mac_key = hmacSha256Key(key.data(), key.size());
+  const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    result.error = "Could not open audit log " + path;
+    return result;
+  }
+  ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  AuditLogHeader header{};
+  if (readAll(fd, &header, sizeof(header), 0) != sizeof(header) or
+      std::memcmp(header.magic, kAuditLogMagic, sizeof(header.magic)) != 0 or
+      header.record_size != sizeof(AuditRecord)) {
+    ::close(fd);
+    result.error = "Not an audit log " + path;
+    return result;
+  }
+  result.bytes = sizeof(header);
+
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  // Two buffers: one being hashed while the other is read into.  Each starts with the part of a block the previous
+  // chunk ended in the middle of.
+  const size_t buffer_size = kVerifyChunkSize + blockSize(AuditLog::kRecordsPerBlock);
+  std::vector<uint8_t> buffers[2] = {std::vector<uint8_t>(buffer_size), std::vector<uint8_t>(buffer_size)};
+  uint64_t file_offset = sizeof(header);
+  ssize_t read = readAll(fd, buffers[0].data(), kVerifyChunkSize, file_offset);
+  size_t filled = read < 0 ? 0 : read;
+  file_offset += filled;
+  bool read_failed = read < 0;
+  bool at_end = filled < kVerifyChunkSize;
+
+  Sha256Digest previous_hash{};
+  std::vector<VerifyBlock> blocks;
+  std::vector<Sha256Digest> digests;
+  for (int current = 0; !read_failed; current ^= 1) {
+    // Find the complete blocks in the buffer
+    const uint8_t* const data = buffers[current].data();
+    size_t offset = 0;
+    bool malformed = false;
+    blocks.clear();
+    while (offset + sizeof(AuditBlockHeader) <= filled) {
+      AuditBlockHeader block{};
+      std::memcpy(&block, data + offset, sizeof(block));
+      if (block.record_count == 0 or block.record_count > AuditLog::kRecordsPerBlock) {
+        malformed = true;
+        break;
+      }
+      if (offset + blockSize(block.record_count) > filled) {
+        break;
+      }
+      blocks.push_back(VerifyBlock{data + offset, block.record_count});
+      offset += blockSize(block.record_count);
+    }
+    const size_t carried = filled - offset;
+
+    // Hash them on the hashing threads while the next chunk is read in after what's carried over
+    digests.resize(blocks.size());
+    std::atomic<size_t> next_block(0);
+    std::vector<std::thread> hashers;
+    for (unsigned i = 0; i < threads and i < blocks.size(); ++i) {
+      hashers.emplace_back([&blocks, &digests, &next_block, &mac_key] {
+        for (size_t b = next_block++; b < blocks.size(); b = next_block++) {
+          digests[b] = hmacSha256(mac_key, blocks[b].bytes, blockSize(blocks[b].records) - sizeof(Sha256Digest));
+        }
+      });
+    }
+    size_t next_filled = 0;
+    bool next_at_end = true;
+    if (!at_end and !malformed) {
+      std::vector<uint8_t>& next = buffers[current ^ 1];
+      std::memcpy(next.data(), data + offset, carried);
+      read = readAll(fd, next.data() + carried, kVerifyChunkSize, file_offset);
+      read_failed = read < 0;
+      next_filled = carried + (read < 0 ? 0 : read);
+      next_at_end = read < static_cast<ssize_t>(kVerifyChunkSize);
+      file_offset += read < 0 ? 0 : read;
+    }
+    for (std::thread& hasher : hashers) {
+      hasher.join();
+    }
+
+    // Check the links in order
+    for (size_t b = 0; b < blocks.size(); ++b) {
+      AuditBlockHeader block{};
+      std::memcpy(&block, blocks[b].bytes, sizeof(block));
+      const uint8_t* const stored = blocks[b].bytes + blockSize(blocks[b].records) - sizeof(Sha256Digest);
+      const char* error = nullptr;
+      if (block.sequence != result.blocks) {
+        error = "Block out of sequence";
+      } else if (std::memcmp(block.previous_hash, previous_hash.data(), previous_hash.size()) != 0) {
+        error = "Block doesn't chain to the one before it";
+      } else if (std::memcmp(stored, digests[b].data(), digests[b].size()) != 0) {
+        error = "Block MAC doesn't match its contents";
+      } else if (head != nullptr and block.sequence + 1 == head->blocks and digests[b] != head->mac) {
+        error = "Block isn't the recorded head";
+      }
+      if (error != nullptr) {
+        ::close(fd);
+        result.bad_block = result.blocks;
+        result.error = error;
+        return result;
+      }
+      previous_hash = digests[b];
+      ++result.blocks;
+      result.records += blocks[b].records;
+      result.bytes += blockSize(blocks[b].records);
+    }
+
+    if (malformed or (at_end and carried > 0)) {
+      ::close(fd);
+      result.bad_block = result.blocks;
+      result.error = malformed ? "Malformed block header" : "Torn block at the end of the log";
+      return result;
+    }
+    if (at_end) {
+      ::close(fd);
+      if (head != nullptr and result.blocks < head->blocks) {
+        result.bad_block = result.blocks;
+        result.error = "Log ends before the recorded head";
+        return result;
+      }
+      result.ok = true;
+      return result;
+    }
+    filled = next_filled;
+    at_end = next_at_end;
+  }
+
+  ::close(fd);
+  result.bad_block = result.blocks;
+  result.error = "Could not read audit log " + path;
+  return result;
+}
@@ -0,0 +1,210 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+#ifndef ATM_AUDIT_LOG_H
+#define ATM_AUDIT_LOG_H
+
+// C++ Standard Library
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// ATM Controller
+#include "bounded_queue.h"
+#include "sha256.h"
+
+/// Kinds of security-relevant event in the audit log
+enum AuditEvent {
+  /// A PIN that didn't match the card's
+  AUDIT_WRONG_PIN = 1,
+  /// A PIN entry refused because the card is locked out (E12347), or the wrong PIN that locked it out
+  AUDIT_CARD_LOCKED = 2,
+  /// A withdrawal refused, the error code says why
+  AUDIT_WITHDRAW_REFUSED = 3,
+  /// Cash dispensed for a withdrawal
+  AUDIT_CASH_DISBURSED = 4,
+  /// Cash a jammed or short dispense didn't hand out, credited back.  The code is the DispenseStatus
+  AUDIT_DISPENSE_FAULT = 5
+};
+
+/// One security-relevant event, as stored in the audit log
+struct AuditRecord {
+  /// When it happened, microseconds since the Unix epoch
+  int64_t time_us;
+  uint64_t account_number;
+  /// The amount asked for or dispensed, 0 if there is none
+  int32_t amount;
+  /// Number of the error refused with, e.g. 12343 for E12343, 0 if there is none
+  uint32_t code;
+  /// An AuditEvent
+  uint32_t event;
+  uint32_t reserved;
+};
+
+static_assert(sizeof(AuditRecord) == 32, "Audit log records are a fixed 32 bytes on disk");
+
+/// A record of an event happening now
+AuditRecord auditRecord(AuditEvent event, uint64_t accountNumber, int32_t amount = 0, uint32_t code = 0);
+
+/// Key of the block MACs, kept apart from the log (in an HSM, in a real deployment)
+using AuditKey = std::array<uint8_t, 32>;
+
+/// Where the chain of a log ends, to record outside the log so the log can't be cut short unnoticed
+struct AuditHead {
+  /// Blocks in the chain
+  uint64_t blocks;
+  /// MAC of the last of them, all zeros if there are none
+  Sha256Digest mac;
+};
+
+/**
+ * @brief Append-only, hash-chained log of security-relevant events
+ * @details  Records are grouped into blocks.  Each block's header holds its sequence number and the MAC of the block
+ *           before it, and the block ends with the HMAC-SHA256 of its header and records under the log's key, so
+ *           changing, dropping or reordering anything breaks the chain from there on, and it can't be rebuilt
+ *           without the key.  Dropping blocks off the end leaves a shorter chain that checks out, which only a head
+ *           recorded outside the log can catch; see head() and verifyAuditLog().
+ *
+ *           append() only pushes the record onto a lock-free ring.  A hasher thread drains the ring into blocks of
+ *           up to kRecordsPerBlock records and chains them, and a writer thread writes the finished blocks, so the
+ *           next block is hashed while the last one is written.  A partly filled block goes out after
+ *           kFlushInterval, or on flush().  A crash loses what wasn't written yet, and a block torn by it is cut
+ *           off when the log is reopened.
+ */
+class AuditLog {
+ public:
+  /// Records appended but not yet taken by the hasher before append() has to wait
+  static constexpr size_t kRingCapacity = 1 << 16;
+  /// Most records in one block
+  static constexpr uint32_t kRecordsPerBlock = 512;
+  /// Blocks between the hasher and the writer
+  static constexpr size_t kPipelineBlocks = 4;
+  /// Longest a record waits for its block to fill up before it is written anyway
+  static constexpr std::chrono::milliseconds kFlushInterval{50};
+
+  /**
+   * @brief Opens or creates an audit log, chaining new blocks to the last one already in it
+   * @details  Throws if the file isn't an audit log, or a block header is damaged.  A torn block at the end is
+   *           truncated, nothing else is ever cut off.
+   *
+   * @param path  The log file
+   * @param key  Key the blocks are MACed under, the same every time the log is opened
+   */
+  AuditLog(const std::string& path, const AuditKey& key);
+
+  /// Writes out everything appended
+  ~AuditLog();
+
+  AuditLog(const AuditLog&) = delete;
+  AuditLog& operator=(const AuditLog&) = delete;
+
+  /// Adds a record to the log.  Thread-safe, and only waits if the background threads are kRingCapacity behind
+  void append(const AuditRecord& record);
+
+  /// Waits until every record appended before the call is written, and syncs the file to disk if asked
+  void flush(bool sync = false);
+
+  /// Blocks written to the log, including those from before it was opened
+  uint64_t blocks();
+
+  /// Where the chain ends on disk, for keeping outside the log after a flush()
+  AuditHead head();
+
+ private:
+  struct Block;
+
+  /// Finds where the chain in an existing log ends, cutting off a torn block and throwing at a damaged one
+  void resumeChain();
+
+  /// Packs records from the ring into chained blocks for the writer
+  void hashLoop();
+
+  /// Writes the blocks the hasher finished, in order
+  void writeLoop();
+
+  const std::string path_;
+  const HmacSha256Key key_;
+  int fd_;
+
+  BoundedQueue<AuditRecord> ring_;
+  /// Records appended so far, counted before they are pushed
+  std::atomic<uint64_t> appended_;
+
+  /// Guards the fields below and the block lists
+  std::mutex mutex_;
+  /// Wakes the hasher when records pile up or a flush is waiting
+  std::condition_variable records_ready_;
+  /// Wakes the writer when a block is finished, and the hasher when one is free again
+  std::condition_variable block_ready_;
+  std::condition_variable block_free_;
+  /// Wakes flush() as blocks are written
+  std::condition_variable written_cv_;
+
+  /// Blocks, owned here, and which are waiting to be written or free to fill
+  std::vector<std::unique_ptr<Block>> blocks_;
+  std::deque<Block*> finished_;
+  std::vector<Block*> free_;
+
+  /// Records the hasher put into blocks, those written, and the count a flush() is waiting for
+  uint64_t taken_;
+  uint64_t written_;
+  uint64_t flush_target_;
+  /// The end of the chain written so far
+  AuditHead written_head_;
+  /// The first write error, once one happened nothing more is written
+  std::string error_;
+  bool stopping_;
+  bool hasher_done_;
+
+  /// The next block's sequence number and the previous block's MAC, used by the hasher
+  uint64_t next_sequence_;
+  Sha256Digest previous_hash_;
+
+  std::thread hasher_;
+  std::thread writer_;
+};
+
+/// What verifyAuditLog() found
+struct AuditVerifyResult {
+  /// Whether the header and every block checked out
+  bool ok{false};
+  /// Blocks and records verified
+  uint64_t blocks{0};
+  uint64_t records{0};
+  /// Bytes of the file read
+  uint64_t bytes{0};
+  /// Sequence number of the first block that failed, if not ok
+  uint64_t bad_block{0};
+  /// Why it failed, if not ok
+  std::string error;
+};
+
+/**
+ * @brief Checks the hash chain of an audit log
+ * @details  The file is read in large chunks.  The blocks of each chunk are hashed by threads while the next chunk
+ *           is read, and the links between blocks are checked in order, so a log verifies about as fast as the disk
+ *           or the hash cores can go.  Stops at the first broken block; a torn block at the end is an error too.
+ *           Given a head recorded earlier, the chain has to pass through it, so a log cut short or rebuilt since
+ *           fails.
+ *
+ * @param path     The log file
+ * @param key      The key the log was written with
+ * @param head     A head the log had, nullptr to only check the chain
+ * @param threads  Hashing threads, 0 for one per core
+ */
+AuditVerifyResult verifyAuditLog(const std::string& path,
+                                 const AuditKey& key,
+                                 const AuditHead* head = nullptr,
+                                 unsigned threads = 0);
+
+#endif  // ATM_AUDIT_LOG_H
@@ -0,0 +1,121 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ *
+ * Checks the hash chain of an audit log, or writes a synthetic one to check.  The key file holds the 32-byte key of
+ * the log; --write creates it with a random key if it doesn't exist.  A head printed by --write, or recorded from
+ * AuditLog::head(), can be given to check the log still reaches it.
+ *
+ * Usage: audit_verify <log> <key file> [threads] [<head blocks> <head mac>]
+ *        audit_verify --write <log> <key file> <records>
+ */
+
+// C++ Standard Library
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+// ATM Controller
+#include "audit_log.h"
+#include "pin_store.h"
+
+/// Reads the key file, creating it with a random key if asked and it doesn't exist
+static bool readKey(const std::string& path, bool create, AuditKey& key) {
+  std::ifstream in(path, std::ios::binary);
+  if (in) {
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(key.data()), key.size()));
+  }
+  if (!create) {
+    return false;
+  }
+  key = PinStore::randomKey();
+  std::ofstream out(path, std::ios::binary);
+  return static_cast<bool>(out.write(reinterpret_cast<const char*>(key.data()), key.size()));
+}
+
+static std::string toHex(const Sha256Digest& digest) {
+  static constexpr char kDigits[] = "0123456789abcdef";
+  std::string hex;
+  for (const uint8_t byte : digest) {
+    hex += kDigits[byte >> 4];
+    hex += kDigits[byte & 0xf];
+  }
+  return hex;
+}
+
+static bool fromHex(const std::string& hex, Sha256Digest& digest) {
+  if (hex.size() != 2 * digest.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < digest.size(); ++i) {
+    char* end = nullptr;
+    const std::string byte = hex.substr(2 * i, 2);
+    digest[i] = static_cast<uint8_t>(std::strtoul(byte.c_str(), &end, 16));
+    if (*end != '\0') {
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  const bool write = argc > 1 and std::string(argv[1]) == "--write";
+  if (write ? argc != 5 : (argc < 3 or argc == 5 or argc > 6)) {
+    std::cerr << "Usage: " << argv[0] << " <log> <key file> [threads] [<head blocks> <head mac>]" << std::endl;
+    std::cerr << "       " << argv[0] << " --write <log> <key file> <records>" << std::endl;
+    return 2;
+  }
+
+  AuditKey key{};
+  const std::string key_path = write ? argv[3] : argv[2];
+  if (!readKey(key_path, write, key)) {
+    std::cerr << "Could not read the key from " << key_path << std::endl;
+    return 2;
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  const auto seconds = [&start]() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  };
+
+  if (write) {
+    const uint64_t records = std::strtoull(argv[4], nullptr, 10);
+    try {
+      AuditLog log(argv[2], key);
+      for (uint64_t i = 0; i < records; ++i) {
+        log.append(auditRecord(AUDIT_WRONG_PIN, 1234123412341234 + i % 1000));
+      }
+      log.flush(true);
+      const AuditHead head = log.head();
+      std::cout << records << " records appended in " << seconds() << " s, " << head.blocks << " blocks in the log"
+                << std::endl;
+      std::cout << "head " << head.blocks << " " << toHex(head.mac) << std::endl;
+    } catch (const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  AuditHead head{};
+  if (argc == 6) {
+    head.blocks = std::strtoull(argv[4], nullptr, 10);
+    if (!fromHex(argv[5], head.mac)) {
+      std::cerr << "The head mac is 64 hex digits" << std::endl;
+      return 2;
+    }
+  }
+  const unsigned threads = argc > 3 ? static_cast<unsigned>(std::strtoul(argv[3], nullptr, 10)) : 0;
+  const AuditVerifyResult result = verifyAuditLog(argv[1], key, argc == 6 ? &head : nullptr, threads);
+  const double elapsed = seconds();
+  std::cout << result.blocks << " blocks, " << result.records << " records, " << result.bytes / 1e6 << " MB in "
+            << elapsed << " s (" << result.bytes / 1e6 / elapsed << " MB/s)" << std::endl;
+  if (!result.ok) {
+    std::cout << "FAILED at block " << result.bad_block << ": " << result.error << std::endl;
+    return 1;
+  }
+  std::cout << "OK" << std::endl;
+  return 0;
+}
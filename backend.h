@@ -0,0 +1,407 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+#ifndef ATM_BACKEND_H
+#define ATM_BACKEND_H
+
+// C++ Standard Library
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+// ATM Controller
+#include "machine.h"
+
+/**
+ * @brief Whether or not a type can serve as the machine / server backend of an ATM and its accounts
+ * @details  A backend provides:
+ *             bool verifyPin(uint64_t accountNumber, uint16_t pin);
+ *             Balances getAccountBalances(uint64_t accountNumber);
+ *             bool updateAccountBalance(uint64_t accountNumber, AccountType, int amount, TransactionId);
+ *             uint getAvailableCash();
+ *             void disburseCash(uint amount);
+ *             TransactionId newTransactionId();
+ *           and may optionally provide getAccountProfile(), which fetches the balances and limits in one request,
+ *           velocityTracker() and pinAttemptTracker() returning references, which turn
+ *           on the matching security checks, miniStatements(), which turns on mini statements, depositPipeline(),
+ *           which puts deposits on hold until they clear, auditLog() returning a pointer, which records security
+ *           events while it isn't nullptr,
+ *             void dispenseCash(const DispenseRequest&, DispenseCallback done);
+ *           which dispenses without waiting and credits back what doesn't come out, and
+ *             LedgerUpdateResult updateAccountBalanceIfVersion(uint64_t accountNumber, AccountType, int amount,
+ *                                                              uint64_t expectedVersion, TransactionId);
+ *           which lets accounts detect stale balances.  Machine is the default backend.
+ */
+template <typename Backend, typename = void>
+struct IsMachineBackend : std::false_type {};
+
+template <typename Backend>
+struct IsMachineBackend<
+    Backend,
+    std::enable_if_t<
+        std::is_convertible<decltype(std::declval<Backend&>().verifyPin(uint64_t{}, uint16_t{})), bool>::value and
+        std::is_convertible<decltype(std::declval<Backend&>().getAccountBalances(uint64_t{})), Balances>::value and
+        std::is_convertible<decltype(std::declval<Backend&>().updateAccountBalance(
+                                uint64_t{}, AccountType::CHECKING, int{}, TransactionId{})),
+                            bool>::value and
+        std::is_convertible<decltype(std::declval<Backend&>().getAvailableCash()), uint>::value and
+        std::is_void<decltype(std::declval<Backend&>().disburseCash(uint{}))>::value and
+        std::is_convertible<decltype(std::declval<Backend&>().newTransactionId()), TransactionId>::value>>
+    : std::true_type {};
+
+template <typename Backend, typename = void>
+struct HasAccountProfile : std::false_type {};
+
+template <typename Backend>
+struct HasAccountProfile<Backend, std::void_t<decltype(std::declval<Backend&>().getAccountProfile(uint64_t{}))>>
+    : std::true_type {};
+
+/// What a session needs of the account, in one request if the backend has one for it
+template <typename Backend>
+AccountProfile backendGetAccountProfile(Backend& backend, uint64_t accountNumber) {
+  if constexpr (HasAccountProfile<Backend>::value) {
+    return backend.getAccountProfile(accountNumber);
+  } else {
+    return AccountProfile{backend.getAccountBalances(accountNumber)};
+  }
+}
+
+template <typename Backend, typename = void>
+struct HasVelocityTracker : std::false_type {};
+
+template <typename Backend>
+struct HasVelocityTracker<Backend, std::void_t<decltype(std::declval<Backend&>().velocityTracker())>>
+    : std::true_type {};
+
+template <typename Backend, typename = void>
+struct HasPinAttemptTracker : std::false_type {};
+
+template <typename Backend>
+struct HasPinAttemptTracker<Backend, std::void_t<decltype(std::declval<Backend&>().pinAttemptTracker())>>
+    : std::true_type {};
+
+template <typename Backend, typename = void>
+struct HasMiniStatements : std::false_type {};
+
+template <typename Backend>
+struct HasMiniStatements<Backend, std::void_t<decltype(std::declval<Backend&>().miniStatements())>>
+    : std::true_type {};
+
+template <typename Backend, typename = void>
+struct HasVersionedLedger : std::false_type {};
+
+template <typename Backend>
+struct HasVersionedLedger<Backend,
+                          std::void_t<decltype(std::declval<Backend&>().updateAccountBalanceIfVersion(
+                              uint64_t{}, AccountType::CHECKING, int{}, uint64_t{}, TransactionId{}))>>
+    : std::true_type {};
+
+/**
+ * @brief Updates a balance if the account is still at the expected version
+ * @details  Backends without versions never report a conflict, the update is applied unconditionally.
+ */
+template <typename Backend>
+LedgerUpdateResult backendUpdateAccountBalanceIfVersion(Backend& backend,
+                                                        uint64_t accountNumber,
+                                                        AccountType accountType,
+                                                        int amount,
+                                                        uint64_t expectedVersion,
+                                                        TransactionId transactionId) {
+  if constexpr (HasVersionedLedger<Backend>::value) {
+    return backend.updateAccountBalanceIfVersion(accountNumber, accountType, amount, expectedVersion, transactionId);
+  } else {
+    return backend.updateAccountBalance(accountNumber, accountType, amount, transactionId) ? UPDATE_APPLIED
+                                                                                            : UPDATE_DUPLICATE;
+  }
+}
+
+template <typename Backend, typename = void>
+struct HasDepositPipeline : std::false_type {};
+
+template <typename Backend>
+struct HasDepositPipeline<Backend, std::void_t<decltype(std::declval<Backend&>().depositPipeline())>>
+    : std::true_type {};
+
+template <typename Backend, typename = void>
+struct HasAuditLog : std::false_type {};
+
+template <typename Backend>
+struct HasAuditLog<Backend, std::void_t<decltype(std::declval<Backend&>().auditLog())>> : std::true_type {};
+
+template <typename Backend, typename = void>
+struct HasAsyncDispense : std::false_type {};
+
+template <typename Backend>
+struct HasAsyncDispense<Backend,
+                        std::void_t<decltype(std::declval<Backend&>().dispenseCash(
+                            std::declval<const DispenseRequest&>(), std::declval<DispenseCallback>()))>>
+    : std::true_type {};
+
+/**
+ * @brief Dispenses cash for a debit already applied
+ * @details  Backends without asynchronous dispensing disburse the cash before this returns, and report it as
+ *           complete, or throw.  A DispenseFault is reported to done before it is passed on, and the caller credits
+ *           back what didn't come out.
+ */
+template <typename Backend>
+void backendDispenseCash(Backend& backend, const DispenseRequest& request, DispenseCallback done) {
+  if constexpr (HasAsyncDispense<Backend>::value) {
+    backend.dispenseCash(request, std::move(done));
+  } else {
+    try {
+      backend.disburseCash(request.amount);
+    } catch (const DispenseFault& fault) {
+      if (done) {
+        done(fault.event());
+      }
+      throw;
+    }
+    if (done) {
+      done(DispenseEvent{0, DISPENSE_COMPLETE, request.amount, request.amount});
+    }
+  }
+}
+
+/// The backend's velocity tracker, nullptr if it doesn't have one
+template <typename Backend>
+VelocityTracker* backendVelocityTracker(Backend& backend) {
+  if constexpr (HasVelocityTracker<Backend>::value) {
+    return &backend.velocityTracker();
+  } else {
+    return nullptr;
+  }
+}
+
+/// The backend's pin attempt tracker, nullptr if it doesn't have one
+template <typename Backend>
+PinAttemptTracker* backendPinAttemptTracker(Backend& backend) {
+  if constexpr (HasPinAttemptTracker<Backend>::value) {
+    return &backend.pinAttemptTracker();
+  } else {
+    return nullptr;
+  }
+}
+
+/// The backend's mini statement store, nullptr if it doesn't have one
+template <typename Backend>
+MiniStatementStore* backendMiniStatements(Backend& backend) {
+  if constexpr (HasMiniStatements<Backend>::value) {
+    return &backend.miniStatements();
+  } else {
+    return nullptr;
+  }
+}
+
+/// The backend's deposit pipeline, nullptr if deposits are available right away
+template <typename Backend>
+DepositPipeline* backendDepositPipeline(Backend& backend) {
+  if constexpr (HasDepositPipeline<Backend>::value) {
+    return &backend.depositPipeline();
+  } else {
+    return nullptr;
+  }
+}
+
+/// The backend's audit log, nullptr if it doesn't keep one
+template <typename Backend>
+AuditLog* backendAuditLog(Backend& backend) {
+  if constexpr (HasAuditLog<Backend>::value) {
+    return backend.auditLog();
+  } else {
+    return nullptr;
+  }
+}
+
+/**
+ * @brief Type-erased backend, for when the backend is only known at runtime
+ * @details  Every call goes through a virtual function, so prefer instantiating BasicATM / BasicAccount on the
+ *           concrete backend wherever it is known at compile time.
+ */
+class AnyBackend {
+ public:
+  /**
+   * @brief Constructor for the adapter
+   *
+   * @param backend  The backend to forward to, shared with whoever else holds it
+   */
+  template <typename Backend>
+  explicit AnyBackend(std::shared_ptr<Backend> backend) :
+    self_(std::make_shared<Model<Backend>>(std::move(backend))) {
+    static_assert(IsMachineBackend<Backend>::value, "Backend does not provide the machine backend interface");
+  }
+
+  bool verifyPin(uint64_t accountNumber, uint16_t pin) {
+    return self_->verifyPin(accountNumber, pin);
+  }
+
+  Balances getAccountBalances(uint64_t accountNumber) {
+    return self_->getAccountBalances(accountNumber);
+  }
+
+  AccountProfile getAccountProfile(uint64_t accountNumber) {
+    return self_->getAccountProfile(accountNumber);
+  }
+
+  bool updateAccountBalance(uint64_t accountNumber, AccountType accountType, int amount, TransactionId transactionId) {
+    return self_->updateAccountBalance(accountNumber, accountType, amount, transactionId);
+  }
+
+  LedgerUpdateResult updateAccountBalanceIfVersion(uint64_t accountNumber,
+                                                   AccountType accountType,
+                                                   int amount,
+                                                   uint64_t expectedVersion,
+                                                   TransactionId transactionId) {
+    return self_->updateAccountBalanceIfVersion(accountNumber, accountType, amount, expectedVersion, transactionId);
+  }
+
+  uint getAvailableCash() {
+    return self_->getAvailableCash();
+  }
+
+  void disburseCash(uint amount) {
+    self_->disburseCash(amount);
+  }
+
+  void dispenseCash(const DispenseRequest& request, DispenseCallback done) {
+    self_->dispenseCash(request, std::move(done));
+  }
+
+  TransactionId newTransactionId() {
+    return self_->newTransactionId();
+  }
+
+  /// The wrapped backend's velocity tracker, nullptr if it doesn't have one
+  VelocityTracker* velocityTrackerIfAny() {
+    return self_->velocityTracker();
+  }
+
+  /// The wrapped backend's pin attempt tracker, nullptr if it doesn't have one
+  PinAttemptTracker* pinAttemptTrackerIfAny() {
+    return self_->pinAttemptTracker();
+  }
+
+  /// The wrapped backend's mini statement store, nullptr if it doesn't have one
+  MiniStatementStore* miniStatementsIfAny() {
+    return self_->miniStatements();
+  }
+
+  /// The wrapped backend's deposit pipeline, nullptr if it doesn't have one
+  DepositPipeline* depositPipelineIfAny() {
+    return self_->depositPipeline();
+  }
+
+  /// The wrapped backend's audit log, nullptr if it doesn't keep one
+  AuditLog* auditLogIfAny() {
+    return self_->auditLog();
+  }
+
+ private:
+  struct Concept {
+    virtual ~Concept() = default;
+    virtual bool verifyPin(uint64_t accountNumber, uint16_t pin) = 0;
+    virtual Balances getAccountBalances(uint64_t accountNumber) = 0;
+    virtual AccountProfile getAccountProfile(uint64_t accountNumber) = 0;
+    virtual bool updateAccountBalance(uint64_t accountNumber,
+                                      AccountType accountType,
+                                      int amount,
+                                      TransactionId transactionId) = 0;
+    virtual LedgerUpdateResult updateAccountBalanceIfVersion(uint64_t accountNumber,
+                                                             AccountType accountType,
+                                                             int amount,
+                                                             uint64_t expectedVersion,
+                                                             TransactionId transactionId) = 0;
+    virtual uint getAvailableCash() = 0;
+    virtual void disburseCash(uint amount) = 0;
+    virtual void dispenseCash(const DispenseRequest& request, DispenseCallback done) = 0;
+    virtual TransactionId newTransactionId() = 0;
+    virtual VelocityTracker* velocityTracker() = 0;
+    virtual PinAttemptTracker* pinAttemptTracker() = 0;
+    virtual MiniStatementStore* miniStatements() = 0;
+    virtual DepositPipeline* depositPipeline() = 0;
+    virtual AuditLog* auditLog() = 0;
+  };
+
+  template <typename Backend>
+  struct Model : Concept {
+    explicit Model(std::shared_ptr<Backend> backend) : backend(std::move(backend)) {}
+
+    bool verifyPin(uint64_t accountNumber, uint16_t pin) override {
+      return backend->verifyPin(accountNumber, pin);
+    }
+    Balances getAccountBalances(uint64_t accountNumber) override {
+      return backend->getAccountBalances(accountNumber);
+    }
+    AccountProfile getAccountProfile(uint64_t accountNumber) override {
+      return backendGetAccountProfile(*backend, accountNumber);
+    }
+    bool updateAccountBalance(uint64_t accountNumber,
+                              AccountType accountType,
+                              int amount,
+                              TransactionId transactionId) override {
+      return backend->updateAccountBalance(accountNumber, accountType, amount, transactionId);
+    }
+    LedgerUpdateResult updateAccountBalanceIfVersion(uint64_t accountNumber,
+                                                     AccountType accountType,
+                                                     int amount,
+                                                     uint64_t expectedVersion,
+                                                     TransactionId transactionId) override {
+      return backendUpdateAccountBalanceIfVersion(
+          *backend, accountNumber, accountType, amount, expectedVersion, transactionId);
+    }
+    uint getAvailableCash() override {
+      return backend->getAvailableCash();
+    }
+    void disburseCash(uint amount) override {
+      backend->disburseCash(amount);
+    }
+    void dispenseCash(const DispenseRequest& request, DispenseCallback done) override {
+      backendDispenseCash(*backend, request, std::move(done));
+    }
+    TransactionId newTransactionId() override {
+      return backend->newTransactionId();
+    }
+    VelocityTracker* velocityTracker() override {
+      return backendVelocityTracker(*backend);
+    }
+    PinAttemptTracker* pinAttemptTracker() override {
+      return backendPinAttemptTracker(*backend);
+    }
+    MiniStatementStore* miniStatements() override {
+      return backendMiniStatements(*backend);
+    }
+    DepositPipeline* depositPipeline() override {
+      return backendDepositPipeline(*backend);
+    }
+    AuditLog* auditLog() override {
+      return backendAuditLog(*backend);
+    }
+
+    std::shared_ptr<Backend> backend;
+  };
+
+  std::shared_ptr<Concept> self_;
+};
+
+inline VelocityTracker* backendVelocityTracker(AnyBackend& backend) {
+  return backend.velocityTrackerIfAny();
+}
+
+inline PinAttemptTracker* backendPinAttemptTracker(AnyBackend& backend) {
+  return backend.pinAttemptTrackerIfAny();
+}
+
+inline MiniStatementStore* backendMiniStatements(AnyBackend& backend) {
+  return backend.miniStatementsIfAny();
+}
+
+inline DepositPipeline* backendDepositPipeline(AnyBackend& backend) {
+  return backend.depositPipelineIfAny();
+}
+
+inline AuditLog* backendAuditLog(AnyBackend& backend) {
+  return backend.auditLogIfAny();
+}
+
+#endif  // ATM_BACKEND_H
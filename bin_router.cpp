@@ -0,0 +1,149 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+// C++ Standard Library
+#include <algorithm>
+#include <stdexcept>
+
+// ATM Controller
+#include "bin_router.h"
+
+constexpr size_t BinTable::kMinPrefixDigits;
+constexpr size_t BinTable::kMaxPrefixDigits;
+constexpr uint32_t BinTable::kNoRoute;
+
+/// Powers of ten up to the largest that fits in a card number
+static constexpr std::array<uint64_t, 20> kPowersOfTen = {
+  1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull, 1000000000ull,
+  10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull, 100000000000000ull,
+  1000000000000000ull, 10000000000000000ull, 100000000000000000ull, 1000000000000000000ull,
+  10000000000000000000ull
+};
+
+BinTable::BinTable(const std::vector<std::string>& prefixes) {
+  nodes_.push_back(Node{{}, kNoRoute});
+  for (size_t i = 0; i < prefixes.size(); ++i) {
+    const std::string& prefix = prefixes[i];
+    if (prefix.size() < kMinPrefixDigits or prefix.size() > kMaxPrefixDigits or
+        !std::all_of(prefix.begin(), prefix.end(), [](char c) { return c >= '0' and c <= '9'; })) {
+      throw std::runtime_error("Invalid BIN prefix " + prefix);
+    }
+
+    uint32_t node = 0;
+    for (const char c : prefix) {
+      const size_t digit = static_cast<size_t>(c - '0');
+      if (nodes_[node].children[digit] == 0) {
+        nodes_[node].children[digit] = static_cast<uint32_t>(nodes_.size());
+        nodes_.push_back(Node{{}, kNoRoute});
+      }
+      node = nodes_[node].children[digit];
+    }
+    if (nodes_[node].route != kNoRoute) {
+      throw std::runtime_error("Duplicate BIN prefix " + prefix);
+    }
+    nodes_[node].route = static_cast<uint32_t>(i);
+  }
+}
+
+uint32_t BinTable::lookup(uint64_t cardNumber) const {
+  size_t length = 1;
+  while (length < kPowersOfTen.size() and cardNumber >= kPowersOfTen[length]) {
+    ++length;
+  }
+  // Only the leading digits can match, the one division drops the rest
+  const size_t depth = std::min(length, kMaxPrefixDigits);
+  uint64_t leading = cardNumber / kPowersOfTen[length - depth];
+  std::array<uint8_t, kMaxPrefixDigits> digits;
+  for (size_t i = depth; i > 0; --i) {
+    digits[i - 1] = static_cast<uint8_t>(leading % 10);
+    leading /= 10;
+  }
+
+  uint32_t route = kNoRoute;
+  uint32_t node = 0;
+  for (size_t i = 0; i < depth; ++i) {
+    node = nodes_[node].children[digits[i]];
+    if (node == 0) {
+      break;
+    }
+    if (nodes_[node].route != kNoRoute) {
+      route = nodes_[node].route;
+    }
+  }
+  return route;
+}
+
+BinRouter::BinRouter(const std::vector<BinRoute>& routes) : current_(nullptr) {
+  configure(routes);
+}
+
+BinRouter::~BinRouter() = default;
+
+void BinRouter::configure(const std::vector<BinRoute>& routes) {
+  std::vector<std::string> prefixes;
+  prefixes.reserve(routes.size());
+  for (const BinRoute& route : routes) {
+    prefixes.push_back(route.prefix);
+  }
+
+  // Built aside, lookups keep using the current table until the new one is complete
+  std::unique_ptr<Snapshot> snapshot(new Snapshot{BinTable(prefixes), {}});
+  snapshot->targets.reserve(routes.size());
+  MetricsRegistry& registry = MetricsRegistry::instance();
+  for (const BinRoute& route : routes) {
+    Counter& hits = registry.counter(
+        "atm_bin_route_hits_total", "Cards routed to an issuer by BIN", "issuer=\"" + route.issuer + "\"");
+    snapshot->targets.push_back(Target{route.backend, route.issuer, &hits});
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  current_.store(snapshot.get(), std::memory_order_release);
+  snapshots_.push_back(std::move(snapshot));
+}
+
+AnyBackend* BinRouter::route(uint64_t cardNumber) {
+  Target* const found = target(cardNumber);
+  return found == nullptr ? nullptr : &found->backend;
+}
+
+AnyBackend* BinRouter::routeCard(uint64_t cardNumber) {
+  Target* const found = target(cardNumber);
+  if (found == nullptr) {
+    return nullptr;
+  }
+  found->hits->increment();
+  return &found->backend;
+}
+
+BinRouter::Target* BinRouter::target(uint64_t cardNumber) {
+  Snapshot* const snapshot = current_.load(std::memory_order_acquire);
+  const uint32_t index = snapshot->table.lookup(cardNumber);
+  return index == BinTable::kNoRoute ? nullptr : &snapshot->targets[index];
+}
+
+std::string BinRouter::issuer(uint64_t cardNumber) {
+  const Snapshot* const snapshot = current_.load(std::memory_order_acquire);
+  const uint32_t index = snapshot->table.lookup(cardNumber);
+  return index == BinTable::kNoRoute ? std::string() : snapshot->targets[index].issuer;
+}
+
+uint64_t BinRouter::hits(const std::string& issuer) {
+  return MetricsRegistry::instance()
+      .counter("atm_bin_route_hits_total", "Cards routed to an issuer by BIN", "issuer=\"" + issuer + "\"")
+      .value();
+}
+
+RoutedBackend::RoutedBackend(AnyBackend local, const std::vector<BinRoute>& routes) :
+  local_(std::move(local)),
+  router_(routes) {
+}
+
+AnyBackend& RoutedBackend::supported(AnyBackend* backend) {
+  if (backend == nullptr) {
+    atmMetrics().error_e12350.increment();
+    throw std::runtime_error("E12350: Card not supported");
+  }
+  return *backend;
+}
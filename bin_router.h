@@ -0,0 +1,217 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+#ifndef ATM_BIN_ROUTER_H
+#define ATM_BIN_ROUTER_H
+
+// C++ Standard Library
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// ATM Controller
+#include "backend.h"
+#include "metrics.h"
+
+/// Card numbers whose leading digits match prefix belong to issuer, and are served by backend
+struct BinRoute {
+  /// Leading digits of the card number, BinTable::kMinPrefixDigits to BinTable::kMaxPrefixDigits of them
+  std::string prefix;
+  std::string issuer;
+  AnyBackend backend;
+};
+
+/**
+ * @brief Longest prefix match of card numbers against BIN ranges
+ * @details  A decimal radix trie, one node per prefix digit, with the nodes in one array and children as indices so
+ *           a lookup is at most kMaxPrefixDigits dependent loads from a few cache lines.  Immutable once built.
+ */
+class BinTable {
+ public:
+  static constexpr size_t kMinPrefixDigits = 6;
+  static constexpr size_t kMaxPrefixDigits = 11;
+  /// Returned by lookup() for card numbers no prefix matches
+  static constexpr uint32_t kNoRoute = UINT32_MAX;
+
+  /**
+   * @brief Builds the trie
+   *
+   * @param prefixes  The prefixes, a card matching prefixes[i] looks up as i
+   * @throws  If a prefix isn't all digits, is too short or long, or appears twice
+   */
+  explicit BinTable(const std::vector<std::string>& prefixes);
+
+  /// Index of the longest prefix matching the card number, kNoRoute if none does
+  uint32_t lookup(uint64_t cardNumber) const;
+
+  size_t nodes() const {
+    return nodes_.size();
+  }
+
+ private:
+  struct Node {
+    /// Index of the child for each next digit, 0 for none (the root is never a child)
+    std::array<uint32_t, 10> children;
+    /// Index of the prefix ending here, kNoRoute if none does
+    uint32_t route;
+  };
+
+  std::vector<Node> nodes_;
+};
+
+/**
+ * @brief Routes card numbers to the backend of their issuer
+ * @details  Lookups read the current table without a lock.  configure() builds a new table aside and swaps it in,
+ *           lookups already in flight finish against the old one, which is kept until the router goes away since
+ *           configuration changes are rare.  Cards routed with routeCard() are counted per issuer in
+ *           atm_bin_route_hits_total.
+ */
+class BinRouter {
+ public:
+  /// Throws like configure()
+  explicit BinRouter(const std::vector<BinRoute>& routes);
+
+  ~BinRouter();
+
+  BinRouter(const BinRouter&) = delete;
+  BinRouter& operator=(const BinRouter&) = delete;
+
+  /**
+   * @brief Replaces every route at once
+   *
+   * @param routes  The new routes
+   * @throws  If a prefix is invalid or appears twice, the old routes stay in place
+   */
+  void configure(const std::vector<BinRoute>& routes);
+
+  /// The backend serving the card, nullptr if no route matches.  Valid for the life of the router
+  AnyBackend* route(uint64_t cardNumber);
+
+  /// As route(), for a card starting a session, which counts as a hit for its issuer
+  AnyBackend* routeCard(uint64_t cardNumber);
+
+  /// The issuer of the card, empty if no route matches
+  std::string issuer(uint64_t cardNumber);
+
+  /// Cards routed to an issuer, over every router in the process
+  uint64_t hits(const std::string& issuer);
+
+ private:
+  struct Target {
+    AnyBackend backend;
+    std::string issuer;
+    Counter* hits;
+  };
+
+  struct Snapshot {
+    BinTable table;
+    std::vector<Target> targets;
+  };
+
+  /// The target serving the card in the current table, nullptr if no route matches
+  Target* target(uint64_t cardNumber);
+
+  /// The table lookups use
+  std::atomic<Snapshot*> current_;
+
+  /// Guards snapshots_
+  std::mutex mutex_;
+
+  /// Every table published, the last is current_
+  std::vector<std::unique_ptr<Snapshot>> snapshots_;
+};
+
+/**
+ * @brief Backend in front of several issuers' backends, picking one by the card's BIN
+ * @details  Account calls go to the issuer of the account number, or throw E12350 if no issuer is configured for it.
+ *           The cash, transaction ids and the audit log belong to the terminal, so those go to the local backend,
+ *           and velocity and pin attempt tracking are kept here for cards of every issuer.  Cash is disbursed
+ *           synchronously, since only the issuer can credit back an undispensed amount.
+ */
+class RoutedBackend {
+ public:
+  /**
+   * @brief Constructor for the routed backend
+   *
+   * @param local  The terminal's own backend
+   * @param routes  BIN prefixes and the issuers serving them, the local backend can be one of them
+   */
+  RoutedBackend(AnyBackend local, const std::vector<BinRoute>& routes);
+
+  /// For reconfiguring the routes or reading the stats
+  BinRouter& router() {
+    return router_;
+  }
+
+  bool verifyPin(uint64_t accountNumber, uint16_t pin) {
+    return issuer(accountNumber).verifyPin(accountNumber, pin);
+  }
+
+  Balances getAccountBalances(uint64_t accountNumber) {
+    return issuer(accountNumber).getAccountBalances(accountNumber);
+  }
+
+  /// Fetched once per card, at the swipe, so this is where the card counts as routed
+  AccountProfile getAccountProfile(uint64_t accountNumber) {
+    return supported(router_.routeCard(accountNumber)).getAccountProfile(accountNumber);
+  }
+
+  bool updateAccountBalance(uint64_t accountNumber, AccountType accountType, int amount, TransactionId transactionId) {
+    return issuer(accountNumber).updateAccountBalance(accountNumber, accountType, amount, transactionId);
+  }
+
+  LedgerUpdateResult updateAccountBalanceIfVersion(uint64_t accountNumber,
+                                                   AccountType accountType,
+                                                   int amount,
+                                                   uint64_t expectedVersion,
+                                                   TransactionId transactionId) {
+    return issuer(accountNumber)
+        .updateAccountBalanceIfVersion(accountNumber, accountType, amount, expectedVersion, transactionId);
+  }
+
+  uint getAvailableCash() {
+    return local_.getAvailableCash();
+  }
+
+  void disburseCash(uint amount) {
+    local_.disburseCash(amount);
+  }
+
+  TransactionId newTransactionId() {
+    return local_.newTransactionId();
+  }
+
+  VelocityTracker& velocityTracker() {
+    return velocity_tracker_;
+  }
+
+  PinAttemptTracker& pinAttemptTracker() {
+    return pin_attempt_tracker_;
+  }
+
+  AuditLog* auditLog() {
+    return local_.auditLogIfAny();
+  }
+
+ private:
+  /// The backend of the account's issuer, throws E12350 if there is none
+  AnyBackend& issuer(uint64_t accountNumber) {
+    return supported(router_.route(accountNumber));
+  }
+
+  /// The backend a card was routed to, throws E12350 if it wasn't
+  static AnyBackend& supported(AnyBackend* backend);
+
+  AnyBackend local_;
+  BinRouter router_;
+  VelocityTracker velocity_tracker_;
+  PinAttemptTracker pin_attempt_tracker_;
+};
+
+#endif  // ATM_BIN_ROUTER_H
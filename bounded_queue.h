@@ -0,0 +1,117 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+#ifndef ATM_BOUNDED_QUEUE_H
+#define ATM_BOUNDED_QUEUE_H
+
+// C++ Standard Library
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+
+/**
+ * @brief Fixed-capacity, lock-free queue for any number of producers and consumers
+ * @details  Each cell carries a sequence number telling producers and consumers whose turn it is, so neither side
+ *           ever waits on the other: tryPush fails when the queue is full and tryPop fails when it is empty.
+ *
+ * @tparam T  The type of element held, must be default constructible and movable
+ */
+template <typename T>
+class BoundedQueue {
+ public:
+  /**
+   * @brief Constructor for the queue
+   *
+   * @param capacity  The most elements held at once, must be a power of two
+   */
+  explicit BoundedQueue(size_t capacity) :
+    mask_(capacity - 1),
+    cells_(new Cell[capacity]),
+    enqueue_pos_(0),
+    dequeue_pos_(0) {
+    if (capacity < 2 or (capacity & (capacity - 1)) != 0) {
+      throw std::invalid_argument("Queue capacity must be a power of two");
+    }
+    for (size_t i = 0; i < capacity; ++i) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  BoundedQueue(const BoundedQueue&) = delete;
+  BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+  /// Adds an element to the back of the queue, returns false without blocking if the queue is full
+  bool tryPush(T value) {
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell& cell = cells_[pos & mask_];
+      const size_t sequence = cell.sequence.load(std::memory_order_acquire);
+      const intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          cell.value = std::move(value);
+          cell.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  /// Takes an element from the front of the queue, returns false without blocking if the queue is empty
+  bool tryPop(T& value) {
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell& cell = cells_[pos & mask_];
+      const size_t sequence = cell.sequence.load(std::memory_order_acquire);
+      const intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          value = std::move(cell.value);
+          cell.sequence.store(pos + mask_ + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  /// Approximate number of elements in the queue, exact when no other thread is using it
+  size_t size() const {
+    const size_t enqueued = enqueue_pos_.load(std::memory_order_acquire);
+    const size_t dequeued = dequeue_pos_.load(std::memory_order_acquire);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+  }
+
+  /// The most elements held at once
+  size_t capacity() const {
+    return mask_ + 1;
+  }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  /// Keep producers and consumers from sharing a cache line
+  static constexpr size_t kCacheLine = 64;
+
+  const size_t mask_;
+  std::unique_ptr<Cell[]> cells_;
+  alignas(kCacheLine) std::atomic<size_t> enqueue_pos_;
+  alignas(kCacheLine) std::atomic<size_t> dequeue_pos_;
+};
+
+#endif  // ATM_BOUNDED_QUEUE_H
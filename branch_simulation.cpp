@@ -0,0 +1,295 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+// C++ Standard Library
+#include <algorithm>
+#include <deque>
+#include <stdexcept>
+
+// ATM Controller
+#include "atm.h"
+#include "branch_simulation.h"
+
+/// Event types of the simulation, the target of each is an ATM
+enum BranchEventType {
+  /// A customer joins the ATM's line
+  EVENT_ARRIVAL = 0,
+  /// The customer at the ATM presses the next button
+  EVENT_STEP = 1,
+  /// The ATM's service loop runs
+  EVENT_SERVICE_TICK = 2
+};
+
+/// Where a customer is in their session, the next button they press
+enum SessionStep { STEP_CARD = 0, STEP_PIN, STEP_SELECT, STEP_ACTION, STEP_DONE, STEP_FINISHED };
+
+/**
+ * @brief An ATM's connection to the simulated bank host
+ * @details  The ledger is the shared Machine, without its velocity and pin attempt trackers, which run on the wall
+ *           clock and would lock out simulated customers.  The cash is the ATM's own cassette.  The profile fetch
+ *           started at a swipe runs on a prefetch thread; it is answered with the account as of the swipe, so the run
+ *           doesn't depend on when that thread gets to it.
+ */
+struct SimulatedHost {
+  SimulatedHost(std::shared_ptr<Machine> machine, uint cassette) : machine(std::move(machine)), cash(cassette) {}
+
+  /// Takes the profile the host will answer the swipe's fetch with
+  void swipe(uint64_t accountNumber) {
+    swiped = machine->getAccountProfile(accountNumber);
+  }
+
+  AccountProfile getAccountProfile(uint64_t) {
+    return swiped;
+  }
+  bool verifyPin(uint64_t accountNumber, uint16_t pin) {
+    return machine->verifyPin(accountNumber, pin);
+  }
+  Balances getAccountBalances(uint64_t accountNumber) {
+    return machine->getAccountBalances(accountNumber);
+  }
+  bool updateAccountBalance(uint64_t accountNumber, AccountType accountType, int amount, TransactionId transactionId) {
+    return machine->updateAccountBalance(accountNumber, accountType, amount, transactionId);
+  }
+  LedgerUpdateResult updateAccountBalanceIfVersion(uint64_t accountNumber,
+                                                   AccountType accountType,
+                                                   int amount,
+                                                   uint64_t expectedVersion,
+                                                   TransactionId transactionId) {
+    return machine->updateAccountBalanceIfVersion(accountNumber, accountType, amount, expectedVersion, transactionId);
+  }
+  uint getAvailableCash() {
+    return cash;
+  }
+  void disburseCash(uint amount) {
+    if (amount > cash) {
+      throw std::runtime_error("Cash can't be disbursed");
+    }
+    cash -= amount;
+  }
+  TransactionId newTransactionId() {
+    return machine->newTransactionId();
+  }
+
+  std::shared_ptr<Machine> machine;
+  uint cash;
+  AccountProfile swiped{Balances{0, 0}};
+};
+
+/// Mean time between arrivals at an ATM
+static SimTime meanInterarrival(const BranchSimulationConfig& config) {
+  const std::chrono::duration<double, std::ratio<3600>> hours(1.0 / config.arrivals_per_hour);
+  return std::chrono::duration_cast<SimTime>(hours);
+}
+
+struct BranchSimulation::SimulatedATM {
+  SimulatedATM(std::shared_ptr<Machine> machine, uint cassette) :
+    host(std::make_shared<SimulatedHost>(std::move(machine), cassette)),
+    atm(host) {}
+
+  std::shared_ptr<SimulatedHost> host;
+  BasicATM<SimulatedHost> atm;
+
+  /// Arrival times of the customers in line, not counting the one at the ATM
+  std::deque<SimTime> line;
+
+  /// The customer at the ATM, if in_session
+  bool in_session{false};
+  SessionStep step{STEP_CARD};
+  uint64_t account{0};
+  uint16_t pin{0};
+  uint32_t actions_left{0};
+  SimTime session_start{0};
+
+  /// When the host answers the profile fetch of the swipe, and the last ledger update
+  SimTime profile_ready{0};
+  SimTime host_ready{0};
+
+  bool tick_pending{false};
+};
+
+BranchSimulation::BranchSimulation(const BranchSimulationConfig& config) :
+  config_(config),
+  machine_(std::make_shared<Machine>()),
+  events_(4 * std::max<size_t>(config.atms, 1)),
+  random_(config.seed) {
+  if (config_.service_period <= SimTime(0) or config_.max_actions == 0) {
+    throw std::runtime_error("Invalid branch simulation config");
+  }
+  for (uint32_t i = 0; i < config_.atms; ++i) {
+    atms_.emplace_back(new SimulatedATM(machine_, config_.cassette));
+  }
+  for (const auto& account : kAccountPins) {
+    accounts_.push_back(account.first);
+  }
+  // Hash map order isn't something to build a reproducible run on
+  std::sort(accounts_.begin(), accounts_.end());
+}
+
+BranchSimulation::~BranchSimulation() = default;
+
+BranchSimulationStats BranchSimulation::run() {
+  if (config_.arrivals_per_hour > 0) {
+    for (uint32_t i = 0; i < config_.atms; ++i) {
+      const SimTime first = exponential(meanInterarrival(config_));
+      if (first < config_.duration) {
+        events_.scheduleAt(first, EVENT_ARRIVAL, i);
+      }
+    }
+  }
+
+  SimEvent event;
+  while (events_.pop(event)) {
+    switch (event.type) {
+      case EVENT_ARRIVAL:
+        onArrival(event.target);
+        break;
+      case EVENT_STEP:
+        onStep(event.target);
+        break;
+      case EVENT_SERVICE_TICK:
+        onServiceTick(event.target);
+        break;
+    }
+  }
+
+  stats_.simulated = events_.now();
+  stats_.events = events_.processed();
+  return stats_;
+}
+
+void BranchSimulation::onArrival(uint32_t atm) {
+  SimulatedATM& simulated = *atms_[atm];
+  const SimTime now = events_.now();
+  ++stats_.arrivals;
+
+  const SimTime next = now + exponential(meanInterarrival(config_));
+  if (next < config_.duration) {
+    events_.scheduleAt(next, EVENT_ARRIVAL, atm);
+  }
+
+  simulated.line.push_back(now);
+  if (!simulated.in_session) {
+    startSession(atm);
+  }
+  stats_.max_queue = std::max<uint64_t>(stats_.max_queue, simulated.line.size());
+}
+
+void BranchSimulation::startSession(uint32_t atm) {
+  SimulatedATM& simulated = *atms_[atm];
+  const SimTime now = events_.now();
+  const SimTime waited = now - simulated.line.front();
+  simulated.line.pop_front();
+  stats_.total_wait += waited;
+  stats_.max_wait = std::max(stats_.max_wait, waited);
+
+  simulated.in_session = true;
+  simulated.step = STEP_CARD;
+  simulated.account = accounts_[std::uniform_int_distribution<size_t>(0, accounts_.size() - 1)(random_)];
+  // Customers know their pins, the host only keeps hashes of them
+  simulated.pin = kAccountPins.at(simulated.account);
+  simulated.actions_left = std::uniform_int_distribution<uint32_t>(1, config_.max_actions)(random_);
+  simulated.session_start = now;
+  events_.scheduleAfter(exponential(config_.think_time), EVENT_STEP, atm);
+}
+
+void BranchSimulation::onStep(uint32_t atm) {
+  SimulatedATM& simulated = *atms_[atm];
+  const SimTime now = events_.now();
+
+  switch (simulated.step) {
+    case STEP_CARD:
+      simulated.host->swipe(simulated.account);
+      simulated.atm.cardReaderCB(simulated.account);
+      simulated.profile_ready = now + exponential(config_.host_latency);
+      ++stats_.host_requests;
+      simulated.step = STEP_PIN;
+      break;
+    case STEP_PIN:
+      if (now < simulated.profile_ready) {
+        // Typed faster than the host answered, enterPinCB waits for the rest of the fetch
+        ++stats_.pin_waits;
+        stats_.total_pin_wait += simulated.profile_ready - now;
+        events_.scheduleAt(simulated.profile_ready, EVENT_STEP, atm);
+        return;
+      }
+      simulated.atm.enterPinCB(simulated.pin);
+      simulated.step = STEP_SELECT;
+      break;
+    case STEP_SELECT:
+      simulated.atm.accountSelectCB(static_cast<AccountType>(std::uniform_int_distribution<int>(0, 1)(random_)));
+      simulated.step = STEP_ACTION;
+      break;
+    case STEP_ACTION: {
+      const int kind = std::uniform_int_distribution<int>(0, 2)(random_);
+      const int amount = 20 * std::uniform_int_distribution<int>(1, 20)(random_);
+      ManagementAction action{ManagementAction::ManagementActionType::BALANCE};
+      if (kind != 0) {
+        // A round trip to the host before the screen moves on
+        action = ManagementAction{kind == 1 ? ManagementAction::ManagementActionType::WITHDRAW
+                                            : ManagementAction::ManagementActionType::DEPOSIT,
+                                  amount};
+        simulated.host_ready = now + exponential(config_.host_latency);
+        ++stats_.host_requests;
+      }
+      simulated.atm.accountManagementCB(action);
+      if (--simulated.actions_left == 0) {
+        simulated.step = STEP_DONE;
+      }
+      break;
+    }
+    case STEP_DONE:
+      simulated.atm.accountManagementCB(ManagementAction{ManagementAction::ManagementActionType::DONE});
+      simulated.step = STEP_FINISHED;
+      break;
+    case STEP_FINISHED:
+      break;
+  }
+  requestTick(atm, std::max(now, simulated.host_ready));
+}
+
+void BranchSimulation::onServiceTick(uint32_t atm) {
+  SimulatedATM& simulated = *atms_[atm];
+  simulated.tick_pending = false;
+  simulated.atm.service();
+  if (!simulated.in_session) {
+    return;
+  }
+
+  if (simulated.atm.getState() != ATMScreenState::IDLE) {
+    // The customer reads the new screen and presses the next button
+    events_.scheduleAfter(exponential(config_.think_time), EVENT_STEP, atm);
+    return;
+  }
+
+  if (simulated.step == STEP_FINISHED) {
+    ++stats_.sessions;
+  } else {
+    ++stats_.declined;
+  }
+  stats_.total_session += events_.now() - simulated.session_start;
+  simulated.in_session = false;
+  if (!simulated.line.empty()) {
+    startSession(atm);
+  }
+}
+
+void BranchSimulation::requestTick(uint32_t atm, SimTime earliest) {
+  SimulatedATM& simulated = *atms_[atm];
+  if (simulated.tick_pending) {
+    return;
+  }
+  // The service loop runs on a fixed period, the first run from earliest on sees the callback's transition
+  const SimTime period = config_.service_period;
+  simulated.tick_pending = true;
+  events_.scheduleAt((earliest + period - SimTime(1)) / period * period, EVENT_SERVICE_TICK, atm);
+}
+
+SimTime BranchSimulation::exponential(SimTime mean) {
+  if (mean <= SimTime(0)) {
+    return SimTime(0);
+  }
+  std::exponential_distribution<double> distribution(1.0 / static_cast<double>(mean.count()));
+  return SimTime(static_cast<SimTime::rep>(distribution(random_)));
+}
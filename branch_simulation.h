@@ -0,0 +1,118 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+#ifndef ATM_BRANCH_SIMULATION_H
+#define ATM_BRANCH_SIMULATION_H
+
+// C++ Standard Library
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <vector>
+
+// ATM Controller
+#include "event_queue.h"
+#include "machine.h"
+
+/// Traffic and timings of a simulated branch
+struct BranchSimulationConfig {
+  /// ATMs in the branch, each with its own line of customers
+  uint32_t atms{8};
+  /// Customers stop arriving after this long, the ones already in line are still served
+  SimTime duration{std::chrono::hours(24)};
+  /// Mean customer arrivals per hour at each ATM, a Poisson process
+  double arrivals_per_hour{12};
+  /// Mean time a customer takes to read the screen and press the next button, exponentially distributed
+  SimTime think_time{std::chrono::seconds(4)};
+  /// Mean round trip of a request to the bank's host, exponentially distributed
+  SimTime host_latency{std::chrono::milliseconds(300)};
+  /// Period of an ATM's service() loop, it only runs while a transition is pending
+  SimTime service_period{std::chrono::milliseconds(200)};
+  /// Most balance, withdraw and deposit actions in a session, at least one
+  uint32_t max_actions{3};
+  /// Cash loaded in each ATM
+  uint cassette{200000};
+  uint64_t seed{1};
+};
+
+/// What a simulated branch did, identical for identical configs
+struct BranchSimulationStats {
+  /// Virtual time until the last customer left
+  SimTime simulated{0};
+  /// Events processed
+  uint64_t events{0};
+  uint64_t arrivals{0};
+  /// Sessions that ended with DONE
+  uint64_t sessions{0};
+  /// Sessions sent back to IDLE early, e.g. by a declined withdrawal
+  uint64_t declined{0};
+  uint64_t host_requests{0};
+
+  /// Time customers spent in line before reaching an ATM, the mean queue length over time is its total / simulated
+  SimTime total_wait{0};
+  SimTime max_wait{0};
+  uint64_t max_queue{0};
+
+  /// Time customers spent at an ATM, from walking up to it to it being back at IDLE.  The ATMs' utilization is its
+  /// total / (simulated * atms)
+  SimTime total_session{0};
+
+  /// Pins entered before the account profile fetched at the swipe came back, and how long they waited for it
+  uint64_t pin_waits{0};
+  SimTime total_pin_wait{0};
+};
+
+/**
+ * @brief A branch of ATMs and the customers lining up at them, as a discrete-event simulation
+ * @details  Customer arrivals, button presses after a think time, host round trips and ticks of each ATM's service
+ *           loop are events on a virtual clock, so days of traffic run in seconds.  The ATMs are real BasicATM
+ *           controllers driven through their callbacks, on a simulated host that forwards the ledger to a shared
+ *           Machine without its velocity and pin attempt trackers.  All randomness comes from the seed, in event
+ *           order, so a run is reproducible.
+ */
+class BranchSimulation {
+ public:
+  explicit BranchSimulation(const BranchSimulationConfig& config);
+  ~BranchSimulation();
+
+  BranchSimulation(const BranchSimulation&) = delete;
+  BranchSimulation& operator=(const BranchSimulation&) = delete;
+
+  /// Runs until the last customer has left, once
+  BranchSimulationStats run();
+
+  /// The bank's ledger
+  Machine& machine() {
+    return *machine_;
+  }
+
+ private:
+  struct SimulatedATM;
+
+  /// Handlers of the event types
+  void onArrival(uint32_t atm);
+  void onStep(uint32_t atm);
+  void onServiceTick(uint32_t atm);
+
+  /// Brings the next customer in line up to the ATM
+  void startSession(uint32_t atm);
+
+  /// Schedules the service loop tick that will see what the last callback did, if none is scheduled yet
+  void requestTick(uint32_t atm, SimTime earliest);
+
+  /// A sample of the exponential distribution with the given mean
+  SimTime exponential(SimTime mean);
+
+  const BranchSimulationConfig config_;
+  std::shared_ptr<Machine> machine_;
+  std::vector<std::unique_ptr<SimulatedATM>> atms_;
+  /// The ledger's accounts, customers use one at random
+  std::vector<uint64_t> accounts_;
+  EventQueue events_;
+  BranchSimulationStats stats_;
+  std::mt19937_64 random_;
+};
+
+#endif  // ATM_BRANCH_SIMULATION_H
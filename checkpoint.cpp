@@ -0,0 +1,316 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+// C++ Standard Library
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+
+// POSIX
+#include <unistd.h>
+
+// ATM Controller
+#include "checkpoint.h"
+
+constexpr size_t Checkpointer::kDefaultDeltasPerBase;
+
+/// Checkpoint files start with this, followed by the format version
+static constexpr char kCheckpointMagic[8] = {'A', 'T', 'M', 'C', 'K', 'P', 'T', '1'};
+
+static constexpr char kBasePrefix[] = "base-";
+static constexpr char kDeltaPrefix[] = "delta-";
+static constexpr char kCheckpointSuffix[] = ".ckpt";
+
+/// Fixed-size header of every checkpoint file, followed by the account records and a checksum
+struct CheckpointHeader {
+  char magic[8];
+  uint32_t available_cash;
+  uint32_t reserved;
+  uint64_t sequence;
+  uint64_t count;
+};
+
+/// A checkpoint file found in the directory
+struct CheckpointFile {
+  bool base;
+  uint64_t sequence;
+  std::filesystem::path path;
+};
+
+/// FNV-1a, enough to tell a torn write from a complete one
+static uint64_t checksum(const void* data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+  const unsigned char* bytes = static_cast<const unsigned char*>(data);
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+static std::filesystem::path checkpointPath(const std::string& directory, bool base, uint64_t sequence) {
+  char name[64];
+  // Zero padded so the names sort in sequence order
+  std::snprintf(name,
+                sizeof(name),
+                "%s%020llu%s",
+                base ? kBasePrefix : kDeltaPrefix,
+                static_cast<unsigned long long>(sequence),
+                kCheckpointSuffix);
+  return std::filesystem::path(directory) / name;
+}
+
+/// Lists the checkpoint files in a directory, sorted by sequence number with bases before deltas
+static std::vector<CheckpointFile> listCheckpoints(const std::string& directory) {
+  std::vector<CheckpointFile> files;
+  std::error_code error;
+  for (const auto& entry : std::filesystem::directory_iterator(directory, error)) {
+    const std::string name = entry.path().filename().string();
+    if (name.size() <= std::strlen(kCheckpointSuffix) or
+        name.compare(name.size() - std::strlen(kCheckpointSuffix), std::string::npos, kCheckpointSuffix) != 0) {
+      continue;
+    }
+
+    const bool base = name.rfind(kBasePrefix, 0) == 0;
+    if (!base and name.rfind(kDeltaPrefix, 0) != 0) {
+      continue;
+    }
+    const size_t digits = base ? std::strlen(kBasePrefix) : std::strlen(kDeltaPrefix);
+    files.push_back(CheckpointFile{base, std::stoull(name.substr(digits)), entry.path()});
+  }
+
+  std::sort(files.begin(), files.end(), [](const CheckpointFile& a, const CheckpointFile& b) {
+    return a.sequence != b.sequence ? a.sequence < b.sequence : a.base > b.base;
+  });
+  return files;
+}
+
+/// Writes a checkpoint file under a temporary name, syncs it and renames it into place
+static void writeCheckpointFile(const std::filesystem::path& path,
+                                uint64_t sequence,
+                                uint available_cash,
+                                const std::vector<AccountSnapshot>& accounts) {
+  CheckpointHeader header{};
+  std::memcpy(header.magic, kCheckpointMagic, sizeof(header.magic));
+  header.available_cash = available_cash;
+  header.sequence = sequence;
+  header.count = accounts.size();
+
+  uint64_t sum = checksum(&header, sizeof(header));
+  sum = checksum(accounts.data(), accounts.size() * sizeof(AccountSnapshot), sum);
+
+  const std::filesystem::path temporary = path.string() + ".tmp";
+  FILE* file = std::fopen(temporary.c_str(), "wb");
+  if (file == nullptr) {
+    throw std::runtime_error("Could not write checkpoint " + path.string());
+  }
+
+  bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+  ok = ok and (accounts.empty() or
+               std::fwrite(accounts.data(), sizeof(AccountSnapshot), accounts.size(), file) == accounts.size());
+  ok = ok and std::fwrite(&sum, sizeof(sum), 1, file) == 1;
+  ok = ok and std::fflush(file) == 0 and ::fsync(fileno(file)) == 0;
+  ok = (std::fclose(file) == 0) and ok;
+  if (!ok) {
+    std::filesystem::remove(temporary);
+    throw std::runtime_error("Could not write checkpoint " + path.string());
+  }
+
+  std::filesystem::rename(temporary, path);
+}
+
+/// Reads and verifies a checkpoint file, returns false if it is missing, torn or corrupt
+static bool readCheckpointFile(const std::filesystem::path& path,
+                               CheckpointHeader& header,
+                               std::vector<AccountSnapshot>& accounts) {
+  FILE* file = std::fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    return false;
+  }
+
+  bool ok = std::fread(&header, sizeof(header), 1, file) == 1 and
+            std::memcmp(header.magic, kCheckpointMagic, sizeof(header.magic)) == 0;
+  if (ok) {
+    accounts.resize(header.count);
+    uint64_t sum = 0;
+    ok = (accounts.empty() or std::fread(accounts.data(), sizeof(AccountSnapshot), accounts.size(), file) ==
+                                  accounts.size()) and
+         std::fread(&sum, sizeof(sum), 1, file) == 1;
+    ok = ok and sum == checksum(accounts.data(),
+                                accounts.size() * sizeof(AccountSnapshot),
+                                checksum(&header, sizeof(header)));
+  }
+  std::fclose(file);
+  return ok;
+}
+
+Checkpointer::Checkpointer(const std::string& directory, CaptureFunction capture, size_t deltasPerBase) :
+  directory_(directory),
+  capture_(std::move(capture)),
+  deltas_per_base_(std::max<size_t>(deltasPerBase, 1)),
+  sequence_(0),
+  deltas_since_base_(0),
+  last_available_cash_(-1),
+  running_(false) {
+  std::filesystem::create_directories(directory_);
+
+  // Carry on numbering after whatever is already there
+  for (const CheckpointFile& file : listCheckpoints(directory_)) {
+    sequence_ = std::max(sequence_, file.sequence);
+    deltas_since_base_ = file.base ? 0 : deltas_since_base_ + 1;
+  }
+}
+
+Checkpointer::~Checkpointer() {
+  stop();
+}
+
+void Checkpointer::start(std::chrono::milliseconds interval) {
+  std::lock_guard<std::mutex> lock(thread_mutex_);
+  if (running_) {
+    return;
+  }
+  running_ = true;
+  thread_ = std::thread(&Checkpointer::run, this, interval);
+}
+
+void Checkpointer::stop() {
+  {
+    std::lock_guard<std::mutex> lock(thread_mutex_);
+    if (!running_) {
+      return;
+    }
+    running_ = false;
+  }
+  wake_.notify_all();
+  thread_.join();
+}
+
+void Checkpointer::checkpointNow() {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  writeCheckpoint();
+}
+
+uint64_t Checkpointer::sequence() {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  return sequence_;
+}
+
+CheckpointState Checkpointer::load(const std::string& directory) {
+  CheckpointState state;
+  const std::vector<CheckpointFile> files = listCheckpoints(directory);
+
+  // Start from the newest base that reads back cleanly
+  auto start = files.end();
+  CheckpointHeader header{};
+  std::vector<AccountSnapshot> accounts;
+  for (auto file = files.rbegin(); file != files.rend(); ++file) {
+    if (file->base and readCheckpointFile(file->path, header, accounts)) {
+      start = std::next(file).base();
+      break;
+    }
+  }
+
+  if (start != files.end()) {
+    state.found = true;
+    state.sequence = header.sequence;
+    state.available_cash = header.available_cash;
+    for (const AccountSnapshot& account : accounts) {
+      state.accounts[account.account_number] = account;
+    }
+    ++start;
+  } else {
+    start = files.begin();
+  }
+
+  // Replay deltas in order, stopping at the first gap or torn file.  Deltas only hold the accounts that changed, so
+  // without a base they are only a whole ledger if they go back to the first checkpoint
+  for (auto file = start; file != files.end(); ++file) {
+    if (file->base or file->sequence <= state.sequence) {
+      continue;
+    }
+    if (file->sequence != state.sequence + 1 or !readCheckpointFile(file->path, header, accounts)) {
+      break;
+    }
+
+    state.found = true;
+    state.sequence = header.sequence;
+    state.available_cash = header.available_cash;
+    for (const AccountSnapshot& account : accounts) {
+      state.accounts[account.account_number] = account;
+    }
+  }
+
+  return state;
+}
+
+void Checkpointer::writeCheckpoint() {
+  const CheckpointDelta delta = capture_();
+  for (const AccountSnapshot& account : delta.accounts) {
+    pending_accounts_[account.account_number] = account;
+  }
+
+  if (pending_accounts_.empty() and static_cast<int64_t>(delta.available_cash) == last_available_cash_) {
+    // Nothing changed
+    return;
+  }
+
+  std::vector<AccountSnapshot> accounts;
+  accounts.reserve(pending_accounts_.size());
+  for (const auto& account : pending_accounts_) {
+    accounts.push_back(account.second);
+  }
+  writeCheckpointFile(checkpointPath(directory_, false, sequence_ + 1), sequence_ + 1, delta.available_cash, accounts);
+  ++sequence_;
+  pending_accounts_.clear();
+  last_available_cash_ = delta.available_cash;
+
+  if (++deltas_since_base_ >= deltas_per_base_) {
+    compact();
+  }
+}
+
+void Checkpointer::compact() {
+  const CheckpointState state = load(directory_);
+  if (!state.found or state.sequence != sequence_) {
+    // Something on disk is unreadable, keep the files around and try again next time
+    return;
+  }
+
+  std::vector<AccountSnapshot> accounts;
+  accounts.reserve(state.accounts.size());
+  for (const auto& account : state.accounts) {
+    accounts.push_back(account.second);
+  }
+  writeCheckpointFile(checkpointPath(directory_, true, sequence_), sequence_, state.available_cash, accounts);
+  deltas_since_base_ = 0;
+
+  // Everything up to and including this sequence is now in the new base
+  for (const CheckpointFile& file : listCheckpoints(directory_)) {
+    if (file.sequence < sequence_ or (file.sequence == sequence_ and !file.base)) {
+      std::error_code error;
+      std::filesystem::remove(file.path, error);
+    }
+  }
+}
+
+void Checkpointer::run(std::chrono::milliseconds interval) {
+  std::unique_lock<std::mutex> lock(thread_mutex_);
+  bool running = true;
+  while (running) {
+    wake_.wait_for(lock, interval, [this]() { return !running_; });
+    running = running_;
+    lock.unlock();
+
+    try {
+      checkpointNow();
+    } catch (const std::exception& e) {
+      std::cout << e.what() << std::endl;
+    }
+
+    lock.lock();
+  }
+}
@@ -0,0 +1,136 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+#ifndef ATM_CHECKPOINT_H
+#define ATM_CHECKPOINT_H
+
+// C++ Standard Library
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// POSIX
+#include <sys/types.h>
+
+/// Checking and savings balances of one account as of a checkpoint
+struct AccountSnapshot {
+  uint64_t account_number;
+  int checking;
+  int savings;
+};
+
+/// Everything that changed since the previous checkpoint
+struct CheckpointDelta {
+  /// The cash in the machine when the delta was captured
+  uint available_cash;
+
+  /// Only the accounts that changed since the previous delta
+  std::vector<AccountSnapshot> accounts;
+};
+
+/// State rebuilt from the latest base checkpoint and the deltas written after it
+struct CheckpointState {
+  /// Whether or not any checkpoint was found
+  bool found{false};
+
+  /// The sequence number of the newest checkpoint applied
+  uint64_t sequence{0};
+
+  uint available_cash{0};
+
+  /// Latest balances of every account that changed since checkpointing began
+  std::unordered_map<uint64_t, AccountSnapshot> accounts;
+};
+
+/**
+ * @brief Periodically writes incremental checkpoints of machine state to a directory
+ * @details  The capture function only copies what changed since the previous call, so the transaction path is
+ *           stalled for O(changed accounts) rather than O(all accounts).  Writing happens on a background thread.
+ *           Every few deltas the background thread folds them into a new base file (from disk, never touching live
+ *           state) and deletes the files it replaced, so recovery reads one base and a short tail of deltas.  Files
+ *           are written to a temporary name and renamed into place, and carry a checksum, so a crash mid-write
+ *           never leaves a half-written checkpoint behind.
+ */
+class Checkpointer {
+ public:
+  using CaptureFunction = std::function<CheckpointDelta()>;
+
+  /**
+   * @brief Constructor for the checkpointer, numbering continues after any checkpoints already in the directory
+   *
+   * @param directory  Where checkpoints are written, created if missing
+   * @param capture  Returns what changed since it was last called
+   * @param deltasPerBase  How many deltas are written before they are folded into a new base
+   */
+  Checkpointer(const std::string& directory, CaptureFunction capture, size_t deltasPerBase = kDefaultDeltasPerBase);
+
+  /// Stops the background thread, writing a final checkpoint if it was running
+  ~Checkpointer();
+
+  /// Starts writing a checkpoint every interval on a background thread
+  void start(std::chrono::milliseconds interval);
+
+  /// Stops the background thread after writing a final checkpoint
+  void stop();
+
+  /// Captures and writes a checkpoint on the calling thread, folding deltas into a new base if due
+  void checkpointNow();
+
+  /// The sequence number of the last checkpoint written
+  uint64_t sequence();
+
+  /**
+   * @brief Rebuilds state from the latest base checkpoint and the deltas after it
+   *
+   * @param directory  Where checkpoints were written
+   * @return  The recovered state, found is false if there was nothing to recover, or no readable base and the deltas
+   *          don't start at the first checkpoint
+   */
+  static CheckpointState load(const std::string& directory);
+
+  static constexpr size_t kDefaultDeltasPerBase = 16;
+
+ private:
+  /// Writes a delta and compacts if due, must hold write_mutex_
+  void writeCheckpoint();
+
+  /// Folds the base and deltas up to sequence_ into a new base, must hold write_mutex_
+  void compact();
+
+  /// Background thread loop
+  void run(std::chrono::milliseconds interval);
+
+  const std::string directory_;
+  const CaptureFunction capture_;
+  const size_t deltas_per_base_;
+
+  /// Serializes checkpoint writes between the background thread and checkpointNow
+  std::mutex write_mutex_;
+
+  /// Sequence number of the last checkpoint written
+  uint64_t sequence_;
+
+  /// Deltas written since the last base
+  size_t deltas_since_base_;
+
+  /// Cash recorded in the last checkpoint written, -1 if none has been written by this instance
+  int64_t last_available_cash_;
+
+  /// Captured changes not yet on disk, kept across a failed write so they go out with the next one
+  std::unordered_map<uint64_t, AccountSnapshot> pending_accounts_;
+
+  std::mutex thread_mutex_;
+  std::condition_variable wake_;
+  bool running_;
+  std::thread thread_;
+};
+
+#endif  // ATM_CHECKPOINT_H
@@ -0,0 +1,82 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+// ATM Controller
+#include "circuit_breaker.h"
+
+CircuitBreaker::CircuitBreaker(const CircuitBreakerConfig& config) :
+  config_(config),
+  state_(CIRCUIT_CLOSED),
+  consecutive_failures_(0),
+  probing_(false),
+  trips_(0) {
+}
+
+bool CircuitBreaker::allowRequest() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  switch (state_) {
+    case CIRCUIT_CLOSED:
+      return true;
+    case CIRCUIT_OPEN:
+      if (Clock::now() - opened_at_ < config_.open_duration) {
+        return false;
+      }
+      state_ = CIRCUIT_HALF_OPEN;
+      probing_ = true;
+      return true;
+    case CIRCUIT_HALF_OPEN:
+      // A probe that was let through and never reported would otherwise keep the circuit half open for good
+      if (probing_ and Clock::now() - opened_at_ < 2 * config_.open_duration) {
+        return false;
+      }
+      probing_ = true;
+      return true;
+  }
+  return false;
+}
+
+void CircuitBreaker::recordSuccess(Clock::duration latency) {
+  if (latency > config_.slow_call) {
+    recordFailure();
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  consecutive_failures_ = 0;
+  if (state_ == CIRCUIT_HALF_OPEN) {
+    state_ = CIRCUIT_CLOSED;
+    probing_ = false;
+  }
+}
+
+void CircuitBreaker::recordFailure() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const Clock::time_point now = Clock::now();
+  if (state_ == CIRCUIT_HALF_OPEN) {
+    // The probe failed, wait out another open duration
+    trip(now);
+    return;
+  }
+  if (state_ == CIRCUIT_CLOSED and ++consecutive_failures_ >= config_.failure_threshold) {
+    trip(now);
+  }
+}
+
+CircuitState CircuitBreaker::state() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return state_;
+}
+
+uint64_t CircuitBreaker::trips() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return trips_;
+}
+
+void CircuitBreaker::trip(Clock::time_point now) {
+  state_ = CIRCUIT_OPEN;
+  opened_at_ = now;
+  consecutive_failures_ = 0;
+  probing_ = false;
+  ++trips_;
+}
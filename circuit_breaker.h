@@ -0,0 +1,76 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+#ifndef ATM_CIRCUIT_BREAKER_H
+#define ATM_CIRCUIT_BREAKER_H
+
+// C++ Standard Library
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+/// States of a circuit breaker
+enum CircuitState {
+  /// Calls go through
+  CIRCUIT_CLOSED = 0,
+  /// Calls are refused without trying until the open duration is over
+  CIRCUIT_OPEN = 1,
+  /// One probe call goes through to see if the other side is back, the rest are refused
+  CIRCUIT_HALF_OPEN = 2
+};
+
+/// When a circuit breaker trips and how long it stays open
+struct CircuitBreakerConfig {
+  /// A call slower than this counts as a failure even though it answered
+  std::chrono::milliseconds slow_call{100};
+  /// Failed or slow calls in a row that open the circuit
+  uint32_t failure_threshold{3};
+  /// How long the circuit stays open before a probe is let through
+  std::chrono::milliseconds open_duration{1000};
+};
+
+/**
+ * @brief Stops calls to a slow or failing service until it has had time to recover
+ * @details  Callers ask allowRequest() before each call and report how it went.  After failure_threshold failed or
+ *           slow calls in a row the circuit opens and every call is refused straight away.  Once open_duration has
+ *           passed the next caller is let through as a probe: if it is fast the circuit closes again, otherwise it
+ *           stays open for another open_duration.  Thread-safe.
+ */
+class CircuitBreaker {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit CircuitBreaker(const CircuitBreakerConfig& config = CircuitBreakerConfig());
+
+  /// Whether a call may be made now.  A call let through must be reported with recordSuccess() or recordFailure()
+  bool allowRequest();
+
+  /// Reports a call that answered, slow calls count as failures
+  void recordSuccess(Clock::duration latency);
+
+  /// Reports a call that failed or timed out
+  void recordFailure();
+
+  CircuitState state();
+
+  /// Times the circuit has opened
+  uint64_t trips();
+
+ private:
+  /// Opens the circuit.  Must hold mutex_
+  void trip(Clock::time_point now);
+
+  const CircuitBreakerConfig config_;
+
+  std::mutex mutex_;
+  CircuitState state_;
+  uint32_t consecutive_failures_;
+  Clock::time_point opened_at_;
+  /// Whether the half-open probe has been let through and not reported yet
+  bool probing_;
+  uint64_t trips_;
+};
+
+#endif  // ATM_CIRCUIT_BREAKER_H
@@ -0,0 +1,157 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+// C++ Standard Library
+#include <algorithm>
+#include <stdexcept>
+
+// ATM Controller
+#include "dedup_cache.h"
+#include "metrics.h"
+
+constexpr DedupCache::Clock::duration DedupCache::kDefaultWindow;
+constexpr size_t DedupCache::kPeakTransactionsPerSecond;
+constexpr size_t DedupCache::kDefaultCapacity;
+constexpr size_t DedupCache::kInitialShardCapacity;
+
+DedupCache::DedupCache(size_t capacity, Clock::duration window) :
+  shard_capacity_(1),
+  window_(window) {
+  while (shard_capacity_ * kShards < capacity) {
+    shard_capacity_ <<= 1;
+  }
+
+  const size_t initial = std::min(shard_capacity_, kInitialShardCapacity);
+  for (Shard& shard : shards_) {
+    // Keep the tables at most half full so probe runs stay short
+    shard.table.assign(initial * 2, kNoTransactionId);
+    shard.ring.resize(initial);
+  }
+}
+
+bool DedupCache::insert(TransactionId id, Clock::time_point now) {
+  if (id == kNoTransactionId) {
+    throw std::invalid_argument("Invalid transaction id");
+  }
+
+  const uint64_t h = hash(id);
+  Shard& shard = shards_[h % kShards];
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  expire(shard, now);
+
+  size_t slot = find(shard, id, h);
+  if (shard.table[slot] == id) {
+    return false;
+  }
+
+  if (shard.count == shard.ring.size()) {
+    if (shard.count == shard_capacity_) {
+      // Every id here is still inside the window, forgetting one could let its retry through
+      atmMetrics().error_e12351.increment();
+      throw std::runtime_error("E12351: Too many transactions, try again later");
+    }
+    grow(shard);
+    slot = find(shard, id, h);
+  }
+
+  shard.table[slot] = id;
+  shard.ring[(shard.head + shard.count) & (shard.ring.size() - 1)] = Entry{id, now + window_};
+  ++shard.count;
+  return true;
+}
+
+bool DedupCache::contains(TransactionId id, Clock::time_point now) {
+  if (id == kNoTransactionId) {
+    return false;
+  }
+
+  const uint64_t h = hash(id);
+  Shard& shard = shards_[h % kShards];
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  expire(shard, now);
+  return shard.table[find(shard, id, h)] == id;
+}
+
+size_t DedupCache::size() {
+  size_t total = 0;
+  for (Shard& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    total += shard.count;
+  }
+  return total;
+}
+
+size_t DedupCache::capacity() const {
+  return shard_capacity_ * kShards;
+}
+
+uint64_t DedupCache::hash(TransactionId id) {
+  // splitmix64 finalizer
+  uint64_t h = id + 0x9e3779b97f4a7c15ULL;
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+
+size_t DedupCache::find(const Shard& shard, TransactionId id, uint64_t h) const {
+  const size_t mask = shard.table.size() - 1;
+  // The low bits picked the shard, use the rest for the slot
+  size_t slot = (h / kShards) & mask;
+  while (shard.table[slot] != kNoTransactionId and shard.table[slot] != id) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+void DedupCache::erase(Shard& shard, TransactionId id, uint64_t h) {
+  size_t slot = find(shard, id, h);
+  if (shard.table[slot] != id) {
+    return;
+  }
+
+  // Backward shift deletion, no tombstones to clean up later
+  const size_t mask = shard.table.size() - 1;
+  size_t next = (slot + 1) & mask;
+  while (shard.table[next] != kNoTransactionId) {
+    const size_t home = (hash(shard.table[next]) / kShards) & mask;
+    // Move the entry back if its home slot isn't cyclically within (slot, next]
+    if (((next - home) & mask) >= ((next - slot) & mask)) {
+      shard.table[slot] = shard.table[next];
+      slot = next;
+    }
+    next = (next + 1) & mask;
+  }
+  shard.table[slot] = kNoTransactionId;
+}
+
+void DedupCache::expire(Shard& shard, Clock::time_point now) {
+  while (shard.count > 0 and shard.ring[shard.head].expiry <= now) {
+    evictOldest(shard);
+  }
+}
+
+void DedupCache::evictOldest(Shard& shard) {
+  const TransactionId oldest = shard.ring[shard.head].id;
+  erase(shard, oldest, hash(oldest));
+  shard.head = (shard.head + 1) & (shard.ring.size() - 1);
+  --shard.count;
+}
+
+void DedupCache::grow(Shard& shard) {
+  std::vector<Entry> ring(shard.ring.size() * 2);
+  for (size_t i = 0; i < shard.count; ++i) {
+    ring[i] = shard.ring[(shard.head + i) & (shard.ring.size() - 1)];
+  }
+  shard.ring.swap(ring);
+  shard.head = 0;
+
+  shard.table.assign(shard.ring.size() * 2, kNoTransactionId);
+  for (size_t i = 0; i < shard.count; ++i) {
+    const TransactionId id = shard.ring[i].id;
+    shard.table[find(shard, id, hash(id))] = id;
+  }
+}
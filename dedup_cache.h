@@ -0,0 +1,119 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+#ifndef ATM_DEDUP_CACHE_H
+#define ATM_DEDUP_CACHE_H
+
+// C++ Standard Library
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/// Unique identity of a single debit or credit sent to the ledger
+using TransactionId = uint64_t;
+
+/// Never handed out as a transaction id
+static constexpr TransactionId kNoTransactionId = 0;
+
+/**
+ * @brief Bounded, time-windowed set of recently seen transaction ids
+ * @details  Ids are spread over a fixed number of shards, each with its own lock, an open-addressed hash table and a
+ *           ring of ids in insertion order.  The ring expires ids once they fall out of the window.  A shard starts
+ *           small and doubles while it is full of ids still inside the window, up to its share of the capacity.  An
+ *           id is never forgotten before its window is over, since a retry arriving after that would be applied
+ *           twice, so past the capacity new ids are refused instead.  Lookups and inserts are O(1) (amortized over
+ *           expiries and growth).
+ */
+class DedupCache {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  /**
+   * @brief Constructor for the cache
+   *
+   * @param capacity  The most ids remembered at once, rounded up so every shard holds a power of two.  At least the
+   *                  peak transaction rate times the window
+   * @param window  How long an id is remembered for
+   */
+  explicit DedupCache(size_t capacity = kDefaultCapacity, Clock::duration window = kDefaultWindow);
+
+  /**
+   * @brief Remembers a transaction id
+   *
+   * @param id  The id to remember, must not be kNoTransactionId
+   * @param now  The current time
+   * @return  True if the id is new, false if it was already seen inside the window
+   * @throws  E12351 if the id is new but the cache is full of ids still inside the window
+   */
+  bool insert(TransactionId id, Clock::time_point now = Clock::now());
+
+  /// Whether or not the id was seen inside the window
+  bool contains(TransactionId id, Clock::time_point now = Clock::now());
+
+  /// The number of ids currently remembered
+  size_t size();
+
+  /// The most ids that can be remembered at once
+  size_t capacity() const;
+
+  static constexpr Clock::duration kDefaultWindow = std::chrono::minutes(10);
+  /// Transactions per second the default capacity keeps a whole window of
+  static constexpr size_t kPeakTransactionsPerSecond = 50000;
+  static constexpr size_t kDefaultCapacity =
+      kPeakTransactionsPerSecond * std::chrono::duration_cast<std::chrono::seconds>(kDefaultWindow).count();
+
+ private:
+  static constexpr size_t kShards = 16;
+  /// Ids a shard holds before it first grows
+  static constexpr size_t kInitialShardCapacity = 4096;
+
+  /// An id and when it stops being remembered
+  struct Entry {
+    TransactionId id;
+    Clock::time_point expiry;
+  };
+
+  struct Shard {
+    std::mutex mutex;
+
+    /// Linear probing table of ids, kNoTransactionId marks an empty slot.  Twice the ring's size, a power of two
+    std::vector<TransactionId> table;
+
+    /// Ids in the order they were inserted, oldest at head.  A power of two
+    std::vector<Entry> ring;
+    size_t head{0};
+    size_t count{0};
+  };
+
+  /// Mixes the bits of an id so sequential ids spread over shards and slots
+  static uint64_t hash(TransactionId id);
+
+  /// Finds the slot holding an id, or the empty slot where it would go
+  size_t find(const Shard& shard, TransactionId id, uint64_t h) const;
+
+  /// Removes an id from the table, shifting back later entries of its probe run
+  void erase(Shard& shard, TransactionId id, uint64_t h);
+
+  /// Forgets every id at the head of the ring that has expired
+  void expire(Shard& shard, Clock::time_point now);
+
+  /// Forgets the oldest id in the shard
+  void evictOldest(Shard& shard);
+
+  /// Doubles a full shard's ring and table, keeping every id
+  void grow(Shard& shard);
+
+  /// Most ids remembered per shard
+  size_t shard_capacity_;
+
+  /// How long an id is remembered for
+  Clock::duration window_;
+
+  std::array<Shard, kShards> shards_;
+};
+
+#endif  // ATM_DEDUP_CACHE_H
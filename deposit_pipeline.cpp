@@ -0,0 +1,275 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+// C++ Standard Library
+#include <algorithm>
+
+// ATM Controller
+#include "deposit_pipeline.h"
+#include "metrics.h"
+
+constexpr size_t DepositPipeline::kHoldShards;
+
+DepositPipeline::DepositPipeline(ReverseFunction reverse, const DepositPipelineConfig& config, VerifyFunction verify) :
+  config_(config),
+  reverse_(std::move(reverse)),
+  verify_(std::move(verify)),
+  captured_(config.queue_capacity),
+  verifying_(config.queue_capacity),
+  settling_(config.queue_capacity),
+  has_overflow_(false),
+  captured_count_(0),
+  settled_count_(0),
+  rejected_count_(0),
+  wakeups_(0),
+  running_(true) {
+}
+
+DepositPipeline::~DepositPipeline() {
+  {
+    std::lock_guard<std::mutex> lock(wake_mutex_);
+    running_ = false;
+  }
+  wake_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+void DepositPipeline::capture(TransactionId transactionId, uint64_t accountNumber, uint32_t accountType, uint amount) {
+  std::call_once(workers_started_, &DepositPipeline::startWorkers, this);
+
+  DepositItem item{transactionId, accountNumber, accountType, amount, 0, false, Clock::time_point{}};
+  item.held = amount > config_.immediate_availability ? amount - config_.immediate_availability : 0;
+
+  // The hold is in place before the session can see the credit, so it never spends uncleared funds
+  if (item.held > 0 and accountType < 2) {
+    HoldShard& shard = holdShardFor(accountNumber);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.held[accountNumber][accountType] += item.held;
+  }
+  atmMetrics().deposits_held.add(item.held);
+  captured_count_.fetch_add(1, std::memory_order_relaxed);
+
+  if (!captured_.tryPush(item)) {
+    std::lock_guard<std::mutex> lock(overflow_mutex_);
+    overflow_.push_back(item);
+    has_overflow_.store(true, std::memory_order_release);
+  }
+  notify();
+}
+
+int64_t DepositPipeline::heldAmount(uint64_t accountNumber, uint32_t accountType) {
+  if (accountType >= 2) {
+    return 0;
+  }
+  HoldShard& shard = holdShardFor(accountNumber);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  const auto held = shard.held.find(accountNumber);
+  return held == shard.held.end() ? 0 : held->second[accountType];
+}
+
+DepositPipelineStats DepositPipeline::stats() const {
+  return DepositPipelineStats{captured_count_.load(), settled_count_.load(), rejected_count_.load()};
+}
+
+bool DepositPipeline::waitUntilSettled(std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> lock(wake_mutex_);
+  return settled_.wait_for(lock, timeout, [this]() {
+    return settled_count_.load() + rejected_count_.load() >= captured_count_.load();
+  });
+}
+
+void DepositPipeline::startWorkers() {
+  const size_t workers = std::max<size_t>(config_.workers, 1);
+  workers_.reserve(workers);
+  for (size_t i = 0; i < workers; ++i) {
+    workers_.emplace_back(&DepositPipeline::run, this);
+  }
+}
+
+void DepositPipeline::run() {
+  std::vector<DepositItem> batch;
+  batch.reserve(config_.batch_size);
+
+  while (true) {
+    bool running = true;
+    uint64_t wakeups = 0;
+    {
+      std::lock_guard<std::mutex> lock(wake_mutex_);
+      running = running_;
+      wakeups = wakeups_;
+    }
+
+    // Latest stage first, so what is already in flight finishes before more is started.  Once stopping, held
+    // deposits are released early so everything settles
+    size_t moved = settleStage(batch);
+    moved += verifyStage(batch);
+    moved += releaseStage(batch, !running);
+    moved += holdStage(batch);
+    if (moved > 0) {
+      continue;
+    } else if (!running) {
+      return;
+    }
+
+    // Sleep until more is captured, or the soonest held deposit is due.  Anything captured since the stages were
+    // looked at has already bumped wakeups_, so it isn't missed
+    Clock::time_point release = Clock::time_point::max();
+    {
+      std::lock_guard<std::mutex> lock(holding_mutex_);
+      if (!holding_.empty()) {
+        release = holding_.top().release_after;
+      }
+    }
+    std::unique_lock<std::mutex> lock(wake_mutex_);
+    const auto woken = [this, wakeups]() { return !running_ or wakeups_ != wakeups; };
+    if (release == Clock::time_point::max()) {
+      wake_.wait(lock, woken);
+    } else {
+      wake_.wait_until(lock, release, woken);
+    }
+  }
+}
+
+size_t DepositPipeline::holdStage(std::vector<DepositItem>& batch) {
+  batch.clear();
+  DepositItem item;
+  while (batch.size() < config_.batch_size and captured_.tryPop(item)) {
+    batch.push_back(item);
+  }
+  if (has_overflow_.load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> lock(overflow_mutex_);
+    batch.insert(batch.end(), overflow_.begin(), overflow_.end());
+    overflow_.clear();
+    has_overflow_.store(false, std::memory_order_relaxed);
+  }
+  if (batch.empty()) {
+    return 0;
+  }
+
+  const Clock::time_point release_after = Clock::now() + config_.hold_period;
+  if (config_.hold_period.count() == 0) {
+    for (DepositItem& held : batch) {
+      held.release_after = release_after;
+      toVerify(held);
+    }
+  } else {
+    std::lock_guard<std::mutex> lock(holding_mutex_);
+    for (DepositItem& held : batch) {
+      held.release_after = release_after;
+      holding_.push(held);
+    }
+  }
+  return batch.size();
+}
+
+size_t DepositPipeline::releaseStage(std::vector<DepositItem>& batch, bool force) {
+  batch.clear();
+  {
+    std::lock_guard<std::mutex> lock(holding_mutex_);
+    const Clock::time_point now = Clock::now();
+    while (batch.size() < config_.batch_size and !holding_.empty() and
+           (force or holding_.top().release_after <= now)) {
+      batch.push_back(holding_.top());
+      holding_.pop();
+    }
+  }
+
+  for (DepositItem& item : batch) {
+    toVerify(item);
+  }
+  return batch.size();
+}
+
+size_t DepositPipeline::verifyStage(std::vector<DepositItem>& batch) {
+  batch.clear();
+  DepositItem item;
+  while (batch.size() < config_.batch_size and verifying_.tryPop(item)) {
+    batch.push_back(item);
+  }
+
+  for (DepositItem& verified : batch) {
+    verified.accepted = !verify_ or verify_(verified);
+    toSettle(verified);
+  }
+  return batch.size();
+}
+
+size_t DepositPipeline::settleStage(std::vector<DepositItem>& batch) {
+  batch.clear();
+  DepositItem item;
+  while (batch.size() < config_.batch_size and settling_.tryPop(item)) {
+    batch.push_back(item);
+  }
+  if (!batch.empty()) {
+    settle(batch);
+  }
+  return batch.size();
+}
+
+void DepositPipeline::toVerify(DepositItem& item) {
+  if (!verifying_.tryPush(item)) {
+    item.accepted = !verify_ or verify_(item);
+    toSettle(item);
+  }
+}
+
+void DepositPipeline::toSettle(DepositItem& item) {
+  if (!settling_.tryPush(item)) {
+    std::vector<DepositItem> single{item};
+    settle(single);
+  }
+}
+
+void DepositPipeline::settle(std::vector<DepositItem>& batch) {
+  // Grouped by shard so each shard's lock is taken once per batch
+  std::sort(batch.begin(), batch.end(), [this](const DepositItem& a, const DepositItem& b) {
+    return &holdShardFor(a.account_number) < &holdShardFor(b.account_number);
+  });
+
+  int64_t released = 0;
+  for (auto group = batch.begin(); group != batch.end();) {
+    HoldShard& shard = holdShardFor(group->account_number);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    for (; group != batch.end() and &holdShardFor(group->account_number) == &shard; ++group) {
+      if (group->held == 0 or group->account_type >= 2) {
+        continue;
+      }
+      auto held = shard.held.find(group->account_number);
+      held->second[group->account_type] -= group->held;
+      released += group->held;
+      if (held->second[0] == 0 and held->second[1] == 0) {
+        shard.held.erase(held);
+      }
+    }
+  }
+  atmMetrics().deposits_held.add(-released);
+
+  uint64_t rejected = 0;
+  for (const DepositItem& item : batch) {
+    if (!item.accepted) {
+      reverse_(item);
+      ++rejected;
+    }
+  }
+  atmMetrics().deposits_settled.increment(batch.size() - rejected);
+  atmMetrics().deposits_rejected.increment(rejected);
+
+  {
+    std::lock_guard<std::mutex> lock(wake_mutex_);
+    settled_count_.fetch_add(batch.size() - rejected);
+    rejected_count_.fetch_add(rejected);
+  }
+  settled_.notify_all();
+}
+
+void DepositPipeline::notify() {
+  {
+    std::lock_guard<std::mutex> lock(wake_mutex_);
+    ++wakeups_;
+  }
+  wake_.notify_one();
+}
@@ -0,0 +1,203 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+#ifndef ATM_DEPOSIT_PIPELINE_H
+#define ATM_DEPOSIT_PIPELINE_H
+
+// C++ Standard Library
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// POSIX
+#include <sys/types.h>
+
+// ATM Controller
+#include "bounded_queue.h"
+#include "dedup_cache.h"
+
+/// A deposit making its way through clearing
+struct DepositItem {
+  /// The ledger credit the deposit was applied with
+  TransactionId transaction_id;
+  uint64_t account_number;
+  /// AccountType of the credited balance
+  uint32_t account_type;
+  uint amount;
+  /// The part of the amount that isn't available until the deposit settles
+  uint held;
+  /// Whether or not verification accepted the deposit, set by the verify stage
+  bool accepted;
+  /// When the hold stage lets the deposit go on to verification
+  std::chrono::steady_clock::time_point release_after;
+};
+
+/// How the pipeline is sized and how long funds are held
+struct DepositPipelineConfig {
+  /// Background workers, each of which works on whichever stage has work.  Started by the first capture
+  size_t workers{std::max(1u, std::thread::hardware_concurrency())};
+  /// Capacity of each stage's queue, a power of two
+  size_t queue_capacity{4096};
+  /// Most items a worker takes from a stage at once
+  size_t batch_size{64};
+  /// The first part of every deposit is available right away, the rest is held until it settles
+  uint immediate_availability{225};
+  /// How long deposits sit in the hold stage before they are verified
+  std::chrono::milliseconds hold_period{0};
+};
+
+/// Deposits through the pipeline so far
+struct DepositPipelineStats {
+  uint64_t captured;
+  uint64_t settled;
+  uint64_t rejected;
+};
+
+/**
+ * @brief Clears deposits in the background: capture, hold, verify, settle
+ * @details  The session only captures: it records the hold and pushes the deposit onto a lock-free bounded queue,
+ *           so it never waits on clearing.  Background workers then take deposits a batch at a time through the hold
+ *           stage (which schedules their release), verification and settlement (which lifts the hold, or reverses
+ *           the credit of a rejected deposit).  Any worker works on any stage, latest stage first so deposits
+ *           already in flight finish before new ones start, and throughput grows with the number of workers.  A
+ *           worker that finds the next stage's queue full carries the deposit through the remaining stages itself
+ *           rather than wait.
+ */
+class DepositPipeline {
+ public:
+  /// Decides whether a deposit clears, e.g. a call out to the clearing house
+  using VerifyFunction = std::function<bool(const DepositItem&)>;
+
+  /// Takes a rejected deposit back off the ledger
+  using ReverseFunction = std::function<void(const DepositItem&)>;
+
+  /**
+   * @brief Constructor for the pipeline, the workers start with the first deposit
+   *
+   * @param reverse  Called from a worker for each rejected deposit
+   * @param config  Sizing and hold policy
+   * @param verify  Called from a worker for each deposit, nullptr accepts every deposit
+   */
+  explicit DepositPipeline(ReverseFunction reverse,
+                           const DepositPipelineConfig& config = DepositPipelineConfig{},
+                           VerifyFunction verify = nullptr);
+
+  /// Settles whatever is still in flight, ignoring the hold period, and stops the workers
+  ~DepositPipeline();
+
+  DepositPipeline(const DepositPipeline&) = delete;
+  DepositPipeline& operator=(const DepositPipeline&) = delete;
+
+  /**
+   * @brief Places the hold for a deposit already credited to the ledger and queues it for clearing
+   *
+   * @param transactionId  The ledger credit of the deposit
+   * @param accountNumber  The credited account
+   * @param accountType  AccountType of the credited balance
+   * @param amount  The amount deposited
+   */
+  void capture(TransactionId transactionId, uint64_t accountNumber, uint32_t accountType, uint amount);
+
+  /// Funds of an account type deposited but not available yet
+  int64_t heldAmount(uint64_t accountNumber, uint32_t accountType);
+
+  DepositPipelineStats stats() const;
+
+  /**
+   * @brief Waits until every deposit captured so far has settled or been rejected, for tests and shutdown
+   *
+   * @return  False if the timeout ran out first
+   */
+  bool waitUntilSettled(std::chrono::milliseconds timeout);
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  static constexpr size_t kHoldShards = 16;
+
+  struct HoldShard {
+    std::mutex mutex;
+    /// Held amount per account, by account type
+    std::unordered_map<uint64_t, std::array<int64_t, 2>> held;
+  };
+
+  /// Orders the hold stage's waiting deposits soonest release first
+  struct ReleasesLater {
+    bool operator()(const DepositItem& a, const DepositItem& b) const {
+      return a.release_after > b.release_after;
+    }
+  };
+
+  /// Starts the workers, once
+  void startWorkers();
+
+  /// Worker loop
+  void run();
+
+  /// Stage bodies, each takes up to one batch and returns how many deposits it moved on
+  size_t holdStage(std::vector<DepositItem>& batch);
+  size_t releaseStage(std::vector<DepositItem>& batch, bool force);
+  size_t verifyStage(std::vector<DepositItem>& batch);
+  size_t settleStage(std::vector<DepositItem>& batch);
+
+  /// Hands a deposit to the next stage, or runs the rest of the stages itself if that stage's queue is full
+  void toVerify(DepositItem& item);
+  void toSettle(DepositItem& item);
+
+  /// Lifts the holds and reverses the rejections of a batch, taking each hold shard's lock once
+  void settle(std::vector<DepositItem>& batch);
+
+  HoldShard& holdShardFor(uint64_t accountNumber) {
+    return hold_shards_[(accountNumber * 0x9e3779b97f4a7c15ULL >> 32) % kHoldShards];
+  }
+
+  /// Wakes a sleeping worker, which sleeps until the next notify() or held deposit is due, with no polling
+  void notify();
+
+  const DepositPipelineConfig config_;
+  ReverseFunction reverse_;
+  VerifyFunction verify_;
+
+  BoundedQueue<DepositItem> captured_;
+  BoundedQueue<DepositItem> verifying_;
+  BoundedQueue<DepositItem> settling_;
+
+  /// Captured deposits that didn't fit in captured_, so capture never waits
+  std::mutex overflow_mutex_;
+  std::vector<DepositItem> overflow_;
+  std::atomic<bool> has_overflow_;
+
+  /// Deposits in the hold stage waiting for their release time
+  std::mutex holding_mutex_;
+  std::priority_queue<DepositItem, std::vector<DepositItem>, ReleasesLater> holding_;
+
+  std::array<HoldShard, kHoldShards> hold_shards_;
+
+  std::atomic<uint64_t> captured_count_;
+  std::atomic<uint64_t> settled_count_;
+  std::atomic<uint64_t> rejected_count_;
+
+  /// Sleeping workers wait on wake_, waitUntilSettled() on settled_
+  std::mutex wake_mutex_;
+  std::condition_variable wake_;
+  std::condition_variable settled_;
+  /// Bumped by every notify(), so a worker can tell it was notified while it was looking for work
+  uint64_t wakeups_;
+  bool running_;
+
+  std::once_flag workers_started_;
+  std::vector<std::thread> workers_;
+};
+
+#endif  // ATM_DEPOSIT_PIPELINE_H
@@ -0,0 +1,161 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+// C++ Standard Library
+#include <stdexcept>
+
+// ATM Controller
+#include "dispenser.h"
+#include "trace.h"
+
+constexpr size_t CashDispenser::kQueueCapacity;
+
+SimulatedDispenser::SimulatedDispenser(const SimulatedDispenserConfig& config) :
+  config_(config),
+  jammed_(false),
+  fault_(DISPENSE_COMPLETE),
+  fault_notes_(0),
+  random_(config.seed) {
+  if (config_.note_value == 0) {
+    throw std::runtime_error("Invalid dispenser config");
+  }
+}
+
+DispenseEvent SimulatedDispenser::dispense(const DispenseCommand& command) {
+  DispenseEvent event{command.id, DISPENSE_COMPLETE, command.amount, 0};
+  DispenseStatus fault;
+  uint fault_notes;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (jammed_) {
+      event.status = DISPENSE_JAMMED;
+      return event;
+    }
+    fault = fault_;
+    fault_notes = fault_notes_;
+    fault_ = DISPENSE_COMPLETE;
+  }
+
+  std::this_thread::sleep_for(config_.setup_time);
+  const uint notes = command.amount / config_.note_value;
+  std::bernoulli_distribution jams(config_.jam_probability);
+  for (uint note = 0; note < notes; ++note) {
+    if (fault != DISPENSE_COMPLETE and note == fault_notes) {
+      event.status = fault;
+      break;
+    }
+    if (config_.jam_probability > 0 and jams(random_)) {
+      event.status = DISPENSE_JAMMED;
+      break;
+    }
+    std::this_thread::sleep_for(config_.per_note);
+    event.dispensed += config_.note_value;
+  }
+  if (event.status == DISPENSE_COMPLETE and event.dispensed < command.amount) {
+    // Less than a note left over
+    event.status = DISPENSE_PARTIAL;
+  }
+
+  if (event.status == DISPENSE_JAMMED) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    jammed_ = true;
+  }
+  return event;
+}
+
+void SimulatedDispenser::injectFault(DispenseStatus status, uint notes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  fault_ = status;
+  fault_notes_ = notes;
+}
+
+void SimulatedDispenser::clearJam() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  jammed_ = false;
+}
+
+bool SimulatedDispenser::jammed() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return jammed_;
+}
+
+CashDispenser::CashDispenser(std::unique_ptr<DispenserDevice> device) :
+  device_(std::move(device)),
+  next_id_(1),
+  submitted_(0),
+  finished_(0),
+  stopping_(false) {
+  driver_ = std::thread(&CashDispenser::driverLoop, this);
+}
+
+CashDispenser::~CashDispenser() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  queued_cv_.notify_one();
+  driver_.join();
+}
+
+uint64_t CashDispenser::submit(uint amount, DispenseCallback done) {
+  uint64_t id;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (commands_.size() >= kQueueCapacity) {
+      throw std::runtime_error("Dispenser queue full");
+    }
+    id = next_id_++;
+    commands_.push_back(Command{DispenseCommand{id, amount}, std::move(done)});
+    ++submitted_;
+  }
+  queued_cv_.notify_one();
+  return id;
+}
+
+void CashDispenser::drain() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  const uint64_t target = submitted_;
+  finished_cv_.wait(lock, [this, target] { return finished_ >= target; });
+}
+
+size_t CashDispenser::pending() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return static_cast<size_t>(submitted_ - finished_);
+}
+
+void CashDispenser::driverLoop() {
+  for (;;) {
+    Command command;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      queued_cv_.wait(lock, [this] { return stopping_ or !commands_.empty(); });
+      if (commands_.empty()) {
+        return;
+      }
+      command = std::move(commands_.front());
+      commands_.pop_front();
+    }
+
+    DispenseEvent event;
+    {
+      const TraceSpan span("CashDispenser::dispense");
+      try {
+        event = device_->dispense(command.command);
+      } catch (const std::exception&) {
+        // A device that can't say what happened is treated as jammed with nothing out, the safe side for the customer
+        event = DispenseEvent{command.command.id, DISPENSE_JAMMED, command.command.amount, 0};
+      }
+    }
+    if (command.done) {
+      command.done(event);
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++finished_;
+    }
+    finished_cv_.notify_all();
+  }
+}
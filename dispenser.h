@@ -0,0 +1,184 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+#ifndef ATM_DISPENSER_H
+#define ATM_DISPENSER_H
+
+// C++ Standard Library
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <thread>
+
+// POSIX
+#include <sys/types.h>
+
+/// How a dispense ended
+enum DispenseStatus {
+  /// Everything asked for came out
+  DISPENSE_COMPLETE = 0,
+  /// Some notes came out, the device is still fine
+  DISPENSE_PARTIAL = 1,
+  /// The device jammed partway, and refuses every command until the jam is cleared
+  DISPENSE_JAMMED = 2
+};
+
+/// A command to the dispenser
+struct DispenseCommand {
+  uint64_t id;
+  uint amount;
+};
+
+/// What the dispenser reported for a command
+struct DispenseEvent {
+  uint64_t command_id;
+  DispenseStatus status;
+  uint requested;
+  uint dispensed;
+};
+
+/// Called on the driver thread with the event of a command
+using DispenseCallback = std::function<void(const DispenseEvent&)>;
+
+/// Thrown by a dispense that waited for the device and stopped short, with what did come out
+class DispenseFault : public std::runtime_error {
+ public:
+  explicit DispenseFault(const DispenseEvent& event) : std::runtime_error("Cash can't be disbursed"), event_(event) {}
+
+  const DispenseEvent& event() const {
+    return event_;
+  }
+
+ private:
+  DispenseEvent event_;
+};
+
+/**
+ * @brief A cash dispenser, the hardware behind CashDispenser
+ * @details  dispense() is only ever called from CashDispenser's driver thread, one command at a time.
+ */
+class DispenserDevice {
+ public:
+  virtual ~DispenserDevice() = default;
+
+  /// Drives the device through a command, blocking until it stops, and reports what came out
+  virtual DispenseEvent dispense(const DispenseCommand& command) = 0;
+};
+
+/// Timing and faults of a SimulatedDispenser
+struct SimulatedDispenserConfig {
+  /// Denomination of the notes in the cassette, amounts that aren't a multiple come out short
+  uint note_value{20};
+  /// Time to pick up a command before the first note
+  std::chrono::milliseconds setup_time{500};
+  /// Time to pick and present each note
+  std::chrono::milliseconds per_note{150};
+  /// Chance of each note jamming the device
+  double jam_probability{0.0};
+  /// Seeds the jams
+  uint64_t seed{1};
+};
+
+/**
+ * @brief A dispenser that takes about as long as the real thing, with faults on demand
+ * @details  Thread-safe, faults can be injected while a command is running.
+ */
+class SimulatedDispenser : public DispenserDevice {
+ public:
+  explicit SimulatedDispenser(const SimulatedDispenserConfig& config = SimulatedDispenserConfig());
+
+  DispenseEvent dispense(const DispenseCommand& command) override;
+
+  /**
+   * @brief Makes the next command stop with a fault
+   *
+   * @param status  DISPENSE_PARTIAL or DISPENSE_JAMMED
+   * @param notes  Notes that come out before the fault
+   */
+  void injectFault(DispenseStatus status, uint notes);
+
+  /// Clears a jam, so the device takes commands again
+  void clearJam();
+
+  bool jammed();
+
+ private:
+  const SimulatedDispenserConfig config_;
+
+  std::mutex mutex_;
+  bool jammed_;
+  /// The injected fault for the next command, DISPENSE_COMPLETE if none
+  DispenseStatus fault_;
+  uint fault_notes_;
+  std::mt19937_64 random_;
+};
+
+/**
+ * @brief Asynchronous front of a dispenser device
+ * @details  Commands are queued for a driver thread that runs them on the device one at a time, so whoever asks for
+ *           cash doesn't wait the seconds it takes to come out.  Each command's callback gets the device's event,
+ *           on the driver thread, in order.
+ */
+class CashDispenser {
+ public:
+  /// Commands queued at most, more are refused
+  static constexpr size_t kQueueCapacity = 64;
+
+  explicit CashDispenser(std::unique_ptr<DispenserDevice> device);
+
+  /// Runs the commands still queued, then stops the driver thread
+  ~CashDispenser();
+
+  CashDispenser(const CashDispenser&) = delete;
+  CashDispenser& operator=(const CashDispenser&) = delete;
+
+  /**
+   * @brief Queues a command for the device
+   *
+   * @param amount  The cash to dispense
+   * @param done  Called with the device's event once the command has run
+   * @return  The command's id
+   * @throws  If kQueueCapacity commands are already queued
+   */
+  uint64_t submit(uint amount, DispenseCallback done);
+
+  /// Waits until every command submitted so far has run and its callback returned
+  void drain();
+
+  /// Commands queued or running
+  size_t pending();
+
+ private:
+  struct Command {
+    DispenseCommand command;
+    DispenseCallback done;
+  };
+
+  void driverLoop();
+
+  std::unique_ptr<DispenserDevice> device_;
+
+  std::mutex mutex_;
+  /// Wakes the driver when a command is queued or it is time to stop
+  std::condition_variable queued_cv_;
+  /// Wakes drain() as commands finish
+  std::condition_variable finished_cv_;
+  std::deque<Command> commands_;
+  uint64_t next_id_;
+  /// Commands submitted and finished, their difference is pending()
+  uint64_t submitted_;
+  uint64_t finished_;
+  bool stopping_;
+
+  std::thread driver_;
+};
+
+#endif  // ATM_DISPENSER_H
@@ -0,0 +1,43 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+// C++ Standard Library
+#include <algorithm>
+#include <stdexcept>
+
+// ATM Controller
+#include "event_queue.h"
+
+/// Heap order, true if a comes out after b
+static bool laterEvent(const SimEvent& a, const SimEvent& b) {
+  return a.time != b.time ? a.time > b.time : a.sequence > b.sequence;
+}
+
+EventQueue::EventQueue(size_t capacity) :
+  now_(0),
+  next_sequence_(0),
+  processed_(0) {
+  heap_.reserve(capacity);
+}
+
+void EventQueue::scheduleAt(SimTime time, uint32_t type, uint32_t target) {
+  if (time < now_) {
+    throw std::runtime_error("Event scheduled in the past");
+  }
+  heap_.push_back(SimEvent{time, next_sequence_++, type, target});
+  std::push_heap(heap_.begin(), heap_.end(), laterEvent);
+}
+
+bool EventQueue::pop(SimEvent& event) {
+  if (heap_.empty()) {
+    return false;
+  }
+  std::pop_heap(heap_.begin(), heap_.end(), laterEvent);
+  event = heap_.back();
+  heap_.pop_back();
+  now_ = event.time;
+  ++processed_;
+  return true;
+}
@@ -0,0 +1,86 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+#ifndef ATM_EVENT_QUEUE_H
+#define ATM_EVENT_QUEUE_H
+
+// C++ Standard Library
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+/// Virtual time, since the start of a simulation
+using SimTime = std::chrono::nanoseconds;
+
+/// Something to happen at a point in virtual time, its meaning is up to the simulation
+struct SimEvent {
+  SimTime time;
+  /// Order of scheduling, breaks ties between events at the same time
+  uint64_t sequence;
+  /// What happens, e.g. an enumerator of the simulation's
+  uint32_t type;
+  /// Who it happens to, e.g. an index into the simulation's ATMs
+  uint32_t target;
+};
+
+/**
+ * @brief The clock and pending events of a discrete-event simulation
+ * @details  Events come out in time order, and events at the same time in the order they were scheduled, so a
+ *           simulation that draws its random numbers in event order replays exactly from its seed.  Popping an
+ *           event moves the clock to it, nothing ever sleeps.
+ */
+class EventQueue {
+ public:
+  /**
+   * @brief Constructor for the queue
+   *
+   * @param capacity  Pending events to make room for up front
+   */
+  explicit EventQueue(size_t capacity = 1024);
+
+  /// The current virtual time, that of the last event popped
+  SimTime now() const {
+    return now_;
+  }
+
+  /// Schedules an event at a virtual time, no earlier than now()
+  void scheduleAt(SimTime time, uint32_t type, uint32_t target);
+
+  /// Schedules an event a delay after now()
+  void scheduleAfter(SimTime delay, uint32_t type, uint32_t target) {
+    scheduleAt(now_ + delay, type, target);
+  }
+
+  /**
+   * @brief Takes the next event and moves the clock to it
+   *
+   * @param event  Set to the event
+   * @return  False if nothing is pending
+   */
+  bool pop(SimEvent& event);
+
+  bool empty() const {
+    return heap_.empty();
+  }
+
+  /// Events pending
+  size_t size() const {
+    return heap_.size();
+  }
+
+  /// Events popped so far
+  uint64_t processed() const {
+    return processed_;
+  }
+
+ private:
+  /// Min-heap on (time, sequence)
+  std::vector<SimEvent> heap_;
+  SimTime now_;
+  uint64_t next_sequence_;
+  uint64_t processed_;
+};
+
+#endif  // ATM_EVENT_QUEUE_H
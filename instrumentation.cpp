@@ -0,0 +1,124 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+// C++ Standard Library
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+// ATM Controller
+#include "instrumentation.h"
+
+/// The calling thread's allocations, plain integers so that counting needs no initialization of its own
+static thread_local uint64_t t_allocations = 0;
+static thread_local uint64_t t_allocated_bytes = 0;
+
+/// Totals of one scope, over every thread
+struct ScopeTotals {
+  std::atomic<uint64_t> calls{0};
+  std::atomic<uint64_t> allocations{0};
+  std::atomic<uint64_t> bytes{0};
+  std::atomic<uint64_t> cycles{0};
+};
+
+static std::array<ScopeTotals, kInstrumentedScopes> g_scope_totals;
+
+#ifdef ATM_INSTRUMENTATION
+
+// The library's operator new / delete are replaced for the whole program.  The array, nothrow and sized forms of
+// libstdc++ forward to these, so they are counted as well
+
+void* operator new(std::size_t size) {
+  ++t_allocations;
+  t_allocated_bytes += size;
+  void* const memory = std::malloc(size == 0 ? 1 : size);
+  if (memory == nullptr) {
+    throw std::bad_alloc();
+  }
+  return memory;
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+  ++t_allocations;
+  t_allocated_bytes += size;
+  const std::size_t align = static_cast<std::size_t>(alignment);
+  void* const memory = std::aligned_alloc(align, (size + align - 1) / align * align);
+  if (memory == nullptr) {
+    throw std::bad_alloc();
+  }
+  return memory;
+}
+
+void operator delete(void* memory) noexcept {
+  std::free(memory);
+}
+
+void operator delete(void* memory, std::align_val_t) noexcept {
+  std::free(memory);
+}
+
+#endif
+
+bool instrumentationEnabled() {
+#ifdef ATM_INSTRUMENTATION
+  return true;
+#else
+  return false;
+#endif
+}
+
+AllocationCounts threadAllocations() {
+  return AllocationCounts{t_allocations, t_allocated_bytes};
+}
+
+InstrumentationSnapshot instrumentationSnapshot() {
+  InstrumentationSnapshot snapshot;
+  for (size_t i = 0; i < kInstrumentedScopes; ++i) {
+    snapshot[i] = ScopeCost{g_scope_totals[i].calls.load(),
+                            g_scope_totals[i].allocations.load(),
+                            g_scope_totals[i].bytes.load(),
+                            g_scope_totals[i].cycles.load()};
+  }
+  return snapshot;
+}
+
+void resetInstrumentation() {
+  for (ScopeTotals& totals : g_scope_totals) {
+    totals.calls = 0;
+    totals.allocations = 0;
+    totals.bytes = 0;
+    totals.cycles = 0;
+  }
+}
+
+void printInstrumentation(const InstrumentationSnapshot& snapshot, std::ostream& out) {
+  char line[160];
+  std::snprintf(line, sizeof(line), "%-26s %10s %12s %12s %12s %12s\n", "scope", "calls", "allocs", "allocs/call",
+                "bytes/call", "cycles/call");
+  out << line;
+  for (size_t i = 0; i < kInstrumentedScopes; ++i) {
+    const ScopeCost& cost = snapshot[i];
+    const double calls = cost.calls > 0 ? static_cast<double>(cost.calls) : 1.0;
+    std::snprintf(line, sizeof(line), "%-26s %10llu %12llu %12.2f %12.1f %12.0f\n",
+                  kInstrumentedScopeToString[i],
+                  static_cast<unsigned long long>(cost.calls),
+                  static_cast<unsigned long long>(cost.allocations),
+                  cost.allocations / calls,
+                  cost.bytes / calls,
+                  cost.cycles / calls);
+    out << line;
+  }
+}
+
+ScopeProbe::~ScopeProbe() {
+  const uint64_t cycles = readCycleCounter() - cycles_;
+  const AllocationCounts allocations = threadAllocations();
+  ScopeTotals& totals = g_scope_totals[scope_];
+  totals.calls.fetch_add(1, std::memory_order_relaxed);
+  totals.allocations.fetch_add(allocations.allocations - allocations_.allocations, std::memory_order_relaxed);
+  totals.bytes.fetch_add(allocations.bytes - allocations_.bytes, std::memory_order_relaxed);
+  totals.cycles.fetch_add(cycles, std::memory_order_relaxed);
+}
@@ -0,0 +1,107 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+#ifndef ATM_INSTRUMENTATION_H
+#define ATM_INSTRUMENTATION_H
+
+// C++ Standard Library
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+#if defined(__x86_64__) or defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/**
+ * Opt-in cost accounting of the ATM callbacks, turned on with -DATM_INSTRUMENTATION=ON.  The build then replaces the
+ * global operator new / delete with ones that count allocations per thread, and every callback and service() runs
+ * under a ScopeProbe that attributes the allocations, bytes and cycles spent inside it to its scope.  Without the
+ * option ATM_PROBE() compiles to nothing and operator new is left alone.
+ */
+
+/// What the costs are attributed to
+enum InstrumentedScope {
+  SCOPE_CARD_READER_CB = 0,
+  SCOPE_ENTER_PIN_CB = 1,
+  SCOPE_ACCOUNT_SELECT_CB = 2,
+  SCOPE_ACCOUNT_MANAGEMENT_CB = 3,
+  SCOPE_ACCOUNT_MANAGEMENT_BATCH_CB = 4,
+  SCOPE_SERVICE = 5,
+  kInstrumentedScopes = 6
+};
+
+static constexpr std::array<const char*, kInstrumentedScopes> kInstrumentedScopeToString{
+  "cardReaderCB", "enterPinCB", "accountSelectCB", "accountManagementCB", "accountManagementBatchCB", "service"};
+
+/// Totals of one scope
+struct ScopeCost {
+  uint64_t calls;
+  uint64_t allocations;
+  uint64_t bytes;
+  uint64_t cycles;
+};
+
+using InstrumentationSnapshot = std::array<ScopeCost, kInstrumentedScopes>;
+
+/// Allocations made by the calling thread since it started, only counted with ATM_INSTRUMENTATION
+struct AllocationCounts {
+  uint64_t allocations;
+  uint64_t bytes;
+};
+
+/// Whether this build counts allocations, i.e. was built with ATM_INSTRUMENTATION
+bool instrumentationEnabled();
+
+AllocationCounts threadAllocations();
+
+/// Totals of every scope so far
+InstrumentationSnapshot instrumentationSnapshot();
+
+/// Zeroes the totals of every scope, e.g. after warming up
+void resetInstrumentation();
+
+/// Prints a table of the totals, with per-call averages
+void printInstrumentation(const InstrumentationSnapshot& snapshot, std::ostream& out);
+
+/// Time stamp counter where there is one, nanoseconds elsewhere
+inline uint64_t readCycleCounter() {
+#if defined(__x86_64__) or defined(__i386__)
+  return __rdtsc();
+#else
+  return static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+}
+
+/**
+ * @brief Charges what happens on this thread between its construction and destruction to a scope
+ * @details  Probes shouldn't nest, the outer scope would be charged for the inner one as well.
+ */
+class ScopeProbe {
+ public:
+  explicit ScopeProbe(InstrumentedScope scope) :
+    scope_(scope),
+    allocations_(threadAllocations()),
+    cycles_(readCycleCounter()) {}
+
+  ~ScopeProbe();
+
+  ScopeProbe(const ScopeProbe&) = delete;
+  ScopeProbe& operator=(const ScopeProbe&) = delete;
+
+ private:
+  const InstrumentedScope scope_;
+  const AllocationCounts allocations_;
+  const uint64_t cycles_;
+};
+
+#ifdef ATM_INSTRUMENTATION
+#define ATM_PROBE(scope) const ScopeProbe atm_probe_(scope)
+#else
+#define ATM_PROBE(scope) static_cast<void>(0)
+#endif
+
+#endif  // ATM_INSTRUMENTATION_H
@@ -0,0 +1,144 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ *
+ * Benchmark of optimistic write-back on a hot shared account, like a business account with many sessions open on
+ * it at once.  Each thread runs its own session doing deposit / withdraw pairs against the same account, so every
+ * write by one session makes the others' balances stale.  Reports write throughput, how often a write-back had to
+ * be retried, and how fast lock-free balance reads go while the writers run.
+ *
+ * Usage: ledger_benchmark [seconds per run] [max threads]
+ */
+
+// C++ Standard Library
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// ATM Controller
+#include "account.h"
+
+static constexpr uint64_t kHotAccount = 1234123412341234;
+static constexpr uint16_t kHotAccountPin = 1234;
+
+/// Forwards the ledger to a shared Machine, without the security trackers and with a dispenser that never runs dry,
+/// so only the ledger is measured
+struct HotAccountBackend {
+  explicit HotAccountBackend(std::shared_ptr<Machine> machine) : machine(std::move(machine)) {}
+
+  bool verifyPin(uint64_t accountNumber, uint16_t pin) {
+    return machine->verifyPin(accountNumber, pin);
+  }
+  Balances getAccountBalances(uint64_t accountNumber) {
+    return machine->getAccountBalances(accountNumber);
+  }
+  bool updateAccountBalance(uint64_t accountNumber, AccountType accountType, int amount, TransactionId transactionId) {
+    return machine->updateAccountBalance(accountNumber, accountType, amount, transactionId);
+  }
+  LedgerUpdateResult updateAccountBalanceIfVersion(uint64_t accountNumber,
+                                                   AccountType accountType,
+                                                   int amount,
+                                                   uint64_t expectedVersion,
+                                                   TransactionId transactionId) {
+    return machine->updateAccountBalanceIfVersion(accountNumber, accountType, amount, expectedVersion, transactionId);
+  }
+  uint getAvailableCash() {
+    return machine->getAvailableCash();
+  }
+  void disburseCash(uint) {}
+  TransactionId newTransactionId() {
+    return machine->newTransactionId();
+  }
+
+  std::shared_ptr<Machine> machine;
+};
+
+struct RunResult {
+  uint64_t writes{0};
+  uint64_t conflicts{0};
+  uint64_t gave_up{0};
+  uint64_t reads{0};
+  double seconds{0};
+};
+
+/// Runs writer sessions on the hot account, and as many readers, for the given time
+static RunResult run(int threads, double seconds) {
+  const auto machine = std::make_shared<Machine>();
+  const auto backend = std::make_shared<HotAccountBackend>(machine);
+  const uint64_t conflicts_before = atmMetrics().ledger_conflicts.value();
+
+  std::atomic<bool> running{true};
+  std::atomic<uint64_t> writes{0};
+  std::atomic<uint64_t> gave_up{0};
+  std::atomic<uint64_t> reads{0};
+  std::vector<std::thread> workers;
+
+  for (int i = 0; i < threads; ++i) {
+    workers.emplace_back([&]() {
+      BasicAccount<HotAccountBackend> session(backend, kHotAccount);
+      session.unlock(kHotAccountPin);
+      session.selectType(AccountType::CHECKING);
+      uint64_t done = 0;
+      while (running.load(std::memory_order_relaxed)) {
+        try {
+          session.deposit(1);
+          session.withdraw(1);
+          done += 2;
+        } catch (const std::exception& e) {
+          gave_up.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+      writes.fetch_add(done, std::memory_order_relaxed);
+    });
+
+    workers.emplace_back([&]() {
+      uint64_t done = 0;
+      int64_t sink = 0;
+      while (running.load(std::memory_order_relaxed)) {
+        sink += machine->getAccountBalances(kHotAccount).checking;
+        ++done;
+      }
+      reads.fetch_add(done + (sink == 42 ? 1 : 0), std::memory_order_relaxed);
+    });
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+  running = false;
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  RunResult result;
+  result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  result.writes = writes.load();
+  result.conflicts = atmMetrics().ledger_conflicts.value() - conflicts_before;
+  result.gave_up = gave_up.load();
+  result.reads = reads.load();
+  return result;
+}
+
+int main(int argc, char** argv) {
+  const double seconds = argc > 1 ? std::atof(argv[1]) : 1.0;
+  const int max_threads = argc > 2 ? std::max(1, std::atoi(argv[2])) : 8;
+
+  std::printf("%8s %14s %14s %12s %10s %14s\n", "sessions", "writes/s", "conflicts/s", "conflict %", "gave up",
+              "reads/s");
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    const RunResult result = run(threads, seconds);
+    const double attempts = static_cast<double>(result.writes + result.conflicts);
+    std::printf("%8d %14.0f %14.0f %11.2f%% %10llu %14.0f\n",
+                threads,
+                result.writes / result.seconds,
+                result.conflicts / result.seconds,
+                attempts > 0 ? 100.0 * result.conflicts / attempts : 0.0,
+                static_cast<unsigned long long>(result.gave_up),
+                result.reads / result.seconds);
+  }
+  return 0;
+}
@@ -3,42 +3,371 @@
  * Luc Bettaieb, 2021
  */
 
+// C++ Standard Library
+#include <chrono>
+#include <future>
+#include <random>
+#include <thread>
+#include <tuple>
+
 // ATM Controller
 #include "machine.h"
+#include "metrics.h"
+#include "trace.h"
 
-Machine::Machine() : 
-  account_pins_(initializeAccountPins()), 
-  available_cash_(initializeAvailableCash())
-{}
+/// Bits of a transaction id used by the per-machine counter, the rest hold the machine's prefix
+static constexpr int kTransactionCounterBits = 40;
 
-uint16_t Machine::getPin(uint64_t accountNumber) {
-  if (account_pins_.find(accountNumber) == account_pins_.end()) {
-    throw std::runtime_error("Account not found");
+Machine::Machine() : 
+  available_cash_(initializeAvailableCash()),
+  pin_store_(PinStore::randomKey()),
+  transaction_prefix_(initializeTransactionPrefix()),
+  transaction_counter_(1),
+  mini_statements_(initializeAccountBalances().size()) {
+  for (const auto& account : initializeAccountPins()) {
+    pin_store_.enroll(account.first, account.second);
+  }
+  for (const auto& account : initializeAccountBalances()) {
+    account_balances_.emplace(std::piecewise_construct,
+                              std::forward_as_tuple(account.first),
+                              std::forward_as_tuple(account.second));
   }
-  return account_pins_.at(accountNumber);
+  atmMetrics().cash_available.add(available_cash_);
+
+  deposit_pipeline_.reset(new DepositPipeline([this](const DepositItem& item) {
+    updateAccountBalance(item.account_number,
+                         static_cast<AccountType>(item.account_type),
+                         -static_cast<int>(item.amount),
+                         newTransactionId());
+  }));
+}
+
+Machine::~Machine() {
+  drainDispenser();
+  std::lock_guard<std::mutex> lock(ledger_mutex_);
+  atmMetrics().cash_available.add(-static_cast<int64_t>(available_cash_));
+}
+
+bool Machine::verifyPin(uint64_t accountNumber, uint16_t pin) {
+  const TraceSpan span("Machine::verifyPin");
+  return pin_store_.verify(accountNumber, pin);
 }
 
 Balances Machine::getAccountBalances(uint64_t accountNumber) {
+  const TraceSpan span("Machine::getAccountBalances");
   // simulates request to server for account balance for number and type associated with number
-  return kAccountBalances.at(accountNumber);
+  const LedgerEntry& entry = account_balances_.at(accountNumber);
+  Balances balances{0, 0};
+  balances.checking_withdraw_limit = entry.checking_withdraw_limit;
+  balances.savings_withdraw_limit = entry.savings_withdraw_limit;
+  while (true) {
+    const uint64_t sequence = entry.sequence.load(std::memory_order_acquire);
+    if (sequence % 2 == 1) {
+      // Mid-write, the writer holds the lock for a few stores
+      std::this_thread::yield();
+      continue;
+    }
+    balances.checking = entry.checking.load(std::memory_order_relaxed);
+    balances.savings = entry.savings.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (entry.sequence.load(std::memory_order_relaxed) == sequence) {
+      balances.version = sequence / 2;
+      return balances;
+    }
+  }
 }
 
-void Machine::updateAccountBalance(uint64_t accountNumber, int amount) {
+AccountProfile Machine::getAccountProfile(uint64_t accountNumber) {
+  const TraceSpan span("Machine::getAccountProfile");
+  return AccountProfile{getAccountBalances(accountNumber)};
+}
+
+TransactionId Machine::newTransactionId() {
+  const uint64_t count = transaction_counter_.fetch_add(1, std::memory_order_relaxed);
+  return (transaction_prefix_ << kTransactionCounterBits) | (count & ((1ULL << kTransactionCounterBits) - 1));
+}
+
+bool Machine::updateAccountBalance(uint64_t accountNumber,
+                                   AccountType accountType,
+                                   int amount,
+                                   TransactionId transactionId) {
+  const TraceSpan span("Machine::updateAccountBalance");
   // Send to server information about debit or credit to an account
-  return;
+  auto entry = account_balances_.find(accountNumber);
+  if (entry == account_balances_.end()) {
+    throw std::runtime_error("Account not found");
+  }
+
+  std::lock_guard<std::mutex> lock(ledger_mutex_);
+  if (!applied_transactions_.insert(transactionId)) {
+    // A retry of something already applied
+    return false;
+  }
+  applyUpdate(accountNumber, entry->second, accountType, amount, transactionId);
+  return true;
+}
+
+LedgerUpdateResult Machine::updateAccountBalanceIfVersion(uint64_t accountNumber,
+                                                          AccountType accountType,
+                                                          int amount,
+                                                          uint64_t expectedVersion,
+                                                          TransactionId transactionId) {
+  const TraceSpan span("Machine::updateAccountBalanceIfVersion");
+  auto entry = account_balances_.find(accountNumber);
+  if (entry == account_balances_.end()) {
+    throw std::runtime_error("Account not found");
+  }
+
+  std::lock_guard<std::mutex> lock(ledger_mutex_);
+  if (applied_transactions_.contains(transactionId)) {
+    return UPDATE_DUPLICATE;
+  }
+  // Checked before the id is recorded, so the caller can retry the same transaction against fresh balances
+  if (entry->second.sequence.load(std::memory_order_relaxed) / 2 != expectedVersion) {
+    return UPDATE_CONFLICT;
+  }
+  applied_transactions_.insert(transactionId);
+  applyUpdate(accountNumber, entry->second, accountType, amount, transactionId);
+  return UPDATE_APPLIED;
+}
+
+void Machine::applyUpdate(uint64_t accountNumber,
+                          LedgerEntry& entry,
+                          AccountType accountType,
+                          int amount,
+                          TransactionId transactionId) {
+  int checking = entry.checking.load(std::memory_order_relaxed);
+  int savings = entry.savings.load(std::memory_order_relaxed);
+  int& balance = accountType == AccountType::CHECKING ? checking : savings;
+  balance += amount;
+  writeBalances(entry, checking, savings);
+  dirty_accounts_.insert(accountNumber);
+
+  const auto now = std::chrono::system_clock::now();
+  if (!mini_statements_.record(accountNumber, static_cast<uint32_t>(accountType), amount, balance, now)) {
+    // Sized for every account in the ledger, so a drop means the two disagree
+    atmMetrics().mini_statement_drops.increment();
+  }
+  if (transaction_log_) {
+    transaction_log_->append(TransactionRecord{toTransactionTime(now),
+                                               accountNumber,
+                                               transactionId,
+                                               amount,
+                                               balance,
+                                               static_cast<uint32_t>(accountType),
+                                               0});
+  }
+}
+
+void Machine::writeBalances(LedgerEntry& entry, int checking, int savings) {
+  const uint64_t sequence = entry.sequence.load(std::memory_order_relaxed);
+  entry.sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  entry.checking.store(checking, std::memory_order_relaxed);
+  entry.savings.store(savings, std::memory_order_relaxed);
+  entry.sequence.store(sequence + 2, std::memory_order_release);
 }
 
 uint Machine::getAvailableCash() {
+  std::lock_guard<std::mutex> lock(ledger_mutex_);
   return available_cash_;
 }
 
 void Machine::disburseCash(uint amount) {
+  const TraceSpan span("Machine::disburseCash");
+  std::unique_lock<std::mutex> lock(ledger_mutex_);
+  reserveCash(amount);
+  if (!dispenser_) {
+    // Call to motor controller or something to deposit cash
+    lock.unlock();
+    settleCash(DispenseEvent{0, DISPENSE_COMPLETE, amount, amount});
+    return;
+  }
+
+  std::promise<DispenseEvent> reported;
+  std::future<DispenseEvent> outcome = reported.get_future();
+  try {
+    dispenser_->submit(amount, [this, &reported](const DispenseEvent& event) {
+      settleCash(event);
+      reported.set_value(event);
+    });
+  } catch (...) {
+    addCash(amount);
+    throw;
+  }
+  lock.unlock();
+  const DispenseEvent event = outcome.get();
+  if (event.dispensed < event.requested) {
+    throw DispenseFault(event);
+  }
+}
+
+void Machine::dispenseCash(const DispenseRequest& request, DispenseCallback done) {
+  const TraceSpan span("Machine::dispenseCash");
+  std::unique_lock<std::mutex> lock(ledger_mutex_);
+  reserveCash(request.amount);
+  auto settle = [this, request, done = std::move(done)](const DispenseEvent& event) {
+    settleCash(event);
+    if (event.dispensed < request.amount) {
+      atmMetrics().dispense_faults.increment();
+      updateAccountBalance(request.account_number,
+                           request.account_type,
+                           static_cast<int>(request.amount - event.dispensed),
+                           newTransactionId());
+    }
+    if (done) {
+      done(event);
+    }
+  };
+  if (!dispenser_) {
+    lock.unlock();
+    settle(DispenseEvent{0, DISPENSE_COMPLETE, request.amount, request.amount});
+    return;
+  }
+
+  try {
+    dispenser_->submit(request.amount, std::move(settle));
+  } catch (...) {
+    addCash(request.amount);
+    throw;
+  }
+}
+
+void Machine::addCash(int64_t amount) {
+  available_cash_ = static_cast<uint>(available_cash_ + amount);
+  atmMetrics().cash_available.add(amount);
+}
+
+void Machine::attachDispenser(std::unique_ptr<DispenserDevice> device) {
+  std::lock_guard<std::mutex> lock(ledger_mutex_);
+  if (dispenser_) {
+    throw std::runtime_error("Dispenser already attached");
+  }
+  dispenser_.reset(new CashDispenser(std::move(device)));
+}
+
+void Machine::drainDispenser() {
+  CashDispenser* dispenser;
+  {
+    std::lock_guard<std::mutex> lock(ledger_mutex_);
+    dispenser = dispenser_.get();
+  }
+  // Completions take the ledger lock, so wait without it
+  if (dispenser != nullptr) {
+    dispenser->drain();
+  }
+}
+
+void Machine::reserveCash(uint amount) {
   if (amount > available_cash_) {
     throw std::runtime_error("Cash can't be disbursed");
   }
-  // Call to motor controller or something to deposit cash
-  available_cash_ -= amount;
+  addCash(-static_cast<int64_t>(amount));
+}
+
+void Machine::settleCash(const DispenseEvent& event) {
+  std::lock_guard<std::mutex> lock(ledger_mutex_);
+  addCash(event.requested - event.dispensed);
+  atmMetrics().cash_dispensed.increment(event.dispensed);
 
   // Update available cash amount in the server, too.
 }
 
+VelocityTracker& Machine::velocityTracker() {
+  return velocity_tracker_;
+}
+
+PinAttemptTracker& Machine::pinAttemptTracker() {
+  return pin_attempt_tracker_;
+}
+
+PinStore& Machine::pinStore() {
+  return pin_store_;
+}
+
+MiniStatementStore& Machine::miniStatements() {
+  return mini_statements_;
+}
+
+DepositPipeline& Machine::depositPipeline() {
+  return *deposit_pipeline_;
+}
+
+void Machine::enableCheckpointing(const std::string& directory, std::chrono::milliseconds interval) {
+  // Checkpoints only hold accounts that changed, they are applied over the balances fetched from the server
+  checkpointer_.reset();
+  checkpointer_.reset(new Checkpointer(directory, [this]() { return captureCheckpointDelta(); }));
+  checkpointer_->start(interval);
+}
+
+void Machine::checkpointNow() {
+  if (checkpointer_) {
+    checkpointer_->checkpointNow();
+  }
+}
+
+bool Machine::restoreFromCheckpoint(const std::string& directory) {
+  const CheckpointState state = Checkpointer::load(directory);
+  if (!state.found) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(ledger_mutex_);
+  addCash(static_cast<int64_t>(state.available_cash) - available_cash_);
+  for (const auto& account : state.accounts) {
+    auto entry = account_balances_.find(account.first);
+    if (entry != account_balances_.end()) {
+      writeBalances(entry->second, account.second.checking, account.second.savings);
+    }
+  }
+  return true;
+}
+
+void Machine::enableTransactionLog(const std::string& path) {
+  std::unique_ptr<TransactionLog> log(new TransactionLog(path));
+  std::lock_guard<std::mutex> lock(ledger_mutex_);
+  transaction_log_.swap(log);
+}
+
+void Machine::flushTransactionLog(bool sync) {
+  std::lock_guard<std::mutex> lock(ledger_mutex_);
+  if (transaction_log_) {
+    transaction_log_->flush(sync);
+  }
+}
+
+void Machine::enableAuditLog(const std::string& path, const AuditKey& key) {
+  std::lock_guard<std::mutex> lock(ledger_mutex_);
+  if (audit_log_) {
+    throw std::runtime_error("Audit log already enabled");
+  }
+  audit_log_.reset(new AuditLog(path, key));
+  audit_log_ptr_.store(audit_log_.get(), std::memory_order_release);
+}
+
+CheckpointDelta Machine::captureCheckpointDelta() {
+  // Only the changed accounts are copied, so the ledger is held for as long as the delta is small
+  CheckpointDelta delta;
+  std::unordered_set<uint64_t> dirty;
+  {
+    std::lock_guard<std::mutex> lock(ledger_mutex_);
+    dirty.swap(dirty_accounts_);
+    delta.available_cash = available_cash_;
+    delta.accounts.reserve(dirty.size());
+    for (const uint64_t account_number : dirty) {
+      const LedgerEntry& entry = account_balances_.at(account_number);
+      delta.accounts.push_back(AccountSnapshot{account_number,
+                                               entry.checking.load(std::memory_order_relaxed),
+                                               entry.savings.load(std::memory_order_relaxed)});
+    }
+  }
+  return delta;
+}
+
+uint64_t Machine::initializeTransactionPrefix() {
+  // Would be the terminal id, random for now so restarted machines don't reuse ids
+  std::random_device device;
+  std::mt19937_64 generator(device() ^ std::chrono::system_clock::now().time_since_epoch().count());
+  return generator() & ((1ULL << (64 - kTransactionCounterBits)) - 1);
+}
+
@@ -7,9 +7,31 @@
 #define ATM_MACHINE_H
 
 // C++ Standard Library
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 
+// POSIX
+#include <sys/types.h>
+
+// ATM Controller
+#include "audit_log.h"
+#include "checkpoint.h"
+#include "dedup_cache.h"
+#include "deposit_pipeline.h"
+#include "dispenser.h"
+#include "mini_statement.h"
+#include "pin_attempts.h"
+#include "pin_store.h"
+#include "transaction_log.h"
+#include "velocity.h"
+
 /// Enumerated type for which account to access
 enum AccountType {
   CHECKING = 0,
@@ -28,6 +50,9 @@ struct Balances {
   int savings_withdraw_limit{1000};  // Could make this more customized
   int checking_withdraw_limit{5000};
 
+  /// Number of updates the ledger had applied to the account when these balances were read
+  uint64_t version{0};
+
   int& get(AccountType type) {
     if (type == AccountType::CHECKING) {
       return checking;
@@ -45,6 +70,28 @@ struct Balances {
   }
 };
 
+/// Everything a session needs of an account up front, fetched in one go when the card is swiped
+struct AccountProfile {
+  /// Balances and withdraw limits
+  Balances balances;
+};
+
+/// Outcome of a conditional ledger update
+enum LedgerUpdateResult {
+  UPDATE_APPLIED = 0,
+  /// That transaction id was already applied
+  UPDATE_DUPLICATE = 1,
+  /// The account changed since the expected version, nothing was applied
+  UPDATE_CONFLICT = 2
+};
+
+/// Cash to dispense for a debit already applied, and the account to credit whatever doesn't come out back to
+struct DispenseRequest {
+  uint64_t account_number;
+  AccountType account_type;
+  uint amount;
+};
+
 /// Simulated accounts and pin
 static std::unordered_map<uint64_t, uint16_t> kAccountPins = {
   {1234123412341234, 1234},
@@ -68,21 +115,149 @@ public:
   /// Constructor for the machine / server interface
   Machine();
 
-  /// Gets the appropriate pin for an account number
-  uint16_t getPin(uint64_t accountNumber);
+  /// Takes this machine's cash back out of the process-wide gauge once its dispenses have settled
+  ~Machine();
 
-  /// Creates a balances struct given an account number
+  /// Checks a pin entered for an account against its stored hash, throws if the account doesn't exist
+  bool verifyPin(uint64_t accountNumber, uint16_t pin);
+
+  /**
+   * @brief Creates a balances struct given an account number
+   * @details  Lock-free: the balances are read optimistically and read again if an update landed in the meantime.
+   *           The version read along with them can be handed to updateAccountBalanceIfVersion().
+   */
   Balances getAccountBalances(uint64_t accountNumber);
 
-  /// Simulates updating the account balance on some server endpoint
-  void updateAccountBalance(uint64_t accountNumber, int amount);
+  /// Gets the balances and limits of an account in a single request
+  AccountProfile getAccountProfile(uint64_t accountNumber);
+
+  /// Hands out a transaction id that no other debit or credit from this machine will use
+  TransactionId newTransactionId();
+
+  /**
+   * @brief Simulates updating the account balance on some server endpoint
+   * @details  Retrying with the same transaction id is a no-op, so a call that timed out can safely be sent again.
+   *
+   * @param accountNumber  The account to credit or debit
+   * @param accountType  Which of the account's balances to change
+   * @param amount  The amount to add, negative for a debit
+   * @param transactionId  The id of this debit or credit, from newTransactionId()
+   * @return  True if the update was applied, false if that transaction id was already applied
+   * @throws  E12351 if more transactions arrived within the retry window than can be told apart, nothing is applied
+   */
+  bool updateAccountBalance(uint64_t accountNumber, AccountType accountType, int amount, TransactionId transactionId);
+
+  /**
+   * @brief Updates the account balance only if nothing else updated the account since it was read
+   * @details  Compare-and-swap on the account's version, so a session working from balances read earlier finds out
+   *           that they are stale instead of overwriting someone else's change.  On a conflict, read the balances
+   *           again, check the change still makes sense and retry.
+   *
+   * @param accountNumber  The account to credit or debit
+   * @param accountType  Which of the account's balances to change
+   * @param amount  The amount to add, negative for a debit
+   * @param expectedVersion  The version of the balances the change was worked out from
+   * @param transactionId  The id of this debit or credit, from newTransactionId()
+   * @return  Whether the update was applied, a retry, or refused because the account moved on
+   */
+  LedgerUpdateResult updateAccountBalanceIfVersion(uint64_t accountNumber,
+                                                   AccountType accountType,
+                                                   int amount,
+                                                   uint64_t expectedVersion,
+                                                   TransactionId transactionId);
 
   /// Checks to see how much cash is available in the ATM
   uint getAvailableCash();
 
-  /// Dispenses cash to the user
+  /**
+   * @brief Dispenses cash to the user, waiting for the dispenser if one is attached
+   * @throws  If there isn't enough cash, or DispenseFault with what came out if the dispenser stopped short.  Cash
+   *          that didn't come out stays available, crediting it back to the account is up to the caller
+   */
   void disburseCash(uint amount);
 
+  /**
+   * @brief Dispenses cash for a debit, without waiting for it to come out
+   * @details  The cash is taken out of what's available right away, throwing like disburseCash() if there isn't
+   *           enough.  When the dispenser reports, whatever didn't come out goes back into the available cash and is
+   *           credited back to the account under a new transaction id, then done is called on the dispenser's driver
+   *           thread.  Without a dispenser attached the cash comes out, and done is called, before this returns.
+   *
+   * @param request  The cash and the account it was debited from
+   * @param done  Called with the dispenser's event, may be empty
+   */
+  void dispenseCash(const DispenseRequest& request, DispenseCallback done);
+
+  /**
+   * @brief Puts a dispenser device between the machine and its cash, see dispenser.h
+   * @details  Only one dispenser can be attached, throws if there already is one.
+   */
+  void attachDispenser(std::unique_ptr<DispenserDevice> device);
+
+  /// Waits for every dispense in progress to be reported and settled
+  void drainDispenser();
+
+  /// Sliding-window withdrawal tracking for every account served by this machine
+  VelocityTracker& velocityTracker();
+
+  /// Failed pin tracking and lockout for every card served by this machine
+  PinAttemptTracker& pinAttemptTracker();
+
+  /// Hashed pins of every account, for key rotation and bulk verification
+  PinStore& pinStore();
+
+  /// The last few transactions of every account, appended to as the ledger applies them
+  MiniStatementStore& miniStatements();
+
+  /// Clears deposits in the background and holds their funds until they do
+  DepositPipeline& depositPipeline();
+
+  /**
+   * @brief Starts writing incremental checkpoints of the cash and ledger in the background
+   * @details  Restore from the same directory first if the machine is restarting, otherwise the checkpoints written
+   *           from now on will start from the initial state again.
+   *
+   * @param directory  Where checkpoints are written
+   * @param interval  How often a checkpoint is written
+   */
+  void enableCheckpointing(const std::string& directory,
+                           std::chrono::milliseconds interval = std::chrono::milliseconds(1000));
+
+  /// Writes a checkpoint right away, if checkpointing is enabled
+  void checkpointNow();
+
+  /**
+   * @brief Recovers the cash and ledger from the latest checkpoint and the deltas after it
+   *
+   * @param directory  Where checkpoints were written
+   * @return  Whether or not there was a checkpoint to recover from
+   */
+  bool restoreFromCheckpoint(const std::string& directory);
+
+  /**
+   * @brief Starts appending every transaction applied to the ledger to a log, for statements
+   *
+   * @param path  The log file, appended to if it already exists
+   */
+  void enableTransactionLog(const std::string& path);
+
+  /// Writes out transactions buffered for the log, and syncs them to disk if asked
+  void flushTransactionLog(bool sync = false);
+
+  /**
+   * @brief Starts recording wrong pins, refused withdrawals and disbursements in a hash-chained audit log
+   * @details  Only one audit log can be enabled, throws if there already is one.
+   *
+   * @param path  The log file, chained onto if it already exists
+   * @param key  Key the log's blocks are MACed under, see AuditLog
+   */
+  void enableAuditLog(const std::string& path, const AuditKey& key);
+
+  /// The audit log, nullptr unless enabled
+  AuditLog* auditLog() {
+    return audit_log_ptr_.load(std::memory_order_acquire);
+  }
+
 private:
   /// Init function for initializing the internal database of account nums and pins
   inline std::unordered_map<uint64_t, uint16_t> initializeAccountPins() {
@@ -91,6 +266,59 @@ private:
     return kAccountPins;
   }
 
+  /// Init function for initializing the simulated ledger of account balances
+  inline std::unordered_map<uint64_t, Balances> initializeAccountBalances() {
+    // Make call to server to get account balances
+    return kAccountBalances;
+  }
+
+  /**
+   * @brief An account's balances in the ledger, behind a sequence lock
+   * @details  Writers hold ledger_mutex_ and bump the sequence to odd before writing and back to even after, so
+   *           readers can copy the balances without the lock and retry if the sequence moved.  The version of the
+   *           balances is the number of completed writes, sequence / 2.
+   */
+  struct LedgerEntry {
+    explicit LedgerEntry(const Balances& balances) :
+      sequence(0),
+      checking(balances.checking),
+      savings(balances.savings),
+      checking_withdraw_limit(balances.checking_withdraw_limit),
+      savings_withdraw_limit(balances.savings_withdraw_limit) {}
+
+    std::atomic<uint64_t> sequence;
+    std::atomic<int> checking;
+    std::atomic<int> savings;
+    const int checking_withdraw_limit;
+    const int savings_withdraw_limit;
+  };
+
+  /// Applies an update to an entry and records it everywhere it needs to go.  Must hold ledger_mutex_
+  void applyUpdate(uint64_t accountNumber,
+                   LedgerEntry& entry,
+                   AccountType accountType,
+                   int amount,
+                   TransactionId transactionId);
+
+  /// Overwrites both balances of an entry.  Must hold ledger_mutex_
+  static void writeBalances(LedgerEntry& entry, int checking, int savings);
+
+  /// Takes cash out of what's available for a dispense.  Must hold ledger_mutex_
+  void reserveCash(uint amount);
+
+  /// Adds to available_cash_, negative to take away, and to the process-wide gauge along with it.  Must hold
+  /// ledger_mutex_
+  void addCash(int64_t amount);
+
+  /// Puts back what a dispense didn't hand out and counts what it did
+  void settleCash(const DispenseEvent& event);
+
+  /// Copies what changed since the last call, for the checkpointer
+  CheckpointDelta captureCheckpointDelta();
+
+  /// Init function for picking the high bits of every transaction id this machine hands out
+  uint64_t initializeTransactionPrefix();
+
   /// Init function for initializing the amount of available cash
   inline uint initializeAvailableCash() {
     // Query internal ledger to see how much we are supposed to have
@@ -107,8 +335,52 @@ private:
   /// The amount of cash available in the ATM
   uint available_cash_;
 
-  /// Simulated database of account pins
-  std::unordered_map<uint64_t, uint16_t> account_pins_;
+  /// Simulated database of account pins, hashed under a key of this machine's
+  PinStore pin_store_;
+
+  /// Guards account_balances_, dirty_accounts_, available_cash_, transaction_log_ and dispenser_
+  std::mutex ledger_mutex_;
+
+  /// Simulated server side ledger of account balances.  The set of accounts is fixed at construction, so lookups
+  /// need no lock; the entries themselves are written under ledger_mutex_
+  std::unordered_map<uint64_t, LedgerEntry> account_balances_;
+
+  /// Accounts changed since the last checkpoint
+  std::unordered_set<uint64_t> dirty_accounts_;
+
+  /// Transaction ids already applied to the ledger, so retries aren't applied twice
+  DedupCache applied_transactions_;
+
+  /// High bits of every transaction id, distinguishing this machine from others
+  uint64_t transaction_prefix_;
+
+  /// Low bits of the next transaction id
+  std::atomic<uint64_t> transaction_counter_;
+
+  /// Withdrawal history per account, for velocity checks and security alerts
+  VelocityTracker velocity_tracker_;
+
+  /// Failed pin entries per card, to lock out brute force attempts
+  PinAttemptTracker pin_attempt_tracker_;
+
+  /// Recent transactions per account, for mini statements.  Room for every account in the ledger
+  MiniStatementStore mini_statements_;
+
+  /// Every applied transaction, nullptr unless enabled.  Appended to under ledger_mutex_ so it is in ledger order
+  std::unique_ptr<TransactionLog> transaction_log_;
+
+  /// Security events, nullptr unless enabled.  Sessions read the pointer without a lock, so once set it stays
+  std::unique_ptr<AuditLog> audit_log_;
+  std::atomic<AuditLog*> audit_log_ptr_{nullptr};
+
+  /// Deposit clearing, after the ledger so rejected deposits can still be reversed while it shuts down
+  std::unique_ptr<DepositPipeline> deposit_pipeline_;
+
+  /// Dispenser device driver, nullptr unless attached.  Its completions update the ledger, so after it
+  std::unique_ptr<CashDispenser> dispenser_;
+
+  /// Background checkpoint writer, nullptr unless enabled.  Last so it stops before the state it captures goes away
+  std::unique_ptr<Checkpointer> checkpointer_;
 };
 
 #endif  // ATM_MACHINE_H
@@ -0,0 +1,173 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+// C++ Standard Library
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+// ATM Controller
+#include "metrics.h"
+#include "screen_state.h"
+
+constexpr size_t ATMMetrics::kScreenStates;
+
+size_t metricShard() {
+  static std::atomic<size_t> next_shard{0};
+  static thread_local const size_t shard = next_shard.fetch_add(1, std::memory_order_relaxed) % kMetricShards;
+  return shard;
+}
+
+Counter::Counter() {
+  for (Slot& slot : slots_) {
+    slot.value.store(0, std::memory_order_relaxed);
+  }
+}
+
+uint64_t Counter::value() const {
+  uint64_t total = 0;
+  for (const Slot& slot : slots_) {
+    total += slot.value.load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+Gauge::Gauge() {
+  for (Slot& slot : slots_) {
+    slot.value.store(0, std::memory_order_relaxed);
+  }
+}
+
+void Gauge::set(int64_t value) {
+  for (size_t i = 1; i < slots_.size(); ++i) {
+    slots_[i].value.store(0, std::memory_order_relaxed);
+  }
+  slots_[0].value.store(value, std::memory_order_relaxed);
+}
+
+int64_t Gauge::value() const {
+  int64_t total = 0;
+  for (const Slot& slot : slots_) {
+    total += slot.value.load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+MetricsRegistry& MetricsRegistry::instance() {
+  static MetricsRegistry registry;
+  return registry;
+}
+
+Counter& MetricsRegistry::counter(const std::string& name, const std::string& help, const std::string& labels) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto& metric = family(name, help, MetricType::COUNTER).metrics[labels];
+  if (!metric.first) {
+    metric.first.reset(new Counter());
+  }
+  return *metric.first;
+}
+
+Gauge& MetricsRegistry::gauge(const std::string& name, const std::string& help, const std::string& labels) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto& metric = family(name, help, MetricType::GAUGE).metrics[labels];
+  if (!metric.second) {
+    metric.second.reset(new Gauge());
+  }
+  return *metric.second;
+}
+
+std::string MetricsRegistry::renderPrometheus() {
+  std::ostringstream out;
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& family : families_) {
+    out << "# HELP " << family.first << " " << family.second.help << "\n";
+    out << "# TYPE " << family.first << " " << (family.second.type == MetricType::COUNTER ? "counter" : "gauge")
+        << "\n";
+    for (const auto& metric : family.second.metrics) {
+      out << family.first;
+      if (!metric.first.empty()) {
+        out << "{" << metric.first << "}";
+      }
+      if (family.second.type == MetricType::COUNTER) {
+        out << " " << metric.second.first->value() << "\n";
+      } else {
+        out << " " << metric.second.second->value() << "\n";
+      }
+    }
+  }
+  return out.str();
+}
+
+bool MetricsRegistry::writePrometheusFile(const std::string& path) {
+  const std::string temporary = path + ".tmp";
+  {
+    std::ofstream file(temporary, std::ios::trunc);
+    file << renderPrometheus();
+    if (!file) {
+      return false;
+    }
+  }
+  return std::rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+MetricsRegistry::Family& MetricsRegistry::family(const std::string& name, const std::string& help, MetricType type) {
+  auto existing = families_.find(name);
+  if (existing == families_.end()) {
+    existing = families_.emplace(name, Family{type, help, {}}).first;
+  } else if (existing->second.type != type) {
+    throw std::runtime_error("Metric " + name + " already registered with another type");
+  }
+  return existing->second;
+}
+
+ATMMetrics& atmMetrics() {
+  static ATMMetrics metrics = []() {
+    MetricsRegistry& registry = MetricsRegistry::instance();
+    const std::string errors_help = "Refused operations by error code";
+    ATMMetrics built{
+      registry.counter("atm_sessions_total", "Cards read by an idle ATM"),
+      registry.counter("atm_wrong_pins_total", "Wrong pins entered"),
+      registry.counter("atm_card_lockouts_total", "Cards locked out after too many wrong pins"),
+      registry.counter("atm_withdrawals_total", "Withdrawals applied"),
+      registry.counter("atm_deposits_total", "Deposits applied"),
+      registry.counter("atm_batches_total", "Batches of management actions applied"),
+      registry.counter("atm_errors_total", errors_help, "code=\"E12343\""),
+      registry.counter("atm_errors_total", errors_help, "code=\"E12344\""),
+      registry.counter("atm_errors_total", errors_help, "code=\"E12345\""),
+      registry.counter("atm_errors_total", errors_help, "code=\"E12346\""),
+      registry.counter("atm_errors_total", errors_help, "code=\"E12347\""),
+      registry.counter("atm_errors_total", errors_help, "code=\"E12348\""),
+      registry.counter("atm_errors_total", errors_help, "code=\"E12349\""),
+      registry.counter("atm_errors_total", errors_help, "code=\"E12350\""),
+      registry.counter("atm_errors_total", errors_help, "code=\"E12351\""),
+      registry.counter("atm_cash_dispensed_total", "Cash dispensed, in dollars"),
+      registry.counter("atm_cash_deposited_total", "Cash deposited, in dollars"),
+      registry.counter("atm_ledger_conflicts_total", "Balance write-backs retried because the account moved on"),
+      registry.counter("atm_deposits_settled_total", "Deposits cleared and made available"),
+      registry.counter("atm_deposits_rejected_total", "Deposits rejected by verification and reversed"),
+      registry.counter("atm_host_timeouts_total", "Host calls not answered in time"),
+      registry.counter("atm_stand_in_approvals_total", "Balance changes approved in stand-in"),
+      registry.counter("atm_stand_in_forwarded_total", "Stand-in changes forwarded to the host"),
+      registry.counter("atm_dispense_faults_total", "Dispenses that jammed or came out short and were credited back"),
+      registry.counter("atm_mini_statement_drops_total", "Transactions left out of mini statements, the store was full"),
+      registry.gauge("atm_deposits_held", "Deposited funds not available yet, in dollars"),
+      registry.gauge("atm_stand_in_queued", "Stand-in changes waiting to be forwarded to the host"),
+      registry.gauge("atm_cash_available", "Cash left in every machine of the process, in dollars"),
+      {}};
+
+    for (size_t from = 0; from < ATMMetrics::kScreenStates; ++from) {
+      for (size_t to = 0; to < ATMMetrics::kScreenStates; ++to) {
+        built.transitions[from][to] = &registry.counter(
+            "atm_transitions_total",
+            "Screen state transitions",
+            std::string("from=\"") + kATMScreenStateToString.at(static_cast<ATMScreenState>(from)) + "\",to=\"" +
+                kATMScreenStateToString.at(static_cast<ATMScreenState>(to)) + "\"");
+      }
+    }
+    return built;
+  }();
+  return metrics;
+}
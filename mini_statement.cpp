@@ -0,0 +1,114 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+// C++ Standard Library
+#include <algorithm>
+
+// ATM Controller
+#include "mini_statement.h"
+
+constexpr size_t MiniStatementStore::kAccountTypes;
+constexpr uint32_t MiniStatementStore::kNoSlot;
+
+/// splitmix64 finalizer, spreads account numbers over the index
+static uint64_t accountHash(uint64_t accountNumber) {
+  accountNumber ^= accountNumber >> 30;
+  accountNumber *= 0xbf58476d1ce4e5b9ULL;
+  accountNumber ^= accountNumber >> 27;
+  accountNumber *= 0x94d049bb133111ebULL;
+  return accountNumber ^ (accountNumber >> 31);
+}
+
+MiniStatementStore::MiniStatementStore(size_t maxAccounts) :
+  max_accounts_(std::max<size_t>(maxAccounts, 1)),
+  arena_(new Slot[max_accounts_]),
+  used_slots_(0) {
+  // At most half full, so probes stay short
+  size_t index_size = 1;
+  while (index_size < 2 * max_accounts_) {
+    index_size <<= 1;
+  }
+  index_keys_.reset(new std::atomic<uint64_t>[index_size]);
+  index_slots_.reset(new uint32_t[index_size]);
+  index_mask_ = index_size - 1;
+  for (size_t i = 0; i < index_size; ++i) {
+    index_keys_[i].store(0, std::memory_order_relaxed);
+    index_slots_[i] = kNoSlot;
+  }
+}
+
+bool MiniStatementStore::record(uint64_t accountNumber,
+                                uint32_t accountType,
+                                int amount,
+                                int balance,
+                                std::chrono::system_clock::time_point now) {
+  const uint32_t slot = findOrInsert(accountNumber);
+  if (slot == kNoSlot or accountType >= kAccountTypes) {
+    return false;
+  }
+
+  const uint32_t seconds = static_cast<uint32_t>(
+      std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch()).count());
+  std::lock_guard<std::mutex> lock(lockFor(slot));
+  Ring& ring = arena_[slot].rings[accountType];
+  ring.entries[ring.next] = MiniStatementEntry{seconds, amount, balance, 0};
+  ring.next = (ring.next + 1) % kMiniStatementEntries;
+  ring.size = std::min<uint32_t>(ring.size + 1, kMiniStatementEntries);
+  return true;
+}
+
+size_t MiniStatementStore::read(uint64_t accountNumber, uint32_t accountType, MiniStatement& out) {
+  const uint32_t slot = find(accountNumber);
+  if (slot == kNoSlot or accountType >= kAccountTypes) {
+    return 0;
+  }
+
+  std::lock_guard<std::mutex> lock(lockFor(slot));
+  const Ring& ring = arena_[slot].rings[accountType];
+  for (uint32_t i = 0; i < ring.size; ++i) {
+    out[i] = ring.entries[(ring.next + kMiniStatementEntries - 1 - i) % kMiniStatementEntries];
+  }
+  return ring.size;
+}
+
+uint32_t MiniStatementStore::find(uint64_t accountNumber) const {
+  if (accountNumber == 0) {
+    return kNoSlot;
+  }
+  for (size_t i = accountHash(accountNumber) & index_mask_;; i = (i + 1) & index_mask_) {
+    const uint64_t key = index_keys_[i].load(std::memory_order_acquire);
+    if (key == accountNumber) {
+      return index_slots_[i];
+    } else if (key == 0) {
+      return kNoSlot;
+    }
+  }
+}
+
+uint32_t MiniStatementStore::findOrInsert(uint64_t accountNumber) {
+  const uint32_t existing = find(accountNumber);
+  if (existing != kNoSlot or accountNumber == 0) {
+    return existing;
+  }
+
+  std::lock_guard<std::mutex> lock(index_mutex_);
+  size_t i = accountHash(accountNumber) & index_mask_;
+  for (;; i = (i + 1) & index_mask_) {
+    const uint64_t key = index_keys_[i].load(std::memory_order_relaxed);
+    if (key == accountNumber) {
+      // Added by another thread in the meantime
+      return index_slots_[i];
+    } else if (key == 0) {
+      break;
+    }
+  }
+
+  if (used_slots_ == max_accounts_) {
+    return kNoSlot;
+  }
+  index_slots_[i] = used_slots_++;
+  index_keys_[i].store(accountNumber, std::memory_order_release);
+  return index_slots_[i];
+}
@@ -0,0 +1,128 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+#ifndef ATM_MINI_STATEMENT_H
+#define ATM_MINI_STATEMENT_H
+
+// C++ Standard Library
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+/// Transactions kept per account and account type for mini statements
+static constexpr size_t kMiniStatementEntries = 10;
+
+/// One recent transaction, packed into 16 bytes
+struct MiniStatementEntry {
+  /// When the ledger applied it, seconds since the Unix epoch
+  uint32_t time;
+  /// Negative for a debit
+  int32_t amount;
+  /// Balance right after this transaction
+  int32_t balance;
+  uint32_t reserved;
+};
+
+static_assert(sizeof(MiniStatementEntry) == 16, "Mini statement entries are kept compact");
+
+/// The most recent transactions of an account, newest first, filled in by MiniStatementStore::read()
+using MiniStatement = std::array<MiniStatementEntry, kMiniStatementEntries>;
+
+/**
+ * @brief The last few transactions of every account, for "last 10 transactions" without touching the full history
+ * @details  Every account gets a fixed ring of kMiniStatementEntries per account type, carved out of one arena
+ *           allocated up front, so appending and reading never allocate and a read is a copy of at most
+ *           kMiniStatementEntries entries.  Accounts are found through a fixed-size open-addressing index that is only
+ *           written when an account is seen for the first time.
+ */
+class MiniStatementStore {
+ public:
+  /// Account types with their own ring, matching AccountType
+  static constexpr size_t kAccountTypes = 2;
+
+  /**
+   * @brief Constructor for the store
+   *
+   * @param maxAccounts  How many accounts the arena has room for, e.g. the size of the account table.  Transactions of
+   *                     accounts beyond that aren't kept
+   */
+  explicit MiniStatementStore(size_t maxAccounts);
+
+  /**
+   * @brief Appends a transaction to an account's ring, overwriting the oldest once it is full
+   *
+   * @param accountNumber  The account the transaction applied to
+   * @param accountType  AccountType of the balance that changed
+   * @param amount  The amount added, negative for a debit
+   * @param balance  The balance right after the transaction
+   * @param now  When it was applied
+   * @return  False if the arena is full and the account has no ring
+   */
+  bool record(uint64_t accountNumber,
+              uint32_t accountType,
+              int amount,
+              int balance,
+              std::chrono::system_clock::time_point now = std::chrono::system_clock::now());
+
+  /**
+   * @brief Copies an account's recent transactions, newest first
+   *
+   * @param accountNumber  The account to read
+   * @param accountType  AccountType to read
+   * @param out  Filled in from the front
+   * @return  How many entries of out were filled in
+   */
+  size_t read(uint64_t accountNumber, uint32_t accountType, MiniStatement& out);
+
+ private:
+  struct Ring {
+    MiniStatement entries;
+    /// Where the next entry goes
+    uint32_t next{0};
+    uint32_t size{0};
+  };
+
+  /// The rings of one account
+  struct Slot {
+    std::array<Ring, kAccountTypes> rings;
+  };
+
+  /// Slot of an account, kNoSlot if it has none
+  uint32_t find(uint64_t accountNumber) const;
+
+  /// Slot of an account, giving it one if there is room
+  uint32_t findOrInsert(uint64_t accountNumber);
+
+  /// Lock guarding a slot's rings
+  std::mutex& lockFor(uint32_t slot) {
+    return locks_[slot % locks_.size()];
+  }
+
+  static constexpr uint32_t kNoSlot = UINT32_MAX;
+
+  const size_t max_accounts_;
+
+  /// Every account's rings, allocated once
+  std::unique_ptr<Slot[]> arena_;
+
+  /// Account numbers of the index, 0 for an empty entry, written once under index_mutex_
+  std::unique_ptr<std::atomic<uint64_t>[]> index_keys_;
+
+  /// Arena slot of each index entry, written before its key is published
+  std::unique_ptr<uint32_t[]> index_slots_;
+  size_t index_mask_;
+
+  /// Serializes adding accounts to the index
+  std::mutex index_mutex_;
+  uint32_t used_slots_;
+
+  /// Guard the rings, striped over slots
+  std::array<std::mutex, 16> locks_;
+};
+
+#endif  // ATM_MINI_STATEMENT_H
@@ -0,0 +1,149 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+// C++ Standard Library
+#include <algorithm>
+#include <limits>
+
+// ATM Controller
+#include "pin_attempts.h"
+
+constexpr uint PinAttemptTracker::kDefaultMaxFailures;
+
+/// Marks an unused heavy hitter slot, no real card has this number
+static constexpr uint64_t kNoAccount = 0;
+
+PinAttemptTracker::PinAttemptTracker(uint maxFailures,
+                                     Clock::duration lockoutDuration,
+                                     Clock::duration decayPeriod) :
+  max_failures_(maxFailures),
+  lockout_duration_(lockoutDuration),
+  decay_period_(decayPeriod),
+  decay_epoch_(0),
+  sketch_{},
+  heavy_hitters_{} {
+}
+
+bool PinAttemptTracker::isLockedOut(uint64_t accountNumber, Clock::time_point now) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const HeavyHitter* hitter = findHeavyHitter(accountNumber);
+  return hitter != nullptr and hitter->locked_until > now;
+}
+
+bool PinAttemptTracker::recordFailure(uint64_t accountNumber, Clock::time_point now) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  decay(now);
+
+  // Conservative update: only raise the counters that are at the current minimum
+  const uint current = estimate(accountNumber);
+  for (size_t row = 0; row < kSketchDepth; ++row) {
+    uint8_t& counter = sketch_[row][hash(accountNumber, row) % kSketchWidth];
+    if (counter == current and counter < std::numeric_limits<uint8_t>::max()) {
+      ++counter;
+    }
+  }
+
+  HeavyHitter* hitter = findHeavyHitter(accountNumber);
+  if (hitter == nullptr) {
+    hitter = promote(accountNumber, estimate(accountNumber), now);
+    if (hitter == nullptr) {
+      // Its set is busy with cards at least as suspicious, it gets a slot once the sketch says it has failed more
+      return false;
+    }
+  }
+  // Only this card's own failures are counted, the sketch's estimate includes every card sharing its counters
+  ++hitter->failures;
+
+  if (hitter->failures >= max_failures_ and hitter->locked_until <= now) {
+    hitter->locked_until = now + lockout_duration_;
+    return true;
+  }
+  return false;
+}
+
+void PinAttemptTracker::recordSuccess(uint64_t accountNumber) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  HeavyHitter* hitter = findHeavyHitter(accountNumber);
+  if (hitter != nullptr) {
+    // Keep the slot with a clean count, the sketch still remembers the old failures and would otherwise re-promote
+    // the card straight back up.  Clean slots are the first to be evicted.
+    hitter->failures = 0;
+    hitter->locked_until = Clock::time_point{};
+  }
+}
+
+uint PinAttemptTracker::estimateFailures(uint64_t accountNumber, Clock::time_point now) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  decay(now);
+  return estimate(accountNumber);
+}
+
+uint64_t PinAttemptTracker::hash(uint64_t accountNumber, size_t row) {
+  // splitmix64 finalizer, seeded per row
+  uint64_t h = accountNumber + 0x9e3779b97f4a7c15ULL * (row + 1);
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+
+void PinAttemptTracker::decay(Clock::time_point now) {
+  const int64_t epoch = now.time_since_epoch() / decay_period_;
+  if (epoch <= decay_epoch_) {
+    return;
+  }
+
+  // One pass per period, a few microseconds for the whole sketch
+  const int64_t halvings = std::min<int64_t>(epoch - decay_epoch_, 8);
+  for (auto& row : sketch_) {
+    for (uint8_t& counter : row) {
+      counter >>= halvings;
+    }
+  }
+  decay_epoch_ = epoch;
+}
+
+uint PinAttemptTracker::estimate(uint64_t accountNumber) const {
+  uint smallest = std::numeric_limits<uint>::max();
+  for (size_t row = 0; row < kSketchDepth; ++row) {
+    smallest = std::min<uint>(smallest, sketch_[row][hash(accountNumber, row) % kSketchWidth]);
+  }
+  return smallest;
+}
+
+PinAttemptTracker::HeavyHitter* PinAttemptTracker::findHeavyHitter(uint64_t accountNumber) {
+  auto& set = heavy_hitters_[hash(accountNumber, kSketchDepth) % kHeavyHitterSets];
+  for (HeavyHitter& hitter : set) {
+    if (hitter.account_number == accountNumber and accountNumber != kNoAccount) {
+      return &hitter;
+    }
+  }
+  return nullptr;
+}
+
+PinAttemptTracker::HeavyHitter* PinAttemptTracker::promote(uint64_t accountNumber,
+                                                           uint estimated,
+                                                           Clock::time_point now) {
+  auto& set = heavy_hitters_[hash(accountNumber, kSketchDepth) % kHeavyHitterSets];
+
+  // Prefer a free slot, then the unlocked card with the fewest failures.  Locked cards are never evicted, that would
+  // lift their lockout early
+  HeavyHitter* victim = nullptr;
+  for (HeavyHitter& hitter : set) {
+    if (hitter.account_number == kNoAccount) {
+      victim = &hitter;
+      break;
+    }
+    if (hitter.locked_until <= now and (victim == nullptr or hitter.failures < victim->failures)) {
+      victim = &hitter;
+    }
+  }
+
+  // The sketch only decides who is worth a slot, a card it overestimates takes one sooner but still starts from 0
+  if (victim == nullptr or (victim->account_number != kNoAccount and estimated < victim->failures)) {
+    return nullptr;
+  }
+  *victim = HeavyHitter{accountNumber, 0, Clock::time_point{}};
+  return victim;
+}
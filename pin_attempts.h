@@ -0,0 +1,118 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+#ifndef ATM_PIN_ATTEMPTS_H
+#define ATM_PIN_ATTEMPTS_H
+
+// C++ Standard Library
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+// POSIX
+#include <sys/types.h>
+
+/**
+ * @brief Counts failed pin entries per card in fixed memory and locks cards out after too many
+ * @details  A failing card gets an exact counter in a small set-associative table, and is locked out once that counter
+ *           reaches the failure limit.  Lockouts only ever come from a card's own exact count.  Every failure also goes
+ *           into a count-min sketch, which overestimates but never underestimates the number of failures for a card,
+ *           and decides who gets a slot when a set is full: the unlocked card with the fewest failures gives way to a
+ *           card the sketch puts at least that high, so a stream of one-off typos can't push out a card being
+ *           guessed at.  Locked cards keep their slot until the lockout ends.  The sketch is halved every decay
+ *           period so old failures fade away.  Memory is fixed at construction and every operation touches a
+ *           constant number of counters.
+ */
+class PinAttemptTracker {
+ public:
+  using Clock = std::chrono::system_clock;
+
+  /**
+   * @brief Constructor for the tracker
+   *
+   * @param maxFailures  Failed attempts allowed before a card is locked out
+   * @param lockoutDuration  How long a card stays locked out
+   * @param decayPeriod  How often the failure counts are halved
+   */
+  explicit PinAttemptTracker(uint maxFailures = kDefaultMaxFailures,
+                             Clock::duration lockoutDuration = std::chrono::hours(24),
+                             Clock::duration decayPeriod = std::chrono::hours(1));
+
+  /// Whether or not the card is currently locked out
+  bool isLockedOut(uint64_t accountNumber, Clock::time_point now = Clock::now());
+
+  /**
+   * @brief Records a wrong pin for a card
+   *
+   * @return  True if this failure locked the card out
+   */
+  bool recordFailure(uint64_t accountNumber, Clock::time_point now = Clock::now());
+
+  /// Records a correct pin for a card, resetting its exact failure count
+  void recordSuccess(uint64_t accountNumber);
+
+  /// The sketch's (over)estimate of recent failures for a card
+  uint estimateFailures(uint64_t accountNumber, Clock::time_point now = Clock::now());
+
+  /// Bytes used by the sketch and the exact counters, fixed for the tracker's lifetime
+  static constexpr size_t memoryFootprint() {
+    return sizeof(Sketch) + sizeof(HeavyHitters);
+  }
+
+  static constexpr uint kDefaultMaxFailures = 3;
+
+ private:
+  static constexpr size_t kSketchDepth = 4;
+  static constexpr size_t kSketchWidth = 4096;
+  static constexpr size_t kHeavyHitterSets = 256;
+  static constexpr size_t kHeavyHitterWays = 4;
+
+  using Sketch = std::array<std::array<uint8_t, kSketchWidth>, kSketchDepth>;
+
+  /// Exact failure count for a card that failed often enough to be worth tracking
+  struct HeavyHitter {
+    uint64_t account_number;
+    uint32_t failures;
+    Clock::time_point locked_until;
+  };
+
+  using HeavyHitters = std::array<std::array<HeavyHitter, kHeavyHitterWays>, kHeavyHitterSets>;
+
+  /// Hash of a card number for a given sketch row, or for the heavy hitter table when row == kSketchDepth
+  static uint64_t hash(uint64_t accountNumber, size_t row);
+
+  /// Halves the sketch for every decay period that passed since the last call
+  void decay(Clock::time_point now);
+
+  /// Smallest counter for a card over every sketch row
+  uint estimate(uint64_t accountNumber) const;
+
+  /// The exact counter for a card, nullptr if it isn't tracked
+  HeavyHitter* findHeavyHitter(uint64_t accountNumber);
+
+  /**
+   * @brief Takes a slot for a card, with a count of 0
+   * @details  Evicts the unlocked card of its set with the fewest failures if the set is full, as long as the card's
+   *           sketch estimate is at least that many.
+   *
+   * @return  The slot, nullptr if every card in the set is locked out or has failed more
+   */
+  HeavyHitter* promote(uint64_t accountNumber, uint estimated, Clock::time_point now);
+
+  const uint max_failures_;
+  const Clock::duration lockout_duration_;
+  const Clock::duration decay_period_;
+
+  std::mutex mutex_;
+
+  /// Number of decay periods since the epoch, as of the last decay
+  int64_t decay_epoch_;
+
+  Sketch sketch_;
+  HeavyHitters heavy_hitters_;
+};
+
+#endif  // ATM_PIN_ATTEMPTS_H
@@ -0,0 +1,89 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ *
+ * Benchmark of the hashed pin store over a large card base: enrolment, a single verification as at a swipe, batch
+ * verification and a key rotation over every record.
+ *
+ * Usage: pin_benchmark [records] [threads]
+ */
+
+// C++ Standard Library
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+// ATM Controller
+#include "pin_store.h"
+
+static constexpr uint64_t kFirstAccount = 4000000000000000;
+
+/// The pin given to an account, for knowing what to verify
+static uint16_t pinOf(uint64_t account) {
+  return static_cast<uint16_t>(account * 2654435761u % 10000);
+}
+
+int main(int argc, char** argv) {
+  const size_t records = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+  const size_t threads = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 0;
+  if (records == 0) {
+    std::fprintf(stderr, "Usage: %s [records] [threads]\n", argv[0]);
+    return 2;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  const auto seconds = [&start]() {
+    const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    start = std::chrono::steady_clock::now();
+    return elapsed;
+  };
+
+  std::unique_ptr<PinStore> store(new PinStore(PinStore::randomKey()));
+  for (size_t i = 0; i < records; ++i) {
+    store->enroll(kFirstAccount + i, pinOf(kFirstAccount + i));
+  }
+  const double enrolled = seconds();
+  std::printf("%-24s %10.3f s %14.0f records/s\n", "enrol", enrolled, records / enrolled);
+
+  constexpr int kSwipes = 100000;
+  size_t right = 0;
+  for (int i = 0; i < kSwipes; ++i) {
+    const uint64_t account = kFirstAccount + i % records;
+    right += store->verify(account, pinOf(account));
+  }
+  const double swiped = seconds();
+  std::printf("%-24s %10.3f us %14.0f verifies/s\n", "verify one", 1e6 * swiped / kSwipes, kSwipes / swiped);
+
+  std::vector<PinCheck> checks(records);
+  for (size_t i = 0; i < records; ++i) {
+    checks[i] = PinCheck{kFirstAccount + i, pinOf(kFirstAccount + i)};
+  }
+  std::unique_ptr<bool[]> results(new bool[records]);
+  seconds();
+  store->verifyBatch(checks.data(), records, results.get(), threads);
+  const double batched = seconds();
+  for (size_t i = 0; i < records; ++i) {
+    right += results[i];
+  }
+  std::printf("%-24s %10.3f s %14.0f verifies/s\n", "verify batch", batched, records / batched);
+
+  store->rotateKey(PinStore::randomKey(), threads);
+  const double rotated = seconds();
+  std::printf("%-24s %10.3f s %14.0f records/s\n", "rotate key", rotated, records / rotated);
+
+  store->verifyBatch(checks.data(), records, results.get(), threads);
+  const double wrapped = seconds();
+  for (size_t i = 0; i < records; ++i) {
+    right += results[i];
+  }
+  std::printf("%-24s %10.3f s %14.0f verifies/s\n", "verify batch, rotated", wrapped, records / wrapped);
+
+  const size_t expected = kSwipes + 2 * records;
+  if (right != expected) {
+    std::fprintf(stderr, "%zu of %zu pins verified\n", right, expected);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,279 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+// C++ Standard Library
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+// ATM Controller
+#include "pin_store.h"
+
+constexpr size_t PinStore::kShards;
+constexpr uint32_t PinStore::kMaxKeys;
+
+/// The first message of a record's chain: salt, account number and PIN, little-endian
+static constexpr size_t kPinMessageSize = 16 + 8 + 2;
+
+static void pinMessage(uint8_t* message, const PinRecord& record, uint64_t accountNumber, uint16_t pin) {
+  std::copy(record.salt.begin(), record.salt.end(), message);
+  for (int i = 0; i < 8; ++i) {
+    message[16 + i] = static_cast<uint8_t>(accountNumber >> (8 * i));
+  }
+  message[24] = static_cast<uint8_t>(pin);
+  message[25] = static_cast<uint8_t>(pin >> 8);
+}
+
+/// Compares every byte whatever the first difference, so the time taken doesn't tell how much of a guess matched
+static bool constantTimeEqual(const Sha256Digest& a, const Sha256Digest& b) {
+  uint8_t difference = 0;
+  for (size_t i = 0; i < a.size(); ++i) {
+    difference |= a[i] ^ b[i];
+  }
+  return difference == 0;
+}
+
+PinStore::PinStore(const PinKey& key) : key_count_(1), salt_random_(std::random_device()()) {
+  keys_[0] = hmacSha256Key(key.data(), key.size());
+}
+
+PinKey PinStore::randomKey() {
+  std::random_device random;
+  PinKey key;
+  for (size_t i = 0; i < key.size(); i += 4) {
+    const uint32_t word = random();
+    for (size_t j = 0; j < 4; ++j) {
+      key[i + j] = static_cast<uint8_t>(word >> (8 * j));
+    }
+  }
+  return key;
+}
+
+void PinStore::enroll(uint64_t accountNumber, uint16_t pin) {
+  const PinRecord record = hashPin(accountNumber, pin);
+  Shard& shard = shardFor(accountNumber);
+  std::unique_lock<std::shared_mutex> lock(shard.mutex);
+  shard.records[accountNumber] = record;
+}
+
+bool PinStore::verify(uint64_t accountNumber, uint16_t pin) {
+  Shard& shard = shardFor(accountNumber);
+  PinRecord record;
+  {
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    const auto found = shard.records.find(accountNumber);
+    if (found == shard.records.end()) {
+      throw std::runtime_error("Account not found");
+    }
+    record = found->second;
+  }
+
+  const bool match = constantTimeEqual(chainHash(record, accountNumber, pin), record.hash);
+  if (match and record.first_key_version != record.key_version) {
+    // Wrapped by rotations, hash it again under the current key so the next verify is one HMAC
+    const PinRecord fresh = hashPin(accountNumber, pin);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    const auto found = shard.records.find(accountNumber);
+    // Unless it changed since it was read
+    if (found != shard.records.end() and found->second.key_version == record.key_version and
+        found->second.hash == record.hash) {
+      found->second = fresh;
+    }
+  }
+  return match;
+}
+
+bool PinStore::contains(uint64_t accountNumber) {
+  Shard& shard = shardFor(accountNumber);
+  std::shared_lock<std::shared_mutex> lock(shard.mutex);
+  return shard.records.count(accountNumber) > 0;
+}
+
+void PinStore::verifyBatch(const PinCheck* checks, size_t count, bool* results, size_t threads) {
+  parallelFor(count, threads, [this, checks, results](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i += kSha256Lanes) {
+      verifyLanes(checks + i, std::min(kSha256Lanes, end - i), results + i);
+    }
+  });
+}
+
+uint32_t PinStore::rotateKey(const PinKey& key, size_t threads) {
+  std::lock_guard<std::mutex> rotate_lock(rotate_mutex_);
+  const uint32_t version = key_count_.load(std::memory_order_relaxed) + 1;
+  if (version > kMaxKeys) {
+    throw std::runtime_error("Too many PIN key rotations");
+  }
+  keys_[version - 1] = hmacSha256Key(key.data(), key.size());
+  // Records enrolled from here on are hashed under the new key and left alone below
+  key_count_.store(version, std::memory_order_release);
+
+  const HmacSha256Key* const new_key = &keys_[version - 1];
+  parallelFor(kShards, threads, [this, version, new_key](size_t begin, size_t end) {
+    const HmacSha256Key* keys[kSha256Lanes];
+    std::fill(std::begin(keys), std::end(keys), new_key);
+    for (size_t index = begin; index < end; ++index) {
+      Shard& shard = shards_[index];
+      std::unique_lock<std::shared_mutex> lock(shard.mutex);
+      std::vector<PinRecord*> records;
+      records.reserve(shard.records.size());
+      for (auto& entry : shard.records) {
+        if (entry.second.key_version < version) {
+          records.push_back(&entry.second);
+        }
+      }
+
+      for (size_t i = 0; i < records.size(); i += kSha256Lanes) {
+        const size_t lanes = std::min(kSha256Lanes, records.size() - i);
+        const uint8_t* messages[kSha256Lanes];
+        for (size_t lane = 0; lane < kSha256Lanes; ++lane) {
+          // Spare lanes hash the last record again, and the result is dropped
+          messages[lane] = records[i + std::min(lane, lanes - 1)]->hash.data();
+        }
+        Sha256Digest wrapped[kSha256Lanes];
+        hmacSha256ShortLanes(keys, messages, sizeof(Sha256Digest), wrapped);
+        for (size_t lane = 0; lane < lanes; ++lane) {
+          records[i + lane]->hash = wrapped[lane];
+          records[i + lane]->key_version = version;
+        }
+      }
+    }
+  });
+  return version;
+}
+
+uint32_t PinStore::keyVersion() {
+  return key_count_.load(std::memory_order_acquire);
+}
+
+PinRecord PinStore::record(uint64_t accountNumber) {
+  Shard& shard = shardFor(accountNumber);
+  std::shared_lock<std::shared_mutex> lock(shard.mutex);
+  const auto found = shard.records.find(accountNumber);
+  if (found == shard.records.end()) {
+    throw std::runtime_error("Account not found");
+  }
+  return found->second;
+}
+
+size_t PinStore::size() {
+  size_t total = 0;
+  for (Shard& shard : shards_) {
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    total += shard.records.size();
+  }
+  return total;
+}
+
+PinRecord PinStore::hashPin(uint64_t accountNumber, uint16_t pin) {
+  PinRecord record;
+  {
+    std::lock_guard<std::mutex> lock(salt_mutex_);
+    for (size_t i = 0; i < record.salt.size(); i += 8) {
+      const uint64_t word = salt_random_();
+      for (size_t j = 0; j < 8; ++j) {
+        record.salt[i + j] = static_cast<uint8_t>(word >> (8 * j));
+      }
+    }
+  }
+  record.first_key_version = keyVersion();
+  record.key_version = record.first_key_version;
+
+  uint8_t message[kPinMessageSize];
+  pinMessage(message, record, accountNumber, pin);
+  record.hash = hmacSha256Short(keys_[record.first_key_version - 1], message, sizeof(message));
+  return record;
+}
+
+Sha256Digest PinStore::chainHash(const PinRecord& record, uint64_t accountNumber, uint16_t pin) {
+  uint8_t message[kPinMessageSize];
+  pinMessage(message, record, accountNumber, pin);
+  Sha256Digest hash = hmacSha256Short(keys_[record.first_key_version - 1], message, sizeof(message));
+  for (uint32_t version = record.first_key_version + 1; version <= record.key_version; ++version) {
+    hash = hmacSha256Short(keys_[version - 1], hash.data(), hash.size());
+  }
+  return hash;
+}
+
+void PinStore::verifyLanes(const PinCheck* checks, size_t count, bool* results) {
+  PinRecord records[kSha256Lanes];
+  bool found[kSha256Lanes];
+  for (size_t lane = 0; lane < kSha256Lanes; ++lane) {
+    // Spare lanes check the last PIN again, and the result is dropped
+    const PinCheck& check = checks[std::min(lane, count - 1)];
+    Shard& shard = shardFor(check.account_number);
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    const auto record = shard.records.find(check.account_number);
+    found[lane] = record != shard.records.end();
+    if (found[lane]) {
+      records[lane] = record->second;
+    } else {
+      // Hashed like any other so a missing account takes as long, and never matches
+      records[lane] = PinRecord{{}, 1, 1, {}};
+    }
+  }
+
+  uint8_t messages[kSha256Lanes][kPinMessageSize];
+  const uint8_t* message_pointers[kSha256Lanes];
+  const HmacSha256Key* keys[kSha256Lanes];
+  uint32_t versions[kSha256Lanes];
+  for (size_t lane = 0; lane < kSha256Lanes; ++lane) {
+    const PinCheck& check = checks[std::min(lane, count - 1)];
+    pinMessage(messages[lane], records[lane], check.account_number, check.pin);
+    message_pointers[lane] = messages[lane];
+    versions[lane] = records[lane].first_key_version;
+    keys[lane] = &keys_[versions[lane] - 1];
+  }
+  Sha256Digest hashes[kSha256Lanes];
+  hmacSha256ShortLanes(keys, message_pointers, kPinMessageSize, hashes);
+
+  // Then the wrapping of each rotation.  Lanes with fewer of them are done first, and their results dropped after
+  for (;;) {
+    bool advancing[kSha256Lanes];
+    bool wrapping = false;
+    for (size_t lane = 0; lane < kSha256Lanes; ++lane) {
+      advancing[lane] = versions[lane] < records[lane].key_version;
+      if (advancing[lane]) {
+        ++versions[lane];
+        keys[lane] = &keys_[versions[lane] - 1];
+        wrapping = true;
+      }
+      message_pointers[lane] = hashes[lane].data();
+    }
+    if (!wrapping) {
+      break;
+    }
+    Sha256Digest wrapped[kSha256Lanes];
+    hmacSha256ShortLanes(keys, message_pointers, sizeof(Sha256Digest), wrapped);
+    for (size_t lane = 0; lane < kSha256Lanes; ++lane) {
+      if (advancing[lane]) {
+        hashes[lane] = wrapped[lane];
+      }
+    }
+  }
+
+  for (size_t lane = 0; lane < count; ++lane) {
+    results[lane] = found[lane] and constantTimeEqual(hashes[lane], records[lane].hash);
+  }
+}
+
+template <typename Work>
+void PinStore::parallelFor(size_t count, size_t threads, Work work) {
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  threads = std::max<size_t>(1, std::min(threads, count));
+  const size_t per_thread = (count + threads - 1) / threads;
+
+  std::vector<std::thread> workers;
+  for (size_t begin = per_thread; begin < count; begin += per_thread) {
+    workers.emplace_back(work, begin, std::min(count, begin + per_thread));
+  }
+  // The caller takes the first share
+  work(0, std::min(count, per_thread));
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+}
@@ -0,0 +1,149 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+#ifndef ATM_PIN_STORE_H
+#define ATM_PIN_STORE_H
+
+// C++ Standard Library
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <unordered_map>
+
+// ATM Controller
+#include "sha256.h"
+
+/// Key of the PIN hashes, kept apart from the records (in an HSM, in a real deployment)
+using PinKey = std::array<uint8_t, 32>;
+
+/// An account's PIN as stored, never the PIN itself
+struct PinRecord {
+  /// Random per enrolment, so the same PIN hashes differently for every account and every time it is set
+  std::array<uint8_t, 16> salt;
+  /// The key the salted PIN was hashed with
+  uint32_t first_key_version;
+  /// The latest key, every key after first_key_version wrapped the hash once more
+  uint32_t key_version;
+  /// HMAC-SHA256 of the salt, account number and PIN, then of that hash with each later key
+  Sha256Digest hash;
+};
+
+/// A PIN to check in a batch
+struct PinCheck {
+  uint64_t account_number;
+  uint16_t pin;
+};
+
+/**
+ * @brief PINs stored as salted, keyed hashes
+ * @details  A PIN is hashed with HMAC-SHA256 under the current key.  Rotating the key can't rehash from the PINs,
+ *           which aren't kept, so every hash is wrapped in another HMAC under the new key instead, and verifying
+ *           recomputes the chain.  A PIN is rehashed from scratch under the current key the next time it verifies.
+ *           Bulk work, rotation and batch verification, hashes kSha256Lanes records at a time with
+ *           sha256CompressLanes() across threads.  Records are sharded by account, each shard behind its own lock,
+ *           so a rotation only holds up verifications of the shard it is working on.  Thread-safe.
+ */
+class PinStore {
+ public:
+  static constexpr size_t kShards = 64;
+  /// Keys a store can have, rotations past it are refused
+  static constexpr uint32_t kMaxKeys = 64;
+
+  /// Constructor for the store, with the first key
+  explicit PinStore(const PinKey& key);
+
+  PinStore(const PinStore&) = delete;
+  PinStore& operator=(const PinStore&) = delete;
+
+  /// A key from the system's random source
+  static PinKey randomKey();
+
+  /// Hashes an account's PIN under the current key, replacing the one it had
+  void enroll(uint64_t accountNumber, uint16_t pin);
+
+  /**
+   * @brief Checks an account's PIN
+   * @details  Takes the same time whichever PIN is tried and however much of its hash matches.
+   *
+   * @return  Whether the PIN is the account's
+   * @throws  If the account has no PIN
+   */
+  bool verify(uint64_t accountNumber, uint16_t pin);
+
+  /// Whether or not the account has a PIN
+  bool contains(uint64_t accountNumber);
+
+  /**
+   * @brief Checks many PINs at once, as for verify() but without rehashing
+   *
+   * @param checks  The accounts and PINs to check
+   * @param count  The number of checks
+   * @param results  Set to whether each PIN is right, false for accounts without one
+   * @param threads  Threads to spread the checks over, 0 for one per core
+   */
+  void verifyBatch(const PinCheck* checks, size_t count, bool* results, size_t threads = 0);
+
+  /**
+   * @brief Makes a key current and wraps every stored hash with it
+   * @details  PINs verified or enrolled meanwhile carry on as normal, under whichever key their record is at.
+   *
+   * @param key  The new key
+   * @param threads  Threads to spread the records over, 0 for one per core
+   * @return  The version of the new key
+   * @throws  If the store already has kMaxKeys keys
+   */
+  uint32_t rotateKey(const PinKey& key, size_t threads = 0);
+
+  /// The version of the current key, 1 for the first
+  uint32_t keyVersion();
+
+  /// A copy of an account's record, throws if the account has no PIN
+  PinRecord record(uint64_t accountNumber);
+
+  /// The number of accounts with a PIN
+  size_t size();
+
+ private:
+  struct Shard {
+    std::shared_mutex mutex;
+    std::unordered_map<uint64_t, PinRecord> records;
+  };
+
+  Shard& shardFor(uint64_t accountNumber) {
+    return shards_[(accountNumber * 0x9e3779b97f4a7c15ULL >> 32) % kShards];
+  }
+
+  /// A new record for a PIN, under the current key
+  PinRecord hashPin(uint64_t accountNumber, uint16_t pin);
+
+  /// The record's hash recomputed from a PIN, to compare with the stored one
+  Sha256Digest chainHash(const PinRecord& record, uint64_t accountNumber, uint16_t pin);
+
+  /// Checks up to kSha256Lanes PINs side by side
+  void verifyLanes(const PinCheck* checks, size_t count, bool* results);
+
+  /// Runs work(begin, end) over [0, count) split across threads
+  template <typename Work>
+  static void parallelFor(size_t count, size_t threads, Work work);
+
+  /// Key version v is keys_[v - 1].  Written before key_count_ is bumped and never changed after
+  std::array<HmacSha256Key, kMaxKeys> keys_;
+  std::atomic<uint32_t> key_count_;
+
+  /// Guards rotations, one at a time
+  std::mutex rotate_mutex_;
+
+  /// Salts, which only need to be unique
+  std::mutex salt_mutex_;
+  std::mt19937_64 salt_random_;
+
+  std::array<Shard, kShards> shards_;
+};
+
+#endif  // ATM_PIN_STORE_H
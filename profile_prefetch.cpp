@@ -0,0 +1,144 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+// C++ Standard Library
+#include <algorithm>
+#include <utility>
+
+// ATM Controller
+#include "profile_prefetch.h"
+#include "trace.h"
+
+ProfileFetch::ProfileFetch() :
+  running_(false),
+  fetch_(nullptr),
+  backend_(nullptr),
+  account_number_(0),
+  trace_session_(0),
+  done_function_(nullptr),
+  done_context_(nullptr),
+  profile_{Balances{0, 0}} {
+}
+
+ProfileFetch::~ProfileFetch() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_.wait(lock, [this]() { return !running_; });
+}
+
+void ProfileFetch::start(FetchFunction fetch, void* backend, uint64_t accountNumber, uint64_t traceSession) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    // A card pulled before its fetch came back leaves the fetch running
+    done_.wait(lock, [this]() { return !running_; });
+    running_ = true;
+    fetch_ = fetch;
+    backend_ = backend;
+    account_number_ = accountNumber;
+    trace_session_ = traceSession;
+    error_ = nullptr;
+  }
+  profilePrefetcher().submit(*this);
+}
+
+AccountProfile ProfileFetch::wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_.wait(lock, [this]() { return !running_; });
+  if (error_) {
+    std::rethrow_exception(error_);
+  }
+  return profile_;
+}
+
+bool ProfileFetch::ready() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return !running_;
+}
+
+void ProfileFetch::waitFinished() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_.wait(lock, [this]() { return !running_; });
+}
+
+bool ProfileFetch::notifyWhenFinished(DoneFunction done, void* context) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!running_) {
+    return false;
+  }
+  done_function_ = done;
+  done_context_ = context;
+  return true;
+}
+
+void ProfileFetch::run() {
+  AccountProfile profile{Balances{0, 0}};
+  std::exception_ptr error;
+  try {
+    const TraceSession trace_session(trace_session_);
+    const TraceSpan span("profileFetch");
+    profile = fetch_(backend_, account_number_);
+  } catch (...) {
+    error = std::current_exception();
+  }
+
+  // Notified under the lock, the ATM may destroy the fetch as soon as it sees it finished.  The error is moved so
+  // nothing of it is left to release after the lock, when the ATM may already be done with it
+  std::lock_guard<std::mutex> lock(mutex_);
+  profile_ = profile;
+  error_ = std::move(error);
+  running_ = false;
+  if (done_function_ != nullptr) {
+    done_function_(done_context_);
+    done_function_ = nullptr;
+  }
+  done_.notify_all();
+}
+
+ProfilePrefetcher::ProfilePrefetcher(size_t workers, size_t queueCapacity) :
+  queue_(queueCapacity),
+  stopping_(false) {
+  for (size_t i = 0; i < std::max<size_t>(workers, 1); ++i) {
+    workers_.emplace_back(&ProfilePrefetcher::run, this);
+  }
+}
+
+ProfilePrefetcher::~ProfilePrefetcher() {
+  {
+    std::lock_guard<std::mutex> lock(wake_mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+void ProfilePrefetcher::submit(ProfileFetch& fetch) {
+  if (!queue_.tryPush(&fetch)) {
+    fetch.run();
+    return;
+  }
+  // Taking the lock orders the push before a worker's check for work, so the wakeup isn't lost
+  { std::lock_guard<std::mutex> lock(wake_mutex_); }
+  wake_.notify_one();
+}
+
+void ProfilePrefetcher::run() {
+  while (true) {
+    ProfileFetch* fetch = nullptr;
+    {
+      std::unique_lock<std::mutex> lock(wake_mutex_);
+      wake_.wait(lock, [this, &fetch]() { return queue_.tryPop(fetch) or stopping_; });
+    }
+    if (fetch == nullptr) {
+      return;
+    }
+    fetch->run();
+  }
+}
+
+ProfilePrefetcher& profilePrefetcher() {
+  static ProfilePrefetcher prefetcher;
+  return prefetcher;
+}
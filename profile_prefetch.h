@@ -0,0 +1,139 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+#ifndef ATM_PROFILE_PREFETCH_H
+#define ATM_PROFILE_PREFETCH_H
+
+// C++ Standard Library
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// ATM Controller
+#include "bounded_queue.h"
+#include "machine.h"
+
+/**
+ * @brief A fetch of an account's profile running in the background, for one ATM to start and wait on
+ * @details  Reused from one card to the next, so starting a fetch doesn't allocate.
+ */
+class ProfileFetch {
+ public:
+  /// Fetches the profile from a backend, passed as void* so the prefetch workers can run fetches of any backend
+  using FetchFunction = AccountProfile (*)(void* backend, uint64_t accountNumber);
+
+  /// Called once a fetch finishes, see notifyWhenFinished()
+  using DoneFunction = void (*)(void* context);
+
+  ProfileFetch();
+
+  /// Waits for a fetch still running, which refers to its backend
+  ~ProfileFetch();
+
+  ProfileFetch(const ProfileFetch&) = delete;
+  ProfileFetch& operator=(const ProfileFetch&) = delete;
+
+  /**
+   * @brief Starts fetching on the prefetch workers, after the previous fetch finished
+   *
+   * @param fetch  Does the fetching, on a worker
+   * @param backend  Handed to fetch, must outlive the fetch
+   * @param accountNumber  The account to fetch
+   * @param traceSession  Trace session the fetch is recorded under, see trace.h
+   */
+  void start(FetchFunction fetch, void* backend, uint64_t accountNumber, uint64_t traceSession);
+
+  /**
+   * @brief Waits for the fetch, which only blocks if it is still running
+   *
+   * @return  The fetched profile
+   * @throws  Whatever the fetch threw, e.g. for an unknown account
+   */
+  AccountProfile wait();
+
+  /// Whether the fetch has finished, e.g. to check whether wait() would block
+  bool ready();
+
+  /// Waits for the fetch to finish without taking its result, e.g. before taking a lock its result is read under
+  void waitFinished();
+
+  /**
+   * @brief Has a function called once the fetch finishes, for callers that can't wait on it
+   * @details  The function runs on the thread that ran the fetch, before the fetch can be waited for or destroyed.
+   *           It is called once, for the fetch running now.
+   *
+   * @param done  Called with context
+   * @param context  Handed to done
+   * @return  Whether the fetch was still running, if not done isn't called
+   */
+  bool notifyWhenFinished(DoneFunction done, void* context);
+
+ private:
+  friend class ProfilePrefetcher;
+
+  /// Runs the fetch, on a worker
+  void run();
+
+  std::mutex mutex_;
+  std::condition_variable done_;
+  bool running_;
+
+  FetchFunction fetch_;
+  void* backend_;
+  uint64_t account_number_;
+  uint64_t trace_session_;
+
+  DoneFunction done_function_;
+  void* done_context_;
+
+  AccountProfile profile_;
+  std::exception_ptr error_;
+};
+
+/**
+ * @brief Workers shared by every ATM in the process that run profile fetches
+ * @details  Fetches are handed over through a lock-free bounded queue.  If it is full the fetch runs on the
+ *           caller's thread instead, so starting a fetch never waits on other ATMs' fetches.
+ */
+class ProfilePrefetcher {
+ public:
+  /**
+   * @brief Constructor for the prefetcher, starts the workers
+   *
+   * @param workers  How many fetches can be waiting on the host at once
+   * @param queueCapacity  Fetches waiting for a worker, a power of two
+   */
+  explicit ProfilePrefetcher(size_t workers = 4, size_t queueCapacity = 1024);
+
+  /// Finishes queued fetches and stops the workers
+  ~ProfilePrefetcher();
+
+  ProfilePrefetcher(const ProfilePrefetcher&) = delete;
+  ProfilePrefetcher& operator=(const ProfilePrefetcher&) = delete;
+
+  /// Queues a fetch for a worker
+  void submit(ProfileFetch& fetch);
+
+ private:
+  /// Worker loop
+  void run();
+
+  BoundedQueue<ProfileFetch*> queue_;
+
+  /// Sleeping workers wait on wake_
+  std::mutex wake_mutex_;
+  std::condition_variable wake_;
+  bool stopping_;
+
+  std::vector<std::thread> workers_;
+};
+
+/// The process-wide prefetcher, started on first use
+ProfilePrefetcher& profilePrefetcher();
+
+#endif  // ATM_PROFILE_PREFETCH_H
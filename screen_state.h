@@ -0,0 +1,22 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+#ifndef ATM_SCREEN_STATE_H
+#define ATM_SCREEN_STATE_H
+
+// C++ Standard Library
+#include <array>
+
+enum ATMScreenState { IDLE = 0, ENTER_PIN = 1, SELECT_ACCOUNT = 2, ACCOUNT_MANAGEMENT = 3 };
+
+/// Indexed by ATMScreenState
+static constexpr std::array<const char*, 4> kATMScreenStateToString{
+  "IDLE",
+  "ENTER_PIN",
+  "SELECT_ACCOUNT",
+  "ACCOUNT_MANAGEMENT"
+};
+
+#endif  // ATM_SCREEN_STATE_H
@@ -0,0 +1,300 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+// C++ Standard Library
+#include <algorithm>
+#include <cstring>
+
+// ATM Controller
+#include "sha256.h"
+
+/// Round constants, the first 32 bits of the fractional parts of the cube roots of the first 64 primes
+static constexpr uint32_t kRoundConstants[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static inline uint32_t rotateRight(uint32_t value, int bits) {
+  return (value >> bits) | (value << (32 - bits));
+}
+
+Sha256::Sha256() :
+  state_(kSha256InitialState),
+  length_(0),
+  buffer_{},
+  buffered_(0) {
+}
+
+Sha256::Sha256(const Sha256State& state, uint64_t length) :
+  state_(state),
+  length_(length),
+  buffer_{},
+  buffered_(0) {
+}
+
+void Sha256::update(const void* data, size_t size) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  length_ += size;
+
+  if (buffered_ > 0) {
+    const size_t taken = std::min(size, buffer_.size() - buffered_);
+    std::memcpy(buffer_.data() + buffered_, bytes, taken);
+    buffered_ += taken;
+    bytes += taken;
+    size -= taken;
+    if (buffered_ < buffer_.size()) {
+      return;
+    }
+    sha256Compress(state_, buffer_.data());
+    buffered_ = 0;
+  }
+
+  // Whole blocks straight from the caller's memory
+  for (; size >= 64; bytes += 64, size -= 64) {
+    sha256Compress(state_, bytes);
+  }
+  std::memcpy(buffer_.data(), bytes, size);
+  buffered_ = size;
+}
+
+Sha256Digest Sha256::finish() {
+  // A 1 bit, zeros up to 8 bytes short of a block boundary, and the message length in bits
+  const uint64_t bits = length_ * 8;
+  const uint8_t one = 0x80;
+  const uint8_t zeros[64] = {};
+  update(&one, 1);
+  update(zeros, (buffered_ <= 56 ? 56 : 120) - buffered_);
+  uint8_t length[8];
+  for (int i = 0; i < 8; ++i) {
+    length[i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+  }
+  update(length, sizeof(length));
+
+  return sha256Digest(state_);
+}
+
+void sha256Compress(Sha256State& state, const uint8_t* block) {
+  uint32_t schedule[64];
+  for (int i = 0; i < 16; ++i) {
+    schedule[i] = (static_cast<uint32_t>(block[4 * i]) << 24) | (static_cast<uint32_t>(block[4 * i + 1]) << 16) |
+                  (static_cast<uint32_t>(block[4 * i + 2]) << 8) | static_cast<uint32_t>(block[4 * i + 3]);
+  }
+  for (int i = 16; i < 64; ++i) {
+    const uint32_t s0 = rotateRight(schedule[i - 15], 7) ^ rotateRight(schedule[i - 15], 18) ^ (schedule[i - 15] >> 3);
+    const uint32_t s1 = rotateRight(schedule[i - 2], 17) ^ rotateRight(schedule[i - 2], 19) ^ (schedule[i - 2] >> 10);
+    schedule[i] = schedule[i - 16] + s0 + schedule[i - 7] + s1;
+  }
+
+  uint32_t a = state[0];
+  uint32_t b = state[1];
+  uint32_t c = state[2];
+  uint32_t d = state[3];
+  uint32_t e = state[4];
+  uint32_t f = state[5];
+  uint32_t g = state[6];
+  uint32_t h = state[7];
+  for (int i = 0; i < 64; ++i) {
+    const uint32_t s1 = rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25);
+    const uint32_t choose = (e & f) ^ (~e & g);
+    const uint32_t t1 = h + s1 + choose + kRoundConstants[i] + schedule[i];
+    const uint32_t s0 = rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22);
+    const uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+    const uint32_t t2 = s0 + majority;
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+  state[5] += f;
+  state[6] += g;
+  state[7] += h;
+}
+
+Sha256Digest sha256(const void* data, size_t size) {
+  Sha256 hasher;
+  hasher.update(data, size);
+  return hasher.finish();
+}
+
+/// One round of kSha256Lanes lanes.  Rather than shifting the working variables along, the next round is called
+/// with them in rotated roles, d and h being the ones that change
+static inline void roundLanes(const uint32_t* a,
+                              const uint32_t* b,
+                              const uint32_t* c,
+                              uint32_t* d,
+                              const uint32_t* e,
+                              const uint32_t* f,
+                              const uint32_t* g,
+                              uint32_t* h,
+                              uint32_t constant,
+                              const uint32_t* schedule) {
+  for (size_t lane = 0; lane < kSha256Lanes; ++lane) {
+    const uint32_t s1 = rotateRight(e[lane], 6) ^ rotateRight(e[lane], 11) ^ rotateRight(e[lane], 25);
+    const uint32_t choose = (e[lane] & f[lane]) ^ (~e[lane] & g[lane]);
+    const uint32_t t1 = h[lane] + s1 + choose + constant + schedule[lane];
+    const uint32_t s0 = rotateRight(a[lane], 2) ^ rotateRight(a[lane], 13) ^ rotateRight(a[lane], 22);
+    const uint32_t majority = (a[lane] & b[lane]) ^ (a[lane] & c[lane]) ^ (b[lane] & c[lane]);
+    d[lane] += t1;
+    h[lane] = t1 + s0 + majority;
+  }
+}
+
+void sha256CompressLanes(Sha256State* states, const uint8_t* const* blocks) {
+  // Every variable holds one word per lane, and every step is a loop over the lanes
+  uint32_t schedule[64][kSha256Lanes];
+  for (int i = 0; i < 16; ++i) {
+    for (size_t lane = 0; lane < kSha256Lanes; ++lane) {
+      const uint8_t* word = blocks[lane] + 4 * i;
+      schedule[i][lane] = (static_cast<uint32_t>(word[0]) << 24) | (static_cast<uint32_t>(word[1]) << 16) |
+                          (static_cast<uint32_t>(word[2]) << 8) | static_cast<uint32_t>(word[3]);
+    }
+  }
+  for (int i = 16; i < 64; ++i) {
+    for (size_t lane = 0; lane < kSha256Lanes; ++lane) {
+      const uint32_t w15 = schedule[i - 15][lane];
+      const uint32_t w2 = schedule[i - 2][lane];
+      const uint32_t s0 = rotateRight(w15, 7) ^ rotateRight(w15, 18) ^ (w15 >> 3);
+      const uint32_t s1 = rotateRight(w2, 17) ^ rotateRight(w2, 19) ^ (w2 >> 10);
+      schedule[i][lane] = schedule[i - 16][lane] + s0 + schedule[i - 7][lane] + s1;
+    }
+  }
+
+  uint32_t a[kSha256Lanes], b[kSha256Lanes], c[kSha256Lanes], d[kSha256Lanes];
+  uint32_t e[kSha256Lanes], f[kSha256Lanes], g[kSha256Lanes], h[kSha256Lanes];
+  for (size_t lane = 0; lane < kSha256Lanes; ++lane) {
+    a[lane] = states[lane][0];
+    b[lane] = states[lane][1];
+    c[lane] = states[lane][2];
+    d[lane] = states[lane][3];
+    e[lane] = states[lane][4];
+    f[lane] = states[lane][5];
+    g[lane] = states[lane][6];
+    h[lane] = states[lane][7];
+  }
+  // Eight rounds bring the roles back to where they started
+  for (int i = 0; i < 64; i += 8) {
+    roundLanes(a, b, c, d, e, f, g, h, kRoundConstants[i], schedule[i]);
+    roundLanes(h, a, b, c, d, e, f, g, kRoundConstants[i + 1], schedule[i + 1]);
+    roundLanes(g, h, a, b, c, d, e, f, kRoundConstants[i + 2], schedule[i + 2]);
+    roundLanes(f, g, h, a, b, c, d, e, kRoundConstants[i + 3], schedule[i + 3]);
+    roundLanes(e, f, g, h, a, b, c, d, kRoundConstants[i + 4], schedule[i + 4]);
+    roundLanes(d, e, f, g, h, a, b, c, kRoundConstants[i + 5], schedule[i + 5]);
+    roundLanes(c, d, e, f, g, h, a, b, kRoundConstants[i + 6], schedule[i + 6]);
+    roundLanes(b, c, d, e, f, g, h, a, kRoundConstants[i + 7], schedule[i + 7]);
+  }
+
+  for (size_t lane = 0; lane < kSha256Lanes; ++lane) {
+    states[lane][0] += a[lane];
+    states[lane][1] += b[lane];
+    states[lane][2] += c[lane];
+    states[lane][3] += d[lane];
+    states[lane][4] += e[lane];
+    states[lane][5] += f[lane];
+    states[lane][6] += g[lane];
+    states[lane][7] += h[lane];
+  }
+}
+
+Sha256Digest sha256Digest(const Sha256State& state) {
+  Sha256Digest digest;
+  for (size_t i = 0; i < state.size(); ++i) {
+    digest[4 * i] = static_cast<uint8_t>(state[i] >> 24);
+    digest[4 * i + 1] = static_cast<uint8_t>(state[i] >> 16);
+    digest[4 * i + 2] = static_cast<uint8_t>(state[i] >> 8);
+    digest[4 * i + 3] = static_cast<uint8_t>(state[i]);
+  }
+  return digest;
+}
+
+/// A one block message after a 64-byte pad block: the message, a 1 bit, zeros and the length of both in bits
+static void padShortMessage(uint8_t* block, const void* message, size_t size) {
+  std::memcpy(block, message, size);
+  block[size] = 0x80;
+  std::memset(block + size + 1, 0, 64 - size - 1);
+  const uint64_t bits = (64 + size) * 8;
+  for (int i = 0; i < 8; ++i) {
+    block[56 + i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+  }
+}
+
+HmacSha256Key hmacSha256Key(const void* key, size_t size) {
+  uint8_t inner_pad[64];
+  uint8_t outer_pad[64];
+  std::memset(inner_pad, 0x36, sizeof(inner_pad));
+  std::memset(outer_pad, 0x5c, sizeof(outer_pad));
+  const uint8_t* bytes = static_cast<const uint8_t*>(key);
+  for (size_t i = 0; i < std::min<size_t>(size, 64); ++i) {
+    inner_pad[i] ^= bytes[i];
+    outer_pad[i] ^= bytes[i];
+  }
+
+  HmacSha256Key states{kSha256InitialState, kSha256InitialState};
+  sha256Compress(states.inner, inner_pad);
+  sha256Compress(states.outer, outer_pad);
+  return states;
+}
+
+Sha256Digest hmacSha256(const HmacSha256Key& key, const void* message, size_t size) {
+  // Both pad blocks are already compressed into the key
+  Sha256 inner(key.inner, 64);
+  inner.update(message, size);
+  const Sha256Digest inner_digest = inner.finish();
+  Sha256 outer(key.outer, 64);
+  outer.update(inner_digest.data(), inner_digest.size());
+  return outer.finish();
+}
+
+Sha256Digest hmacSha256Short(const HmacSha256Key& key, const void* message, size_t size) {
+  uint8_t block[64];
+  padShortMessage(block, message, size);
+  Sha256State state = key.inner;
+  sha256Compress(state, block);
+  const Sha256Digest inner = sha256Digest(state);
+
+  padShortMessage(block, inner.data(), inner.size());
+  state = key.outer;
+  sha256Compress(state, block);
+  return sha256Digest(state);
+}
+
+void hmacSha256ShortLanes(const HmacSha256Key* const* keys,
+                          const uint8_t* const* messages,
+                          size_t size,
+                          Sha256Digest* digests) {
+  uint8_t blocks[kSha256Lanes][64];
+  const uint8_t* block_pointers[kSha256Lanes];
+  Sha256State states[kSha256Lanes];
+  for (size_t lane = 0; lane < kSha256Lanes; ++lane) {
+    padShortMessage(blocks[lane], messages[lane], size);
+    block_pointers[lane] = blocks[lane];
+    states[lane] = keys[lane]->inner;
+  }
+  sha256CompressLanes(states, block_pointers);
+
+  for (size_t lane = 0; lane < kSha256Lanes; ++lane) {
+    const Sha256Digest inner = sha256Digest(states[lane]);
+    padShortMessage(blocks[lane], inner.data(), inner.size());
+    states[lane] = keys[lane]->outer;
+  }
+  sha256CompressLanes(states, block_pointers);
+  for (size_t lane = 0; lane < kSha256Lanes; ++lane) {
+    digests[lane] = sha256Digest(states[lane]);
+  }
+}
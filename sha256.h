@@ -0,0 +1,104 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+#ifndef ATM_SHA256_H
+#define ATM_SHA256_H
+
+// C++ Standard Library
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+/// A SHA-256 digest
+using Sha256Digest = std::array<uint8_t, 32>;
+
+/// The chaining state of SHA-256 between blocks
+using Sha256State = std::array<uint32_t, 8>;
+
+/// The state every message starts from
+constexpr Sha256State kSha256InitialState = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+/// Messages sha256CompressLanes() works on side by side
+constexpr size_t kSha256Lanes = 8;
+
+/**
+ * @brief Incremental SHA-256 (FIPS 180-4)
+ * @details  Feed the data with update() in as many pieces as convenient, then take the digest with finish().
+ */
+class Sha256 {
+ public:
+  Sha256();
+
+  /// Carries on from the state after the first length bytes of a message, a whole number of blocks
+  Sha256(const Sha256State& state, uint64_t length);
+
+  /// Hashes the next size bytes of the message
+  void update(const void* data, size_t size);
+
+  /// Pads the message and returns its digest, the hasher can't be updated afterwards
+  Sha256Digest finish();
+
+ private:
+  Sha256State state_;
+  /// Bytes of the message so far
+  uint64_t length_;
+  /// The start of a block not complete yet
+  std::array<uint8_t, 64> buffer_;
+  size_t buffered_;
+};
+
+/// The SHA-256 digest of size bytes of data
+Sha256Digest sha256(const void* data, size_t size);
+
+/// Runs the compression function over one 64-byte block
+void sha256Compress(Sha256State& state, const uint8_t* block);
+
+/**
+ * @brief Runs the compression function over one block of each of kSha256Lanes independent messages
+ * @details  Multi-buffer hashing: every step of the rounds is done for all the lanes before the next, from arrays
+ *           indexed by lane, which the compiler turns into vector instructions.  Several times the throughput of
+ *           sha256Compress() when there are many short messages to hash.
+ *
+ * @param states  The state of each lane, updated in place
+ * @param blocks  The next block of each lane
+ */
+void sha256CompressLanes(Sha256State* states, const uint8_t* const* blocks);
+
+/// The digest of a finished message's state
+Sha256Digest sha256Digest(const Sha256State& state);
+
+/// An HMAC-SHA256 key, as the states after its inner and outer pad blocks
+struct HmacSha256Key {
+  Sha256State inner;
+  Sha256State outer;
+};
+
+/// Works out the pad block states of a key of at most 64 bytes, once for every message under it
+HmacSha256Key hmacSha256Key(const void* key, size_t size);
+
+/// The longest message that fits in one block with its padding
+constexpr size_t kHmacShortMessage = 55;
+
+/// HMAC-SHA256 of a message of any size
+Sha256Digest hmacSha256(const HmacSha256Key& key, const void* message, size_t size);
+
+/// HMAC-SHA256 of a message of at most kHmacShortMessage bytes, in two compressions
+Sha256Digest hmacSha256Short(const HmacSha256Key& key, const void* message, size_t size);
+
+/**
+ * @brief hmacSha256Short() of kSha256Lanes messages at once, with sha256CompressLanes()
+ *
+ * @param keys  The key of each lane
+ * @param messages  The message of each lane
+ * @param size  The size of every message, at most kHmacShortMessage
+ * @param digests  Set to each lane's HMAC
+ */
+void hmacSha256ShortLanes(const HmacSha256Key* const* keys,
+                          const uint8_t* const* messages,
+                          size_t size,
+                          Sha256Digest* digests);
+
+#endif  // ATM_SHA256_H
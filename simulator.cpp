@@ -4,15 +4,82 @@
  */
 
 // C++ Standard Library
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
+#include <string>
 #include <thread>
 
+// POSIX
+#include <fcntl.h>
+#include <unistd.h>
+
 // ATM Controller
 #include "atm.h"
+#include "branch_simulation.h"
 
 static constexpr int kFrequency = 5;
 
-int main() {
+static double seconds(SimTime time) {
+  return std::chrono::duration<double>(time).count();
+}
+
+/// simulator des [days] [atms] [arrivals per hour per atm] [seed]: days of branch traffic on a virtual clock
+static int runDiscreteEvent(int argc, char** argv) {
+  BranchSimulationConfig config;
+  const double days = argc > 2 ? std::atof(argv[2]) : 1.0;
+  config.duration = std::chrono::duration_cast<SimTime>(std::chrono::duration<double, std::ratio<86400>>(days));
+  config.atms = argc > 3 ? std::max(1, std::atoi(argv[3])) : config.atms;
+  config.arrivals_per_hour = argc > 4 ? std::atof(argv[4]) : config.arrivals_per_hour;
+  config.seed = argc > 5 ? std::strtoull(argv[5], nullptr, 10) : config.seed;
+
+  // The controller narrates every transition on stdout, which would drown out the report
+  std::fflush(stdout);
+  const int saved_stdout = ::dup(STDOUT_FILENO);
+  const int null_fd = ::open("/dev/null", O_WRONLY);
+  ::dup2(null_fd, STDOUT_FILENO);
+
+  const auto start = std::chrono::steady_clock::now();
+  BranchSimulation simulation(config);
+  const BranchSimulationStats stats = simulation.run();
+  const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  std::cout.flush();
+  std::fflush(stdout);
+  ::dup2(saved_stdout, STDOUT_FILENO);
+  ::close(null_fd);
+  ::close(saved_stdout);
+
+  const double simulated = seconds(stats.simulated);
+  const double served = static_cast<double>(stats.sessions + stats.declined);
+  std::printf("%.2f simulated days of %u ATMs at %.1f arrivals/hour each, seed %llu\n",
+              simulated / 86400, config.atms, config.arrivals_per_hour, static_cast<unsigned long long>(config.seed));
+  std::printf("%llu events in %.2fs, %.0fx real time\n",
+              static_cast<unsigned long long>(stats.events), elapsed.count(), simulated / elapsed.count());
+  std::printf("%10s %10s %10s %12s %12s %12s %10s %10s %12s %10s %14s\n", "arrivals", "sessions", "declined",
+              "sessions/h", "mean wait s", "max wait s", "max line", "mean line", "utilization", "pin waits",
+              "mean pin wait s");
+  std::printf("%10llu %10llu %10llu %12.1f %12.2f %12.2f %10llu %10.3f %11.1f%% %10llu %14.3f\n",
+              static_cast<unsigned long long>(stats.arrivals),
+              static_cast<unsigned long long>(stats.sessions),
+              static_cast<unsigned long long>(stats.declined),
+              simulated > 0 ? served / simulated * 3600 : 0.0,
+              served > 0 ? seconds(stats.total_wait) / served : 0.0,
+              seconds(stats.max_wait),
+              static_cast<unsigned long long>(stats.max_queue),
+              simulated > 0 ? seconds(stats.total_wait) / simulated : 0.0,
+              simulated > 0 ? 100 * seconds(stats.total_session) / (simulated * config.atms) : 0.0,
+              static_cast<unsigned long long>(stats.pin_waits),
+              stats.pin_waits > 0 ? seconds(stats.total_pin_wait) / stats.pin_waits : 0.0);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1 and std::string(argv[1]) == "des") {
+    return runDiscreteEvent(argc, argv);
+  }
+
   ATM atm{};
   bool ok = true;
 
@@ -61,6 +128,7 @@ int main() {
   ManagementAction balance_action{ManagementAction::ManagementActionType::BALANCE};
   ManagementAction deposit_action{ManagementAction::ManagementActionType::DEPOSIT, 100};
   ManagementAction withdraw_action{ManagementAction::ManagementActionType::WITHDRAW, 150};
+  ManagementAction mini_statement_action{ManagementAction::ManagementActionType::MINI_STATEMENT};
   ManagementAction done_action{ManagementAction::ManagementActionType::DONE};
 
   std::cout << "Check balance" << std::endl;
@@ -84,6 +152,11 @@ int main() {
   std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<int>(1000)));
   std::cout << std::endl;
 
+  std::cout << "Show the last transactions" << std::endl;
+  atm.accountManagementCB(mini_statement_action);
+  std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<int>(1000)));
+  std::cout << std::endl;
+
   std::cout << "Signal done with the ATM" << std::endl;
   atm.accountManagementCB(done_action);
   std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<int>(1000)));
@@ -93,5 +166,8 @@ int main() {
 
   ok = false;
   t.join();
+
+  std::cout << "Metrics" << std::endl;
+  std::cout << MetricsRegistry::instance().renderPrometheus() << std::endl;
   return 0;
 }
@@ -0,0 +1,201 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+// C++ Standard Library
+#include <stdexcept>
+
+// ATM Controller
+#include "stand_in.h"
+
+HostCallPool::HostCallPool(size_t threads, size_t maxQueued) : max_queued_(maxQueued), stopping_(false) {
+  for (size_t i = 0; i < threads; ++i) {
+    threads_.emplace_back(&HostCallPool::run, this);
+  }
+}
+
+HostCallPool::~HostCallPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  ready_.notify_all();
+  for (std::thread& thread : threads_) {
+    thread.join();
+  }
+}
+
+bool HostCallPool::submit(std::function<void()> call) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (calls_.size() >= max_queued_) {
+      return false;
+    }
+    calls_.push_back(std::move(call));
+  }
+  ready_.notify_one();
+  return true;
+}
+
+void HostCallPool::run() {
+  for (;;) {
+    std::function<void()> call;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      ready_.wait(lock, [this] { return stopping_ or !calls_.empty(); });
+      if (calls_.empty()) {
+        return;
+      }
+      call = std::move(calls_.front());
+      calls_.pop_front();
+    }
+    call();
+  }
+}
+
+StandInLedger::StandInLedger(uint32_t offlineLimit) : offline_limit_(offlineLimit), pins_(PinStore::randomKey()) {
+}
+
+void StandInLedger::cacheProfile(uint64_t accountNumber, const AccountProfile& profile) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Entry& entry = entries_[accountNumber];
+  entry.profile = profile;
+  entry.has_balances = true;
+}
+
+void StandInLedger::cacheBalances(uint64_t accountNumber, const Balances& balances) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Entry& entry = entries_[accountNumber];
+  entry.profile.balances = balances;
+  entry.has_balances = true;
+}
+
+void StandInLedger::cachePin(uint64_t accountNumber, uint16_t pin) {
+  // Only hashed again when the pin changed at the host
+  if (!pins_.contains(accountNumber) or !pins_.verify(accountNumber, pin)) {
+    pins_.enroll(accountNumber, pin);
+  }
+}
+
+bool StandInLedger::verifyCachedPin(uint64_t accountNumber, uint16_t pin) {
+  if (!pins_.contains(accountNumber)) {
+    unavailable();
+  }
+  return pins_.verify(accountNumber, pin);
+}
+
+void StandInLedger::hostApplied(uint64_t accountNumber, AccountType accountType, int amount) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto entry = entries_.find(accountNumber);
+  if (entry != entries_.end() and entry->second.has_balances) {
+    entry->second.profile.balances.get(accountType) += amount;
+  }
+}
+
+Balances StandInLedger::withQueued(uint64_t accountNumber, Balances balances) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto entry = entries_.find(accountNumber);
+  if (entry != entries_.end()) {
+    balances.checking += entry->second.queued_debits[AccountType::CHECKING];
+    balances.savings += entry->second.queued_debits[AccountType::SAVINGS];
+  }
+  return balances;
+}
+
+Balances StandInLedger::cachedBalances(uint64_t accountNumber) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto entry = entries_.find(accountNumber);
+  if (entry == entries_.end() or !entry->second.has_balances) {
+    unavailable();
+  }
+  Balances balances = entry->second.profile.balances;
+  balances.checking += entry->second.queued_debits[AccountType::CHECKING];
+  balances.savings += entry->second.queued_debits[AccountType::SAVINGS];
+  return balances;
+}
+
+AccountProfile StandInLedger::cachedProfile(uint64_t accountNumber) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto entry = entries_.find(accountNumber);
+  if (entry == entries_.end() or !entry->second.has_balances) {
+    unavailable();
+  }
+  AccountProfile profile = entry->second.profile;
+  profile.balances.checking += entry->second.queued_debits[AccountType::CHECKING];
+  profile.balances.savings += entry->second.queued_debits[AccountType::SAVINGS];
+  return profile;
+}
+
+bool StandInLedger::authorize(uint64_t accountNumber,
+                              AccountType accountType,
+                              int amount,
+                              TransactionId transactionId) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (amount < 0) {
+    const auto entry = entries_.find(accountNumber);
+    const uint32_t debit = static_cast<uint32_t>(-amount);
+    if (entry == entries_.end() or !entry->second.has_balances or
+        entry->second.offline_withdrawn + debit > offline_limit_ or
+        entry->second.profile.balances.get(accountType) + entry->second.queued_debits[accountType] < -amount) {
+      return false;
+    }
+    entry->second.queued_debits[accountType] += amount;
+    entry->second.offline_withdrawn += debit;
+  }
+
+  queue_.push_back(StandInChange{STAND_IN_UPDATE, accountNumber, accountType, amount, transactionId});
+  atmMetrics().stand_in_approvals.increment();
+  atmMetrics().stand_in_queued.set(static_cast<int64_t>(queue_.size()));
+  return true;
+}
+
+void StandInLedger::queueReversal(uint64_t accountNumber,
+                                  AccountType accountType,
+                                  int amount,
+                                  TransactionId transactionId) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  queue_.push_back(StandInChange{STAND_IN_REVERSAL, accountNumber, accountType, -amount, transactionId});
+  atmMetrics().stand_in_queued.set(static_cast<int64_t>(queue_.size()));
+}
+
+bool StandInLedger::next(StandInChange& change) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (queue_.empty()) {
+    return false;
+  }
+  change = queue_.front();
+  return true;
+}
+
+void StandInLedger::forwarded() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (queue_.empty()) {
+    return;
+  }
+  const StandInChange change = queue_.front();
+  queue_.pop_front();
+  atmMetrics().stand_in_queued.set(static_cast<int64_t>(queue_.size()));
+
+  const auto entry = entries_.find(change.account_number);
+  if (change.type != STAND_IN_UPDATE or entry == entries_.end()) {
+    // A reversal undoes a debit the cache never counted
+    return;
+  }
+  // The host has it now, so it moves from the queue into what the host last said
+  if (change.amount < 0) {
+    entry->second.queued_debits[change.account_type] -= change.amount;
+    entry->second.offline_withdrawn -= static_cast<uint32_t>(-change.amount);
+  }
+  entry->second.profile.balances.get(change.account_type) += change.amount;
+}
+
+size_t StandInLedger::queued() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return queue_.size();
+}
+
+void StandInLedger::unavailable() {
+  atmMetrics().error_e12349.increment();
+  throw std::runtime_error("E12349: Bank unavailable, try again later");
+}
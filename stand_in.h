@@ -0,0 +1,606 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+#ifndef ATM_STAND_IN_H
+#define ATM_STAND_IN_H
+
+// C++ Standard Library
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// ATM Controller
+#include "backend.h"
+#include "circuit_breaker.h"
+#include "metrics.h"
+#include "pin_store.h"
+
+/// How stand-in behaves
+struct StandInConfig {
+  /// When host calls trip the breaker, and how long it stays open
+  CircuitBreakerConfig breaker;
+  /// Longest a session waits on the host before the call counts as failed and stand-in answers it
+  std::chrono::milliseconds call_timeout{250};
+  /// Most an account can withdraw in stand-in before what it withdrew has been forwarded to the host
+  uint32_t offline_limit{200};
+  /// Threads making host calls, a hung call holds one until it returns
+  size_t host_threads{4};
+  /// Calls waiting for a host thread before more are failed straight away
+  size_t max_queued_calls{256};
+  /// How often queued changes are forwarded to the host
+  std::chrono::milliseconds forward_interval{100};
+};
+
+/// What a queued change is
+enum StandInChangeType {
+  /// An update approved in stand-in, under the transaction id of the update it stood in for
+  STAND_IN_UPDATE = 0,
+  /// Hands back a debit that stand-in refused but that reached the host late, after timing out
+  STAND_IN_REVERSAL = 1
+};
+
+/// A change to an account's balance made in stand-in, waiting to be forwarded to the host
+struct StandInChange {
+  StandInChangeType type;
+  uint64_t account_number;
+  AccountType account_type;
+  int amount;
+  TransactionId transaction_id;
+};
+
+/// How a host call went
+enum HostCallOutcome {
+  /// The host answered in time, with a result or its own error
+  HOST_ANSWERED = 0,
+  /// Not sent, the circuit is open
+  HOST_SKIPPED = 1,
+  /// Sent, but it didn't answer in time or there was no thread to send it on.  It may still land
+  HOST_TIMED_OUT = 2
+};
+
+/**
+ * @brief A host call running on a HostCallPool thread, shared by the thread and the session waiting on it
+ * @details  The session may stop waiting before the call finishes.  It can then leave a handler for the late
+ *           answer, which runs on the host thread when the call finishes, or right away if it just did.
+ *
+ * @tparam Result  What the call returns
+ */
+template <typename Result>
+class HostCall {
+ public:
+  /// Waits for the call, true if it finished in time
+  bool waitFor(std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return done_cv_.wait_for(lock, timeout, [this] { return done_; });
+  }
+
+  /// The answer, once waitFor() returned true.  Throws what the call threw
+  Result get() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+    return *result_;
+  }
+
+  /// Stops waiting, handing the answer to late once there is one, unless the call threw
+  void abandon(std::function<void(const Result&)> late) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!done_) {
+      late_ = std::move(late);
+      return;
+    }
+    lock.unlock();
+    if (!error_) {
+      late(*result_);
+    }
+  }
+
+  /// Runs the call, on a host thread
+  template <typename Call>
+  void run(Call& call) {
+    std::optional<Result> result;
+    std::exception_ptr error;
+    try {
+      result.emplace(call());
+    } catch (...) {
+      error = std::current_exception();
+    }
+
+    std::function<void(const Result&)> late;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      result_ = std::move(result);
+      error_ = error;
+      done_ = true;
+      late.swap(late_);
+      // Notified under the lock, the waiting session may destroy its reference as soon as it wakes
+      done_cv_.notify_all();
+    }
+    if (late and !error) {
+      late(*result_);
+    }
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable done_cv_;
+  bool done_{false};
+  std::optional<Result> result_;
+  std::exception_ptr error_;
+  std::function<void(const Result&)> late_;
+};
+
+/**
+ * @brief Threads that make host calls, so a session can stop waiting on one that hangs
+ */
+class HostCallPool {
+ public:
+  HostCallPool(size_t threads, size_t maxQueued);
+
+  /// Waits for the calls still running
+  ~HostCallPool();
+
+  HostCallPool(const HostCallPool&) = delete;
+  HostCallPool& operator=(const HostCallPool&) = delete;
+
+  /// Queues a call for a host thread, false if too many are already waiting
+  bool submit(std::function<void()> call);
+
+ private:
+  void run();
+
+  const size_t max_queued_;
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  std::deque<std::function<void()>> calls_;
+  bool stopping_;
+  std::vector<std::thread> threads_;
+};
+
+/**
+ * @brief What stand-in knows of each account: the last profile the host answered with, and the changes not
+ *        forwarded to it yet
+ * @details  Balances handed out are the host's plus the debits queued here.  Queued credits aren't counted until
+ *           the host has them, so whatever the order of forwarding and host reads, balances err low.  Thread-safe.
+ */
+class StandInLedger {
+ public:
+  explicit StandInLedger(uint32_t offlineLimit);
+
+  /// Remembers what the host answered for an account
+  void cacheProfile(uint64_t accountNumber, const AccountProfile& profile);
+  void cacheBalances(uint64_t accountNumber, const Balances& balances);
+
+  /// Remembers a pin the host accepted, hashed under stand-in's own key
+  void cachePin(uint64_t accountNumber, uint16_t pin);
+
+  /// Checks a pin against the one the host last accepted, throws E12349 if it never accepted one for the account
+  bool verifyCachedPin(uint64_t accountNumber, uint16_t pin);
+
+  /// Keeps the cached balance in step with an update the host applied
+  void hostApplied(uint64_t accountNumber, AccountType accountType, int amount);
+
+  /// Balances from the host with the account's queued debits taken off
+  Balances withQueued(uint64_t accountNumber, Balances balances);
+
+  /// The last balances heard with queued debits taken off, throws E12349 if the host never answered for the account
+  Balances cachedBalances(uint64_t accountNumber);
+
+  /// The same for the whole profile
+  AccountProfile cachedProfile(uint64_t accountNumber);
+
+  /**
+   * @brief Approves and queues a change while the host can't be reached
+   * @details  Credits are always taken.  A debit is taken if the account has a cached balance that covers it and it
+   *           keeps the account within the offline limit.
+   *
+   * @return  Whether the change was approved
+   */
+  bool authorize(uint64_t accountNumber, AccountType accountType, int amount, TransactionId transactionId);
+
+  /// Queues the reversal of a refused debit that the host applied anyway, amount being the debit
+  void queueReversal(uint64_t accountNumber, AccountType accountType, int amount, TransactionId transactionId);
+
+  /// The oldest queued change, false if there are none
+  bool next(StandInChange& change);
+
+  /// Drops the oldest queued change, now the host has it
+  void forwarded();
+
+  /// Changes waiting to be forwarded
+  size_t queued();
+
+  /// Throws E12349, for a request stand-in can't answer
+  [[noreturn]] static void unavailable();
+
+ private:
+  struct Entry {
+    /// Whether the host has answered with the account's balances
+    bool has_balances{false};
+    AccountProfile profile{Balances{0, 0}};
+    /// Debits queued, per AccountType, zero or negative
+    int queued_debits[2]{0, 0};
+    /// Withdrawn in stand-in and not forwarded yet
+    uint32_t offline_withdrawn{0};
+  };
+
+  const uint32_t offline_limit_;
+
+  std::mutex mutex_;
+  std::unordered_map<uint64_t, Entry> entries_;
+  std::deque<StandInChange> queue_;
+
+  /// Pins the host accepted, thread-safe on its own
+  PinStore pins_;
+};
+
+/**
+ * @brief A backend that keeps sessions going when the host behind it is slow or down
+ * @details  Host calls go through a circuit breaker and are made on HostCallPool threads, so a session waits at
+ *           most call_timeout for an answer, and not at all once enough calls have failed to open the circuit.  A
+ *           call that isn't answered is answered by stand-in instead: profiles and balances from the StandInLedger
+ *           cache, pins checked against the ones the host last accepted, and balance updates approved within the
+ *           offline limit and queued.  A background thread forwards queued changes as soon as the host answers
+ *           again, under their original transaction ids, so one that reached the host after timing out isn't
+ *           applied twice.  Cash and transaction ids are local to the ATM and always go straight to the host
+ *           backend, as do its optional trackers.
+ *
+ * @tparam Host  The backend to stand in for, see IsMachineBackend
+ */
+template <typename Host>
+class StandInBackend {
+ public:
+  explicit StandInBackend(std::shared_ptr<Host> host, const StandInConfig& config = StandInConfig());
+
+  /// Stops forwarding, changes still queued are lost
+  ~StandInBackend();
+
+  StandInBackend(const StandInBackend&) = delete;
+  StandInBackend& operator=(const StandInBackend&) = delete;
+
+  bool verifyPin(uint64_t accountNumber, uint16_t pin);
+
+  Balances getAccountBalances(uint64_t accountNumber);
+
+  AccountProfile getAccountProfile(uint64_t accountNumber);
+
+  bool updateAccountBalance(uint64_t accountNumber, AccountType accountType, int amount, TransactionId transactionId);
+
+  LedgerUpdateResult updateAccountBalanceIfVersion(uint64_t accountNumber,
+                                                   AccountType accountType,
+                                                   int amount,
+                                                   uint64_t expectedVersion,
+                                                   TransactionId transactionId);
+
+  uint getAvailableCash() {
+    return host_->getAvailableCash();
+  }
+
+  void disburseCash(uint amount) {
+    host_->disburseCash(amount);
+  }
+
+  /// The cash is in this machine, so dispensing doesn't wait on the circuit
+  void dispenseCash(const DispenseRequest& request, DispenseCallback done) {
+    backendDispenseCash(*host_, request, std::move(done));
+  }
+
+  TransactionId newTransactionId() {
+    return host_->newTransactionId();
+  }
+
+  template <typename H = Host>
+  auto velocityTracker() -> decltype(std::declval<H&>().velocityTracker()) {
+    return host_->velocityTracker();
+  }
+
+  template <typename H = Host>
+  auto pinAttemptTracker() -> decltype(std::declval<H&>().pinAttemptTracker()) {
+    return host_->pinAttemptTracker();
+  }
+
+  template <typename H = Host>
+  auto miniStatements() -> decltype(std::declval<H&>().miniStatements()) {
+    return host_->miniStatements();
+  }
+
+  template <typename H = Host>
+  auto depositPipeline() -> decltype(std::declval<H&>().depositPipeline()) {
+    return host_->depositPipeline();
+  }
+
+  AuditLog* auditLog() {
+    return backendAuditLog(*host_);
+  }
+
+  CircuitState circuitState() {
+    return breaker_.state();
+  }
+
+  /// Times the circuit to the host has opened
+  uint64_t circuitTrips() {
+    return breaker_.trips();
+  }
+
+  /// Changes made in stand-in and not forwarded yet
+  size_t queuedChanges() {
+    return ledger_.queued();
+  }
+
+  /// Forwards queued changes until there are none left or the host stops answering
+  void forwardQueued();
+
+ private:
+  /**
+   * @brief Makes a host call through the breaker, on a host thread, waiting at most call_timeout
+   *
+   * @param call  The call, run on a host thread
+   * @param result  Set to what the call returned, if it answered
+   * @param timedOut  Set to the call if it timed out, to leave a handler for its late answer
+   * @return  How the call went
+   * @throws  The host's own error, if it answered with one
+   */
+  template <typename Result, typename Call>
+  HostCallOutcome callHost(Call call,
+                           std::optional<Result>& result,
+                           std::shared_ptr<HostCall<Result>>* timedOut = nullptr);
+
+  /**
+   * @brief Answers a balance update the host didn't, approving it in stand-in or refusing it with E12349
+   *
+   * @param timedOut  The host call if it timed out, in which case the host may still apply the update
+   * @param applied  Whether the host's late answer to the call says it applied the update
+   */
+  template <typename Result, typename Applied>
+  void standInUpdate(uint64_t accountNumber,
+                     AccountType accountType,
+                     int amount,
+                     TransactionId transactionId,
+                     const std::shared_ptr<HostCall<Result>>& timedOut,
+                     Applied applied);
+
+  /// Forwards queued changes every forward_interval
+  void forwardLoop();
+
+  std::shared_ptr<Host> host_;
+  const StandInConfig config_;
+  CircuitBreaker breaker_;
+  StandInLedger ledger_;
+
+  /// Held while forwarding, so a change isn't sent by two threads
+  std::mutex forward_mutex_;
+
+  /// Wakes the forwarder to stop
+  std::mutex stop_mutex_;
+  std::condition_variable stop_cv_;
+  bool stopping_;
+
+  /// Destroyed before the ledger, late answers running on its threads may queue reversals
+  HostCallPool pool_;
+  std::thread forwarder_;
+};
+
+template <typename Host>
+StandInBackend<Host>::StandInBackend(std::shared_ptr<Host> host, const StandInConfig& config) :
+  host_(std::move(host)),
+  config_(config),
+  breaker_(config.breaker),
+  ledger_(config.offline_limit),
+  stopping_(false),
+  pool_(config.host_threads, config.max_queued_calls),
+  forwarder_(&StandInBackend::forwardLoop, this) {
+  static_assert(IsMachineBackend<Host>::value, "Host does not provide the machine backend interface");
+}
+
+template <typename Host>
+StandInBackend<Host>::~StandInBackend() {
+  {
+    std::lock_guard<std::mutex> lock(stop_mutex_);
+    stopping_ = true;
+  }
+  stop_cv_.notify_one();
+  forwarder_.join();
+}
+
+template <typename Host>
+Balances StandInBackend<Host>::getAccountBalances(uint64_t accountNumber) {
+  std::optional<Balances> balances;
+  const std::shared_ptr<Host> host = host_;
+  if (callHost([host, accountNumber]() { return host->getAccountBalances(accountNumber); }, balances) ==
+      HOST_ANSWERED) {
+    ledger_.cacheBalances(accountNumber, *balances);
+    return ledger_.withQueued(accountNumber, *balances);
+  }
+  return ledger_.cachedBalances(accountNumber);
+}
+
+template <typename Host>
+AccountProfile StandInBackend<Host>::getAccountProfile(uint64_t accountNumber) {
+  std::optional<AccountProfile> profile;
+  const std::shared_ptr<Host> host = host_;
+  if (callHost([host, accountNumber]() { return backendGetAccountProfile(*host, accountNumber); }, profile) ==
+      HOST_ANSWERED) {
+    ledger_.cacheProfile(accountNumber, *profile);
+    profile->balances = ledger_.withQueued(accountNumber, profile->balances);
+    return *profile;
+  }
+  return ledger_.cachedProfile(accountNumber);
+}
+
+template <typename Host>
+bool StandInBackend<Host>::verifyPin(uint64_t accountNumber, uint16_t pin) {
+  std::optional<bool> verified;
+  const std::shared_ptr<Host> host = host_;
+  if (callHost([host, accountNumber, pin]() { return host->verifyPin(accountNumber, pin); }, verified) ==
+      HOST_ANSWERED) {
+    if (*verified) {
+      ledger_.cachePin(accountNumber, pin);
+    }
+    return *verified;
+  }
+  return ledger_.verifyCachedPin(accountNumber, pin);
+}
+
+template <typename Host>
+bool StandInBackend<Host>::updateAccountBalance(uint64_t accountNumber,
+                                                AccountType accountType,
+                                                int amount,
+                                                TransactionId transactionId) {
+  std::optional<bool> applied;
+  std::shared_ptr<HostCall<bool>> timed_out;
+  const std::shared_ptr<Host> host = host_;
+  const HostCallOutcome outcome = callHost(
+      [=]() { return host->updateAccountBalance(accountNumber, accountType, amount, transactionId); },
+      applied,
+      &timed_out);
+  if (outcome == HOST_ANSWERED) {
+    if (*applied) {
+      ledger_.hostApplied(accountNumber, accountType, amount);
+    }
+    return *applied;
+  }
+  standInUpdate(accountNumber, accountType, amount, transactionId, timed_out, [](bool result) { return result; });
+  return true;
+}
+
+template <typename Host>
+LedgerUpdateResult StandInBackend<Host>::updateAccountBalanceIfVersion(uint64_t accountNumber,
+                                                                       AccountType accountType,
+                                                                       int amount,
+                                                                       uint64_t expectedVersion,
+                                                                       TransactionId transactionId) {
+  std::optional<LedgerUpdateResult> result;
+  std::shared_ptr<HostCall<LedgerUpdateResult>> timed_out;
+  const std::shared_ptr<Host> host = host_;
+  const HostCallOutcome outcome = callHost(
+      [=]() {
+        return backendUpdateAccountBalanceIfVersion(
+            *host, accountNumber, accountType, amount, expectedVersion, transactionId);
+      },
+      result,
+      &timed_out);
+  if (outcome == HOST_ANSWERED) {
+    if (*result == UPDATE_APPLIED) {
+      ledger_.hostApplied(accountNumber, accountType, amount);
+    }
+    return *result;
+  }
+  // Stand-in can't tell whether the session's balances are current, only whether the change fits what it knows
+  standInUpdate(accountNumber, accountType, amount, transactionId, timed_out, [](LedgerUpdateResult late) {
+    return late == UPDATE_APPLIED;
+  });
+  return UPDATE_APPLIED;
+}
+
+template <typename Host>
+template <typename Result, typename Applied>
+void StandInBackend<Host>::standInUpdate(uint64_t accountNumber,
+                                         AccountType accountType,
+                                         int amount,
+                                         TransactionId transactionId,
+                                         const std::shared_ptr<HostCall<Result>>& timedOut,
+                                         Applied applied) {
+  if (ledger_.authorize(accountNumber, accountType, amount, transactionId)) {
+    // If the call that timed out lands too, the forwarded copy under the same id is dropped as a retry
+    return;
+  }
+  if (timedOut) {
+    // Refused here, but the host may still apply it.  Then it has to be handed back
+    StandInLedger* const ledger = &ledger_;
+    const std::shared_ptr<Host> host = host_;
+    timedOut->abandon([=](const Result& late) {
+      if (applied(late)) {
+        ledger->queueReversal(accountNumber, accountType, amount, host->newTransactionId());
+      }
+    });
+  }
+  StandInLedger::unavailable();
+}
+
+template <typename Host>
+void StandInBackend<Host>::forwardQueued() {
+  std::lock_guard<std::mutex> lock(forward_mutex_);
+  StandInChange change;
+  while (ledger_.next(change)) {
+    std::optional<bool> applied;
+    const std::shared_ptr<Host> host = host_;
+    HostCallOutcome outcome;
+    try {
+      outcome = callHost(
+          [host, change]() {
+            return host->updateAccountBalance(
+                change.account_number, change.account_type, change.amount, change.transaction_id);
+          },
+          applied);
+    } catch (const std::exception&) {
+      // The host answered that it will never take this change, e.g. the account is gone
+      ledger_.forwarded();
+      continue;
+    }
+    if (outcome != HOST_ANSWERED) {
+      // Sent again next time under the same id, in case this one lands late
+      return;
+    }
+    ledger_.forwarded();
+    atmMetrics().stand_in_forwarded.increment();
+  }
+}
+
+template <typename Host>
+template <typename Result, typename Call>
+HostCallOutcome StandInBackend<Host>::callHost(Call call,
+                                               std::optional<Result>& result,
+                                               std::shared_ptr<HostCall<Result>>* timedOut) {
+  if (!breaker_.allowRequest()) {
+    return HOST_SKIPPED;
+  }
+
+  // Shared with the host thread, which may finish the call long after the session stopped waiting
+  const auto host_call = std::make_shared<HostCall<Result>>();
+  const CircuitBreaker::Clock::time_point start = CircuitBreaker::Clock::now();
+  const bool submitted = pool_.submit([host_call, call]() mutable { host_call->run(call); });
+  if (!submitted or !host_call->waitFor(config_.call_timeout)) {
+    breaker_.recordFailure();
+    atmMetrics().host_timeouts.increment();
+    if (submitted and timedOut != nullptr) {
+      *timedOut = host_call;
+    }
+    return HOST_TIMED_OUT;
+  }
+
+  // An error from the host is still an answer, the host is up
+  breaker_.recordSuccess(CircuitBreaker::Clock::now() - start);
+  result.emplace(host_call->get());
+  return HOST_ANSWERED;
+}
+
+template <typename Host>
+void StandInBackend<Host>::forwardLoop() {
+  std::unique_lock<std::mutex> lock(stop_mutex_);
+  while (!stopping_) {
+    stop_cv_.wait_for(lock, config_.forward_interval, [this] { return stopping_; });
+    if (stopping_) {
+      return;
+    }
+    lock.unlock();
+    if (ledger_.queued() > 0) {
+      forwardQueued();
+    }
+    lock.lock();
+  }
+}
+
+#endif  // ATM_STAND_IN_H
@@ -0,0 +1,213 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+// C++ Standard Library
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+
+// ATM Controller
+#include "machine.h"
+#include "statement.h"
+
+/// Columnar statements start with this
+static constexpr char kColumnarMagic[8] = {'A', 'T', 'M', 'S', 'T', 'M', 'C', '1'};
+
+struct ColumnarHeader {
+  char magic[8];
+  uint64_t account_number;
+  int64_t from_us;
+  int64_t to_us;
+};
+
+/// Precedes every block, a block of zero rows ends the file
+struct ColumnarBlockHeader {
+  uint32_t rows;
+  uint32_t reserved;
+};
+
+/// One block of rows, a column at a time
+struct ColumnarBlock {
+  uint32_t rows{0};
+  std::array<int64_t, kStatementBlockRows> time_us;
+  std::array<uint64_t, kStatementBlockRows> transaction_id;
+  std::array<int32_t, kStatementBlockRows> amount;
+  std::array<int32_t, kStatementBlockRows> balance;
+  std::array<uint8_t, kStatementBlockRows> account_type;
+};
+
+/// Streams the log, calling visit for each of the query's transactions
+template <typename Visit>
+static StatementSummary forEachStatementRecord(const std::string& logPath, const StatementQuery& query, Visit&& visit) {
+  const int64_t from = toTransactionTime(query.from);
+  const int64_t to = query.to == std::chrono::system_clock::time_point::max() ? INT64_MAX : toTransactionTime(query.to);
+
+  StatementSummary summary;
+  TransactionLogReader reader(logPath);
+  TransactionRecord record;
+  while (reader.next(record)) {
+    // The log is in ledger order, which the clock can disagree with after an adjustment, so every record is checked
+    if (record.account_number != query.account_number or record.time_us < from or record.time_us >= to) {
+      continue;
+    }
+    ++summary.transactions;
+    if (record.amount >= 0) {
+      summary.credits += record.amount;
+    } else {
+      summary.debits -= record.amount;
+    }
+    visit(record);
+  }
+  return summary;
+}
+
+StatementSummary exportStatementCsv(const std::string& logPath, const StatementQuery& query, std::ostream& out) {
+  out << "time,transaction_id,account_type,amount,balance\n";
+  const StatementSummary summary = forEachStatementRecord(logPath, query, [&out](const TransactionRecord& record) {
+    const std::time_t seconds = record.time_us / 1000000;
+    std::tm utc{};
+    ::gmtime_r(&seconds, &utc);
+
+    char line[128];
+    const size_t date = std::strftime(line, sizeof(line), "%Y-%m-%dT%H:%M:%S", &utc);
+    const int rest = std::snprintf(line + date,
+                                   sizeof(line) - date,
+                                   ".%06lldZ,%llu,%s,%d,%d\n",
+                                   static_cast<long long>(record.time_us % 1000000),
+                                   static_cast<unsigned long long>(record.transaction_id),
+                                   record.account_type == AccountType::SAVINGS ? "savings" : "checking",
+                                   record.amount,
+                                   record.balance);
+    out.write(line, date + rest);
+  });
+
+  if (!out) {
+    throw std::runtime_error("Could not write statement");
+  }
+  return summary;
+}
+
+/// Writes one block and empties it
+static bool writeColumnarBlock(FILE* file, ColumnarBlock& block) {
+  const ColumnarBlockHeader header{block.rows, 0};
+  bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+  ok = ok and std::fwrite(block.time_us.data(), sizeof(int64_t), block.rows, file) == block.rows;
+  ok = ok and std::fwrite(block.transaction_id.data(), sizeof(uint64_t), block.rows, file) == block.rows;
+  ok = ok and std::fwrite(block.amount.data(), sizeof(int32_t), block.rows, file) == block.rows;
+  ok = ok and std::fwrite(block.balance.data(), sizeof(int32_t), block.rows, file) == block.rows;
+  ok = ok and std::fwrite(block.account_type.data(), sizeof(uint8_t), block.rows, file) == block.rows;
+  block.rows = 0;
+  return ok;
+}
+
+StatementSummary exportStatementColumnar(const std::string& logPath,
+                                         const StatementQuery& query,
+                                         const std::string& outPath) {
+  const std::string temporary = outPath + ".tmp";
+  FILE* file = std::fopen(temporary.c_str(), "wb");
+  if (file == nullptr) {
+    throw std::runtime_error("Could not write statement " + outPath);
+  }
+
+  ColumnarHeader header{};
+  std::memcpy(header.magic, kColumnarMagic, sizeof(header.magic));
+  header.account_number = query.account_number;
+  header.from_us = toTransactionTime(query.from);
+  header.to_us = query.to == std::chrono::system_clock::time_point::max() ? INT64_MAX : toTransactionTime(query.to);
+  bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+
+  // Too big for the stack, but allocated once however many rows there are
+  std::unique_ptr<ColumnarBlock> block(new ColumnarBlock());
+  StatementSummary summary;
+  try {
+    summary = forEachStatementRecord(logPath, query, [&](const TransactionRecord& record) {
+      const uint32_t row = block->rows++;
+      block->time_us[row] = record.time_us;
+      block->transaction_id[row] = record.transaction_id;
+      block->amount[row] = record.amount;
+      block->balance[row] = record.balance;
+      block->account_type[row] = static_cast<uint8_t>(record.account_type);
+      if (block->rows == kStatementBlockRows) {
+        ok = writeColumnarBlock(file, *block) and ok;
+      }
+    });
+  } catch (const std::exception& e) {
+    std::fclose(file);
+    std::filesystem::remove(temporary);
+    throw;
+  }
+
+  if (block->rows > 0) {
+    ok = writeColumnarBlock(file, *block) and ok;
+  }
+  // An empty block marks the end, so a truncated file can be told apart from a complete one
+  ok = writeColumnarBlock(file, *block) and ok;
+  ok = (std::fclose(file) == 0) and ok;
+  if (!ok) {
+    std::filesystem::remove(temporary);
+    throw std::runtime_error("Could not write statement " + outPath);
+  }
+
+  std::filesystem::rename(temporary, outPath);
+  return summary;
+}
+
+uint64_t readColumnarStatement(const std::string& path, const std::function<void(const TransactionRecord&)>& visit) {
+  FILE* file = std::fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    throw std::runtime_error("Could not open statement " + path);
+  }
+
+  ColumnarHeader header{};
+  if (std::fread(&header, sizeof(header), 1, file) != 1 or
+      std::memcmp(header.magic, kColumnarMagic, sizeof(header.magic)) != 0) {
+    std::fclose(file);
+    throw std::runtime_error("Not a columnar statement " + path);
+  }
+
+  std::unique_ptr<ColumnarBlock> block(new ColumnarBlock());
+  uint64_t rows = 0;
+  bool complete = false;
+  ColumnarBlockHeader block_header{};
+  while (std::fread(&block_header, sizeof(block_header), 1, file) == 1) {
+    if (block_header.rows == 0) {
+      complete = true;
+      break;
+    }
+
+    const uint32_t count = block_header.rows;
+    if (count > kStatementBlockRows or
+        std::fread(block->time_us.data(), sizeof(int64_t), count, file) != count or
+        std::fread(block->transaction_id.data(), sizeof(uint64_t), count, file) != count or
+        std::fread(block->amount.data(), sizeof(int32_t), count, file) != count or
+        std::fread(block->balance.data(), sizeof(int32_t), count, file) != count or
+        std::fread(block->account_type.data(), sizeof(uint8_t), count, file) != count) {
+      break;
+    }
+
+    for (uint32_t row = 0; row < count; ++row) {
+      TransactionRecord record{};
+      record.time_us = block->time_us[row];
+      record.account_number = header.account_number;
+      record.transaction_id = block->transaction_id[row];
+      record.amount = block->amount[row];
+      record.balance = block->balance[row];
+      record.account_type = block->account_type[row];
+      visit(record);
+    }
+    rows += count;
+  }
+  std::fclose(file);
+
+  if (!complete) {
+    throw std::runtime_error("Truncated columnar statement " + path);
+  }
+  return rows;
+}
@@ -0,0 +1,76 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+#ifndef ATM_STATEMENT_H
+#define ATM_STATEMENT_H
+
+// C++ Standard Library
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+
+// ATM Controller
+#include "transaction_log.h"
+
+/// Which transactions go on a statement
+struct StatementQuery {
+  uint64_t account_number;
+
+  /// Transactions applied at or after this time
+  std::chrono::system_clock::time_point from{};
+
+  /// Transactions applied before this time
+  std::chrono::system_clock::time_point to{std::chrono::system_clock::time_point::max()};
+};
+
+/// Totals over the transactions written to a statement
+struct StatementSummary {
+  uint64_t transactions{0};
+  int64_t credits{0};
+  int64_t debits{0};
+};
+
+/**
+ * @brief Writes a statement as CSV: time (UTC, ISO 8601), transaction id, account type, amount and balance
+ * @details  The log is streamed once, holding one mapped window of it and one line of output at a time, so memory
+ *           stays flat however long the log is.
+ *
+ * @param logPath  The transaction log to read
+ * @param query  Whose transactions and over which dates
+ * @param out  Where the CSV goes
+ * @return  Totals over the transactions written
+ */
+StatementSummary exportStatementCsv(const std::string& logPath, const StatementQuery& query, std::ostream& out);
+
+/**
+ * @brief Writes a statement in a compact binary columnar format
+ * @details  Rows are grouped into blocks of kStatementBlockRows, and each block is stored a column at a time (times,
+ *           transaction ids, amounts, balances, account types), 25 bytes a row against 40 in the log.  Only one block
+ *           is held in memory.  Read it back with readColumnarStatement().
+ *
+ * @param logPath  The transaction log to read
+ * @param query  Whose transactions and over which dates
+ * @param outPath  The file to write, replaced once it is complete
+ * @return  Totals over the transactions written
+ */
+StatementSummary exportStatementColumnar(const std::string& logPath,
+                                         const StatementQuery& query,
+                                         const std::string& outPath);
+
+/// Rows per block of a columnar statement
+static constexpr uint32_t kStatementBlockRows = 4096;
+
+/**
+ * @brief Streams the rows of a columnar statement, a block at a time
+ *
+ * @param path  A file written by exportStatementColumnar()
+ * @param visit  Called with each row in order
+ * @return  The number of rows read
+ */
+uint64_t readColumnarStatement(const std::string& path, const std::function<void(const TransactionRecord&)>& visit);
+
+#endif  // ATM_STATEMENT_H
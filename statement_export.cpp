@@ -0,0 +1,60 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ *
+ * Exports one account's statement from a transaction log.
+ *
+ * Usage: statement_export <log> <account> <csv|columnar> <output, - for stdout with csv> [from] [to]
+ * where from and to are Unix times in seconds.
+ */
+
+// C++ Standard Library
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+// ATM Controller
+#include "statement.h"
+
+int main(int argc, char** argv) {
+  if (argc < 5) {
+    std::cerr << "Usage: " << argv[0] << " <log> <account> <csv|columnar> <output|-> [from] [to]" << std::endl;
+    return 2;
+  }
+
+  const std::string log_path = argv[1];
+  const std::string format = argv[3];
+  const std::string output = argv[4];
+
+  StatementQuery query{std::strtoull(argv[2], nullptr, 10)};
+  if (argc > 5) {
+    query.from = std::chrono::system_clock::time_point(std::chrono::seconds(std::strtoll(argv[5], nullptr, 10)));
+  }
+  if (argc > 6) {
+    query.to = std::chrono::system_clock::time_point(std::chrono::seconds(std::strtoll(argv[6], nullptr, 10)));
+  }
+
+  try {
+    StatementSummary summary;
+    if (format == "csv" and output == "-") {
+      summary = exportStatementCsv(log_path, query, std::cout);
+    } else if (format == "csv") {
+      std::ofstream file(output, std::ios::trunc);
+      summary = exportStatementCsv(log_path, query, file);
+    } else if (format == "columnar") {
+      summary = exportStatementColumnar(log_path, query, output);
+    } else {
+      std::cerr << "Unknown format " << format << std::endl;
+      return 2;
+    }
+
+    std::cerr << summary.transactions << " transactions, " << summary.credits << " in, " << summary.debits << " out"
+              << std::endl;
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,378 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ *
+ * Concurrency stress harness: many ATMs share one Machine, each with its callbacks and service() on separate
+ * threads, while other threads hit the Machine's ledger and cash directly.  Invariants are checked throughout and at
+ * the end, and per-operation throughput is reported next to a single-ATM baseline so contention shows up as a
+ * slowdown.  Build with -DATM_SANITIZER=thread (or the tsan preset) to have ThreadSanitizer watch the run.
+ *
+ * Usage: stress_test [seconds] [atms] [seed]
+ */
+
+// C++ Standard Library
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+// POSIX
+#include <fcntl.h>
+#include <unistd.h>
+
+// ATM Controller
+#include "atm.h"
+
+/// Operations timed by the harness
+enum StressOp { CARD = 0, PIN, SELECT, MANAGE, BATCH, SERVICE, GET_STATE, LEDGER_UPDATE, DISBURSE, kStressOps };
+
+static const char* kStressOpNames[kStressOps] = {
+  "cardReaderCB", "enterPinCB", "accountSelectCB", "accountManagementCB", "accountManagementBatchCB", "service",
+  "getState", "updateAccountBalance", "disburseCash"};
+
+static const std::array<uint64_t, 2> kStressAccounts = {1234123412341234, 2345234523452345};
+static const std::array<uint16_t, 2> kStressPins = {1234, 2345};
+
+/// Forwards the ledger and cash calls to a shared Machine, leaving out its trackers so sessions on it are never
+/// locked out or velocity limited and keep money moving
+struct UntrackedMachine {
+  UntrackedMachine() : machine(std::make_shared<Machine>()) {}
+  explicit UntrackedMachine(std::shared_ptr<Machine> machine) : machine(std::move(machine)) {}
+
+  bool verifyPin(uint64_t accountNumber, uint16_t pin) {
+    return machine->verifyPin(accountNumber, pin);
+  }
+  Balances getAccountBalances(uint64_t accountNumber) {
+    return machine->getAccountBalances(accountNumber);
+  }
+  bool updateAccountBalance(uint64_t accountNumber, AccountType accountType, int amount, TransactionId transactionId) {
+    return machine->updateAccountBalance(accountNumber, accountType, amount, transactionId);
+  }
+  LedgerUpdateResult updateAccountBalanceIfVersion(uint64_t accountNumber,
+                                                   AccountType accountType,
+                                                   int amount,
+                                                   uint64_t expectedVersion,
+                                                   TransactionId transactionId) {
+    return machine->updateAccountBalanceIfVersion(accountNumber, accountType, amount, expectedVersion, transactionId);
+  }
+  uint getAvailableCash() {
+    return machine->getAvailableCash();
+  }
+  void disburseCash(uint amount) {
+    machine->disburseCash(amount);
+  }
+  TransactionId newTransactionId() {
+    return machine->newTransactionId();
+  }
+
+  std::shared_ptr<Machine> machine;
+};
+
+struct StressConfig {
+  double seconds;
+  int atms;
+  int ledger_threads;
+  uint64_t seed;
+};
+
+struct OpStats {
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> total_ns{0};
+  std::atomic<uint64_t> max_ns{0};
+};
+
+struct StressResult {
+  std::array<OpStats, kStressOps> ops;
+  std::atomic<uint64_t> violations{0};
+  double elapsed_s{0};
+};
+
+/// Runs f and adds how long it took to the stats for op
+template <typename F>
+static void timed(StressResult& result, StressOp op, F&& f) {
+  const auto start = std::chrono::steady_clock::now();
+  f();
+  const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start).count();
+  OpStats& stats = result.ops[op];
+  stats.count.fetch_add(1, std::memory_order_relaxed);
+  stats.total_ns.fetch_add(ns, std::memory_order_relaxed);
+  uint64_t max = stats.max_ns.load(std::memory_order_relaxed);
+  while (ns > max and !stats.max_ns.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+  }
+}
+
+static void violation(StressResult& result, const char* what) {
+  if (result.violations.fetch_add(1) < 10) {
+    std::fprintf(stderr, "INVARIANT VIOLATED: %s\n", what);
+  }
+}
+
+/// Sum of every balance in the machine's ledger
+static int64_t ledgerTotal(Machine& machine) {
+  int64_t total = 0;
+  for (const uint64_t account : kStressAccounts) {
+    const Balances balances = machine.getAccountBalances(account);
+    total += balances.checking + balances.savings;
+  }
+  return total;
+}
+
+/// Drives one ATM's callbacks with a random mix of the expected next step and out of order calls
+template <typename Backend>
+static void driveCallbacks(BasicATM<Backend>& atm,
+                           StressResult& result,
+                           const std::atomic<bool>& running,
+                           uint64_t seed,
+                           bool wrong_pins) {
+  std::mt19937_64 random(seed);
+  std::uniform_int_distribution<int> percent(0, 99);
+  std::uniform_int_distribution<int> amount(1, 300);
+  std::uniform_int_distribution<size_t> account(0, kStressAccounts.size() - 1);
+  size_t current = 0;
+
+  while (running.load(std::memory_order_relaxed)) {
+    ATMScreenState state = ATMScreenState::IDLE;
+    timed(result, GET_STATE, [&]() { state = atm.getState(); });
+    if (state > ATMScreenState::ACCOUNT_MANAGEMENT) {
+      violation(result, "ATM in an unknown state");
+    }
+
+    // Mostly follow the flow, but interleave callbacks out of order too
+    const int roll = percent(random);
+    const int step = roll < 75 ? static_cast<int>(state) : roll % 5;
+    switch (step) {
+      case 0:
+        current = account(random);
+        timed(result, CARD, [&]() { atm.cardReaderCB(kStressAccounts[current]); });
+        break;
+      case 1: {
+        const bool wrong = wrong_pins and percent(random) < 5;
+        timed(result, PIN, [&]() { atm.enterPinCB(kStressPins[current] + (wrong ? 1 : 0)); });
+        break;
+      }
+      case 2:
+        timed(result, SELECT, [&]() {
+          atm.accountSelectCB(percent(random) < 50 ? AccountType::CHECKING : AccountType::SAVINGS);
+        });
+        break;
+      case 3: {
+        const int action = percent(random);
+        if (action < 10) {
+          timed(result, BATCH, [&]() {
+            atm.accountManagementBatchCB({{ManagementAction::ManagementActionType::DEPOSIT, amount(random)},
+                                          {ManagementAction::ManagementActionType::WITHDRAW, amount(random)},
+                                          {ManagementAction::ManagementActionType::BALANCE}});
+          });
+        } else {
+          ManagementAction::ManagementActionType type = ManagementAction::ManagementActionType::DONE;
+          if (action < 45) {
+            type = ManagementAction::ManagementActionType::WITHDRAW;
+          } else if (action < 80) {
+            type = ManagementAction::ManagementActionType::DEPOSIT;
+          } else if (action < 90) {
+            type = ManagementAction::ManagementActionType::BALANCE;
+          } else if (action < 95) {
+            type = ManagementAction::ManagementActionType::MINI_STATEMENT;
+          }
+          timed(result, MANAGE, [&]() { atm.accountManagementCB(ManagementAction{type, amount(random)}); });
+        }
+        break;
+      }
+      default:
+        // A pin where a card was expected and so on
+        timed(result, PIN, [&]() { atm.enterPinCB(kStressPins[current]); });
+        break;
+    }
+
+    if (percent(random) < 10) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+template <typename Backend>
+static void driveService(BasicATM<Backend>& atm, StressResult& result, const std::atomic<bool>& running) {
+  while (running.load(std::memory_order_relaxed)) {
+    timed(result, SERVICE, [&]() { atm.service(); });
+    std::this_thread::yield();
+  }
+}
+
+static void runStress(const StressConfig& config, StressResult& result) {
+  const auto machine = std::make_shared<Machine>();
+  const auto untracked = std::make_shared<UntrackedMachine>(machine);
+  const uint initial_cash = machine->getAvailableCash();
+  const int64_t initial_ledger = ledgerTotal(*machine);
+  const uint64_t initial_deposited = atmMetrics().cash_deposited.value();
+
+  // Half the ATMs go through the machine's trackers, half around them
+  std::vector<std::unique_ptr<BasicATM<Machine>>> tracked_atms;
+  std::vector<std::unique_ptr<BasicATM<UntrackedMachine>>> untracked_atms;
+  for (int i = 0; i < config.atms; ++i) {
+    if (i % 2 == 0) {
+      untracked_atms.emplace_back(new BasicATM<UntrackedMachine>(untracked));
+    } else {
+      tracked_atms.emplace_back(new BasicATM<Machine>(machine));
+    }
+  }
+
+  std::atomic<bool> running{true};
+  std::atomic<int64_t> direct_ledger_change{0};
+  std::atomic<uint64_t> direct_dispensed{0};
+  std::vector<std::thread> threads;
+
+  for (size_t i = 0; i < untracked_atms.size(); ++i) {
+    BasicATM<UntrackedMachine>& atm = *untracked_atms[i];
+    threads.emplace_back([&, i]() { driveCallbacks(atm, result, running, config.seed + 2 * i, false); });
+    threads.emplace_back([&]() { driveService(atm, result, running); });
+  }
+  for (size_t i = 0; i < tracked_atms.size(); ++i) {
+    BasicATM<Machine>& atm = *tracked_atms[i];
+    threads.emplace_back([&, i]() { driveCallbacks(atm, result, running, config.seed + 2 * i + 1, true); });
+    threads.emplace_back([&]() { driveService(atm, result, running); });
+  }
+
+  // Straight to the ledger and the cash, including retries that must not be applied twice
+  for (int i = 0; i < config.ledger_threads; ++i) {
+    threads.emplace_back([&, i]() {
+      std::mt19937_64 random(config.seed ^ (0x9e3779b97f4a7c15ULL * (i + 1)));
+      std::uniform_int_distribution<int> amount(-50, 50);
+      while (running.load(std::memory_order_relaxed)) {
+        const uint64_t account = kStressAccounts[random() % kStressAccounts.size()];
+        const AccountType type = random() % 2 == 0 ? AccountType::CHECKING : AccountType::SAVINGS;
+        const int change = amount(random);
+        const TransactionId id = machine->newTransactionId();
+        bool first = false;
+        bool retry = true;
+        timed(result, LEDGER_UPDATE, [&]() { first = machine->updateAccountBalance(account, type, change, id); });
+        timed(result, LEDGER_UPDATE, [&]() { retry = machine->updateAccountBalance(account, type, change, id); });
+        if (!first or retry) {
+          violation(result, "Transaction id applied twice or not at all");
+        }
+        if (first) {
+          direct_ledger_change.fetch_add(change);
+        }
+
+        if (random() % 8 == 0) {
+          timed(result, DISBURSE, [&]() {
+            try {
+              machine->disburseCash(1);
+              direct_dispensed.fetch_add(1);
+            } catch (const std::exception& e) {
+              // Out of cash is expected eventually
+            }
+          });
+        }
+      }
+    });
+  }
+
+  // Watch the vault while everything runs
+  threads.emplace_back([&]() {
+    while (running.load(std::memory_order_relaxed)) {
+      if (machine->getAvailableCash() > initial_cash) {
+        violation(result, "Vault cash went negative or grew from nowhere");
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  });
+
+  const auto start = std::chrono::steady_clock::now();
+  std::this_thread::sleep_for(std::chrono::duration<double>(config.seconds));
+  running = false;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  result.elapsed_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  // Money is neither created nor destroyed: the ledger moved by what was deposited, minus what the ATMs dispensed,
+  // plus the direct updates
+  const uint final_cash = machine->getAvailableCash();
+  const int64_t atm_dispensed = static_cast<int64_t>(initial_cash - final_cash) - direct_dispensed.load();
+  const int64_t deposited = static_cast<int64_t>(atmMetrics().cash_deposited.value() - initial_deposited);
+  const int64_t ledger_change = ledgerTotal(*machine) - initial_ledger;
+  if (final_cash > initial_cash or atm_dispensed < 0) {
+    violation(result, "More cash dispensed than the vault held");
+  }
+  if (ledger_change != deposited - atm_dispensed + direct_ledger_change.load()) {
+    std::fprintf(stderr,
+                 "ledger change %lld, deposited %lld, dispensed %lld, direct %lld\n",
+                 static_cast<long long>(ledger_change),
+                 static_cast<long long>(deposited),
+                 static_cast<long long>(atm_dispensed),
+                 static_cast<long long>(direct_ledger_change.load()));
+    violation(result, "Money not conserved between the ledger and the vault");
+  }
+}
+
+int main(int argc, char** argv) {
+  StressConfig config{2.0, 8, 4, 42};
+  if (argc > 1) {
+    config.seconds = std::atof(argv[1]);
+  }
+  if (argc > 2) {
+    config.atms = std::max(1, std::atoi(argv[2]));
+  }
+  if (argc > 3) {
+    config.seed = std::strtoull(argv[3], nullptr, 10);
+  }
+
+  // The controller narrates every transition on stdout, which would drown out the report
+  std::fflush(stdout);
+  const int saved_stdout = ::dup(STDOUT_FILENO);
+  const int null_fd = ::open("/dev/null", O_WRONLY);
+  ::dup2(null_fd, STDOUT_FILENO);
+
+  StressResult baseline;
+  runStress(StressConfig{config.seconds / 4, 1, 1, config.seed}, baseline);
+  resetInstrumentation();
+  StressResult result;
+  runStress(config, result);
+
+  std::cout.flush();
+  std::fflush(stdout);
+  ::dup2(saved_stdout, STDOUT_FILENO);
+  ::close(null_fd);
+  ::close(saved_stdout);
+
+  std::printf("%d ATMs, %d ledger threads, %.2fs, seed %llu\n",
+              config.atms,
+              config.ledger_threads,
+              result.elapsed_s,
+              static_cast<unsigned long long>(config.seed));
+  std::printf("%-26s %12s %12s %10s %10s %14s\n", "operation", "count", "ops/s", "avg us", "max us", "vs 1 ATM avg");
+  for (int op = 0; op < kStressOps; ++op) {
+    const OpStats& stats = result.ops[op];
+    const OpStats& base = baseline.ops[op];
+    const uint64_t count = stats.count.load();
+    const double avg_us = count ? stats.total_ns.load() / 1000.0 / count : 0.0;
+    const double base_avg_us = base.count.load() ? base.total_ns.load() / 1000.0 / base.count.load() : 0.0;
+    std::printf("%-26s %12llu %12.0f %10.2f %10.1f %13.1fx\n",
+                kStressOpNames[op],
+                static_cast<unsigned long long>(count),
+                count / result.elapsed_s,
+                avg_us,
+                stats.max_ns.load() / 1000.0,
+                base_avg_us > 0 ? avg_us / base_avg_us : 0.0);
+  }
+
+  if (instrumentationEnabled()) {
+    // What each callback cost under contention, from an -DATM_INSTRUMENTATION=ON build
+    std::printf("\n");
+    std::fflush(stdout);
+    printInstrumentation(instrumentationSnapshot(), std::cout);
+    std::cout.flush();
+  }
+
+  const uint64_t violations = baseline.violations.load() + result.violations.load();
+  std::printf("%s: %llu invariant violations\n", violations ? "FAILED" : "PASSED",
+              static_cast<unsigned long long>(violations));
+  return violations ? 1 : 0;
+}
@@ -0,0 +1,173 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ *
+ * Throughput of the terminal front-end.  A TerminalServer runs on its own thread while simulated terminals, all
+ * driven from one client thread, pipeline whole sessions over their connections: card, pin, account, balance, state
+ * and done, each a message with a response.  Reports messages per second and how many responses each write carried.
+ *
+ * Usage: terminal_benchmark [seconds] [terminals] [sessions per burst] [tcp|unix]
+ */
+
+// C++ Standard Library
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// POSIX
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// ATM Controller
+#include "terminal_server.h"
+
+static constexpr uint64_t kCardNumber = 2345234523452345;
+static constexpr uint16_t kCardPin = 2345;
+static constexpr size_t kMessagesPerSession = 6;
+
+static int connectTo(bool tcp, uint16_t port, const std::string& path) {
+  int fd = -1;
+  int connected = -1;
+  if (tcp) {
+    fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    connected = ::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+  } else {
+    fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    connected = ::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+  }
+  if (fd < 0 or connected != 0) {
+    throw std::runtime_error("Could not connect to the terminal server");
+  }
+  return fd;
+}
+
+static void sendAll(int fd, const uint8_t* data, size_t size) {
+  while (size > 0) {
+    const ssize_t sent = ::send(fd, data, size, MSG_NOSIGNAL);
+    if (sent <= 0) {
+      throw std::runtime_error("Terminal server went away");
+    }
+    data += sent;
+    size -= sent;
+  }
+}
+
+static void receiveAll(int fd, uint8_t* data, size_t size) {
+  while (size > 0) {
+    const ssize_t received = ::recv(fd, data, size, 0);
+    if (received <= 0) {
+      throw std::runtime_error("Terminal server went away");
+    }
+    data += received;
+    size -= received;
+  }
+}
+
+int main(int argc, char** argv) {
+  const double seconds = argc > 1 ? std::atof(argv[1]) : 2.0;
+  const int terminals = argc > 2 ? std::max(1, std::atoi(argv[2])) : 16;
+  const size_t burst = argc > 3 ? std::max(1, std::atoi(argv[3])) : 64;
+  const bool tcp = argc > 4 and std::string(argv[4]) == "tcp";
+  const std::string path = "/tmp/atm_terminal_benchmark." + std::to_string(::getpid());
+
+  // The controller narrates every transition on stdout, which would drown out the report
+  std::fflush(stdout);
+  const int saved_stdout = ::dup(STDOUT_FILENO);
+  const int null_fd = ::open("/dev/null", O_WRONLY);
+  ::dup2(null_fd, STDOUT_FILENO);
+
+  TerminalServer server(std::make_shared<Machine>());
+  uint16_t port = 0;
+  if (tcp) {
+    port = server.listenTcp(0);
+  } else {
+    server.listenUnix(path);
+  }
+  std::thread serving([&server]() { server.run(); });
+
+  // Every terminal sends the same bursts of sessions
+  std::vector<uint8_t> requests;
+  uint8_t frame[kMaxFrameSize];
+  const auto append = [&requests, &frame](size_t size) { requests.insert(requests.end(), frame, frame + size); };
+  for (size_t session = 0; session < burst; ++session) {
+    const uint32_t stan = static_cast<uint32_t>(session * kMessagesPerSession);
+    append(encodeCardFrame(frame, stan, kCardNumber));
+    append(encodePinFrame(frame, stan + 1, kCardPin));
+    append(encodeSelectFrame(frame, stan + 2, AccountType::CHECKING));
+    append(encodeActionFrame(frame, stan + 3, {ManagementAction::ManagementActionType::BALANCE}));
+    append(encodeStateFrame(frame, stan + 4));
+    append(encodeActionFrame(frame, stan + 5, {ManagementAction::ManagementActionType::DONE}));
+  }
+  std::vector<uint8_t> responses(burst * kMessagesPerSession * kResponseFrameSize);
+
+  std::vector<int> connections;
+  for (int i = 0; i < terminals; ++i) {
+    connections.push_back(connectTo(tcp, port, path));
+  }
+
+  uint64_t messages = 0;
+  uint64_t bad_sessions = 0;
+  const auto start = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed{0};
+  while (elapsed.count() < seconds) {
+    // A burst on every terminal, then every terminal's responses
+    for (const int fd : connections) {
+      sendAll(fd, requests.data(), requests.size());
+    }
+    for (const int fd : connections) {
+      receiveAll(fd, responses.data(), responses.size());
+      for (size_t session = 0; session < burst; ++session) {
+        // The balance was asked for with the account open, and the session ended
+        TerminalMessage balance;
+        TerminalMessage done;
+        const uint8_t* const responded = responses.data() + session * kMessagesPerSession * kResponseFrameSize;
+        parseTerminalFrame(responded + 3 * kResponseFrameSize, kResponseFrameSize, balance);
+        parseTerminalFrame(responded + 5 * kResponseFrameSize, kResponseFrameSize, done);
+        bad_sessions += balance.state() != ATMScreenState::ACCOUNT_MANAGEMENT or done.state() != ATMScreenState::IDLE;
+      }
+      messages += burst * kMessagesPerSession;
+    }
+    elapsed = std::chrono::steady_clock::now() - start;
+  }
+
+  for (const int fd : connections) {
+    ::close(fd);
+  }
+  server.stop();
+  serving.join();
+  const TerminalServerStats stats = server.stats();
+
+  std::cout.flush();
+  std::fflush(stdout);
+  ::dup2(saved_stdout, STDOUT_FILENO);
+  ::close(null_fd);
+  ::close(saved_stdout);
+
+  std::printf("%d terminals over %s, %zu sessions per burst, %.2fs\n",
+              terminals, tcp ? "tcp" : "unix sockets", burst, elapsed.count());
+  std::printf("%14s %14s %18s %14s\n", "messages", "messages/s", "responses/write", "bad sessions");
+  std::printf("%14llu %14.0f %18.1f %14llu\n",
+              static_cast<unsigned long long>(messages),
+              messages / elapsed.count(),
+              stats.writes > 0 ? static_cast<double>(stats.messages) / stats.writes : 0.0,
+              static_cast<unsigned long long>(bad_sessions));
+  return bad_sessions > 0 ? 1 : 0;
+}
@@ -0,0 +1,131 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+// C++ Standard Library
+#include <stdexcept>
+
+// ATM Controller
+#include "terminal_protocol.h"
+
+static uint64_t readBigEndian(const uint8_t* data, size_t bytes) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < bytes; ++i) {
+    value = (value << 8) | data[i];
+  }
+  return value;
+}
+
+static uint8_t* writeBigEndian(uint8_t* out, uint64_t value, size_t bytes) {
+  for (size_t i = bytes; i > 0; --i) {
+    out[i - 1] = static_cast<uint8_t>(value);
+    value >>= 8;
+  }
+  return out + bytes;
+}
+
+/// Writes the length and body header of a frame whose payload has the given size, returns where the payload goes
+static uint8_t* writeFrameHeader(uint8_t* out, uint8_t type, uint32_t stan, size_t payloadSize) {
+  out = writeBigEndian(out, kBodyHeaderSize + payloadSize, kFrameHeaderSize);
+  *out++ = type;
+  return writeBigEndian(out, stan, 4);
+}
+
+/// Payload size of each request type, indexed by type
+static constexpr size_t kPayloadSizes[] = {0, 8, 2, 1, 5, 0};
+
+bool TerminalMessage::validPayload() const {
+  if (type & kResponseFlag) {
+    return payload_size == 2;
+  }
+  if (type < MSG_CARD or type > MSG_STATE or payload_size != kPayloadSizes[type]) {
+    return false;
+  }
+  switch (type) {
+    case MSG_SELECT:
+      return payload[0] <= AccountType::SAVINGS;
+    case MSG_ACTION:
+      return payload[0] <= ManagementAction::ManagementActionType::DONE;
+    default:
+      return true;
+  }
+}
+
+uint64_t TerminalMessage::accountNumber() const {
+  return readBigEndian(payload, 8);
+}
+
+uint16_t TerminalMessage::pin() const {
+  return static_cast<uint16_t>(readBigEndian(payload, 2));
+}
+
+AccountType TerminalMessage::accountType() const {
+  return static_cast<AccountType>(payload[0]);
+}
+
+ManagementAction TerminalMessage::action() const {
+  return ManagementAction(static_cast<ManagementAction::ManagementActionType>(payload[0]),
+                          static_cast<int>(static_cast<uint32_t>(readBigEndian(payload + 1, 4))));
+}
+
+uint8_t TerminalMessage::state() const {
+  return payload[0];
+}
+
+uint8_t TerminalMessage::status() const {
+  return payload[1];
+}
+
+size_t parseTerminalFrame(const uint8_t* data, size_t size, TerminalMessage& message) {
+  if (size < kFrameHeaderSize) {
+    return 0;
+  }
+  const size_t body_size = readBigEndian(data, kFrameHeaderSize);
+  if (body_size < kBodyHeaderSize or kFrameHeaderSize + body_size > kMaxFrameSize) {
+    throw std::runtime_error("Malformed terminal frame");
+  }
+  if (size < kFrameHeaderSize + body_size) {
+    return 0;
+  }
+
+  const uint8_t* const body = data + kFrameHeaderSize;
+  message.type = body[0];
+  message.stan = static_cast<uint32_t>(readBigEndian(body + 1, 4));
+  message.payload = body + kBodyHeaderSize;
+  message.payload_size = body_size - kBodyHeaderSize;
+  return kFrameHeaderSize + body_size;
+}
+
+size_t encodeCardFrame(uint8_t* out, uint32_t stan, uint64_t accountNumber) {
+  uint8_t* const payload = writeFrameHeader(out, MSG_CARD, stan, 8);
+  return writeBigEndian(payload, accountNumber, 8) - out;
+}
+
+size_t encodePinFrame(uint8_t* out, uint32_t stan, uint16_t pin) {
+  uint8_t* const payload = writeFrameHeader(out, MSG_PIN, stan, 2);
+  return writeBigEndian(payload, pin, 2) - out;
+}
+
+size_t encodeSelectFrame(uint8_t* out, uint32_t stan, AccountType accountType) {
+  uint8_t* const payload = writeFrameHeader(out, MSG_SELECT, stan, 1);
+  *payload = static_cast<uint8_t>(accountType);
+  return payload + 1 - out;
+}
+
+size_t encodeActionFrame(uint8_t* out, uint32_t stan, const ManagementAction& action) {
+  uint8_t* const payload = writeFrameHeader(out, MSG_ACTION, stan, 5);
+  *payload = static_cast<uint8_t>(action.action);
+  return writeBigEndian(payload + 1, static_cast<uint32_t>(action.amount), 4) - out;
+}
+
+size_t encodeStateFrame(uint8_t* out, uint32_t stan) {
+  return writeFrameHeader(out, MSG_STATE, stan, 0) - out;
+}
+
+size_t encodeResponseFrame(uint8_t* out, uint8_t requestType, uint32_t stan, uint8_t state, uint8_t status) {
+  uint8_t* const payload = writeFrameHeader(out, requestType | kResponseFlag, stan, 2);
+  payload[0] = state;
+  payload[1] = status;
+  return payload + 2 - out;
+}
@@ -0,0 +1,93 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+#ifndef ATM_TERMINAL_PROTOCOL_H
+#define ATM_TERMINAL_PROTOCOL_H
+
+// C++ Standard Library
+#include <cstddef>
+#include <cstdint>
+
+// ATM Controller
+#include "account.h"
+
+/**
+ * Binary protocol between terminals and the controller, in the spirit of ISO 8583.  Every message is a frame: a
+ * 2-byte big-endian length followed by that many bytes of body.  A body starts with the message type and a 4-byte
+ * system trace audit number (STAN) picked by the terminal, which the response echoes, followed by fixed fields:
+ *
+ *   MSG_CARD     account number (8)          -> cardReaderCB
+ *   MSG_PIN      pin (2)                     -> enterPinCB
+ *   MSG_SELECT   account type (1)            -> accountSelectCB
+ *   MSG_ACTION   action (1), amount (4)      -> accountManagementCB
+ *   MSG_STATE    nothing, asks for the state
+ *
+ * Every request gets a response of type (request type | kResponseFlag) carrying the screen state after the request
+ * was serviced and a status.  Integers are big-endian.
+ */
+
+enum TerminalMessageType : uint8_t { MSG_CARD = 1, MSG_PIN = 2, MSG_SELECT = 3, MSG_ACTION = 4, MSG_STATE = 5 };
+
+/// Set in the type of a response
+static constexpr uint8_t kResponseFlag = 0x80;
+
+/// Status of a response
+enum TerminalStatus : uint8_t { STATUS_OK = 0, STATUS_MALFORMED = 1 };
+
+/// The 2-byte length in front of every body
+static constexpr size_t kFrameHeaderSize = 2;
+
+/// Type and STAN, the start of every body
+static constexpr size_t kBodyHeaderSize = 5;
+
+/// Largest frame either side sends, a card swipe
+static constexpr size_t kMaxFrameSize = kFrameHeaderSize + kBodyHeaderSize + 8;
+
+/// Size of every response frame
+static constexpr size_t kResponseFrameSize = kFrameHeaderSize + kBodyHeaderSize + 2;
+
+/**
+ * @brief A parsed frame, pointing into the buffer it was parsed from rather than copying it
+ * @details  Field accessors don't check the payload size, validPayload() does.
+ */
+struct TerminalMessage {
+  uint8_t type;
+  uint32_t stan;
+  const uint8_t* payload;
+  size_t payload_size;
+
+  /// Whether the payload has the size the message type calls for, and an account type or action that exists
+  bool validPayload() const;
+
+  uint64_t accountNumber() const;
+  uint16_t pin() const;
+  AccountType accountType() const;
+  ManagementAction action() const;
+
+  /// Fields of a response
+  uint8_t state() const;
+  uint8_t status() const;
+};
+
+/**
+ * @brief Parses the frame at the start of a buffer, in place
+ *
+ * @param data  Received bytes
+ * @param size  How many
+ * @param message  Set to the frame's message, pointing into data
+ * @return  The size of the frame, 0 if data doesn't hold all of it yet
+ * @throws std::runtime_error  If the frame can't be one of ours, after which the stream can't be trusted
+ */
+size_t parseTerminalFrame(const uint8_t* data, size_t size, TerminalMessage& message);
+
+/// Encoders, each writes one frame of at most kMaxFrameSize to out and returns its size
+size_t encodeCardFrame(uint8_t* out, uint32_t stan, uint64_t accountNumber);
+size_t encodePinFrame(uint8_t* out, uint32_t stan, uint16_t pin);
+size_t encodeSelectFrame(uint8_t* out, uint32_t stan, AccountType accountType);
+size_t encodeActionFrame(uint8_t* out, uint32_t stan, const ManagementAction& action);
+size_t encodeStateFrame(uint8_t* out, uint32_t stan);
+size_t encodeResponseFrame(uint8_t* out, uint8_t requestType, uint32_t stan, uint8_t state, uint8_t status);
+
+#endif  // ATM_TERMINAL_PROTOCOL_H
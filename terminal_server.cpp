@@ -0,0 +1,414 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+// C++ Standard Library
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+// POSIX
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// ATM Controller
+#include "terminal_server.h"
+
+constexpr size_t TerminalServer::kBufferSize;
+
+/// Events taken from epoll at once
+static constexpr int kMaxEvents = 256;
+
+static std::runtime_error systemError(const std::string& what) {
+  return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+TerminalServer::TerminalServer(std::shared_ptr<Machine> machine) :
+  machine_(std::move(machine)),
+  epoll_fd_(::epoll_create1(EPOLL_CLOEXEC)),
+  wake_fd_(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+  fetched_fd_(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+  accepted_count_(0),
+  message_count_(0),
+  write_count_(0) {
+  if (epoll_fd_ < 0 or wake_fd_ < 0 or fetched_fd_ < 0) {
+    throw systemError("Could not set up the terminal server");
+  }
+  for (const int fd : {wake_fd_, fetched_fd_}) {
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    ::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event);
+  }
+}
+
+TerminalServer::~TerminalServer() {
+  for (const auto& connection : connections_) {
+    ::close(connection.first);
+  }
+  // Waits for fetches still running, which may still signal fetched_fd_
+  connections_.clear();
+  for (const int listener : listeners_) {
+    ::close(listener);
+  }
+  for (const std::string& path : unix_paths_) {
+    ::unlink(path.c_str());
+  }
+  ::close(wake_fd_);
+  ::close(fetched_fd_);
+  ::close(epoll_fd_);
+}
+
+uint16_t TerminalServer::listenTcp(uint16_t port) {
+  const int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    throw systemError("Could not create a terminal socket");
+  }
+  const int on = 1;
+  ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  socklen_t address_size = sizeof(address);
+  if (::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 or ::listen(fd, SOMAXCONN) != 0 or
+      ::getsockname(fd, reinterpret_cast<sockaddr*>(&address), &address_size) != 0) {
+    const std::runtime_error error = systemError("Could not listen on port " + std::to_string(port));
+    ::close(fd);
+    throw error;
+  }
+  addListener(fd);
+  return ntohs(address.sin_port);
+}
+
+void TerminalServer::listenUnix(const std::string& path) {
+  sockaddr_un address{};
+  if (path.size() >= sizeof(address.sun_path)) {
+    throw std::runtime_error("Socket path too long " + path);
+  }
+  const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    throw systemError("Could not create a terminal socket");
+  }
+
+  address.sun_family = AF_UNIX;
+  std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+  ::unlink(path.c_str());
+  if (::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 or ::listen(fd, SOMAXCONN) != 0) {
+    const std::runtime_error error = systemError("Could not listen on " + path);
+    ::close(fd);
+    throw error;
+  }
+  unix_paths_.push_back(path);
+  addListener(fd);
+}
+
+void TerminalServer::run() {
+  std::array<epoll_event, kMaxEvents> events;
+  while (true) {
+    const int ready = ::epoll_wait(epoll_fd_, events.data(), kMaxEvents, -1);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw systemError("Terminal server wait failed");
+    }
+
+    for (int i = 0; i < ready; ++i) {
+      const int fd = events[i].data.fd;
+      if (fd == wake_fd_) {
+        uint64_t count;
+        static_cast<void>(::read(wake_fd_, &count, sizeof(count)));
+        return;
+      } else if (fd == fetched_fd_) {
+        uint64_t count;
+        static_cast<void>(::read(fetched_fd_, &count, sizeof(count)));
+        std::vector<int> fetched;
+        {
+          std::lock_guard<std::mutex> lock(fetched_mutex_);
+          fetched.swap(fetched_);
+        }
+        for (const int parked : fetched) {
+          // The connection may have gone, and its fd been reused, since
+          const auto connection = connections_.find(parked);
+          if (connection != connections_.end() and !resume(*connection->second)) {
+            close(parked);
+          }
+        }
+        continue;
+      } else if (std::find(listeners_.begin(), listeners_.end(), fd) != listeners_.end()) {
+        accept(fd);
+        continue;
+      }
+
+      const auto connection = connections_.find(fd);
+      if (connection == connections_.end()) {
+        continue;
+      }
+      bool open = true;
+      if (connection->second->parked and (events[i].events & (EPOLLHUP | EPOLLERR))) {
+        // Gone before its fetch came back, and epoll reports it whatever is watched
+        open = false;
+      } else if (events[i].events & EPOLLOUT) {
+        open = onWritable(*connection->second);
+      }
+      if (open and (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        open = onReadable(*connection->second);
+      }
+      if (!open) {
+        close(fd);
+      }
+    }
+  }
+}
+
+void TerminalServer::stop() {
+  const uint64_t count = 1;
+  static_cast<void>(::write(wake_fd_, &count, sizeof(count)));
+}
+
+TerminalServerStats TerminalServer::stats() const {
+  return TerminalServerStats{accepted_count_.load(), message_count_.load(), write_count_.load()};
+}
+
+void TerminalServer::addListener(int fd) {
+  epoll_event event{};
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+  if (::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) != 0) {
+    const std::runtime_error error = systemError("Could not watch a terminal socket");
+    ::close(fd);
+    throw error;
+  }
+  listeners_.push_back(fd);
+}
+
+void TerminalServer::accept(int listener) {
+  while (true) {
+    const int fd = ::accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      // EAGAIN once the backlog is empty, anything else is the terminal's problem
+      return;
+    }
+    // Responses are batched already, don't let Nagle hold them back.  Fails harmlessly on Unix sockets
+    const int on = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) != 0) {
+      ::close(fd);
+      continue;
+    }
+    connections_[fd].reset(new Connection(this, fd, machine_));
+    accepted_count_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+bool TerminalServer::onReadable(Connection& connection) {
+  if (connection.blocked or connection.parked) {
+    return true;
+  }
+
+  // Everything there is, then a single write of all the responses
+  while (!connection.blocked and !connection.parked) {
+    const ssize_t received =
+        ::recv(connection.fd, connection.in.data() + connection.in_size, kBufferSize - connection.in_size, 0);
+    if (received == 0) {
+      // The terminal hung up, it gets what was ready for it
+      flush(connection);
+      return false;
+    } else if (received < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN or errno == EWOULDBLOCK) {
+        break;
+      }
+      return false;
+    }
+
+    connection.in_size += received;
+    if (!handleFrames(connection)) {
+      return false;
+    }
+  }
+
+  if (!flush(connection)) {
+    return false;
+  }
+  watch(connection, connection.out_size > 0);
+  return true;
+}
+
+bool TerminalServer::onWritable(Connection& connection) {
+  if (!flush(connection)) {
+    return false;
+  }
+  if (connection.out_size > 0) {
+    return true;
+  }
+
+  // Drained, so handle the requests left over when the ring filled and go back to reading
+  watch(connection, false);
+  if (!handleFrames(connection) or !flush(connection)) {
+    return false;
+  }
+  watch(connection, connection.out_size > 0);
+  return true;
+}
+
+bool TerminalServer::handleFrames(Connection& connection) {
+  size_t offset = 0;
+  TerminalMessage message;
+  try {
+    while (true) {
+      if (kBufferSize - connection.out_size < kResponseFrameSize) {
+        if (!flush(connection)) {
+          return false;
+        }
+        if (kBufferSize - connection.out_size < kResponseFrameSize) {
+          // The terminal isn't reading, wait for it before reading more
+          watch(connection, true);
+          break;
+        }
+      }
+
+      const size_t frame = parseTerminalFrame(connection.in.data() + offset, connection.in_size - offset, message);
+      if (frame == 0 or park(connection, message)) {
+        break;
+      }
+      dispatch(connection, message);
+      offset += frame;
+    }
+  } catch (const std::exception& e) {
+    // Can't find the next frame after a bad length
+    return false;
+  }
+
+  // Keep the partial frame, if any, for the next read
+  std::memmove(connection.in.data(), connection.in.data() + offset, connection.in_size - offset);
+  connection.in_size -= offset;
+  return true;
+}
+
+bool TerminalServer::park(Connection& connection, const TerminalMessage& message) {
+  if ((message.type != MSG_CARD and message.type != MSG_PIN) or !message.validPayload()) {
+    return false;
+  }
+  // A swipe waits for the previous card's fetch, a pin for the card's own
+  connection.parked = connection.atm.notifyWhenFetched(&TerminalServer::onFetched, &connection);
+  return connection.parked;
+}
+
+void TerminalServer::onFetched(void* context) {
+  const Connection& connection = *static_cast<const Connection*>(context);
+  TerminalServer& server = *connection.server;
+  {
+    std::lock_guard<std::mutex> lock(server.fetched_mutex_);
+    server.fetched_.push_back(connection.fd);
+  }
+  const uint64_t count = 1;
+  static_cast<void>(::write(server.fetched_fd_, &count, sizeof(count)));
+}
+
+bool TerminalServer::resume(Connection& connection) {
+  if (!connection.parked) {
+    return true;
+  }
+  connection.parked = false;
+  if (!handleFrames(connection) or !flush(connection)) {
+    return false;
+  }
+  watch(connection, connection.out_size > 0);
+  return true;
+}
+
+void TerminalServer::dispatch(Connection& connection, const TerminalMessage& message) {
+  message_count_.fetch_add(1, std::memory_order_relaxed);
+  uint8_t status = STATUS_OK;
+  if (!message.validPayload()) {
+    status = STATUS_MALFORMED;
+  } else {
+    switch (message.type) {
+      case MSG_CARD:
+        connection.atm.cardReaderCB(message.accountNumber());
+        break;
+      case MSG_PIN:
+        connection.atm.enterPinCB(message.pin());
+        break;
+      case MSG_SELECT:
+        connection.atm.accountSelectCB(message.accountType());
+        break;
+      case MSG_ACTION:
+        connection.atm.accountManagementCB(message.action());
+        break;
+      case MSG_STATE:
+        break;
+    }
+    connection.atm.service();
+  }
+
+  uint8_t response[kResponseFrameSize];
+  const size_t size = encodeResponseFrame(
+      response, message.type, message.stan, static_cast<uint8_t>(connection.atm.getState()), status);
+  const size_t tail = (connection.out_head + connection.out_size) % kBufferSize;
+  const size_t first = std::min(size, kBufferSize - tail);
+  std::memcpy(connection.out.data() + tail, response, first);
+  std::memcpy(connection.out.data(), response + first, size - first);
+  connection.out_size += size;
+}
+
+bool TerminalServer::flush(Connection& connection) {
+  while (connection.out_size > 0) {
+    // The ring may wrap, in which case it goes out in two pieces of one write
+    const size_t first = std::min(connection.out_size, kBufferSize - connection.out_head);
+    iovec pieces[2] = {{connection.out.data() + connection.out_head, first},
+                       {connection.out.data(), connection.out_size - first}};
+    msghdr message{};
+    message.msg_iov = pieces;
+    message.msg_iovlen = first < connection.out_size ? 2 : 1;
+
+    // writev, without SIGPIPE when the terminal has gone away
+    const ssize_t sent = ::sendmsg(connection.fd, &message, MSG_NOSIGNAL);
+    write_count_.fetch_add(1, std::memory_order_relaxed);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN or errno == EWOULDBLOCK;
+    }
+    connection.out_head = (connection.out_head + sent) % kBufferSize;
+    connection.out_size -= sent;
+  }
+  return true;
+}
+
+void TerminalServer::watch(Connection& connection, bool blocked) {
+  connection.blocked = blocked;
+  const uint32_t watched = blocked ? EPOLLOUT : connection.parked ? 0 : EPOLLIN;
+  if (connection.watched == watched) {
+    return;
+  }
+  connection.watched = watched;
+  epoll_event event{};
+  event.events = watched;
+  event.data.fd = connection.fd;
+  ::epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, connection.fd, &event);
+}
+
+void TerminalServer::close(int fd) {
+  ::epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+  ::close(fd);
+  connections_.erase(fd);
+}
@@ -0,0 +1,160 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+#ifndef ATM_TERMINAL_SERVER_H
+#define ATM_TERMINAL_SERVER_H
+
+// C++ Standard Library
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// POSIX
+#include <sys/epoll.h>
+
+// ATM Controller
+#include "atm.h"
+#include "terminal_protocol.h"
+
+/// What a server has done so far
+struct TerminalServerStats {
+  uint64_t connections;
+  uint64_t messages;
+  /// Calls to writev, each sending every response ready at the time
+  uint64_t writes;
+};
+
+/**
+ * @brief Serves terminals over loopback TCP or Unix sockets, one ATM per connection, see terminal_protocol.h
+ * @details  A single thread runs an epoll loop over every connection.  Frames are parsed in place in the
+ *           connection's receive buffer and dispatched straight to the ATM callbacks, followed by service().  The
+ *           responses to everything a read brought in are collected in the connection's send ring and go out with
+ *           one writev.  A terminal that doesn't read its responses stops being read from once its ring fills, so
+ *           a slow terminal can't make the server buffer without bound.  The loop never waits on the host: a card or
+ *           pin that would wait for the account's profile fetch parks its connection, which picks up where it left
+ *           off once the fetch is back, while the other connections carry on.  To use more cores, run a server per
+ *           core on the same TCP port; listenTcp() sets SO_REUSEPORT so the kernel spreads connections over them.
+ */
+class TerminalServer {
+ public:
+  /// Size of each connection's receive buffer and send ring
+  static constexpr size_t kBufferSize = 64 * 1024;
+
+  /**
+   * @brief Constructor for the server
+   *
+   * @param machine  Backend of every connection's ATM
+   */
+  explicit TerminalServer(std::shared_ptr<Machine> machine);
+
+  /// Closes every connection and listening socket
+  ~TerminalServer();
+
+  TerminalServer(const TerminalServer&) = delete;
+  TerminalServer& operator=(const TerminalServer&) = delete;
+
+  /**
+   * @brief Accepts terminals on a loopback TCP port
+   *
+   * @param port  The port, 0 for any free one
+   * @return  The port listened on
+   */
+  uint16_t listenTcp(uint16_t port);
+
+  /// Accepts terminals on a Unix socket, replacing whatever is at path
+  void listenUnix(const std::string& path);
+
+  /// Serves terminals until stop() is called
+  void run();
+
+  /// Makes run() return, from any thread
+  void stop();
+
+  TerminalServerStats stats() const;
+
+ private:
+  struct Connection {
+    Connection(TerminalServer* server, int fd, std::shared_ptr<Machine> machine) :
+      server(server), fd(fd), atm(std::move(machine)) {}
+
+    TerminalServer* server;
+    int fd;
+    ATM atm;
+
+    /// Received bytes not parsed yet, from the start of in
+    std::array<uint8_t, kBufferSize> in;
+    size_t in_size{0};
+
+    /// Responses not sent yet, out_size bytes from out_head, wrapping around
+    std::array<uint8_t, kBufferSize> out;
+    size_t out_head{0};
+    size_t out_size{0};
+
+    /// Waiting for the socket to take more responses before reading more requests
+    bool blocked{false};
+
+    /// Waiting for the ATM's profile fetch before handling the next request, which is left at the start of in
+    bool parked{false};
+
+    /// Events asked of epoll
+    uint32_t watched{EPOLLIN};
+  };
+
+  void addListener(int fd);
+  void accept(int listener);
+
+  /// Reads what's there and handles it, false if the connection is done with
+  bool onReadable(Connection& connection);
+
+  /// Sends pending responses and picks up where reading stopped, false if the connection is done with
+  bool onWritable(Connection& connection);
+
+  /// Handles the complete frames received so far, as many as there is room to respond to
+  bool handleFrames(Connection& connection);
+
+  /// Parks the connection if the request would wait on its ATM's profile fetch, true if it did
+  bool park(Connection& connection, const TerminalMessage& message);
+
+  /// Called on a prefetch worker once a parked connection's fetch is back
+  static void onFetched(void* context);
+
+  /// Handles the requests a parked connection held back once its fetch is back, false if the connection is done with
+  bool resume(Connection& connection);
+
+  /// Runs a request against the connection's ATM and queues the response
+  void dispatch(Connection& connection, const TerminalMessage& message);
+
+  /// writev()s the send ring, false if the connection broke
+  bool flush(Connection& connection);
+
+  /// Switches epoll between reading and waiting to write, and to neither while parked with nothing to send
+  void watch(Connection& connection, bool blocked);
+
+  void close(int fd);
+
+  std::shared_ptr<Machine> machine_;
+  int epoll_fd_;
+  /// Written to by stop()
+  int wake_fd_;
+  /// Written to by onFetched()
+  int fetched_fd_;
+  /// Connections whose fetches came back since the loop last looked, guarded by fetched_mutex_
+  std::mutex fetched_mutex_;
+  std::vector<int> fetched_;
+  std::vector<int> listeners_;
+  std::vector<std::string> unix_paths_;
+  std::unordered_map<int, std::unique_ptr<Connection>> connections_;
+
+  std::atomic<uint64_t> accepted_count_;
+  std::atomic<uint64_t> message_count_;
+  std::atomic<uint64_t> write_count_;
+};
+
+#endif  // ATM_TERMINAL_SERVER_H
@@ -0,0 +1,255 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+// C++ Standard Library
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+// ATM Controller
+#include "trace.h"
+
+/// One event, every field atomic so a dump can read a slot while its owner overwrites it
+struct TraceSlot {
+  /// 2 * position + 1 while being written, 2 * position + 2 once written
+  std::atomic<uint64_t> sequence{0};
+  std::atomic<uint64_t> time_ns{0};
+  std::atomic<uint64_t> session{0};
+  std::atomic<const char*> name{nullptr};
+  std::atomic<const char*> detail{nullptr};
+  /// 'B', 'E' or 'i' as in the Chrome trace event format
+  std::atomic<char> phase{0};
+};
+
+/// A recorded event, as read back out of a ring
+struct TraceEvent {
+  uint64_t time_ns;
+  uint64_t session;
+  const char* name;
+  const char* detail;
+  char phase;
+};
+
+/// Events of one thread.  Only the owner writes, anyone may read
+class TraceRing {
+ public:
+  TraceRing(size_t capacity, uint32_t threadId) : thread_id_(threadId) {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    slots_.reset(new TraceSlot[size]);
+    mask_ = size - 1;
+  }
+
+  void record(char phase, const char* name, const char* detail, uint64_t session) {
+    const uint64_t position = head_.load(std::memory_order_relaxed);
+    TraceSlot& slot = slots_[position & mask_];
+    slot.sequence.store(2 * position + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.time_ns.store(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now().time_since_epoch()).count()),
+                       std::memory_order_relaxed);
+    slot.session.store(session, std::memory_order_relaxed);
+    slot.name.store(name, std::memory_order_relaxed);
+    slot.detail.store(detail, std::memory_order_relaxed);
+    slot.phase.store(phase, std::memory_order_relaxed);
+    slot.sequence.store(2 * position + 2, std::memory_order_release);
+    head_.store(position + 1, std::memory_order_release);
+  }
+
+  /// Copies out the events still in the ring, oldest first, skipping any being overwritten
+  void read(std::vector<TraceEvent>& events) const {
+    const uint64_t head = head_.load(std::memory_order_acquire);
+    const uint64_t start = std::max(start_.load(std::memory_order_relaxed), head > mask_ ? head - mask_ - 1 : 0);
+    for (uint64_t position = start; position < head; ++position) {
+      const TraceSlot& slot = slots_[position & mask_];
+      const uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+      TraceEvent event{slot.time_ns.load(std::memory_order_relaxed),
+                       slot.session.load(std::memory_order_relaxed),
+                       slot.name.load(std::memory_order_relaxed),
+                       slot.detail.load(std::memory_order_relaxed),
+                       slot.phase.load(std::memory_order_relaxed)};
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (sequence == 2 * position + 2 and slot.sequence.load(std::memory_order_relaxed) == sequence) {
+        events.push_back(event);
+      }
+    }
+  }
+
+  /// Drops everything recorded so far
+  void clear() {
+    start_.store(head_.load(std::memory_order_acquire), std::memory_order_relaxed);
+  }
+
+  uint32_t threadId() const {
+    return thread_id_;
+  }
+
+ private:
+  const uint32_t thread_id_;
+  std::unique_ptr<TraceSlot[]> slots_;
+  uint64_t mask_;
+
+  /// Position of the next event
+  std::atomic<uint64_t> head_{0};
+
+  /// Position of the oldest event not cleared
+  std::atomic<uint64_t> start_{0};
+};
+
+static std::atomic<bool> g_tracing{false};
+static std::atomic<size_t> g_events_per_thread{kDefaultTraceEventsPerThread};
+static std::atomic<uint64_t> g_last_session_id{0};
+
+/// Every thread's ring, kept after the thread exits so its events can still be dumped
+static std::mutex g_rings_mutex;
+static std::vector<std::unique_ptr<TraceRing>> g_rings;
+
+static thread_local TraceRing* t_ring = nullptr;
+static thread_local uint64_t t_session = 0;
+
+/// Records into the calling thread's ring, which is made on its first event
+static void record(char phase, const char* name, const char* detail) {
+  if (t_ring == nullptr) {
+    std::lock_guard<std::mutex> lock(g_rings_mutex);
+    g_rings.emplace_back(new TraceRing(g_events_per_thread.load(), static_cast<uint32_t>(g_rings.size() + 1)));
+    t_ring = g_rings.back().get();
+  }
+  t_ring->record(phase, name, detail, t_session);
+}
+
+/// Writes a string as a JSON string literal
+static void writeJsonString(std::ostream& out, const char* value) {
+  out << '"';
+  for (const char* c = value; *c != '\0'; ++c) {
+    if (*c == '"' or *c == '\\') {
+      out << '\\' << *c;
+    } else if (static_cast<unsigned char>(*c) < 0x20) {
+      char escaped[8];
+      std::snprintf(escaped, sizeof(escaped), "\\u%04x", *c);
+      out << escaped;
+    } else {
+      out << *c;
+    }
+  }
+  out << '"';
+}
+
+void enableTracing(size_t eventsPerThread) {
+  g_events_per_thread = std::max<size_t>(eventsPerThread, 2);
+  g_tracing.store(true, std::memory_order_release);
+}
+
+void disableTracing() {
+  g_tracing.store(false, std::memory_order_release);
+}
+
+bool tracingEnabled() {
+  return g_tracing.load(std::memory_order_relaxed);
+}
+
+void clearTrace() {
+  std::lock_guard<std::mutex> lock(g_rings_mutex);
+  for (auto& ring : g_rings) {
+    ring->clear();
+  }
+}
+
+uint64_t newTraceSessionId() {
+  return g_last_session_id.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+void traceInstant(const char* name, const char* detail) {
+  if (tracingEnabled()) {
+    record('i', name, detail);
+  }
+}
+
+size_t writeChromeTrace(std::ostream& out) {
+  std::vector<std::pair<uint32_t, std::vector<TraceEvent>>> threads;
+  {
+    std::lock_guard<std::mutex> lock(g_rings_mutex);
+    for (const auto& ring : g_rings) {
+      threads.emplace_back(ring->threadId(), std::vector<TraceEvent>{});
+      ring->read(threads.back().second);
+    }
+  }
+
+  // Times are relative to the earliest event, in microseconds
+  uint64_t epoch_ns = UINT64_MAX;
+  for (const auto& thread : threads) {
+    if (!thread.second.empty()) {
+      epoch_ns = std::min(epoch_ns, thread.second.front().time_ns);
+    }
+  }
+
+  size_t written = 0;
+  out << "{\"traceEvents\":[";
+  for (const auto& thread : threads) {
+    if (thread.second.empty()) {
+      continue;
+    }
+    out << (written > 0 ? ",\n" : "\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread.first
+        << ",\"args\":{\"name\":\"thread " << thread.first << "\"}}";
+
+    for (const TraceEvent& event : thread.second) {
+      char timestamp[32];
+      std::snprintf(timestamp, sizeof(timestamp), "%.3f", (event.time_ns - epoch_ns) / 1000.0);
+      out << ",\n{\"name\":";
+      writeJsonString(out, event.name);
+      out << ",\"cat\":\"atm\",\"ph\":\"" << event.phase << "\",\"ts\":" << timestamp << ",\"pid\":1,\"tid\":"
+          << thread.first;
+      if (event.phase == 'i') {
+        out << ",\"s\":\"t\"";
+      }
+      out << ",\"args\":{\"session\":" << event.session;
+      if (event.detail != nullptr) {
+        out << ",\"detail\":";
+        writeJsonString(out, event.detail);
+      }
+      out << "}}";
+      ++written;
+    }
+  }
+  out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+  return written;
+}
+
+size_t writeChromeTraceFile(const std::string& path) {
+  std::ofstream out(path, std::ios::trunc);
+  const size_t written = writeChromeTrace(out);
+  out.flush();
+  if (!out) {
+    throw std::runtime_error("Could not write trace " + path);
+  }
+  return written;
+}
+
+TraceSession::TraceSession(uint64_t sessionId) : previous_(t_session) {
+  t_session = sessionId;
+}
+
+TraceSession::~TraceSession() {
+  t_session = previous_;
+}
+
+TraceSpan::TraceSpan(const char* name, const char* detail) : name_(tracingEnabled() ? name : nullptr) {
+  if (name_ != nullptr) {
+    record('B', name_, detail);
+  }
+}
+
+TraceSpan::~TraceSpan() {
+  if (name_ != nullptr) {
+    record('E', name_, nullptr);
+  }
+}
@@ -0,0 +1,92 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+#ifndef ATM_TRACE_H
+#define ATM_TRACE_H
+
+// C++ Standard Library
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+/**
+ * Span tracing of sessions, for finding where the time of a slow session went.  Spans are recorded as begin / end
+ * events into a ring owned by the recording thread, so recording takes no lock and never waits on another thread.
+ * Every event is tagged with the session it was recorded for, a number handed out at card swipe.  The rings are
+ * written out in the Chrome trace event format, which chrome://tracing and ui.perfetto.dev load as a timeline with
+ * a row per thread.
+ *
+ * Tracing is off until enableTracing(), and a span then costs one relaxed load.
+ */
+
+/// Events each thread keeps by default, older ones are overwritten
+static constexpr size_t kDefaultTraceEventsPerThread = 16384;
+
+/**
+ * @brief Starts recording spans
+ *
+ * @param eventsPerThread  Size of the ring of each thread that records from now on, rounded up to a power of two
+ */
+void enableTracing(size_t eventsPerThread = kDefaultTraceEventsPerThread);
+
+/// Stops recording spans, what was recorded is kept
+void disableTracing();
+
+bool tracingEnabled();
+
+/// Forgets every recorded event, only while nothing is recording
+void clearTrace();
+
+/// A new session ID, never 0
+uint64_t newTraceSessionId();
+
+/// Records a point in time, e.g. a transition being queued
+void traceInstant(const char* name, const char* detail = nullptr);
+
+/**
+ * @brief Writes every thread's recorded events as Chrome trace event JSON
+ * @details  Meant for when sessions are idle, events recorded during the dump may or may not make it in.
+ *
+ * @return  The number of events written
+ */
+size_t writeChromeTrace(std::ostream& out);
+
+/// writeChromeTrace() to a file, throws if it can't be written
+size_t writeChromeTraceFile(const std::string& path);
+
+/// Tags the events the calling thread records during its lifetime with a session
+class TraceSession {
+ public:
+  explicit TraceSession(uint64_t sessionId);
+  ~TraceSession();
+
+  TraceSession(const TraceSession&) = delete;
+  TraceSession& operator=(const TraceSession&) = delete;
+
+ private:
+  const uint64_t previous_;
+};
+
+/// Records a begin event on construction and the matching end event on destruction
+class TraceSpan {
+ public:
+  /**
+   * @brief Begins the span, if tracing is on
+   *
+   * @param name  What the span covers, a string literal
+   * @param detail  Shown with the span, a string literal or nullptr
+   */
+  explicit TraceSpan(const char* name, const char* detail = nullptr);
+  ~TraceSpan();
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+ private:
+  /// nullptr if tracing was off when the span began
+  const char* const name_;
+};
+
+#endif  // ATM_TRACE_H
@@ -0,0 +1,95 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ *
+ * Runs a fleet of simulated ATMs with tracing on and writes the trace as Chrome trace event JSON, to be opened in
+ * chrome://tracing or ui.perfetto.dev.  Each ATM runs on its own thread against one shared Machine, swiping cards
+ * back to back.  Every span carries the session it belongs to, so a slow session can be picked out and followed
+ * from the swipe through its transitions and Machine calls.
+ *
+ * Usage: trace_sessions <trace.json> [atms] [sessions per atm]
+ */
+
+// C++ Standard Library
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// POSIX
+#include <fcntl.h>
+#include <unistd.h>
+
+// ATM Controller
+#include "atm.h"
+#include "trace.h"
+
+/// The simulated cards, see machine.h
+static const std::vector<std::pair<uint64_t, uint16_t>> kCards = {{1234123412341234, 1234}, {2345234523452345, 2345}};
+
+/// One customer at the ATM: check the balance, take some cash out, put some back
+static void runSession(ATM& atm, size_t session) {
+  const auto& card = kCards[session % kCards.size()];
+  atm.cardReaderCB(card.first);
+  atm.service();
+  atm.enterPinCB(card.second);
+  atm.service();
+  atm.accountSelectCB(session % 3 == 0 ? AccountType::SAVINGS : AccountType::CHECKING);
+  atm.service();
+  atm.accountManagementCB(ManagementAction{ManagementAction::ManagementActionType::BALANCE});
+  atm.accountManagementCB(ManagementAction{ManagementAction::ManagementActionType::WITHDRAW, 20});
+  atm.accountManagementCB(ManagementAction{ManagementAction::ManagementActionType::DEPOSIT, 40});
+  atm.accountManagementCB(ManagementAction{ManagementAction::ManagementActionType::DONE});
+  atm.service();
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " <trace.json> [atms] [sessions per atm]" << std::endl;
+    return 1;
+  }
+  const int atms = argc > 2 ? std::max(1, std::atoi(argv[2])) : 4;
+  const size_t sessions = argc > 3 ? std::max(1, std::atoi(argv[3])) : 100;
+
+  // The controller narrates every transition on stdout, which would drown out the summary
+  std::fflush(stdout);
+  const int saved_stdout = ::dup(STDOUT_FILENO);
+  const int null_fd = ::open("/dev/null", O_WRONLY);
+  ::dup2(null_fd, STDOUT_FILENO);
+
+  // Room for every event, so the start of the run isn't overwritten
+  enableTracing(sessions * 64);
+  const auto machine = std::make_shared<Machine>();
+  std::vector<std::thread> fleet;
+  for (int i = 0; i < atms; ++i) {
+    fleet.emplace_back([machine, sessions]() {
+      ATM atm(machine);
+      for (size_t session = 0; session < sessions; ++session) {
+        runSession(atm, session);
+      }
+    });
+  }
+  for (auto& atm : fleet) {
+    atm.join();
+  }
+  disableTracing();
+
+  std::cout.flush();
+  std::fflush(stdout);
+  ::dup2(saved_stdout, STDOUT_FILENO);
+  ::close(null_fd);
+  ::close(saved_stdout);
+
+  try {
+    const size_t events = writeChromeTraceFile(argv[1]);
+    std::printf("%zu events of %zu sessions on %d ATMs written to %s\n", events, sessions * atms, atms, argv[1]);
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
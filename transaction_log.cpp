@@ -0,0 +1,177 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+// C++ Standard Library
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+// POSIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// ATM Controller
+#include "transaction_log.h"
+
+constexpr size_t TransactionLog::kBufferedRecords;
+constexpr size_t TransactionLogReader::kWindowSize;
+
+/// Transaction logs start with this, followed by the record size
+static constexpr char kTransactionLogMagic[8] = {'A', 'T', 'M', 'T', 'X', 'L', 'G', '1'};
+
+struct TransactionLogHeader {
+  char magic[8];
+  uint64_t record_size;
+};
+
+/// Writes all of data, retrying short writes
+static bool writeAll(int fd, const void* data, size_t size) {
+  const char* bytes = static_cast<const char*>(data);
+  while (size > 0) {
+    const ssize_t written = ::write(fd, bytes, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    bytes += written;
+    size -= written;
+  }
+  return true;
+}
+
+int64_t toTransactionTime(std::chrono::system_clock::time_point time) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(time.time_since_epoch()).count();
+}
+
+TransactionLog::TransactionLog(const std::string& path) : path_(path), fd_(-1) {
+  fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd_ < 0) {
+    throw std::runtime_error("Could not open transaction log " + path);
+  }
+
+  struct stat status {};
+  if (::fstat(fd_, &status) == 0 and status.st_size == 0) {
+    TransactionLogHeader header{};
+    std::memcpy(header.magic, kTransactionLogMagic, sizeof(header.magic));
+    header.record_size = sizeof(TransactionRecord);
+    if (!writeAll(fd_, &header, sizeof(header))) {
+      ::close(fd_);
+      throw std::runtime_error("Could not write transaction log " + path);
+    }
+  } else if (status.st_size > static_cast<off_t>(sizeof(TransactionLogHeader))) {
+    // A crash may have torn the last record, pad it out so new records stay aligned.  The padded record reads back
+    // as garbage, which is better than every record after it reading back shifted.
+    const size_t torn = (status.st_size - sizeof(TransactionLogHeader)) % sizeof(TransactionRecord);
+    if (torn != 0) {
+      const char padding[sizeof(TransactionRecord)] = {};
+      writeAll(fd_, padding, sizeof(TransactionRecord) - torn);
+    }
+  }
+
+  buffer_.reserve(kBufferedRecords);
+}
+
+TransactionLog::~TransactionLog() {
+  try {
+    flush();
+  } catch (const std::exception& e) {
+    // Nothing left to tell
+  }
+  ::close(fd_);
+}
+
+void TransactionLog::append(const TransactionRecord& record) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  buffer_.push_back(record);
+  if (buffer_.size() >= kBufferedRecords) {
+    writeBuffer();
+  }
+}
+
+void TransactionLog::flush(bool sync) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  writeBuffer();
+  if (sync and ::fsync(fd_) != 0) {
+    throw std::runtime_error("Could not sync transaction log " + path_);
+  }
+}
+
+void TransactionLog::writeBuffer() {
+  if (buffer_.empty()) {
+    return;
+  }
+  const bool ok = writeAll(fd_, buffer_.data(), buffer_.size() * sizeof(TransactionRecord));
+  buffer_.clear();
+  if (!ok) {
+    throw std::runtime_error("Could not write transaction log " + path_);
+  }
+}
+
+TransactionLogReader::TransactionLogReader(const std::string& path) :
+  fd_(-1),
+  file_size_(0),
+  offset_(sizeof(TransactionLogHeader)),
+  window_(nullptr),
+  window_offset_(0),
+  window_size_(0) {
+  fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd_ < 0) {
+    throw std::runtime_error("Could not open transaction log " + path);
+  }
+
+  struct stat status {};
+  TransactionLogHeader header{};
+  if (::fstat(fd_, &status) != 0 or ::pread(fd_, &header, sizeof(header), 0) != sizeof(header) or
+      std::memcmp(header.magic, kTransactionLogMagic, sizeof(header.magic)) != 0 or
+      header.record_size != sizeof(TransactionRecord)) {
+    ::close(fd_);
+    throw std::runtime_error("Not a transaction log " + path);
+  }
+  file_size_ = status.st_size;
+}
+
+TransactionLogReader::~TransactionLogReader() {
+  if (window_ != nullptr) {
+    ::munmap(window_, window_size_);
+  }
+  ::close(fd_);
+}
+
+bool TransactionLogReader::next(TransactionRecord& record) {
+  if (offset_ + sizeof(TransactionRecord) > file_size_) {
+    // Done, or only a torn record is left
+    return false;
+  }
+
+  if (window_ == nullptr or offset_ + sizeof(TransactionRecord) > window_offset_ + window_size_) {
+    mapWindow();
+  }
+  std::memcpy(&record, window_ + (offset_ - window_offset_), sizeof(TransactionRecord));
+  offset_ += sizeof(TransactionRecord);
+  return true;
+}
+
+void TransactionLogReader::mapWindow() {
+  if (window_ != nullptr) {
+    // Unmapping drops the pages already read from this process, keeping memory flat
+    ::munmap(window_, window_size_);
+    window_ = nullptr;
+  }
+
+  static const uint64_t page_size = ::sysconf(_SC_PAGESIZE);
+  window_offset_ = offset_ - offset_ % page_size;
+  window_size_ = std::min<uint64_t>(kWindowSize, file_size_ - window_offset_);
+  void* mapped = ::mmap(nullptr, window_size_, PROT_READ, MAP_PRIVATE, fd_, window_offset_);
+  if (mapped == MAP_FAILED) {
+    throw std::runtime_error("Could not map transaction log");
+  }
+  window_ = static_cast<char*>(mapped);
+  ::madvise(window_, window_size_, MADV_SEQUENTIAL);
+}
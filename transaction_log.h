@@ -0,0 +1,123 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+#ifndef ATM_TRANSACTION_LOG_H
+#define ATM_TRANSACTION_LOG_H
+
+// C++ Standard Library
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// POSIX
+#include <sys/types.h>
+
+/// One applied debit or credit, as stored in the transaction log
+struct TransactionRecord {
+  /// When the ledger applied it, microseconds since the Unix epoch
+  int64_t time_us;
+  uint64_t account_number;
+  uint64_t transaction_id;
+  /// Negative for a debit
+  int32_t amount;
+  /// Balance of the changed account type right after this transaction
+  int32_t balance;
+  /// AccountType of the balance that changed
+  uint32_t account_type;
+  uint32_t reserved;
+};
+
+static_assert(sizeof(TransactionRecord) == 40, "Transaction log records are a fixed 40 bytes on disk");
+
+/// Microseconds since the Unix epoch, the unit of TransactionRecord::time_us
+int64_t toTransactionTime(std::chrono::system_clock::time_point time);
+
+/**
+ * @brief Append-only file of every transaction applied to the ledger
+ * @details  Records are fixed size and copied into an in-memory buffer, which is written out with one write() when
+ *           it fills up or on flush(), so appending costs a memcpy on the transaction path.  A crash can lose the
+ *           buffered records and leave a partial record at the end of the file, which readers ignore.
+ */
+class TransactionLog {
+ public:
+  /// Records buffered before they are written out
+  static constexpr size_t kBufferedRecords = 1024;
+
+  /**
+   * @brief Opens or creates a transaction log, appending after any records already in it
+   *
+   * @param path  The log file
+   */
+  explicit TransactionLog(const std::string& path);
+
+  /// Writes out anything still buffered
+  ~TransactionLog();
+
+  TransactionLog(const TransactionLog&) = delete;
+  TransactionLog& operator=(const TransactionLog&) = delete;
+
+  /// Adds a record to the end of the log
+  void append(const TransactionRecord& record);
+
+  /// Writes out the buffered records, and syncs them to disk if asked
+  void flush(bool sync = false);
+
+ private:
+  /// Writes out the buffer.  Must hold mutex_
+  void writeBuffer();
+
+  const std::string path_;
+  int fd_;
+
+  /// Guards buffer_ and the file
+  std::mutex mutex_;
+  std::vector<TransactionRecord> buffer_;
+};
+
+/**
+ * @brief Streams the records of a transaction log from start to end
+ * @details  The file is mapped a window at a time with MADV_SEQUENTIAL, so the kernel reads ahead and the reader
+ *           holds at most one window of the file however long it is.
+ */
+class TransactionLogReader {
+ public:
+  /// Bytes of the file mapped at once
+  static constexpr size_t kWindowSize = 16 << 20;
+
+  /// Opens a transaction log for reading, throws if it is missing or not a transaction log
+  explicit TransactionLogReader(const std::string& path);
+
+  ~TransactionLogReader();
+
+  TransactionLogReader(const TransactionLogReader&) = delete;
+  TransactionLogReader& operator=(const TransactionLogReader&) = delete;
+
+  /**
+   * @brief Reads the next record
+   *
+   * @param record  Filled in with the record
+   * @return  False once every complete record has been read
+   */
+  bool next(TransactionRecord& record);
+
+ private:
+  /// Maps the window holding the record at offset_
+  void mapWindow();
+
+  int fd_;
+  uint64_t file_size_;
+
+  /// Offset of the next record in the file
+  uint64_t offset_;
+
+  /// The mapped window, nullptr if none
+  char* window_;
+  uint64_t window_offset_;
+  size_t window_size_;
+};
+
+#endif  // ATM_TRANSACTION_LOG_H
@@ -3,59 +3,1849 @@
  * Luc Bettaieb, 2021
  */
 
+// C++ Standard Library
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <thread>
+
+// POSIX
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
 // Google Testing
 #include <gtest/gtest.h>
 
-// ATM Controller
-#include "atm.h"
+// ATM Controller
+#include "atm.h"
+#include "atm_fleet.h"
+#include "bin_router.h"
+#include "branch_simulation.h"
+#include "pin_store.h"
+#include "stand_in.h"
+#include "statement.h"
+#include "terminal_server.h"
+#include "trace.h"
+
+const uint64_t kTestAccountNum = 1234123412341234;
+const uint16_t kTestAccountPin = 1234;
+const int kTestAccountCheckingBalance = 1000;
+const int kTestAccountSavingsBalance = 10000;
+
+const int kTestAccountSavingsWithdrawLimit = 1000;
+const int kTestAccountCheckingWithdrawLimit = 5000;
+
+/// In-memory backend with a single account and no security trackers
+struct FakeBackend {
+  bool verifyPin(uint64_t, uint16_t pin) {
+    return pin == kTestAccountPin;
+  }
+  Balances getAccountBalances(uint64_t) {
+    return Balances{kTestAccountCheckingBalance, kTestAccountSavingsBalance};
+  }
+  bool updateAccountBalance(uint64_t, AccountType, int amount, TransactionId) {
+    ++updates;
+    net_change += amount;
+    return true;
+  }
+  uint getAvailableCash() {
+    return cash;
+  }
+  void disburseCash(uint amount) {
+    if (jammed) {
+      throw std::runtime_error("Dispenser jammed");
+    }
+    cash -= amount;
+  }
+  TransactionId newTransactionId() {
+    return ++last_transaction_id;
+  }
+
+  int updates{0};
+  int net_change{0};
+  uint cash{500};
+  bool jammed{false};
+  TransactionId last_transaction_id{0};
+};
+
+static_assert(IsMachineBackend<Machine>::value, "Machine must be a backend");
+static_assert(IsMachineBackend<FakeBackend>::value, "FakeBackend must be a backend");
+static_assert(IsMachineBackend<AnyBackend>::value, "AnyBackend must be a backend");
+static_assert(!IsMachineBackend<Balances>::value, "Balances is not a backend");
+static_assert(IsMachineBackend<StandInBackend<Machine>>::value, "StandInBackend must be a backend");
+static_assert(HasVelocityTracker<StandInBackend<Machine>>::value, "StandInBackend forwards the host's trackers");
+static_assert(!HasVelocityTracker<StandInBackend<FakeBackend>>::value, "StandInBackend only has the host's trackers");
+
+TEST(MachineTest, machineInit)
+{
+  Machine m{};
+  EXPECT_TRUE(m.verifyPin(kTestAccountNum, kTestAccountPin));
+  EXPECT_TRUE(!m.verifyPin(kTestAccountNum, kTestAccountPin + 1));
+
+  EXPECT_TRUE(m.getAccountBalances(kTestAccountNum).get(AccountType::CHECKING) == kTestAccountCheckingBalance);
+  EXPECT_TRUE(m.getAccountBalances(kTestAccountNum).get(AccountType::SAVINGS) == kTestAccountSavingsBalance);
+  EXPECT_TRUE(m.getAccountBalances(kTestAccountNum).limit(AccountType::CHECKING) == kTestAccountCheckingWithdrawLimit);
+  EXPECT_TRUE(m.getAccountBalances(kTestAccountNum).limit(AccountType::SAVINGS) == kTestAccountSavingsWithdrawLimit);
+
+  EXPECT_TRUE(m.getAvailableCash() == kAvailableCashLogged);
+}
+
+TEST(MachineTest, machineUpdate)
+{
+  Machine m{};
+
+  m.getAccountBalances(kTestAccountNum).get(AccountType::CHECKING) += 100;
+  EXPECT_TRUE(m.getAccountBalances(kTestAccountNum).get(AccountType::CHECKING) == kTestAccountCheckingBalance);
+  EXPECT_FALSE(m.getAccountBalances(kTestAccountNum).get(AccountType::CHECKING) == kTestAccountCheckingBalance + 100);
+}
+
+TEST(MachineTest, machineDisburse)
+{
+  Machine m{};
+
+  bool except = false;
+  try {
+    m.disburseCash(kAvailableCashLogged+1);
+  } catch(std::exception& e) {
+    except = true;
+  }
+  EXPECT_TRUE(except);
+
+  EXPECT_TRUE(m.getAvailableCash() == kAvailableCashLogged);
+  m.disburseCash(100);
+  // Would call m.updateAccountBalance(account, -100);
+  // But no server interaction exsits
+  EXPECT_TRUE(m.getAvailableCash() == kAvailableCashLogged-100);
+}
+
+TEST(MachineTest, machineLedgerIdempotent)
+{
+  Machine m{};
+
+  const TransactionId debit = m.newTransactionId();
+  const TransactionId credit = m.newTransactionId();
+  EXPECT_FALSE(debit == credit);
+  EXPECT_FALSE(debit == kNoTransactionId);
+
+  EXPECT_TRUE(m.updateAccountBalance(kTestAccountNum, AccountType::CHECKING, -100, debit));
+  EXPECT_TRUE(m.getAccountBalances(kTestAccountNum).get(AccountType::CHECKING) == kTestAccountCheckingBalance - 100);
+
+  // A retry of the same debit is a no-op
+  EXPECT_FALSE(m.updateAccountBalance(kTestAccountNum, AccountType::CHECKING, -100, debit));
+  EXPECT_TRUE(m.getAccountBalances(kTestAccountNum).get(AccountType::CHECKING) == kTestAccountCheckingBalance - 100);
+
+  EXPECT_TRUE(m.updateAccountBalance(kTestAccountNum, AccountType::SAVINGS, 50, credit));
+  EXPECT_TRUE(m.getAccountBalances(kTestAccountNum).get(AccountType::SAVINGS) == kTestAccountSavingsBalance + 50);
+}
+
+TEST(MachineTest, machineVersionedUpdate)
+{
+  Machine m{};
+  const Balances before = m.getAccountBalances(kTestAccountNum);
+
+  // Moving the account on makes the earlier read stale
+  m.updateAccountBalance(kTestAccountNum, AccountType::SAVINGS, 10, m.newTransactionId());
+  const Balances after = m.getAccountBalances(kTestAccountNum);
+  EXPECT_TRUE(after.version == before.version + 1);
+
+  const TransactionId id = m.newTransactionId();
+  EXPECT_TRUE(m.updateAccountBalanceIfVersion(kTestAccountNum, AccountType::CHECKING, -100, before.version, id) ==
+              UPDATE_CONFLICT);
+  EXPECT_TRUE(m.getAccountBalances(kTestAccountNum).get(AccountType::CHECKING) == kTestAccountCheckingBalance);
+
+  // The same transaction goes through against the fresh version, once
+  EXPECT_TRUE(m.updateAccountBalanceIfVersion(kTestAccountNum, AccountType::CHECKING, -100, after.version, id) ==
+              UPDATE_APPLIED);
+  EXPECT_TRUE(m.updateAccountBalanceIfVersion(kTestAccountNum, AccountType::CHECKING, -100, after.version + 1, id) ==
+              UPDATE_DUPLICATE);
+  EXPECT_TRUE(m.getAccountBalances(kTestAccountNum).get(AccountType::CHECKING) == kTestAccountCheckingBalance - 100);
+  EXPECT_TRUE(m.getAccountBalances(kTestAccountNum).version == after.version + 1);
+}
+
+TEST(AccountTest, staleSessions)
+{
+  const auto m = std::make_shared<Machine>();
+  Account first(m, kTestAccountNum);
+  Account second(m, kTestAccountNum);
+  for (Account* a : {&first, &second}) {
+    a->unlock(kTestAccountPin);
+    a->selectType(AccountType::CHECKING);
+  }
+
+  // Both sessions saw the full balance, only one of them gets to take most of it
+  first.withdraw(800);
+  bool except = false;
+  try {
+    second.withdraw(800);
+  } catch (const std::exception& e) {
+    except = true;
+  }
+  EXPECT_TRUE(except);
+  EXPECT_TRUE(second.getBalance() == kTestAccountCheckingBalance - 800);
+
+  // And neither session's change is lost
+  second.deposit(50);
+  first.withdraw(100);
+  EXPECT_TRUE(m->getAccountBalances(kTestAccountNum).get(AccountType::CHECKING) == kTestAccountCheckingBalance - 850);
+  EXPECT_TRUE(first.getBalance() == kTestAccountCheckingBalance - 850);
+
+  // A batch is run again against the fresh balance, and refused if it no longer fits
+  const ManagementBatchResult batch = second.applyBatch({{ManagementAction::ManagementActionType::WITHDRAW, 100},
+                                                         {ManagementAction::ManagementActionType::WITHDRAW, 100}});
+  EXPECT_FALSE(batch.applied);
+  EXPECT_TRUE(m->getAccountBalances(kTestAccountNum).get(AccountType::CHECKING) == kTestAccountCheckingBalance - 850);
+  EXPECT_TRUE(m->getAvailableCash() == kAvailableCashLogged - 900);
+}
+
+TEST(DedupCacheTest, boundedWindow)
+{
+  DedupCache cache(64, std::chrono::seconds(10));
+  const auto start = DedupCache::Clock::now();
+
+  EXPECT_TRUE(cache.insert(1, start));
+  EXPECT_FALSE(cache.insert(1, start + std::chrono::seconds(5)));
+  EXPECT_TRUE(cache.contains(1, start + std::chrono::seconds(5)));
+
+  // Forgotten once the window has passed
+  EXPECT_FALSE(cache.contains(1, start + std::chrono::seconds(11)));
+  EXPECT_TRUE(cache.insert(1, start + std::chrono::seconds(11)));
+
+  // Never grows past capacity, and refuses new ids rather than forget ones still inside the window
+  size_t refused = 0;
+  for (TransactionId id = 100; id < 100 + 10 * cache.capacity(); ++id) {
+    try {
+      cache.insert(id, start + std::chrono::seconds(11));
+    } catch(std::exception& e) {
+      refused += std::string(e.what()).find("E12351") == 0;
+    }
+  }
+  EXPECT_TRUE(cache.size() <= cache.capacity());
+  EXPECT_TRUE(refused >= 9 * cache.capacity());
+  EXPECT_FALSE(cache.insert(100, start + std::chrono::seconds(12)));
+  EXPECT_TRUE(cache.contains(100, start + std::chrono::seconds(12)));
+
+  // Room again once they expire
+  EXPECT_TRUE(cache.insert(100 + 10 * cache.capacity(), start + std::chrono::seconds(22)));
+  EXPECT_FALSE(cache.contains(100, start + std::chrono::seconds(22)));
+
+  // The default capacity grows well past its starting size to keep a whole window of retries
+  DedupCache busy;
+  EXPECT_TRUE(busy.capacity() >= DedupCache::kPeakTransactionsPerSecond * 600);
+  for (TransactionId id = 1; id <= 200000; ++id) {
+    busy.insert(id, start + std::chrono::milliseconds(id / 50));
+  }
+  EXPECT_TRUE(busy.size() == 200000);
+  EXPECT_FALSE(busy.insert(1, start + std::chrono::seconds(5)));
+  EXPECT_FALSE(busy.insert(100000, start + std::chrono::seconds(5)));
+}
+
+TEST(VelocityTest, slidingWindows)
+{
+  VelocityLimits limits;
+  limits.hourly_amount = 500;
+  limits.hourly_count = 3;
+  limits.daily_amount = 800;
+  limits.daily_count = 10;
+  VelocityTracker tracker(limits, 4);
+  const auto start = VelocityTracker::Clock::now();
+  VelocityAlert alert{};
+
+  EXPECT_TRUE(tracker.tryRecordWithdrawal(kTestAccountNum, 200, 1, start));
+  EXPECT_TRUE(tracker.tryRecordWithdrawal(kTestAccountNum, 200, 1, start + std::chrono::minutes(10)));
+  EXPECT_FALSE(tracker.pollAlert(alert));
+
+  // Over the hourly amount
+  EXPECT_FALSE(tracker.tryRecordWithdrawal(kTestAccountNum, 200, 1, start + std::chrono::minutes(20)));
+  ASSERT_TRUE(tracker.pollAlert(alert));
+  EXPECT_TRUE(alert.reason == VelocityAlert::Reason::HOURLY_AMOUNT);
+  EXPECT_TRUE(alert.account_number == kTestAccountNum);
+
+  // Other accounts are unaffected
+  EXPECT_TRUE(tracker.tryRecordWithdrawal(kTestAccountNum + 1, 200, 1, start + std::chrono::minutes(20)));
+
+  // The first two withdrawals have left the hour window, but the day window still holds all of them
+  EXPECT_TRUE(tracker.tryRecordWithdrawal(kTestAccountNum, 200, 1, start + std::chrono::minutes(70)));
+  VelocityTotals totals = tracker.totals(kTestAccountNum, start + std::chrono::minutes(70));
+  EXPECT_TRUE(totals.hourly_amount == 200);
+  EXPECT_TRUE(totals.daily_amount == 600);
+  EXPECT_FALSE(tracker.tryRecordWithdrawal(kTestAccountNum, 300, 1, start + std::chrono::minutes(130)));
+  ASSERT_TRUE(tracker.pollAlert(alert));
+  EXPECT_TRUE(alert.reason == VelocityAlert::Reason::DAILY_AMOUNT);
+
+  // A day after the last withdrawal it's all forgotten.  The day window moves an hour at a time, so give it the hour
+  totals = tracker.totals(kTestAccountNum, start + std::chrono::minutes(70) + std::chrono::hours(25));
+  EXPECT_TRUE(totals.hourly_count == 0 and totals.daily_count == 0 and totals.daily_amount == 0);
+
+  // Alerts are dropped rather than blocking when nobody drains them
+  for (int i = 0; i < 10; ++i) {
+    tracker.reportRefusal(kTestAccountNum, 1, VelocityAlert::Reason::OVER_LIMIT, start);
+  }
+  EXPECT_TRUE(tracker.droppedAlerts() == 6);
+}
+
+TEST(AccountTest, velocityAlerts)
+{
+  const auto m = std::make_shared<Machine>();
+  Account a(m, kTestAccountNum);
+
+  a.unlock(kTestAccountPin);
+  a.selectType(AccountType::SAVINGS);
+
+  bool except = false;
+  try {
+    a.withdraw(kTestAccountSavingsWithdrawLimit + 1);
+  } catch(std::exception& e) {
+    except = true;
+  }
+  EXPECT_TRUE(except);
+
+  VelocityAlert alert{};
+  ASSERT_TRUE(m->velocityTracker().pollAlert(alert));
+  EXPECT_TRUE(alert.reason == VelocityAlert::Reason::OVER_LIMIT);
+
+  // Default limits allow ten withdrawals an hour
+  for (int i = 0; i < 10; ++i) {
+    a.withdraw(10);
+  }
+  except = false;
+  try {
+    a.withdraw(10);
+  } catch(std::exception& e) {
+    except = true;
+  }
+  EXPECT_TRUE(except);
+  EXPECT_TRUE(a.getBalance() == kTestAccountSavingsBalance - 100);
+  ASSERT_TRUE(m->velocityTracker().pollAlert(alert));
+  EXPECT_TRUE(alert.reason == VelocityAlert::Reason::HOURLY_COUNT);
+}
+
+TEST(PinAttemptTest, lockout)
+{
+  PinAttemptTracker tracker(3, std::chrono::hours(24), std::chrono::hours(1));
+  const auto start = PinAttemptTracker::Clock::now();
+
+  EXPECT_FALSE(tracker.recordFailure(kTestAccountNum, start));
+  EXPECT_FALSE(tracker.recordFailure(kTestAccountNum, start));
+  EXPECT_FALSE(tracker.isLockedOut(kTestAccountNum, start));
+  EXPECT_TRUE(tracker.recordFailure(kTestAccountNum, start));
+  EXPECT_TRUE(tracker.isLockedOut(kTestAccountNum, start));
+  EXPECT_FALSE(tracker.isLockedOut(kTestAccountNum + 1, start));
+
+  // Lockouts expire
+  EXPECT_FALSE(tracker.isLockedOut(kTestAccountNum, start + std::chrono::hours(25)));
+
+  // A correct pin clears the count
+  EXPECT_FALSE(tracker.recordFailure(kTestAccountNum + 1, start));
+  EXPECT_FALSE(tracker.recordFailure(kTestAccountNum + 1, start));
+  tracker.recordSuccess(kTestAccountNum + 1);
+  EXPECT_FALSE(tracker.recordFailure(kTestAccountNum + 1, start));
+  EXPECT_FALSE(tracker.isLockedOut(kTestAccountNum + 1, start));
+
+  // Old failures decay away
+  EXPECT_TRUE(tracker.estimateFailures(kTestAccountNum + 2, start) == 0);
+  tracker.recordFailure(kTestAccountNum + 2, start);
+  tracker.recordFailure(kTestAccountNum + 2, start);
+  EXPECT_TRUE(tracker.estimateFailures(kTestAccountNum + 2, start) >= 2);
+  EXPECT_TRUE(tracker.estimateFailures(kTestAccountNum + 2, start + std::chrono::hours(3)) == 0);
+
+  // More cards guessed at than there are exact counters, every card that got locked out stays locked
+  PinAttemptTracker crowded(3, std::chrono::hours(24), std::chrono::hours(1));
+  std::vector<uint64_t> locked;
+  for (uint64_t card = 1; card <= 1500; ++card) {
+    for (int i = 0; i < 3; ++i) {
+      if (crowded.recordFailure(card * 7919, start)) {
+        locked.push_back(card * 7919);
+      }
+    }
+  }
+  EXPECT_FALSE(locked.empty());
+  size_t unlocked = 0;
+  for (const uint64_t card : locked) {
+    unlocked += !crowded.isLockedOut(card, start + std::chrono::minutes(30));
+  }
+  EXPECT_TRUE(unlocked == 0);
+
+  // A busy sketch doesn't lock anyone out on their first wrong pin
+  PinAttemptTracker busy(3, std::chrono::hours(24), std::chrono::hours(1));
+  for (uint64_t card = 1; card <= 20000; ++card) {
+    busy.recordFailure(card * 7919, start);
+  }
+  size_t falseLockouts = 0;
+  for (uint64_t card = 20001; card <= 21000; ++card) {
+    falseLockouts += busy.recordFailure(card * 7919, start);
+    falseLockouts += busy.isLockedOut(card * 7919, start);
+  }
+  EXPECT_TRUE(falseLockouts == 0);
+
+  // Memory doesn't depend on how many cards are seen
+  for (uint64_t card = 1; card < 100000; ++card) {
+    tracker.recordFailure(card * 7919, start);
+  }
+  EXPECT_TRUE(PinAttemptTracker::memoryFootprint() < 64 * 1024);
+}
+
+TEST(AccountTest, pinLockout)
+{
+  const auto m = std::make_shared<Machine>();
+
+  for (uint i = 0; i < PinAttemptTracker::kDefaultMaxFailures; ++i) {
+    Account a(m, kTestAccountNum);
+    bool except = false;
+    try {
+      a.unlock(kTestAccountPin + 1);
+    } catch(std::exception& e) {
+      except = true;
+    }
+    EXPECT_TRUE(except);
+  }
+
+  // Even the right pin is refused now
+  Account a(m, kTestAccountNum);
+  bool except = false;
+  try {
+    a.unlock(kTestAccountPin);
+  } catch(std::exception& e) {
+    except = true;
+  }
+  EXPECT_TRUE(except);
+  EXPECT_TRUE(m->pinAttemptTracker().isLockedOut(kTestAccountNum));
+}
+
+TEST(CheckpointTest, deltasAndCompaction)
+{
+  const std::string directory = ::testing::TempDir() + "atm_checkpoint_compaction";
+  std::filesystem::remove_all(directory);
+
+  CheckpointDelta next{500, {}};
+  {
+    Checkpointer checkpointer(directory, [&next]() { return next; }, 3);
+    for (int i = 1; i <= 7; ++i) {
+      next.available_cash = 500 - i;
+      next.accounts = {AccountSnapshot{static_cast<uint64_t>(i % 2), i, -i}};
+      checkpointer.checkpointNow();
+    }
+    EXPECT_TRUE(checkpointer.sequence() == 7);
+  }
+
+  // One base and the deltas after it remain
+  size_t files = 0;
+  for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+    (void)entry;
+    ++files;
+  }
+  EXPECT_TRUE(files == 2);
+
+  const CheckpointState state = Checkpointer::load(directory);
+  ASSERT_TRUE(state.found);
+  EXPECT_TRUE(state.sequence == 7);
+  EXPECT_TRUE(state.available_cash == 493);
+  ASSERT_TRUE(state.accounts.size() == 2);
+  EXPECT_TRUE(state.accounts.at(0).checking == 6);
+  EXPECT_TRUE(state.accounts.at(1).checking == 7 and state.accounts.at(1).savings == -7);
+
+  // Numbering carries on after a restart
+  Checkpointer restarted(directory, [&next]() { return next; }, 3);
+  next.available_cash = 1;
+  restarted.checkpointNow();
+  EXPECT_TRUE(restarted.sequence() == 8);
+  EXPECT_TRUE(Checkpointer::load(directory).available_cash == 1);
+
+  // Deltas without their base are only part of the ledger, so nothing is recovered from them
+  for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+    if (entry.path().filename().string().find("base-") == 0) {
+      std::filesystem::remove(entry.path());
+    }
+  }
+  EXPECT_FALSE(Checkpointer::load(directory).found);
+
+  std::filesystem::remove_all(directory);
+}
+
+TEST(MachineTest, machineCheckpointRestore)
+{
+  const std::string directory = ::testing::TempDir() + "atm_checkpoint_machine";
+  std::filesystem::remove_all(directory);
+
+  {
+    Machine m{};
+    EXPECT_FALSE(m.restoreFromCheckpoint(directory));
+    m.enableCheckpointing(directory, std::chrono::milliseconds(10));
+    m.updateAccountBalance(kTestAccountNum, AccountType::CHECKING, -100, m.newTransactionId());
+    m.disburseCash(100);
+    m.checkpointNow();
+    m.updateAccountBalance(kTestAccountNum, AccountType::SAVINGS, 25, m.newTransactionId());
+    // The final checkpoint is written on the way down
+  }
+
+  Machine restarted{};
+  EXPECT_TRUE(restarted.getAvailableCash() == kAvailableCashLogged);
+  EXPECT_TRUE(restarted.restoreFromCheckpoint(directory));
+  EXPECT_TRUE(restarted.getAvailableCash() == kAvailableCashLogged - 100);
+  EXPECT_TRUE(restarted.getAccountBalances(kTestAccountNum).get(AccountType::CHECKING) ==
+              kTestAccountCheckingBalance - 100);
+  EXPECT_TRUE(restarted.getAccountBalances(kTestAccountNum).get(AccountType::SAVINGS) ==
+              kTestAccountSavingsBalance + 25);
+
+  std::filesystem::remove_all(directory);
+}
+
+TEST(StatementTest, transactionLogExport)
+{
+  const std::string directory = ::testing::TempDir() + "atm_statement_export";
+  std::filesystem::remove_all(directory);
+  std::filesystem::create_directories(directory);
+  const std::string log = directory + "/transactions.log";
+
+  const auto m = std::make_shared<Machine>();
+  m->enableTransactionLog(log);
+  {
+    Account a(m, kTestAccountNum);
+    a.unlock(kTestAccountPin);
+    a.selectType(AccountType::CHECKING);
+    a.deposit(100);
+    a.withdraw(40);
+  }
+  const TransactionId retried = m->newTransactionId();
+  EXPECT_TRUE(m->updateAccountBalance(kTestAccountNum, AccountType::SAVINGS, -5, retried));
+  EXPECT_FALSE(m->updateAccountBalance(kTestAccountNum, AccountType::SAVINGS, -5, retried));
+  m->updateAccountBalance(2345234523452345, AccountType::CHECKING, 1, m->newTransactionId());
+  m->flushTransactionLog();
+
+  // Only the account asked for, and a retry is only logged once
+  std::ostringstream csv;
+  const StatementSummary summary = exportStatementCsv(log, StatementQuery{kTestAccountNum}, csv);
+  EXPECT_TRUE(summary.transactions == 3);
+  EXPECT_TRUE(summary.credits == 100 and summary.debits == 45);
+  const std::string text = csv.str();
+  EXPECT_TRUE(std::count(text.begin(), text.end(), '\n') == 4);
+  EXPECT_TRUE(text.find(",checking,100," + std::to_string(kTestAccountCheckingBalance + 100) + "\n") !=
+              std::string::npos);
+  EXPECT_TRUE(text.find(",savings,-5," + std::to_string(kTestAccountSavingsBalance - 5) + "\n") != std::string::npos);
+
+  // Nothing falls in a range that ended before the transactions
+  std::ostringstream empty;
+  const auto before = std::chrono::system_clock::now() - std::chrono::hours(1);
+  EXPECT_TRUE(exportStatementCsv(log, StatementQuery{kTestAccountNum, {}, before}, empty).transactions == 0);
+
+  const std::string columnar = directory + "/statement.bin";
+  EXPECT_TRUE(exportStatementColumnar(log, StatementQuery{kTestAccountNum}, columnar).transactions == 3);
+  std::vector<TransactionRecord> rows;
+  EXPECT_TRUE(readColumnarStatement(columnar, [&rows](const TransactionRecord& row) { rows.push_back(row); }) == 3);
+  ASSERT_TRUE(rows.size() == 3);
+  EXPECT_TRUE(rows[1].amount == -40 and rows[1].balance == kTestAccountCheckingBalance + 60);
+  EXPECT_TRUE(rows[2].transaction_id == retried and rows[2].account_type == AccountType::SAVINGS);
+
+  // A torn record at the end is skipped, and records appended after it still line up
+  {
+    std::ofstream torn(log, std::ios::app | std::ios::binary);
+    torn << "torn";
+  }
+  m->enableTransactionLog(log);
+  m->updateAccountBalance(kTestAccountNum, AccountType::CHECKING, 7, m->newTransactionId());
+  m->flushTransactionLog();
+  std::ostringstream after;
+  EXPECT_TRUE(exportStatementCsv(log, StatementQuery{kTestAccountNum}, after).transactions == 4);
+  EXPECT_TRUE(after.str().find(",checking,7,") != std::string::npos);
+
+  std::filesystem::remove_all(directory);
+}
+
+/// The records of an audit log in order, without checking the chain
+static std::vector<AuditRecord> readAuditRecords(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  const std::string bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  std::vector<AuditRecord> records;
+  size_t offset = 16;
+  while (offset + 48 <= bytes.size()) {
+    uint32_t count = 0;
+    std::memcpy(&count, bytes.data() + offset + 8, sizeof(count));
+    offset += 48;
+    for (uint32_t i = 0; i < count; ++i, offset += sizeof(AuditRecord)) {
+      AuditRecord record;
+      std::memcpy(&record, bytes.data() + offset, sizeof(record));
+      records.push_back(record);
+    }
+    offset += 32;
+  }
+  return records;
+}
+
+TEST(AuditLogTest, hashChain)
+{
+  // FIPS 180-4 test vectors, one-shot and split across updates
+  const std::string abc = "abc";
+  const Sha256Digest abc_digest = sha256(abc.data(), abc.size());
+  const uint8_t abc_expected[4] = {0xba, 0x78, 0x16, 0xbf};
+  EXPECT_TRUE(std::memcmp(abc_digest.data(), abc_expected, sizeof(abc_expected)) == 0 and abc_digest[31] == 0xad);
+  const std::string long_message = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+  Sha256 split;
+  split.update(long_message.data(), 5);
+  split.update(long_message.data() + 5, long_message.size() - 5);
+  const Sha256Digest long_digest = split.finish();
+  EXPECT_TRUE(long_digest == sha256(long_message.data(), long_message.size()));
+  EXPECT_TRUE(long_digest[0] == 0x24 and long_digest[1] == 0x8d and long_digest[31] == 0xc1);
+
+  const std::string directory = ::testing::TempDir() + "atm_audit_log";
+  std::filesystem::remove_all(directory);
+  std::filesystem::create_directories(directory);
+  const std::string path = directory + "/audit.log";
+  const AuditKey key = PinStore::randomKey();
+
+  // Several sessions appending at once, more than a block's worth
+  AuditHead head{};
+  {
+    AuditLog log(path, key);
+    std::vector<std::thread> sessions;
+    for (int t = 0; t < 4; ++t) {
+      sessions.emplace_back([&log, t] {
+        for (int i = 0; i < 400; ++i) {
+          log.append(auditRecord(AUDIT_WRONG_PIN, kTestAccountNum + t, i));
+        }
+      });
+    }
+    for (std::thread& session : sessions) {
+      session.join();
+    }
+    log.flush(true);
+    EXPECT_TRUE(log.blocks() >= 1600 / AuditLog::kRecordsPerBlock + 1);
+    head = log.head();
+  }
+  AuditVerifyResult result = verifyAuditLog(path, key, &head, 2);
+  EXPECT_TRUE(result.ok);
+  EXPECT_TRUE(result.records == 1600 and result.blocks == head.blocks);
+  EXPECT_TRUE(result.bytes == std::filesystem::file_size(path));
+
+  // Without the key the chain can't be checked, or rebuilt
+  AuditKey other_key = key;
+  other_key[0] ^= 1;
+  EXPECT_FALSE(verifyAuditLog(path, other_key).ok);
+
+  // Blocks cut off the end leave a chain that checks out, but not one that reaches the head
+  const std::string cut = directory + "/cut.log";
+  uint32_t first_records = 0;
+  {
+    std::ifstream file(path, std::ios::binary);
+    file.seekg(16 + 8);
+    file.read(reinterpret_cast<char*>(&first_records), sizeof(first_records));
+  }
+  std::filesystem::copy_file(path, cut);
+  std::filesystem::resize_file(cut, 16 + 48 + first_records * sizeof(AuditRecord) + 32);
+  EXPECT_TRUE(verifyAuditLog(cut, key).ok);
+  result = verifyAuditLog(cut, key, &head);
+  EXPECT_FALSE(result.ok);
+  EXPECT_TRUE(result.blocks == 1 and result.bad_block == 1);
+
+  // A torn block is cut off on reopening, and new blocks chain onto the last whole one
+  const uint64_t blocks = head.blocks;
+  {
+    std::ofstream torn(path, std::ios::app | std::ios::binary);
+    torn << "torn";
+  }
+  EXPECT_FALSE(verifyAuditLog(path, key).ok);
+  {
+    AuditLog log(path, key);
+    EXPECT_TRUE(log.blocks() == blocks);
+    log.append(auditRecord(AUDIT_CASH_DISBURSED, kTestAccountNum, 20));
+  }
+  // The head recorded before is still on the chain
+  result = verifyAuditLog(path, key, &head);
+  EXPECT_TRUE(result.ok);
+  EXPECT_TRUE(result.blocks == blocks + 1 and result.records == 1601);
+  const std::vector<AuditRecord> records = readAuditRecords(path);
+  ASSERT_TRUE(records.size() == 1601);
+  EXPECT_TRUE(records.back().event == AUDIT_CASH_DISBURSED and records.back().amount == 20);
+
+  // Changing one byte of one record breaks its block
+  {
+    std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+    file.seekp(16 + 48 + 10 * sizeof(AuditRecord) + 16);
+    file.put('\x7f');
+  }
+  result = verifyAuditLog(path, key);
+  EXPECT_FALSE(result.ok);
+  EXPECT_TRUE(result.bad_block == 0 and result.blocks == 0);
+
+  // A damaged block header isn't taken for a torn write, the log refuses to open and keeps every block after it
+  const uint64_t size = std::filesystem::file_size(path);
+  {
+    std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+    file.seekp(16);
+    file.put('\x7f');
+  }
+  bool except = false;
+  try {
+    AuditLog log(path, key);
+  } catch(std::exception& e) {
+    except = std::string(e.what()).find("corrupt at block 0") != std::string::npos;
+  }
+  EXPECT_TRUE(except);
+  EXPECT_TRUE(std::filesystem::file_size(path) == size);
+
+  std::filesystem::remove_all(directory);
+}
+
+TEST(AccountTest, auditLog)
+{
+  const std::string directory = ::testing::TempDir() + "atm_account_audit";
+  std::filesystem::remove_all(directory);
+  std::filesystem::create_directories(directory);
+  const std::string path = directory + "/audit.log";
+
+  const AuditKey key = PinStore::randomKey();
+  const auto m = std::make_shared<Machine>();
+  m->enableAuditLog(path, key);
+  {
+    Account a(m, kTestAccountNum);
+    bool except = false;
+    try {
+      a.unlock(kTestAccountPin + 1);
+    } catch(std::exception& e) {
+      except = true;
+    }
+    EXPECT_TRUE(except);
+
+    a.unlock(kTestAccountPin);
+    a.selectType(AccountType::CHECKING);
+    a.withdraw(40);
+    except = false;
+    try {
+      a.withdraw(kTestAccountCheckingBalance);
+    } catch(std::exception& e) {
+      except = true;
+    }
+    EXPECT_TRUE(except);
+  }
+  m->auditLog()->flush();
+
+  const std::vector<AuditRecord> records = readAuditRecords(path);
+  ASSERT_TRUE(records.size() == 3);
+  EXPECT_TRUE(records[0].event == AUDIT_WRONG_PIN and records[0].account_number == kTestAccountNum);
+  EXPECT_TRUE(records[1].event == AUDIT_CASH_DISBURSED and records[1].amount == 40);
+  EXPECT_TRUE(records[2].event == AUDIT_WITHDRAW_REFUSED and records[2].code == 12343);
+  EXPECT_TRUE(records[2].amount == kTestAccountCheckingBalance);
+  const AuditHead head = m->auditLog()->head();
+  EXPECT_TRUE(verifyAuditLog(path, key, &head).ok);
+
+  std::filesystem::remove_all(directory);
+}
+
+TEST(MiniStatementTest, ringPerAccount)
+{
+  MiniStatementStore store(2);
+  const auto now = std::chrono::system_clock::now();
+  for (int i = 1; i <= 15; ++i) {
+    EXPECT_TRUE(store.record(kTestAccountNum, AccountType::CHECKING, i, 100 + i, now));
+  }
+  EXPECT_TRUE(store.record(kTestAccountNum, AccountType::SAVINGS, -5, 95, now));
+
+  // Only the newest entries are kept, newest first
+  MiniStatement statement;
+  ASSERT_TRUE(store.read(kTestAccountNum, AccountType::CHECKING, statement) == kMiniStatementEntries);
+  for (size_t i = 0; i < kMiniStatementEntries; ++i) {
+    EXPECT_TRUE(statement[i].amount == static_cast<int>(15 - i));
+    EXPECT_TRUE(statement[i].balance == static_cast<int>(115 - i));
+  }
+  ASSERT_TRUE(store.read(kTestAccountNum, AccountType::SAVINGS, statement) == 1);
+  EXPECT_TRUE(statement[0].amount == -5 and statement[0].balance == 95);
+
+  // The arena only has room for two accounts
+  EXPECT_TRUE(store.record(2345234523452345, AccountType::CHECKING, 1, 1, now));
+  EXPECT_FALSE(store.record(3456345634563456, AccountType::CHECKING, 1, 1, now));
+  EXPECT_TRUE(store.read(3456345634563456, AccountType::CHECKING, statement) == 0);
+}
+
+TEST(AccountTest, miniStatement)
+{
+  const auto m = std::make_shared<Machine>();
+  {
+    Account a(m, kTestAccountNum);
+    a.unlock(kTestAccountPin);
+    a.selectType(AccountType::CHECKING);
+    a.deposit(100);
+    a.withdraw(40);
+  }
+
+  // A later session sees the earlier one's transactions
+  Account a(m, kTestAccountNum);
+  MiniStatement statement;
+  bool except = false;
+  try {
+    a.getMiniStatement(statement);
+  } catch (const std::exception& e) {
+    except = true;
+  }
+  EXPECT_TRUE(except);
+
+  a.unlock(kTestAccountPin);
+  a.selectType(AccountType::CHECKING);
+  ASSERT_TRUE(a.getMiniStatement(statement) == 2);
+  EXPECT_TRUE(statement[0].amount == -40 and statement[0].balance == kTestAccountCheckingBalance + 60);
+  EXPECT_TRUE(statement[1].amount == 100 and statement[1].balance == kTestAccountCheckingBalance + 100);
+
+  // The store has room for every account in the ledger
+  const uint64_t drops = atmMetrics().mini_statement_drops.value();
+  for (const auto& account : kAccountBalances) {
+    m->updateAccountBalance(account.first, AccountType::SAVINGS, 1, m->newTransactionId());
+    EXPECT_TRUE(m->miniStatements().read(account.first, AccountType::SAVINGS, statement) == 1);
+  }
+  EXPECT_TRUE(atmMetrics().mini_statement_drops.value() == drops);
+
+  // A backend without mini statements has nothing to show
+  BasicAccount<FakeBackend> fake(std::make_shared<FakeBackend>(), kTestAccountNum);
+  fake.unlock(kTestAccountPin);
+  fake.selectType(AccountType::CHECKING);
+  fake.deposit(10);
+  EXPECT_TRUE(fake.getMiniStatement(statement) == 0);
+}
+
+TEST(DepositPipelineTest, clearing)
+{
+  std::atomic<int> reversed{0};
+  DepositPipelineConfig config;
+  config.workers = 2;
+  config.queue_capacity = 8;
+  config.batch_size = 4;
+  config.hold_period = std::chrono::milliseconds(20);
+  DepositPipeline pipeline([&reversed](const DepositItem& item) { reversed += item.amount; }, config,
+                           [](const DepositItem& item) { return item.amount != 1013; });
+
+  // More deposits than the queues hold, some of which bounce
+  for (uint64_t i = 0; i < 100; ++i) {
+    pipeline.capture(i + 1, kTestAccountNum + i % 4, AccountType::CHECKING, i % 10 == 0 ? 1013 : 1000);
+  }
+  pipeline.capture(101, kTestAccountNum, AccountType::SAVINGS, 100);
+  EXPECT_TRUE(pipeline.heldAmount(kTestAccountNum, AccountType::CHECKING) > 0);
+  EXPECT_TRUE(pipeline.heldAmount(kTestAccountNum, AccountType::SAVINGS) == 0);
+
+  ASSERT_TRUE(pipeline.waitUntilSettled(std::chrono::seconds(10)));
+  for (uint64_t i = 0; i < 4; ++i) {
+    EXPECT_TRUE(pipeline.heldAmount(kTestAccountNum + i, AccountType::CHECKING) == 0);
+  }
+  const DepositPipelineStats stats = pipeline.stats();
+  EXPECT_TRUE(stats.captured == 101);
+  EXPECT_TRUE(stats.rejected == 10);
+  EXPECT_TRUE(stats.settled == 91);
+  EXPECT_TRUE(reversed == 10 * 1013);
+}
+
+/// FakeBackend that holds deposits for an hour
+struct HoldingBackend : FakeBackend {
+  HoldingBackend() :
+    pipeline([this](const DepositItem& item) { net_change -= item.amount; }, config()) {}
+
+  static DepositPipelineConfig config() {
+    DepositPipelineConfig config;
+    config.workers = 1;
+    config.hold_period = std::chrono::hours(1);
+    return config;
+  }
+
+  DepositPipeline& depositPipeline() {
+    return pipeline;
+  }
+
+  DepositPipeline pipeline;
+};
+
+TEST(AccountTest, depositHolds)
+{
+  const auto backend = std::make_shared<HoldingBackend>();
+  backend->cash = 5000;
+  BasicAccount<HoldingBackend> a(backend, kTestAccountNum);
+  a.unlock(kTestAccountPin);
+  a.selectType(AccountType::CHECKING);
+
+  // The ledger has the whole deposit, only the first part of it can be taken out before it clears
+  a.deposit(1000);
+  EXPECT_TRUE(a.getBalance() == kTestAccountCheckingBalance + 1000);
+  EXPECT_TRUE(a.getAvailableBalance() == kTestAccountCheckingBalance + 225);
+  bool except = false;
+  try {
+    a.withdraw(kTestAccountCheckingBalance + 300);
+  } catch (const std::exception& e) {
+    except = true;
+  }
+  EXPECT_TRUE(except);
+  a.withdraw(kTestAccountCheckingBalance + 200);
+  EXPECT_TRUE(a.getAvailableBalance() == 25);
+
+  // Nor can a batch spend its own deposits
+  ManagementBatchResult batch = a.applyBatch({{ManagementAction::ManagementActionType::DEPOSIT, 500},
+                                              {ManagementAction::ManagementActionType::WITHDRAW, 300}});
+  EXPECT_FALSE(batch.applied);
+  batch = a.applyBatch({{ManagementAction::ManagementActionType::DEPOSIT, 500},
+                        {ManagementAction::ManagementActionType::WITHDRAW, 20}});
+  EXPECT_TRUE(batch.applied);
+  EXPECT_TRUE(a.getBalance() == 800 + 500 - 20);
+  EXPECT_TRUE(a.getAvailableBalance() == 25 - 20 + 225);
+
+  // Nothing to deposit
+  except = false;
+  try {
+    a.deposit(0);
+  } catch (const std::exception& e) {
+    except = true;
+  }
+  EXPECT_TRUE(except);
+  EXPECT_TRUE(backend->pipeline.stats().captured == 2);
+}
+
+TEST(CircuitBreakerTest, tripAndProbe)
+{
+  CircuitBreakerConfig config;
+  config.slow_call = std::chrono::milliseconds(10);
+  config.failure_threshold = 2;
+  config.open_duration = std::chrono::milliseconds(50);
+  CircuitBreaker breaker(config);
+
+  // Fast calls keep it closed, and a success resets the count
+  EXPECT_TRUE(breaker.allowRequest());
+  breaker.recordFailure();
+  breaker.recordSuccess(std::chrono::milliseconds(1));
+  breaker.recordFailure();
+  EXPECT_TRUE(breaker.state() == CIRCUIT_CLOSED);
+
+  // A slow answer is a failure too
+  breaker.recordSuccess(std::chrono::milliseconds(20));
+  EXPECT_TRUE(breaker.state() == CIRCUIT_OPEN);
+  EXPECT_FALSE(breaker.allowRequest());
+  EXPECT_TRUE(breaker.trips() == 1);
+
+  // One probe once the open duration is over, a failed probe opens it again
+  std::this_thread::sleep_for(config.open_duration);
+  EXPECT_TRUE(breaker.allowRequest());
+  EXPECT_TRUE(breaker.state() == CIRCUIT_HALF_OPEN);
+  EXPECT_FALSE(breaker.allowRequest());
+  breaker.recordFailure();
+  EXPECT_TRUE(breaker.state() == CIRCUIT_OPEN);
+  EXPECT_TRUE(breaker.trips() == 2);
+
+  std::this_thread::sleep_for(config.open_duration);
+  EXPECT_TRUE(breaker.allowRequest());
+  breaker.recordSuccess(std::chrono::milliseconds(1));
+  EXPECT_TRUE(breaker.state() == CIRCUIT_CLOSED);
+  EXPECT_TRUE(breaker.allowRequest());
+}
+
+/// The Machine as a remote host, answering after an injected delay
+struct DelayedHost {
+  bool verifyPin(uint64_t accountNumber, uint16_t pin) {
+    wait();
+    return machine->verifyPin(accountNumber, pin);
+  }
+  Balances getAccountBalances(uint64_t accountNumber) {
+    wait();
+    return machine->getAccountBalances(accountNumber);
+  }
+  bool updateAccountBalance(uint64_t accountNumber, AccountType accountType, int amount, TransactionId transactionId) {
+    wait();
+    return machine->updateAccountBalance(accountNumber, accountType, amount, transactionId);
+  }
+  LedgerUpdateResult updateAccountBalanceIfVersion(uint64_t accountNumber,
+                                                   AccountType accountType,
+                                                   int amount,
+                                                   uint64_t expectedVersion,
+                                                   TransactionId transactionId) {
+    wait();
+    return machine->updateAccountBalanceIfVersion(accountNumber, accountType, amount, expectedVersion, transactionId);
+  }
+  uint getAvailableCash() {
+    return machine->getAvailableCash();
+  }
+  void disburseCash(uint amount) {
+    machine->disburseCash(amount);
+  }
+  TransactionId newTransactionId() {
+    return machine->newTransactionId();
+  }
+
+  void wait() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms.load()));
+  }
+
+  std::shared_ptr<Machine> machine{std::make_shared<Machine>()};
+  std::atomic<int> delay_ms{0};
+};
+
+using StandInAccount = BasicAccount<StandInBackend<DelayedHost>>;
+
+/// Stand-in settings quick enough for a test
+static StandInConfig testStandInConfig() {
+  StandInConfig config;
+  config.breaker.slow_call = std::chrono::milliseconds(20);
+  config.breaker.failure_threshold = 2;
+  config.breaker.open_duration = std::chrono::milliseconds(500);
+  config.call_timeout = std::chrono::milliseconds(50);
+  config.offline_limit = 200;
+  config.forward_interval = std::chrono::milliseconds(20);
+  return config;
+}
+
+/// Waits for a stand-in backend to forward everything and close its circuit again
+static bool waitForForwarding(StandInBackend<DelayedHost>& backend) {
+  for (int i = 0; i < 300; ++i) {
+    if (backend.queuedChanges() == 0 and backend.circuitState() == CIRCUIT_CLOSED) {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return false;
+}
+
+TEST(StandInTest, hostDown)
+{
+  const auto host = std::make_shared<DelayedHost>();
+  const auto backend = std::make_shared<StandInBackend<DelayedHost>>(host, testStandInConfig());
+  {
+    StandInAccount a(backend, kTestAccountNum);
+    a.unlock(kTestAccountPin);
+    a.selectType(AccountType::CHECKING);
+    a.withdraw(20);
+  }
+  EXPECT_TRUE(backend->circuitState() == CIRCUIT_CLOSED);
+
+  // The host stops answering in time.  Sessions wait out the timeout until the circuit opens, then not at all
+  host->delay_ms = 500;
+  const auto start = std::chrono::steady_clock::now();
+  StandInAccount b(backend, kTestAccountNum);
+  b.unlock(kTestAccountPin);
+  b.selectType(AccountType::CHECKING);
+  b.withdraw(100);
+  EXPECT_TRUE(backend->circuitState() == CIRCUIT_OPEN);
+  EXPECT_TRUE(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(400));
+  EXPECT_TRUE(b.getBalance() == kTestAccountCheckingBalance - 120);
+
+  // Past the offline limit is refused, right away
+  const auto refused_start = std::chrono::steady_clock::now();
+  bool except = false;
+  try {
+    b.withdraw(150);
+  } catch(std::exception& e) {
+    except = std::string(e.what()).find("E12349") == 0;
+  }
+  EXPECT_TRUE(except);
+  EXPECT_TRUE(std::chrono::steady_clock::now() - refused_start < std::chrono::milliseconds(50));
+  b.withdraw(100);
+  EXPECT_TRUE(backend->queuedChanges() == 2);
+
+  // The pin accepted online is checked offline too, so a wrong one is still refused
+  except = false;
+  try {
+    StandInAccount wrong(backend, kTestAccountNum);
+    wrong.unlock(kTestAccountPin + 1);
+  } catch(std::exception& e) {
+    except = std::string(e.what()) == "Wrong pin";
+  }
+  EXPECT_TRUE(except);
+
+  // An account the host never answered for can't be served
+  except = false;
+  try {
+    StandInAccount unknown(backend, 2345234523452345);
+  } catch(std::exception& e) {
+    except = true;
+  }
+  EXPECT_TRUE(except);
+
+  // Once the host is back the debits are forwarded, the one that timed out and landed late only counts once
+  host->delay_ms = 0;
+  EXPECT_TRUE(waitForForwarding(*backend));
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  EXPECT_TRUE(host->machine->getAccountBalances(kTestAccountNum).checking == kTestAccountCheckingBalance - 220);
+  EXPECT_TRUE(backend->getAccountBalances(kTestAccountNum).checking == kTestAccountCheckingBalance - 220);
+}
+
+TEST(StandInTest, lateDebitReversed)
+{
+  const auto host = std::make_shared<DelayedHost>();
+  const auto backend = std::make_shared<StandInBackend<DelayedHost>>(host, testStandInConfig());
+  StandInAccount a(backend, kTestAccountNum);
+  a.unlock(kTestAccountPin);
+  a.selectType(AccountType::CHECKING);
+
+  // Too much for stand-in, so refused, but the host applies it after the session gave up on it
+  host->delay_ms = 200;
+  bool except = false;
+  try {
+    a.withdraw(300);
+  } catch(std::exception& e) {
+    except = true;
+  }
+  EXPECT_TRUE(except);
+  EXPECT_TRUE(host->machine->getAvailableCash() == kAvailableCashLogged);
+
+  // The debit is handed back as soon as it lands and the host answers again
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+  host->delay_ms = 0;
+  EXPECT_TRUE(waitForForwarding(*backend));
+  EXPECT_TRUE(host->machine->getAccountBalances(kTestAccountNum).checking == kTestAccountCheckingBalance);
+}
+
+TEST(DispenserTest, simulatedFaults)
+{
+  SimulatedDispenserConfig config;
+  config.setup_time = std::chrono::milliseconds(0);
+  config.per_note = std::chrono::milliseconds(1);
+  SimulatedDispenser* device = new SimulatedDispenser(config);
+  std::mutex mutex;
+  std::vector<DispenseEvent> events;
+  const auto record = [&mutex, &events](const DispenseEvent& event) {
+    std::lock_guard<std::mutex> lock(mutex);
+    events.push_back(event);
+  };
+
+  CashDispenser dispenser((std::unique_ptr<DispenserDevice>(device)));
+  EXPECT_TRUE(dispenser.submit(100, record) == 1);
+  dispenser.drain();
+  device->injectFault(DISPENSE_PARTIAL, 2);
+  dispenser.submit(100, record);
+  dispenser.submit(50, record);
+  dispenser.drain();
+  device->injectFault(DISPENSE_JAMMED, 1);
+  dispenser.submit(100, record);
+  dispenser.submit(100, record);
+  dispenser.drain();
+  EXPECT_TRUE(device->jammed());
+  device->clearJam();
+  dispenser.submit(20, record);
+  dispenser.drain();
+  EXPECT_TRUE(dispenser.pending() == 0);
+
+  ASSERT_TRUE(events.size() == 6);
+  EXPECT_TRUE(events[0].status == DISPENSE_COMPLETE and events[0].dispensed == 100 and events[0].command_id == 1);
+  EXPECT_TRUE(events[1].status == DISPENSE_PARTIAL and events[1].dispensed == 40);
+  // Less than a note left over
+  EXPECT_TRUE(events[2].status == DISPENSE_PARTIAL and events[2].dispensed == 40 and events[2].requested == 50);
+  EXPECT_TRUE(events[3].status == DISPENSE_JAMMED and events[3].dispensed == 20);
+  EXPECT_TRUE(events[4].status == DISPENSE_JAMMED and events[4].dispensed == 0);
+  EXPECT_TRUE(events[5].status == DISPENSE_COMPLETE and events[5].dispensed == 20);
+}
+
+TEST(AccountTest, asyncDispense)
+{
+  const std::string directory = ::testing::TempDir() + "atm_account_dispense";
+  std::filesystem::remove_all(directory);
+  std::filesystem::create_directories(directory);
+  const std::string path = directory + "/audit.log";
+
+  SimulatedDispenserConfig config;
+  config.setup_time = std::chrono::milliseconds(0);
+  config.per_note = std::chrono::milliseconds(40);
+  SimulatedDispenser* device = new SimulatedDispenser(config);
+  const auto m = std::make_shared<Machine>();
+  m->enableAuditLog(path, PinStore::randomKey());
+  m->attachDispenser(std::unique_ptr<DispenserDevice>(device));
+  const uint cash = m->getAvailableCash();
+
+  Account a(m, kTestAccountNum);
+  a.unlock(kTestAccountPin);
+  a.selectType(AccountType::CHECKING);
+
+  // Five notes take 200ms to come out, the withdrawal doesn't wait for them
+  const auto start = std::chrono::steady_clock::now();
+  a.withdraw(100);
+  EXPECT_TRUE(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(100));
+  EXPECT_TRUE(m->getAvailableCash() == cash - 100);
+  m->drainDispenser();
+  EXPECT_TRUE(m->getAccountBalances(kTestAccountNum).checking == kTestAccountCheckingBalance - 100);
+
+  // Jams after two notes, the other three are credited back and stay in the machine
+  device->injectFault(DISPENSE_JAMMED, 2);
+  a.withdraw(100);
+  m->drainDispenser();
+  EXPECT_TRUE(m->getAccountBalances(kTestAccountNum).checking == kTestAccountCheckingBalance - 140);
+  EXPECT_TRUE(m->getAvailableCash() == cash - 140);
+  EXPECT_TRUE(device->jammed());
+
+  // Nothing comes out of a jammed dispenser
+  a.withdraw(60);
+  m->drainDispenser();
+  EXPECT_TRUE(m->getAccountBalances(kTestAccountNum).checking == kTestAccountCheckingBalance - 140);
+  EXPECT_TRUE(m->getAvailableCash() == cash - 140);
+
+  m->auditLog()->flush();
+  const std::vector<AuditRecord> records = readAuditRecords(path);
+  ASSERT_TRUE(records.size() == 4);
+  EXPECT_TRUE(records[0].event == AUDIT_CASH_DISBURSED and records[0].amount == 100);
+  EXPECT_TRUE(records[1].event == AUDIT_CASH_DISBURSED and records[1].amount == 40);
+  EXPECT_TRUE(records[2].event == AUDIT_DISPENSE_FAULT and records[2].amount == 60);
+  EXPECT_TRUE(records[2].code == DISPENSE_JAMMED);
+  EXPECT_TRUE(records[3].event == AUDIT_DISPENSE_FAULT and records[3].amount == 60);
+
+  std::filesystem::remove_all(directory);
+}
+
+TEST(AccountTest, waitedDispenseFault)
+{
+  SimulatedDispenserConfig config;
+  config.setup_time = std::chrono::milliseconds(0);
+  config.per_note = std::chrono::milliseconds(1);
+  SimulatedDispenser* device = new SimulatedDispenser(config);
+  const auto m = std::make_shared<Machine>();
+  m->attachDispenser(std::unique_ptr<DispenserDevice>(device));
+  const uint cash = m->getAvailableCash();
+  const uint64_t faults = atmMetrics().dispense_faults.value();
+
+  // Routed cards wait for the cash to come out
+  const auto routed = std::make_shared<RoutedBackend>(
+      AnyBackend(m), std::vector<BinRoute>{{"123412", "test-waited", AnyBackend(m)}});
+  BasicAccount<RoutedBackend> a(routed, kTestAccountNum);
+  a.unlock(kTestAccountPin);
+  a.selectType(AccountType::CHECKING);
+
+  // Stops after two notes, only the three that stayed in the machine are handed back
+  device->injectFault(DISPENSE_PARTIAL, 2);
+  bool except = false;
+  try {
+    a.withdraw(100);
+  } catch(std::exception& e) {
+    except = std::string(e.what()).find("E12345") == 0;
+  }
+  EXPECT_TRUE(except);
+  EXPECT_TRUE(m->getAccountBalances(kTestAccountNum).checking == kTestAccountCheckingBalance - 40);
+  EXPECT_TRUE(a.getBalance() == kTestAccountCheckingBalance - 40);
+  EXPECT_TRUE(m->getAvailableCash() == cash - 40);
+  EXPECT_TRUE(atmMetrics().dispense_faults.value() == faults + 1);
+
+  // Nothing out of a jammed dispenser, all of it is handed back
+  device->injectFault(DISPENSE_JAMMED, 0);
+  except = false;
+  try {
+    a.withdraw(60);
+  } catch(std::exception& e) {
+    except = std::string(e.what()).find("E12345") == 0;
+  }
+  EXPECT_TRUE(except);
+  EXPECT_TRUE(m->getAccountBalances(kTestAccountNum).checking == kTestAccountCheckingBalance - 40);
+  EXPECT_TRUE(m->getAvailableCash() == cash - 40);
+}
+
+TEST(BinRouterTest, longestPrefix)
+{
+  const BinTable table({"123412", "12341234", "234523", "23452345234"});
+  EXPECT_TRUE(table.lookup(kTestAccountNum) == 1);
+  EXPECT_TRUE(table.lookup(1234129999999999) == 0);
+  EXPECT_TRUE(table.lookup(2345234523452345) == 3);
+  EXPECT_TRUE(table.lookup(2345239999999999) == 2);
+  EXPECT_TRUE(table.lookup(9999999999999999) == BinTable::kNoRoute);
+  // Shorter than the prefix
+  EXPECT_TRUE(table.lookup(12341) == BinTable::kNoRoute);
+  EXPECT_TRUE(table.lookup(123412) == 0);
+
+  for (const char* prefix : {"12345", "123456789012", "12345a", "123412"}) {
+    bool except = false;
+    try {
+      const BinTable invalid({"123412", prefix});
+    } catch(std::exception& e) {
+      except = true;
+    }
+    EXPECT_TRUE(except) << prefix;
+  }
+}
+
+TEST(BinRouterTest, routedBackend)
+{
+  const auto local = std::make_shared<Machine>();
+  const auto other = std::make_shared<Machine>();
+  const auto routed = std::make_shared<RoutedBackend>(
+      AnyBackend(local),
+      std::vector<BinRoute>{{"123412", "test-local", AnyBackend(local)}, {"234523", "test-other", AnyBackend(other)}});
+  const uint64_t local_hits = routed->router().hits("test-local");
+
+  BasicAccount<RoutedBackend> a(routed, kTestAccountNum);
+  a.unlock(kTestAccountPin);
+  a.selectType(AccountType::CHECKING);
+  a.withdraw(100);
+  EXPECT_TRUE(local->getAccountBalances(kTestAccountNum).checking == kTestAccountCheckingBalance - 100);
+  EXPECT_TRUE(other->getAccountBalances(kTestAccountNum).checking == kTestAccountCheckingBalance);
+  // One card, one hit, however many calls its session made
+  EXPECT_TRUE(routed->router().hits("test-local") == local_hits + 1);
+  EXPECT_TRUE(routed->router().issuer(2345234523452345) == "test-other");
+
+  // A bad configuration leaves the routes as they were
+  routed->router().configure(std::vector<BinRoute>{{"1234123", "test-local", AnyBackend(local)}});
+  bool except = false;
+  try {
+    routed->router().configure(std::vector<BinRoute>{{"123412", "test-other", AnyBackend(other)},
+                                                     {"123412", "test-local", AnyBackend(local)}});
+  } catch(std::exception& e) {
+    except = true;
+  }
+  EXPECT_TRUE(except);
+  EXPECT_TRUE(routed->router().issuer(kTestAccountNum) == "test-local");
+
+  // Moved to the other issuer, the cash still comes out of this terminal
+  routed->router().configure(std::vector<BinRoute>{{"123412", "test-other", AnyBackend(other)}});
+  BasicAccount<RoutedBackend> b(routed, kTestAccountNum);
+  b.unlock(kTestAccountPin);
+  b.selectType(AccountType::CHECKING);
+  b.withdraw(40);
+  EXPECT_TRUE(other->getAccountBalances(kTestAccountNum).checking == kTestAccountCheckingBalance - 40);
+  EXPECT_TRUE(local->getAvailableCash() == kAvailableCashLogged - 140);
+
+  except = false;
+  try {
+    BasicAccount<RoutedBackend> unknown(routed, 2345234523452345);
+  } catch(std::exception& e) {
+    except = std::string(e.what()).find("E12350") != std::string::npos;
+  }
+  EXPECT_TRUE(except);
+}
+
+TEST(BinRouterTest, reconfigureWhileRouting)
+{
+  const auto local = std::make_shared<Machine>();
+  BinRouter router(std::vector<BinRoute>{{"123412", "test-a", AnyBackend(local)}});
+  std::atomic<bool> stop{false};
+  std::atomic<uint64_t> misses{0};
+  std::thread lookups([&router, &stop, &misses] {
+    while (!stop.load()) {
+      if (router.route(kTestAccountNum) == nullptr) {
+        ++misses;
+      }
+    }
+  });
+  for (int i = 0; i < 200; ++i) {
+    router.configure(std::vector<BinRoute>{{i % 2 == 0 ? "1234123" : "123412", "test-a", AnyBackend(local)}});
+  }
+  stop = true;
+  lookups.join();
+  // Every table routes the card, so a lookup never sees one half built
+  EXPECT_TRUE(misses.load() == 0);
+}
+
+TEST(PinStoreTest, hmac)
+{
+  // RFC 4231 test case 2
+  const std::string key = "Jefe";
+  const std::string data = "what do ya want for nothing?";
+  const Sha256Digest digest = hmacSha256Short(hmacSha256Key(key.data(), key.size()), data.data(), data.size());
+  const uint8_t expected[4] = {0x5b, 0xdc, 0xc1, 0x46};
+  EXPECT_TRUE(std::memcmp(digest.data(), expected, sizeof(expected)) == 0 and digest[31] == 0x43);
+  EXPECT_TRUE(hmacSha256(hmacSha256Key(key.data(), key.size()), data.data(), data.size()) == digest);
+
+  // Lanes agree with one message at a time, with a different key and message in each
+  std::array<HmacSha256Key, kSha256Lanes> keys;
+  std::array<std::array<uint8_t, kHmacShortMessage>, kSha256Lanes> messages;
+  const HmacSha256Key* key_lanes[kSha256Lanes];
+  const uint8_t* message_lanes[kSha256Lanes];
+  for (size_t lane = 0; lane < kSha256Lanes; ++lane) {
+    const uint8_t lane_key[3] = {static_cast<uint8_t>(lane), 1, 2};
+    keys[lane] = hmacSha256Key(lane_key, sizeof(lane_key));
+    for (size_t i = 0; i < kHmacShortMessage; ++i) {
+      messages[lane][i] = static_cast<uint8_t>(lane * 31 + i);
+    }
+    key_lanes[lane] = &keys[lane];
+    message_lanes[lane] = messages[lane].data();
+  }
+  Sha256Digest digests[kSha256Lanes];
+  hmacSha256ShortLanes(key_lanes, message_lanes, kHmacShortMessage, digests);
+  for (size_t lane = 0; lane < kSha256Lanes; ++lane) {
+    EXPECT_TRUE(digests[lane] == hmacSha256Short(keys[lane], messages[lane].data(), kHmacShortMessage));
+  }
+
+  // Longer messages, spanning several blocks
+  const std::vector<uint8_t> long_message(1000, 0xaa);
+  const Sha256Digest long_digest = hmacSha256(keys[0], long_message.data(), long_message.size());
+  EXPECT_TRUE(long_digest != hmacSha256(keys[1], long_message.data(), long_message.size()));
+  EXPECT_TRUE(long_digest != hmacSha256(keys[0], long_message.data(), long_message.size() - 1));
+}
+
+TEST(PinStoreTest, verifyAndRotate)
+{
+  PinStore store(PinStore::randomKey());
+  constexpr size_t kAccounts = 100;
+  for (size_t i = 0; i < kAccounts; ++i) {
+    store.enroll(kTestAccountNum + i, static_cast<uint16_t>(1000 + i));
+  }
+  EXPECT_TRUE(store.size() == kAccounts);
+  EXPECT_TRUE(store.keyVersion() == 1);
 
-const uint64_t kTestAccountNum = 1234123412341234;
-const uint16_t kTestAccountPin = 1234;
-const int kTestAccountCheckingBalance = 1000;
-const int kTestAccountSavingsBalance = 10000;
+  // The same pin is salted differently every time it is set
+  const PinRecord first = store.record(kTestAccountNum);
+  store.enroll(kTestAccountNum, 1000);
+  const PinRecord second = store.record(kTestAccountNum);
+  EXPECT_TRUE(first.salt != second.salt and first.hash != second.hash);
 
-const int kTestAccountSavingsWithdrawLimit = 1000;
-const int kTestAccountCheckingWithdrawLimit = 5000;
+  EXPECT_TRUE(store.verify(kTestAccountNum + 7, 1007));
+  EXPECT_TRUE(!store.verify(kTestAccountNum + 7, 1008));
+  bool except = false;
+  try {
+    store.verify(kTestAccountNum + kAccounts, 1000);
+  } catch(std::exception& e) {
+    except = std::string(e.what()) == "Account not found";
+  }
+  EXPECT_TRUE(except);
 
-TEST(MachineTest, machineInit)
+  // A batch that doesn't fill the last lanes, with wrong pins and an unknown account among the right ones
+  std::vector<PinCheck> checks;
+  for (size_t i = 0; i < kAccounts; ++i) {
+    checks.push_back(PinCheck{kTestAccountNum + i, static_cast<uint16_t>(i % 10 == 3 ? 9999 : 1000 + i)});
+  }
+  checks.push_back(PinCheck{kTestAccountNum + kAccounts, 1000});
+  std::unique_ptr<bool[]> results(new bool[checks.size()]);
+  store.verifyBatch(checks.data(), checks.size(), results.get(), 3);
+  for (size_t i = 0; i < checks.size(); ++i) {
+    EXPECT_TRUE(results[i] == (i < kAccounts and i % 10 != 3));
+  }
+
+  // Rotating wraps every hash, which still verifies, and one verify rehashes under the new key alone
+  EXPECT_TRUE(store.rotateKey(PinStore::randomKey(), 2) == 2);
+  EXPECT_TRUE(store.rotateKey(PinStore::randomKey(), 2) == 3);
+  const PinRecord wrapped = store.record(kTestAccountNum + 1);
+  EXPECT_TRUE(wrapped.first_key_version == 1 and wrapped.key_version == 3);
+  EXPECT_TRUE(!store.verify(kTestAccountNum + 1, 1002));
+  EXPECT_TRUE(store.record(kTestAccountNum + 1).first_key_version == 1);
+  EXPECT_TRUE(store.verify(kTestAccountNum + 1, 1001));
+  const PinRecord rehashed = store.record(kTestAccountNum + 1);
+  EXPECT_TRUE(rehashed.first_key_version == 3 and rehashed.key_version == 3);
+
+  // Batches mix records at different depths of wrapping
+  store.enroll(kTestAccountNum + 2, 1002);
+  store.verifyBatch(checks.data(), checks.size(), results.get(), 1);
+  for (size_t i = 0; i < checks.size(); ++i) {
+    EXPECT_TRUE(results[i] == (i < kAccounts and i % 10 != 3));
+  }
+}
+
+TEST(MetricsTest, shardedCounters)
 {
-  Machine m{};
-  EXPECT_TRUE(m.getPin(kTestAccountNum) == kTestAccountPin);
+  Counter& counter = MetricsRegistry::instance().counter("test_sharded_total", "Test counter", "kind=\"a\"");
+  EXPECT_TRUE(&counter == &MetricsRegistry::instance().counter("test_sharded_total", "Test counter", "kind=\"a\""));
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back([&counter]() {
+      for (int i = 0; i < 10000; ++i) {
+        counter.increment();
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_TRUE(counter.value() == 80000);
 
-  EXPECT_TRUE(m.getAccountBalances(kTestAccountNum).get(AccountType::CHECKING) == kTestAccountCheckingBalance);
-  EXPECT_TRUE(m.getAccountBalances(kTestAccountNum).get(AccountType::SAVINGS) == kTestAccountSavingsBalance);
-  EXPECT_TRUE(m.getAccountBalances(kTestAccountNum).limit(AccountType::CHECKING) == kTestAccountCheckingWithdrawLimit);
-  EXPECT_TRUE(m.getAccountBalances(kTestAccountNum).limit(AccountType::SAVINGS) == kTestAccountSavingsWithdrawLimit);
+  Gauge& gauge = MetricsRegistry::instance().gauge("test_gauge", "Test gauge");
+  gauge.set(10);
+  gauge.add(-3);
+  EXPECT_TRUE(gauge.value() == 7);
 
-  EXPECT_TRUE(m.getAvailableCash() == kAvailableCashLogged);
+  // A name can't change type
+  bool except = false;
+  try {
+    MetricsRegistry::instance().gauge("test_sharded_total", "Test counter");
+  } catch(std::exception& e) {
+    except = true;
+  }
+  EXPECT_TRUE(except);
+
+  const std::string text = MetricsRegistry::instance().renderPrometheus();
+  EXPECT_TRUE(text.find("# TYPE test_sharded_total counter\n") != std::string::npos);
+  EXPECT_TRUE(text.find("test_sharded_total{kind=\"a\"} 80000\n") != std::string::npos);
+  EXPECT_TRUE(text.find("# TYPE test_gauge gauge\ntest_gauge 7\n") != std::string::npos);
 }
 
-TEST(MachineTest, machineUpdate)
+TEST(MetricsTest, atmMetrics)
 {
-  Machine m{};
+  ATMMetrics& metrics = atmMetrics();
+  const uint64_t sessions = metrics.sessions.value();
+  const uint64_t wrong_pins = metrics.wrong_pins.value();
+  const uint64_t over_limit = metrics.error_e12344.value();
+  const uint64_t dispensed = metrics.cash_dispensed.value();
+  const uint64_t idle_to_pin = metrics.transitions[ATMScreenState::IDLE][ATMScreenState::ENTER_PIN]->value();
 
-  m.getAccountBalances(kTestAccountNum).get(AccountType::CHECKING) += 100;
-  EXPECT_TRUE(m.getAccountBalances(kTestAccountNum).get(AccountType::CHECKING) == kTestAccountCheckingBalance);
-  EXPECT_FALSE(m.getAccountBalances(kTestAccountNum).get(AccountType::CHECKING) == kTestAccountCheckingBalance + 100);
+  ATM atm{};
+  atm.cardReaderCB(kTestAccountNum);
+  atm.service();
+  atm.enterPinCB(kTestAccountPin + 1);
+  atm.service();
+  atm.cardReaderCB(kTestAccountNum);
+  atm.service();
+  atm.enterPinCB(kTestAccountPin);
+  atm.service();
+  atm.accountSelectCB(AccountType::SAVINGS);
+  atm.service();
+  atm.accountManagementCB(ManagementAction{ManagementAction::ManagementActionType::WITHDRAW, 120});
+  atm.accountManagementCB(ManagementAction{ManagementAction::ManagementActionType::WITHDRAW, 5000});
+  atm.service();
+
+  EXPECT_TRUE(metrics.sessions.value() == sessions + 2);
+  EXPECT_TRUE(metrics.wrong_pins.value() == wrong_pins + 1);
+  EXPECT_TRUE(metrics.error_e12344.value() == over_limit + 1);
+  EXPECT_TRUE(metrics.cash_dispensed.value() == dispensed + 120);
+  EXPECT_TRUE(metrics.transitions[ATMScreenState::IDLE][ATMScreenState::ENTER_PIN]->value() == idle_to_pin + 2);
+
+  // Every machine's cash counts toward the gauge, and leaves with the machine
+  const int64_t cash = metrics.cash_available.value();
+  {
+    const auto other = std::make_shared<Machine>();
+    EXPECT_TRUE(metrics.cash_available.value() == cash + other->getAvailableCash());
+    other->disburseCash(40);
+    EXPECT_TRUE(metrics.cash_available.value() == cash + other->getAvailableCash());
+  }
+  EXPECT_TRUE(metrics.cash_available.value() == cash);
+
+  const std::string path = ::testing::TempDir() + "atm_metrics.prom";
+  ASSERT_TRUE(MetricsRegistry::instance().writePrometheusFile(path));
+  std::ifstream file(path);
+  std::stringstream contents;
+  contents << file.rdbuf();
+  EXPECT_TRUE(contents.str().find("atm_errors_total{code=\"E12344\"}") != std::string::npos);
+  EXPECT_TRUE(contents.str().find("atm_transitions_total{from=\"IDLE\",to=\"ENTER_PIN\"}") != std::string::npos);
+  std::filesystem::remove(path);
 }
 
-TEST(MachineTest, machineDisburse)
+TEST(InstrumentationTest, scopeCosts)
 {
-  Machine m{};
+  resetInstrumentation();
+  for (int i = 0; i < 3; ++i) {
+    ScopeProbe probe(InstrumentedScope::SCOPE_SERVICE);
+    std::vector<int> allocated(100);
+  }
+
+  const InstrumentationSnapshot snapshot = instrumentationSnapshot();
+  EXPECT_TRUE(snapshot[InstrumentedScope::SCOPE_SERVICE].calls == 3);
+  EXPECT_TRUE(snapshot[InstrumentedScope::SCOPE_CARD_READER_CB].calls == 0);
+  if (instrumentationEnabled()) {
+    EXPECT_TRUE(snapshot[InstrumentedScope::SCOPE_SERVICE].allocations == 3);
+    EXPECT_TRUE(snapshot[InstrumentedScope::SCOPE_SERVICE].bytes == 3 * 100 * sizeof(int));
+  } else {
+    EXPECT_TRUE(snapshot[InstrumentedScope::SCOPE_SERVICE].allocations == 0);
+  }
+}
+
+#ifdef ATM_INSTRUMENTATION
+TEST(InstrumentationTest, zeroAllocationSession)
+{
+  ATM atm;
+  const auto session = [&atm]() {
+    atm.cardReaderCB(kTestAccountNum);
+    atm.service();
+    atm.enterPinCB(kTestAccountPin);
+    atm.service();
+    atm.accountSelectCB(AccountType::CHECKING);
+    atm.service();
+    atm.accountManagementCB(ManagementAction{ManagementAction::ManagementActionType::BALANCE});
+    atm.accountManagementCB(ManagementAction{ManagementAction::ManagementActionType::WITHDRAW, 20});
+    atm.accountManagementCB(ManagementAction{ManagementAction::ManagementActionType::DEPOSIT, 20});
+    atm.accountManagementCB(ManagementAction{ManagementAction::ManagementActionType::MINI_STATEMENT});
+    atm.accountManagementCB(ManagementAction{ManagementAction::ManagementActionType::DONE});
+    atm.service();
+  };
+
+  // The first session sets up what the account keeps for good, after that a session allocates nothing.  Few enough
+  // sessions that the account stays under its hourly withdrawal count
+  session();
+  resetInstrumentation();
+  for (int i = 0; i < 8; ++i) {
+    session();
+  }
+  EXPECT_TRUE(atm.getState() == ATMScreenState::IDLE);
+
+  const InstrumentationSnapshot snapshot = instrumentationSnapshot();
+  printInstrumentation(snapshot, std::cout);
+  EXPECT_TRUE(snapshot[InstrumentedScope::SCOPE_SERVICE].calls == 8 * 4);
+  EXPECT_TRUE(snapshot[InstrumentedScope::SCOPE_ACCOUNT_MANAGEMENT_CB].calls == 8 * 5);
+  for (size_t i = 0; i < kInstrumentedScopes; ++i) {
+    EXPECT_TRUE(snapshot[i].allocations == 0) << kInstrumentedScopeToString[i];
+  }
+}
+#endif
+
+TEST(TraceTest, chromeTrace)
+{
+  const auto m = std::make_shared<Machine>();
+  ATM atm(m);
+  clearTrace();
+  enableTracing();
+  atm.cardReaderCB(kTestAccountNum);
+  atm.service();
+  std::thread other([m]() {
+    // Another thread, outside of any session
+    m->getAvailableCash();
+    m->verifyPin(kTestAccountNum, kTestAccountPin);
+  });
+  other.join();
+  atm.enterPinCB(kTestAccountPin);
+  atm.service();
+  disableTracing();
+  atm.accountSelectCB(AccountType::CHECKING);
+
+  std::stringstream json;
+  const size_t events = writeChromeTrace(json);
+  const std::string trace = json.str();
+  const auto count = [&trace](const std::string& what) {
+    size_t found = 0;
+    for (size_t at = trace.find(what); at != std::string::npos; at = trace.find(what, at + 1)) {
+      ++found;
+    }
+    return found;
+  };
+
+  // Every span is closed, and nothing is recorded once tracing is off
+  EXPECT_TRUE(count("\"ph\":\"B\"") == count("\"ph\":\"E\""));
+  EXPECT_TRUE(count("\"ph\":\"B\"") + count("\"ph\":\"E\"") + count("\"ph\":\"i\"") == events);
+  EXPECT_TRUE(count("\"name\":\"cardReaderCB\",\"cat\":\"atm\",\"ph\":\"B\"") == 1);
+  EXPECT_TRUE(count("\"name\":\"Machine::getAccountProfile\",\"cat\":\"atm\",\"ph\":\"B\"") == 1);
+  EXPECT_TRUE(count("\"name\":\"Machine::verifyPin\",\"cat\":\"atm\",\"ph\":\"B\"") == 2);
+  EXPECT_TRUE(count("\"name\":\"transitionCB\"") == 2);
+  EXPECT_TRUE(count("\"detail\":\"ENTER_PIN\"") == 2);
+  EXPECT_TRUE(count("accountSelectCB") == 0);
+
+  // The session's events are on the ATM's thread and the prefetch worker's, the other thread's on a row of its own
+  EXPECT_TRUE(count("\"args\":{\"session\":0}") == 2);
+  EXPECT_TRUE(count("\"name\":\"thread_name\"") == 3);
+  EXPECT_TRUE(trace.front() == '{' and trace.find("\"traceEvents\":[") != std::string::npos);
+
+  clearTrace();
+  std::stringstream empty;
+  EXPECT_TRUE(writeChromeTrace(empty) == 0);
+}
 
+TEST(TerminalProtocolTest, frames)
+{
+  uint8_t buffer[4 * kMaxFrameSize];
+  size_t size = encodeCardFrame(buffer, 7, kTestAccountNum);
+  size += encodeActionFrame(buffer + size, 8, {ManagementAction::ManagementActionType::WITHDRAW, 300});
+
+  // Parsed in place, and not before the whole frame is there
+  TerminalMessage message;
+  EXPECT_TRUE(parseTerminalFrame(buffer, 1, message) == 0);
+  EXPECT_TRUE(parseTerminalFrame(buffer, 10, message) == 0);
+  const size_t card = parseTerminalFrame(buffer, size, message);
+  ASSERT_TRUE(card == kMaxFrameSize);
+  EXPECT_TRUE(message.type == MSG_CARD and message.stan == 7 and message.validPayload());
+  EXPECT_TRUE(message.accountNumber() == kTestAccountNum and message.payload == buffer + 7);
+  ASSERT_TRUE(parseTerminalFrame(buffer + card, size - card, message) == size - card);
+  EXPECT_TRUE(message.type == MSG_ACTION and message.stan == 8 and message.validPayload());
+  EXPECT_TRUE(message.action().action == ManagementAction::ManagementActionType::WITHDRAW);
+  EXPECT_TRUE(message.action().amount == 300);
+
+  // A known length with the wrong payload is answered, a length that can't be ours ends the stream
+  buffer[1] = kBodyHeaderSize + 1;
+  ASSERT_TRUE(parseTerminalFrame(buffer, size, message) == kFrameHeaderSize + kBodyHeaderSize + 1);
+  EXPECT_FALSE(message.validPayload());
+  // So is an account type that doesn't exist
+  encodeSelectFrame(buffer, 9, AccountType::SAVINGS);
+  ASSERT_TRUE(parseTerminalFrame(buffer, kMaxFrameSize, message) == kFrameHeaderSize + kBodyHeaderSize + 1);
+  EXPECT_TRUE(message.validPayload() and message.accountType() == AccountType::SAVINGS);
+  buffer[kFrameHeaderSize + kBodyHeaderSize] = 2;
+  EXPECT_FALSE(message.validPayload());
+
+  buffer[1] = 200;
   bool except = false;
   try {
-    m.disburseCash(kAvailableCashLogged+1);
-  } catch(std::exception& e) {
+    parseTerminalFrame(buffer, size, message);
+  } catch (const std::exception& e) {
     except = true;
   }
   EXPECT_TRUE(except);
+}
 
-  EXPECT_TRUE(m.getAvailableCash() == kAvailableCashLogged);
-  m.disburseCash(100);
-  // Would call m.updateAccountBalance(account, -100);
-  // But no server interaction exsits
-  EXPECT_TRUE(m.getAvailableCash() == kAvailableCashLogged-100);
+TEST(TerminalServerTest, session)
+{
+  TerminalServer server(std::make_shared<Machine>());
+  const uint16_t port = server.listenTcp(0);
+  std::thread serving([&server]() { server.run(); });
+
+  const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  ASSERT_TRUE(::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0);
+
+  // A whole session at once, with the last frame split over two sends
+  uint8_t requests[8 * kMaxFrameSize];
+  size_t size = encodeCardFrame(requests, 1, kTestAccountNum);
+  size += encodePinFrame(requests + size, 2, kTestAccountPin);
+  size += encodeSelectFrame(requests + size, 3, AccountType::SAVINGS);
+  size += encodeActionFrame(requests + size, 4, {ManagementAction::ManagementActionType::WITHDRAW, 100});
+  size += encodeStateFrame(requests + size, 5);
+  size += encodeStateFrame(requests + size, 6);
+  requests[size - kBodyHeaderSize] = 9;
+  size += encodeActionFrame(requests + size, 7, {ManagementAction::ManagementActionType::DONE});
+  ASSERT_TRUE(::send(fd, requests, size - 4, 0) == static_cast<ssize_t>(size - 4));
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  ASSERT_TRUE(::send(fd, requests + size - 4, 4, 0) == 4);
+
+  uint8_t responses[7 * kResponseFrameSize];
+  size_t received = 0;
+  while (received < sizeof(responses)) {
+    const ssize_t got = ::recv(fd, responses + received, sizeof(responses) - received, 0);
+    ASSERT_TRUE(got > 0);
+    received += got;
+  }
+
+  const ATMScreenState expected[] = {ATMScreenState::ENTER_PIN, ATMScreenState::SELECT_ACCOUNT,
+                                     ATMScreenState::ACCOUNT_MANAGEMENT, ATMScreenState::ACCOUNT_MANAGEMENT,
+                                     ATMScreenState::ACCOUNT_MANAGEMENT, ATMScreenState::ACCOUNT_MANAGEMENT,
+                                     ATMScreenState::IDLE};
+  for (size_t i = 0; i < 7; ++i) {
+    TerminalMessage response;
+    ASSERT_TRUE(parseTerminalFrame(responses + i * kResponseFrameSize, kResponseFrameSize, response) ==
+                kResponseFrameSize);
+    EXPECT_TRUE(response.validPayload() and response.stan == i + 1);
+    EXPECT_TRUE(response.state() == expected[i]);
+    // The message of an unknown type is refused without touching the ATM
+    EXPECT_TRUE(response.status() == (i == 5 ? STATUS_MALFORMED : STATUS_OK));
+  }
+
+  // A frame that can't be ours hangs up
+  const uint8_t garbage[] = {0xff, 0xff, 0, 0};
+  ASSERT_TRUE(::send(fd, garbage, sizeof(garbage), 0) == sizeof(garbage));
+  uint8_t rest;
+  EXPECT_TRUE(::recv(fd, &rest, 1, 0) == 0);
+  ::close(fd);
+
+  server.stop();
+  serving.join();
+  EXPECT_TRUE(server.stats().connections == 1);
+  EXPECT_TRUE(server.stats().messages == 7);
+}
+
+TEST(TerminalServerTest, parkedOnFetch)
+{
+  TerminalServer server(std::make_shared<Machine>());
+  const uint16_t port = server.listenTcp(0);
+  std::thread serving([&server]() { server.run(); });
+  const auto connectTerminal = [port]() {
+    const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    EXPECT_TRUE(::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0);
+    return fd;
+  };
+  const auto receive = [](int fd, uint8_t* responses, size_t size) {
+    size_t received = 0;
+    while (received < size) {
+      const ssize_t got = ::recv(fd, responses + received, size - received, 0);
+      ASSERT_TRUE(got > 0);
+      received += got;
+    }
+  };
+
+  // Every prefetch worker busy with a slow host, so the terminal's fetch waits in the queue
+  static constexpr std::chrono::milliseconds kHostDelay{300};
+  std::array<ProfileFetch, 4> busy;
+  for (ProfileFetch& fetch : busy) {
+    fetch.start([](void*, uint64_t accountNumber) {
+      std::this_thread::sleep_for(kHostDelay);
+      return AccountProfile{Balances{static_cast<int>(accountNumber), 0}};
+    }, nullptr, 0, 0);
+  }
+
+  const int waiting = connectTerminal();
+  uint8_t requests[2 * kMaxFrameSize];
+  size_t size = encodeCardFrame(requests, 1, kTestAccountNum);
+  size += encodePinFrame(requests + size, 2, kTestAccountPin);
+  const auto start = std::chrono::steady_clock::now();
+  ASSERT_TRUE(::send(waiting, requests, size, 0) == static_cast<ssize_t>(size));
+
+  // Another terminal is answered while the pin waits on the host
+  const int other = connectTerminal();
+  size = encodeStateFrame(requests, 3);
+  ASSERT_TRUE(::send(other, requests, size, 0) == static_cast<ssize_t>(size));
+  uint8_t responses[2 * kResponseFrameSize];
+  receive(other, responses, kResponseFrameSize);
+  EXPECT_TRUE(std::chrono::steady_clock::now() - start < kHostDelay);
+
+  // The pin is answered once the fetch is back
+  receive(waiting, responses, sizeof(responses));
+  EXPECT_TRUE(std::chrono::steady_clock::now() - start >= kHostDelay);
+  TerminalMessage response;
+  ASSERT_TRUE(parseTerminalFrame(responses + kResponseFrameSize, kResponseFrameSize, response) ==
+              kResponseFrameSize);
+  EXPECT_TRUE(response.stan == 2 and response.status() == STATUS_OK);
+  EXPECT_TRUE(response.state() == ATMScreenState::SELECT_ACCOUNT);
+  for (ProfileFetch& fetch : busy) {
+    fetch.waitFinished();
+  }
+  ::close(waiting);
+  ::close(other);
+
+  server.stop();
+  serving.join();
+  EXPECT_TRUE(server.stats().messages == 3);
+}
+
+TEST(EventQueueTest, ordering)
+{
+  EventQueue events(2);
+  events.scheduleAt(std::chrono::seconds(5), 1, 0);
+  events.scheduleAt(std::chrono::seconds(2), 2, 0);
+  events.scheduleAt(std::chrono::seconds(5), 3, 0);
+  events.scheduleAfter(std::chrono::seconds(2), 4, 0);
+
+  // Time order, and scheduling order at the same time, with the clock following along
+  SimEvent event;
+  std::vector<uint32_t> order;
+  while (events.pop(event)) {
+    order.push_back(event.type);
+    EXPECT_TRUE(events.now() == event.time);
+    if (event.type == 2) {
+      events.scheduleAfter(std::chrono::seconds(3), 5, 0);
+    }
+  }
+  EXPECT_TRUE((order == std::vector<uint32_t>{2, 4, 1, 3, 5}));
+  EXPECT_TRUE(events.now() == std::chrono::seconds(5));
+  EXPECT_TRUE(events.processed() == 5);
+
+  bool except = false;
+  try {
+    events.scheduleAt(std::chrono::seconds(1), 6, 0);
+  } catch (std::exception& e) {
+    except = true;
+  }
+  EXPECT_TRUE(except);
+}
+
+TEST(BranchSimulationTest, reproducible)
+{
+  BranchSimulationConfig config;
+  config.atms = 2;
+  config.duration = std::chrono::hours(6);
+  config.arrivals_per_hour = 30;
+  config.seed = 7;
+
+  BranchSimulation first(config);
+  const BranchSimulationStats stats = first.run();
+  BranchSimulation second(config);
+  const BranchSimulationStats again = second.run();
+
+  // Hours of traffic, everyone who showed up was served
+  EXPECT_TRUE(stats.arrivals > 100);
+  EXPECT_TRUE(stats.sessions + stats.declined == stats.arrivals);
+  EXPECT_TRUE(stats.sessions > stats.declined);
+  EXPECT_TRUE(stats.simulated >= std::chrono::hours(5));
+  EXPECT_TRUE(stats.max_queue >= 1);
+  EXPECT_TRUE(stats.total_session > stats.total_wait);
+  EXPECT_TRUE(stats.host_requests >= stats.arrivals);
+
+  // The same seed replays the same day
+  EXPECT_TRUE(again.simulated == stats.simulated);
+  EXPECT_TRUE(again.events == stats.events);
+  EXPECT_TRUE(again.arrivals == stats.arrivals);
+  EXPECT_TRUE(again.sessions == stats.sessions);
+  EXPECT_TRUE(again.declined == stats.declined);
+  EXPECT_TRUE(again.total_wait == stats.total_wait);
+  EXPECT_TRUE(again.total_session == stats.total_session);
+  EXPECT_TRUE(again.pin_waits == stats.pin_waits);
+  EXPECT_TRUE(second.machine().getAccountBalances(kTestAccountNum).checking ==
+              first.machine().getAccountBalances(kTestAccountNum).checking);
+
+  config.seed = 8;
+  EXPECT_TRUE(BranchSimulation(config).run().events != stats.events);
 }
 
 TEST(AccountTest, initLocked)
@@ -334,6 +2124,102 @@ TEST(AccountTest, initUnlockedSelectedSavings)
   EXPECT_TRUE(except);
 }
 
+TEST(AccountTest, batchApplied)
+{
+  const auto m = std::make_shared<Machine>();
+  Account a(m, kTestAccountNum);
+
+  a.unlock(kTestAccountPin);
+  a.selectType(AccountType::CHECKING);
+
+  const std::vector<ManagementAction> actions{
+    {ManagementAction::ManagementActionType::DEPOSIT, 100},
+    {ManagementAction::ManagementActionType::WITHDRAW, 150},
+    {ManagementAction::ManagementActionType::BALANCE},
+    {ManagementAction::ManagementActionType::WITHDRAW, 50},
+    {ManagementAction::ManagementActionType::DONE}
+  };
+
+  const ManagementBatchResult batch = a.applyBatch(actions);
+  EXPECT_TRUE(batch.applied);
+  ASSERT_TRUE(batch.results.size() == actions.size());
+  for (const auto& result : batch.results) {
+    EXPECT_TRUE(result.ok());
+  }
+  EXPECT_TRUE(batch.results[2].balance == kTestAccountCheckingBalance - 50);
+  EXPECT_TRUE(batch.results[3].balance == kTestAccountCheckingBalance - 100);
+
+  EXPECT_TRUE(a.getBalance() == kTestAccountCheckingBalance - 100);
+  EXPECT_TRUE(m->getAvailableCash() == kAvailableCashLogged - 200);
+}
+
+TEST(AccountTest, batchRefused)
+{
+  const auto m = std::make_shared<Machine>();
+  Account a(m, kTestAccountNum);
+
+  a.unlock(kTestAccountPin);
+  a.selectType(AccountType::SAVINGS);
+
+  // Each withdrawal is under the limit, but together they are not
+  const std::vector<ManagementAction> actions{
+    {ManagementAction::ManagementActionType::WITHDRAW, 600},
+    {ManagementAction::ManagementActionType::BALANCE},
+    {ManagementAction::ManagementActionType::WITHDRAW, 600}
+  };
+
+  const ManagementBatchResult batch = a.applyBatch(actions);
+  EXPECT_FALSE(batch.applied);
+  ASSERT_TRUE(batch.results.size() == actions.size());
+  EXPECT_TRUE(batch.results[0].ok());
+  EXPECT_TRUE(batch.results[1].ok());
+  EXPECT_FALSE(batch.results[2].ok());
+
+  // Nothing was applied
+  EXPECT_TRUE(a.getBalance() == kTestAccountSavingsBalance);
+  EXPECT_TRUE(m->getAvailableCash() == kAvailableCashLogged);
+
+  // DONE has to end the batch
+  const ManagementBatchResult done_first = a.applyBatch({{ManagementAction::ManagementActionType::DONE},
+                                                         {ManagementAction::ManagementActionType::DEPOSIT, 100}});
+  EXPECT_FALSE(done_first.applied);
+  EXPECT_TRUE(a.getBalance() == kTestAccountSavingsBalance);
+}
+
+TEST(AccountTest, batchDispenseFailed)
+{
+  const auto fake = std::make_shared<FakeBackend>();
+  fake->jammed = true;
+  BasicAccount<FakeBackend> a(fake, kTestAccountNum);
+  a.unlock(kTestAccountPin);
+  a.selectType(AccountType::CHECKING);
+
+  // Only the withdrawal is handed back, the deposit stands
+  bool except = false;
+  try {
+    a.applyBatch({{ManagementAction::ManagementActionType::DEPOSIT, 100},
+                  {ManagementAction::ManagementActionType::WITHDRAW, 40}});
+  } catch(std::exception& e) {
+    except = std::string(e.what()).find("E12345") == 0;
+  }
+  EXPECT_TRUE(except);
+  EXPECT_TRUE(fake->net_change == 100);
+  EXPECT_TRUE(a.getBalance() == kTestAccountCheckingBalance + 100);
+
+  // Even when the deposit and withdrawal cancel out and nothing else went to the ledger
+  except = false;
+  try {
+    a.applyBatch({{ManagementAction::ManagementActionType::DEPOSIT, 40},
+                  {ManagementAction::ManagementActionType::WITHDRAW, 40}});
+  } catch(std::exception& e) {
+    except = std::string(e.what()).find("E12345") == 0;
+  }
+  EXPECT_TRUE(except);
+  EXPECT_TRUE(fake->net_change == 140);
+  EXPECT_TRUE(a.getBalance() == kTestAccountCheckingBalance + 140);
+  EXPECT_TRUE(fake->cash == 500);
+}
+
 TEST(ATMTest, correctFunctionality)
 {
   ATM atm{};
@@ -565,3 +2451,294 @@ TEST(ATMTest, incorrectFunctionality3)
   atm.service();
   ASSERT_TRUE(atm.getState() == ATMScreenState::IDLE);
 }
+
+TEST(ATMTest, batchFunctionality)
+{
+  ATM atm{};
+
+  atm.cardReaderCB(kTestAccountNum);
+  atm.service();
+  atm.enterPinCB(kTestAccountPin);
+  atm.service();
+  atm.accountSelectCB(AccountType::CHECKING);
+  atm.service();
+  ASSERT_TRUE(atm.getState() == ATMScreenState::ACCOUNT_MANAGEMENT);
+
+  ManagementBatchResult batch = atm.accountManagementBatchCB({{ManagementAction::ManagementActionType::WITHDRAW, 150},
+                                                              {ManagementAction::ManagementActionType::BALANCE}});
+  atm.service();
+  EXPECT_TRUE(batch.applied);
+  EXPECT_TRUE(batch.results.back().balance == kTestAccountCheckingBalance - 150);
+  ASSERT_TRUE(atm.getState() == ATMScreenState::ACCOUNT_MANAGEMENT);
+
+  batch = atm.accountManagementBatchCB({{ManagementAction::ManagementActionType::BALANCE},
+                                        {ManagementAction::ManagementActionType::DONE}});
+  atm.service();
+  EXPECT_TRUE(batch.applied);
+  ASSERT_TRUE(atm.getState() == ATMScreenState::IDLE);
+
+  // Refused batches send the ATM back to idle
+  atm.cardReaderCB(kTestAccountNum);
+  atm.service();
+  atm.enterPinCB(kTestAccountPin);
+  atm.service();
+  atm.accountSelectCB(AccountType::CHECKING);
+  atm.service();
+  ASSERT_TRUE(atm.getState() == ATMScreenState::ACCOUNT_MANAGEMENT);
+
+  batch = atm.accountManagementBatchCB({{ManagementAction::ManagementActionType::WITHDRAW, 999999}});
+  atm.service();
+  EXPECT_FALSE(batch.applied);
+  ASSERT_TRUE(atm.getState() == ATMScreenState::IDLE);
+
+  // Not allowed outside of account management
+  batch = atm.accountManagementBatchCB({{ManagementAction::ManagementActionType::BALANCE}});
+  atm.service();
+  EXPECT_TRUE(batch.results.empty());
+  ASSERT_TRUE(atm.getState() == ATMScreenState::IDLE);
+}
+
+TEST(ATMTest, customBackend)
+{
+  const auto fake = std::make_shared<FakeBackend>();
+  BasicATM<FakeBackend> atm(fake);
+
+  // No pin attempt tracker, so wrong pins never lock the card
+  for (int i = 0; i < 5; ++i) {
+    atm.cardReaderCB(kTestAccountNum);
+    atm.service();
+    atm.enterPinCB(kTestAccountPin + 1);
+    atm.service();
+    ASSERT_TRUE(atm.getState() == ATMScreenState::IDLE);
+  }
+
+  atm.cardReaderCB(kTestAccountNum);
+  atm.service();
+  atm.enterPinCB(kTestAccountPin);
+  atm.service();
+  atm.accountSelectCB(AccountType::CHECKING);
+  atm.service();
+  ASSERT_TRUE(atm.getState() == ATMScreenState::ACCOUNT_MANAGEMENT);
+
+  atm.accountManagementCB(ManagementAction{ManagementAction::ManagementActionType::WITHDRAW, 100});
+  atm.accountManagementCB(ManagementAction{ManagementAction::ManagementActionType::DEPOSIT, 30});
+  atm.service();
+  EXPECT_TRUE(fake->updates == 2);
+  EXPECT_TRUE(fake->net_change == -70);
+  EXPECT_TRUE(fake->cash == 400);
+
+  // More than the fake has in its vault
+  atm.accountManagementCB(ManagementAction{ManagementAction::ManagementActionType::WITHDRAW, 450});
+  atm.service();
+  EXPECT_TRUE(fake->cash == 400);
+  ASSERT_TRUE(atm.getState() == ATMScreenState::IDLE);
+}
+
+/// FakeBackend whose server takes a while to answer
+struct SlowBackend : FakeBackend {
+  static constexpr std::chrono::milliseconds kDelay{200};
+
+  AccountProfile getAccountProfile(uint64_t accountNumber) {
+    std::this_thread::sleep_for(kDelay);
+    ++profile_fetches;
+    return AccountProfile{getAccountBalances(accountNumber)};
+  }
+
+  std::atomic<int> profile_fetches{0};
+};
+
+TEST(ATMTest, profilePrefetch)
+{
+  const auto slow = std::make_shared<SlowBackend>();
+  BasicATM<SlowBackend> atm(slow);
+
+  // The swipe doesn't wait for the server, the pin waits for whatever is left of it
+  auto start = std::chrono::steady_clock::now();
+  atm.cardReaderCB(kTestAccountNum);
+  atm.service();
+  EXPECT_TRUE(atm.getState() == ATMScreenState::ENTER_PIN);
+  EXPECT_TRUE(std::chrono::steady_clock::now() - start < SlowBackend::kDelay);
+  atm.enterPinCB(kTestAccountPin);
+  atm.service();
+  EXPECT_TRUE(std::chrono::steady_clock::now() - start >= SlowBackend::kDelay);
+  EXPECT_TRUE(atm.getState() == ATMScreenState::SELECT_ACCOUNT);
+  EXPECT_TRUE(slow->profile_fetches == 1);
+  atm.accountSelectCB(AccountType::CHECKING);
+  atm.service();
+  atm.accountManagementCB(ManagementAction{ManagementAction::ManagementActionType::WITHDRAW, 100});
+  atm.accountManagementCB(ManagementAction{ManagementAction::ManagementActionType::DONE});
+  atm.service();
+  EXPECT_TRUE(slow->net_change == -100);
+  ASSERT_TRUE(atm.getState() == ATMScreenState::IDLE);
+
+  // A customer slower than the server doesn't wait at all
+  atm.cardReaderCB(kTestAccountNum);
+  atm.service();
+  std::this_thread::sleep_for(2 * SlowBackend::kDelay);
+  start = std::chrono::steady_clock::now();
+  atm.enterPinCB(kTestAccountPin);
+  atm.service();
+  EXPECT_TRUE(std::chrono::steady_clock::now() - start < SlowBackend::kDelay);
+  EXPECT_TRUE(atm.getState() == ATMScreenState::SELECT_ACCOUNT);
+  atm.accountManagementCB(ManagementAction{ManagementAction::ManagementActionType::DONE});
+  atm.service();
+  ASSERT_TRUE(atm.getState() == ATMScreenState::IDLE);
+
+  // A card pulled before its fetch came back, the next swipe fetches again
+  atm.cardReaderCB(kTestAccountNum);
+  atm.service();
+  atm.accountSelectCB(AccountType::CHECKING);
+  atm.service();
+  ASSERT_TRUE(atm.getState() == ATMScreenState::IDLE);
+  atm.cardReaderCB(kTestAccountNum);
+  atm.service();
+  atm.enterPinCB(kTestAccountPin);
+  atm.service();
+  EXPECT_TRUE(atm.getState() == ATMScreenState::SELECT_ACCOUNT);
+  EXPECT_TRUE(slow->profile_fetches == 4);
+  atm.accountManagementCB(ManagementAction{ManagementAction::ManagementActionType::DONE});
+  atm.service();
+  ASSERT_TRUE(atm.getState() == ATMScreenState::IDLE);
+
+  // A pin waiting on the server doesn't hold up the screen
+  atm.cardReaderCB(kTestAccountNum);
+  atm.service();
+  std::thread pin([&atm]() { atm.enterPinCB(kTestAccountPin); });
+  std::this_thread::sleep_for(SlowBackend::kDelay / 4);
+  start = std::chrono::steady_clock::now();
+  atm.service();
+  EXPECT_TRUE(atm.getState() == ATMScreenState::ENTER_PIN);
+  EXPECT_TRUE(std::chrono::steady_clock::now() - start < SlowBackend::kDelay / 2);
+  pin.join();
+  atm.service();
+  EXPECT_TRUE(atm.getState() == ATMScreenState::SELECT_ACCOUNT);
+
+  // An unknown account is turned away once its fetch fails, at the pin
+  ATM machine_atm{};
+  machine_atm.cardReaderCB(kTestAccountNum + 1);
+  machine_atm.service();
+  EXPECT_TRUE(machine_atm.getState() == ATMScreenState::ENTER_PIN);
+  machine_atm.enterPinCB(kTestAccountPin);
+  machine_atm.service();
+  EXPECT_TRUE(machine_atm.getState() == ATMScreenState::IDLE);
+}
+
+TEST(ATMFleetTest, matchesATM)
+{
+  constexpr size_t kTerminals = 8;
+  const auto fake = std::make_shared<FakeBackend>();
+  std::vector<std::unique_ptr<BasicATM<FakeBackend>>> atms;
+  for (size_t i = 0; i < kTerminals; ++i) {
+    atms.emplace_back(new BasicATM<FakeBackend>(fake));
+  }
+  ATMFleet fleet(kTerminals);
+
+  // Random callbacks on each ATM, with the transitions they request mirrored onto the fleet, between services
+  std::mt19937 random(3);
+  for (int round = 0; round < 150; ++round) {
+    for (size_t i = 0; i < kTerminals; ++i) {
+      BasicATM<FakeBackend>& atm = *atms[i];
+      const int calls = std::uniform_int_distribution<int>(0, 6)(random);
+      for (int call = 0; call < calls; ++call) {
+        const ATMScreenState state = fleet.state(i);
+        switch (std::uniform_int_distribution<int>(0, 4)(random)) {
+          case 0:
+            atm.cardReaderCB(kTestAccountNum);
+            fleet.insertCard(i, kTestAccountNum);
+            break;
+          case 1:
+            atm.enterPinCB(kTestAccountPin);
+            fleet.requestTransition(i, state == ATMScreenState::ENTER_PIN ? ATMScreenState::SELECT_ACCOUNT
+                                                                          : ATMScreenState::IDLE);
+            break;
+          case 2:
+            atm.enterPinCB(kTestAccountPin + 1);
+            fleet.requestTransition(i, ATMScreenState::IDLE);
+            break;
+          case 3:
+            atm.accountSelectCB(AccountType::CHECKING);
+            fleet.requestTransition(i, state == ATMScreenState::SELECT_ACCOUNT ? ATMScreenState::ACCOUNT_MANAGEMENT
+                                                                               : ATMScreenState::IDLE);
+            break;
+          case 4:
+            atm.accountManagementCB(ManagementAction{ManagementAction::ManagementActionType::DONE});
+            fleet.requestTransition(i, ATMScreenState::IDLE);
+            break;
+        }
+      }
+      atm.service();
+    }
+    fleet.step();
+    for (size_t i = 0; i < kTerminals; ++i) {
+      ASSERT_TRUE(fleet.state(i) == atms[i]->getState()) << "round " << round << " terminal " << i;
+    }
+  }
+}
+
+TEST(ATMFleetTest, millionTerminals)
+{
+  constexpr size_t kTerminals = 1 << 20;
+  ATMFleet fleet(kTerminals);
+
+  // A card in every third terminal, a pin accepted at every other one of those
+  for (size_t i = 0; i < kTerminals; i += 3) {
+    fleet.insertCard(i, kTestAccountNum + i);
+  }
+  EXPECT_TRUE(fleet.step() == (kTerminals + 2) / 3);
+  for (size_t i = 0; i < kTerminals; i += 6) {
+    fleet.requestTransition(i, ATMScreenState::SELECT_ACCOUNT);
+  }
+  // Not without a card, and not skipping a screen
+  fleet.requestTransition(1, ATMScreenState::ENTER_PIN);
+  fleet.requestTransition(3, ATMScreenState::ACCOUNT_MANAGEMENT);
+  EXPECT_TRUE(fleet.step() == (kTerminals + 5) / 6);
+
+  std::array<uint64_t, 4> counts = fleet.stateCounts();
+  EXPECT_TRUE(counts[ATMScreenState::SELECT_ACCOUNT] == (kTerminals + 5) / 6);
+  EXPECT_TRUE(counts[ATMScreenState::ENTER_PIN] == (kTerminals + 2) / 3 - (kTerminals + 5) / 6);
+  EXPECT_TRUE(fleet.sessions() == (kTerminals + 2) / 3);
+  EXPECT_TRUE(fleet.cardNumber(6) == kTestAccountNum + 6 and fleet.cardNumber(7) == 0);
+
+  // A queue deeper than the dense arrays hold spills over, in order
+  fleet.requestTransition(6, ATMScreenState::ACCOUNT_MANAGEMENT);
+  for (size_t i = 0; i < ATMFleet::kPendingDepth; ++i) {
+    fleet.requestTransition(6, ATMScreenState::ACCOUNT_MANAGEMENT);
+  }
+  fleet.requestTransition(6, ATMScreenState::IDLE);
+  fleet.insertCard(7, kTestAccountNum);
+  EXPECT_TRUE(fleet.step() == 3);
+  EXPECT_TRUE(fleet.state(6) == ATMScreenState::IDLE and !fleet.hasCard(6) and fleet.cardNumber(6) == 0);
+  EXPECT_TRUE(fleet.state(7) == ATMScreenState::ENTER_PIN and fleet.cardNumber(7) == kTestAccountNum);
+  EXPECT_TRUE(fleet.sessions() == (kTerminals + 2) / 3);
+
+  // Everyone leaves
+  for (size_t i = 0; i < kTerminals; ++i) {
+    fleet.requestTransition(i, ATMScreenState::IDLE);
+  }
+  fleet.step();
+  counts = fleet.stateCounts();
+  EXPECT_TRUE(counts[ATMScreenState::IDLE] == kTerminals);
+  EXPECT_TRUE(fleet.sessions() == 0);
+}
+
+TEST(ATMTest, typeErasedBackend)
+{
+  const auto machine = std::make_shared<Machine>();
+  BasicATM<AnyBackend> atm(std::make_shared<AnyBackend>(machine));
+
+  atm.cardReaderCB(kTestAccountNum);
+  atm.service();
+  atm.enterPinCB(kTestAccountPin);
+  atm.service();
+  atm.accountSelectCB(AccountType::SAVINGS);
+  atm.service();
+  ASSERT_TRUE(atm.getState() == ATMScreenState::ACCOUNT_MANAGEMENT);
+
+  atm.accountManagementCB(ManagementAction{ManagementAction::ManagementActionType::WITHDRAW, 100});
+  atm.service();
+  EXPECT_TRUE(machine->getAvailableCash() == kAvailableCashLogged - 100);
+  EXPECT_TRUE(machine->getAccountBalances(kTestAccountNum).get(AccountType::SAVINGS) == kTestAccountSavingsBalance - 100);
+
+  // The machine's trackers are still reached through the adapter
+  EXPECT_TRUE(machine->velocityTracker().totals(kTestAccountNum).hourly_amount == 100);
+}
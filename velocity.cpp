@@ -0,0 +1,125 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+// ATM Controller
+#include "velocity.h"
+
+constexpr size_t VelocityTracker::kDefaultAlertCapacity;
+
+template <size_t N>
+void VelocityTracker::SlidingWindow<N>::advance(int64_t tick) {
+  if (tick <= newest_tick) {
+    return;
+  }
+
+  if (tick - newest_tick >= static_cast<int64_t>(N)) {
+    // Everything fell out of the window
+    buckets.fill(Bucket{0, 0});
+    amount = 0;
+    count = 0;
+  } else {
+    for (int64_t t = newest_tick + 1; t <= tick; ++t) {
+      Bucket& bucket = buckets[t % N];
+      amount -= bucket.amount;
+      count -= bucket.count;
+      bucket = Bucket{0, 0};
+    }
+  }
+  newest_tick = tick;
+}
+
+template <size_t N>
+void VelocityTracker::SlidingWindow<N>::add(uint amount_added, uint count_added) {
+  Bucket& bucket = buckets[newest_tick % N];
+  bucket.amount += amount_added;
+  bucket.count += count_added;
+  amount += amount_added;
+  count += count_added;
+}
+
+VelocityTracker::VelocityTracker(const VelocityLimits& limits, size_t alertCapacity) :
+  limits_(limits),
+  alerts_(alertCapacity),
+  dropped_alerts_(0) {
+}
+
+bool VelocityTracker::tryRecordWithdrawal(uint64_t accountNumber, uint amount, uint count, Clock::time_point now) {
+  Shard& shard = shardFor(accountNumber);
+  bool allowed = true;
+  VelocityAlert::Reason reason = VelocityAlert::Reason::HOURLY_AMOUNT;
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    AccountWindows& windows = shard.accounts[accountNumber];
+    advance(windows, now);
+
+    if (windows.hour.amount + amount > limits_.hourly_amount) {
+      allowed = false;
+      reason = VelocityAlert::Reason::HOURLY_AMOUNT;
+    } else if (windows.hour.count + count > limits_.hourly_count) {
+      allowed = false;
+      reason = VelocityAlert::Reason::HOURLY_COUNT;
+    } else if (windows.day.amount + amount > limits_.daily_amount) {
+      allowed = false;
+      reason = VelocityAlert::Reason::DAILY_AMOUNT;
+    } else if (windows.day.count + count > limits_.daily_count) {
+      allowed = false;
+      reason = VelocityAlert::Reason::DAILY_COUNT;
+    } else {
+      windows.hour.add(amount, count);
+      windows.day.add(amount, count);
+    }
+  }
+
+  // Raise outside the lock, the session only pays for a queue push
+  if (!allowed) {
+    raise(accountNumber, amount, reason, now);
+  }
+  return allowed;
+}
+
+void VelocityTracker::reportRefusal(uint64_t accountNumber,
+                                    uint amount,
+                                    VelocityAlert::Reason reason,
+                                    Clock::time_point now) {
+  raise(accountNumber, amount, reason, now);
+}
+
+VelocityTotals VelocityTracker::totals(uint64_t accountNumber, Clock::time_point now) {
+  Shard& shard = shardFor(accountNumber);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto windows = shard.accounts.find(accountNumber);
+  if (windows == shard.accounts.end()) {
+    return VelocityTotals{0, 0, 0, 0};
+  }
+
+  advance(windows->second, now);
+  return VelocityTotals{
+    windows->second.hour.amount, windows->second.hour.count, windows->second.day.amount, windows->second.day.count};
+}
+
+bool VelocityTracker::pollAlert(VelocityAlert& alert) {
+  return alerts_.tryPop(alert);
+}
+
+uint64_t VelocityTracker::droppedAlerts() const {
+  return dropped_alerts_.load(std::memory_order_relaxed);
+}
+
+VelocityTracker::Shard& VelocityTracker::shardFor(uint64_t accountNumber) {
+  // Card numbers share prefixes, so mix in the high bits before picking a shard
+  return shards_[(accountNumber ^ (accountNumber >> 17) ^ (accountNumber >> 41)) % kShards];
+}
+
+void VelocityTracker::advance(AccountWindows& windows, Clock::time_point now) {
+  const auto since_epoch = now.time_since_epoch();
+  windows.hour.advance(std::chrono::duration_cast<std::chrono::minutes>(since_epoch).count());
+  windows.day.advance(std::chrono::duration_cast<std::chrono::hours>(since_epoch).count());
+}
+
+void VelocityTracker::raise(uint64_t accountNumber, uint amount, VelocityAlert::Reason reason, Clock::time_point now) {
+  if (!alerts_.tryPush(VelocityAlert{accountNumber, amount, reason, now})) {
+    dropped_alerts_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
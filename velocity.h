@@ -0,0 +1,154 @@
+/**
+ * ATM Controller Simulator
+ * Luc Bettaieb, 2021
+ */
+
+#ifndef ATM_VELOCITY_H
+#define ATM_VELOCITY_H
+
+// C++ Standard Library
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+// POSIX
+#include <sys/types.h>
+
+// ATM Controller
+#include "bounded_queue.h"
+
+/// How much and how often an account may withdraw over the trailing hour and day
+struct VelocityLimits {
+  uint hourly_amount{10000};
+  uint hourly_count{10};
+  uint daily_amount{20000};
+  uint daily_count{20};
+};
+
+/// A security-relevant withdrawal event, handed off to whoever monitors the alert queue
+struct VelocityAlert {
+  enum Reason { HOURLY_AMOUNT = 0, HOURLY_COUNT = 1, DAILY_AMOUNT = 2, DAILY_COUNT = 3, OVER_LIMIT = 4,
+                INSUFFICIENT_BALANCE = 5 };
+
+  uint64_t account_number;
+  uint amount;
+  Reason reason;
+  std::chrono::system_clock::time_point time;
+};
+
+/// Amount and number of withdrawals over the trailing hour and day
+struct VelocityTotals {
+  uint64_t hourly_amount;
+  uint32_t hourly_count;
+  uint64_t daily_amount;
+  uint32_t daily_count;
+};
+
+/**
+ * @brief Tracks withdrawals per account over sliding windows and raises alerts on suspicious activity
+ * @details  Each account has an hour window of one-minute buckets and a day window of one-hour buckets, kept as
+ *           rings with running totals so a check is a handful of arithmetic operations.  Alerts go to a lock-free
+ *           bounded queue; if nobody drains it they are dropped (and counted) rather than stalling the session.
+ */
+class VelocityTracker {
+ public:
+  using Clock = std::chrono::system_clock;
+
+  /**
+   * @brief Constructor for the tracker
+   *
+   * @param limits  The limits every account is held to
+   * @param alertCapacity  The most undrained alerts held at once, must be a power of two
+   */
+  explicit VelocityTracker(const VelocityLimits& limits = VelocityLimits{},
+                           size_t alertCapacity = kDefaultAlertCapacity);
+
+  /**
+   * @brief Checks a withdrawal against the windows and records it if allowed
+   *
+   * @param accountNumber  The account withdrawing
+   * @param amount  The total amount being withdrawn
+   * @param count  The number of withdrawals the amount is made of
+   * @param now  The current time
+   * @return  True if the withdrawal was within the limits and recorded, false if an alert was raised instead
+   */
+  bool tryRecordWithdrawal(uint64_t accountNumber, uint amount, uint count = 1, Clock::time_point now = Clock::now());
+
+  /// Raises an alert for a withdrawal refused elsewhere, like going over the per-withdrawal limit
+  void reportRefusal(uint64_t accountNumber,
+                     uint amount,
+                     VelocityAlert::Reason reason,
+                     Clock::time_point now = Clock::now());
+
+  /// Amount and number of withdrawals recorded for an account over the trailing hour and day
+  VelocityTotals totals(uint64_t accountNumber, Clock::time_point now = Clock::now());
+
+  /// Takes the oldest undrained alert, returns false if there are none
+  bool pollAlert(VelocityAlert& alert);
+
+  /// The number of alerts dropped because the queue was full
+  uint64_t droppedAlerts() const;
+
+  static constexpr size_t kDefaultAlertCapacity = 1024;
+
+ private:
+  static constexpr size_t kShards = 16;
+
+  struct Bucket {
+    uint32_t amount;
+    uint32_t count;
+  };
+
+  /**
+   * @brief Ring of N buckets, each covering one tick, with running totals over the whole ring
+   */
+  template <size_t N>
+  struct SlidingWindow {
+    /// Moves the window forward to the given tick, dropping buckets that fell out of it
+    void advance(int64_t tick);
+
+    /// Adds to the bucket of the newest tick, advance first
+    void add(uint amount, uint count);
+
+    std::array<Bucket, N> buckets{};
+    uint64_t amount{0};
+    uint32_t count{0};
+    int64_t newest_tick{0};
+  };
+
+  struct AccountWindows {
+    /// The trailing hour, in minutes
+    SlidingWindow<60> hour;
+    /// The trailing day, in hours
+    SlidingWindow<24> day;
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<uint64_t, AccountWindows> accounts;
+  };
+
+  /// Finds the shard an account lives in
+  Shard& shardFor(uint64_t accountNumber);
+
+  /// Brings both windows of an account up to date
+  static void advance(AccountWindows& windows, Clock::time_point now);
+
+  /// Queues an alert, or drops it if the queue is full
+  void raise(uint64_t accountNumber, uint amount, VelocityAlert::Reason reason, Clock::time_point now);
+
+  const VelocityLimits limits_;
+
+  std::array<Shard, kShards> shards_;
+
+  /// Alerts waiting to be picked up
+  BoundedQueue<VelocityAlert> alerts_;
+
+  /// Alerts that didn't fit in the queue
+  std::atomic<uint64_t> dropped_alerts_;
+};
+
+#endif  // ATM_VELOCITY_H